@@ -0,0 +1,124 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef AUDIO_GATEWAY_H_028CF491_1264_4C00_B9DA_2A3BEEB840BE
+#define AUDIO_GATEWAY_H_028CF491_1264_4C00_B9DA_2A3BEEB840BE
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace lucida {
+
+/// Speech recognizer backend used by the streaming recognize RPC.
+///
+/// A recognizer instance serves exactly one stream. It is fed fixed-size
+/// frames and is never called concurrently.
+class Recognizer {
+public:
+	virtual ~Recognizer() {}
+
+	/// The size in bytes of the frames passed to Process().
+	virtual size_t FrameSize() const = 0;
+
+	/// Called once before the first frame.
+	///
+	/// @param[in]  lucid       The LUCID from the first chunk of the stream.
+	/// @param[in]  sampleRate  The sample rate from the first chunk of the stream.
+	virtual void Begin(const std::string& /*lucid*/, unsigned /*sampleRate*/) {}
+
+	/// Process one frame.
+	///
+	/// @param[in]  frame   Exactly FrameSize() bytes of audio.
+	/// @param[out] interim The interim transcript, if it changed.
+	/// @return     True if interim was updated.
+	virtual bool Process(const char* frame, std::string& interim) = 0;
+
+	/// Called once at the end of the stream.
+	///
+	/// @param[in]  tail    The remaining audio, less than FrameSize() bytes.
+	/// @param[in]  size    The size of tail.
+	/// @return     The final transcript.
+	virtual std::string End(const char* tail, size_t size) = 0;
+
+	/// Called instead of End() when the client cancels the stream. The
+	/// default does nothing.
+	virtual void Abort() {}
+};
+
+
+/// Buffers streamed audio and forwards it to a recognizer in fixed-size
+/// frames, independent of how the client chunked the stream. Whole frames
+/// are passed straight from the chunk, only a frame split across chunks is
+/// copied. Used by the thread serving the stream, so nothing is shared.
+class AudioGateway {
+public:
+	/// @param[in]  recognizer  The recognizer backend.
+	/// @remarks    Takes ownership of the recognizer.
+	explicit AudioGateway(Recognizer* recognizer);
+	AudioGateway(const AudioGateway&) = delete;
+	AudioGateway& operator = (const AudioGateway&) = delete;
+
+	Recognizer* GetRecognizer() { return recognizer_.get(); }
+
+	/// Forward the complete frames of some audio, keeping a trailing partial
+	/// frame for the next call.
+	///
+	/// @param[in]  data    The audio bytes.
+	/// @param[in]  size    The number of bytes.
+	/// @param[out] interim The latest interim transcript, if any frame updated it.
+	/// @return     True if interim was updated.
+	bool Feed(const char* data, size_t size, std::string& interim);
+
+	/// Forward the trailing partial frame and end the stream.
+	///
+	/// @return     The final transcript.
+	std::string Drain();
+
+	/// End a cancelled stream, dropping the partial frame.
+	void Abort();
+
+	/// Number of frames forwarded to the recognizer.
+	uint64_t GetFrameCount() const { return frames_; }
+
+private:
+	bool Process(const char* frame, std::string& interim);
+
+	std::unique_ptr<Recognizer> recognizer_;
+	size_t frameSize_;
+	/// The start of a frame split across chunks.
+	std::vector<char> partial_;
+	uint64_t frames_;
+};
+
+}       // namespace lucida
+#endif  // AUDIO_GATEWAY_H_028CF491_1264_4C00_B9DA_2A3BEEB840BE
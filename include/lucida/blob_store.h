@@ -0,0 +1,160 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BLOB_STORE_H_5B63EF18_895B_4F69_86B5_4DC58F75BA5D
+#define BLOB_STORE_H_5B63EF18_895B_4F69_86B5_4DC58F75BA5D
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <grpc++/support/status.h>
+#include "generated/lucida_service.pb.h"
+
+namespace lucida {
+
+/// Counters for a blob store.
+struct BlobStoreStats {
+	BlobStoreStats(): blobs(0), bytes(0), referencedBytes(0), puts(0), duplicatePuts(0) {}
+	uint64_t blobs;
+	/// Bytes stored.
+	uint64_t bytes;
+	/// Bytes the references stand for. Divided by bytes this is the dedup ratio.
+	uint64_t referencedBytes;
+	uint64_t puts;
+	/// Puts of blobs already stored.
+	uint64_t duplicatePuts;
+};
+
+
+/// Content addressed, reference counted store of immutable blobs, such as
+/// the images many courses learn. Blobs are named by their SHA-256 and kept
+/// one per file under dir/<first byte>/<digest>.
+///
+/// References are taken once a learn using a blob has been kept, and
+/// dropped by the handler when it forgets that knowledge. They are journaled
+/// to dir/refs.log. Unreferenced blobs, for example uploaded but never
+/// learned or part of a learn that failed, are removed by CollectGarbage.
+class BlobStore {
+public:
+	static const size_t kDigestSize = 32;
+
+	/// The SHA-256 of some bytes, as raw bytes.
+	static std::string Digest(const void* data, size_t size);
+
+	/// A digest as lower case hex.
+	static std::string ToHex(const std::string& digest);
+
+	/// @param[in]  dir     The directory, created if missing.
+	explicit BlobStore(const std::string& dir);
+	~BlobStore();
+	BlobStore(const BlobStore&) = delete;
+	BlobStore& operator = (const BlobStore&) = delete;
+
+	/// Load the index and references. Call once before use.
+	bool Open();
+
+	/// Store a blob unless it is already stored. Either way the blob gets a
+	/// full grace period before it can be collected.
+	///
+	/// @param[in]  data    The blob.
+	/// @param[out] digest  Its digest, may be nullptr.
+	/// @return     False on a write error.
+	bool Put(const std::string& data, std::string* digest=nullptr);
+
+	bool Contains(const std::string& digest) const;
+
+	/// Read a blob.
+	///
+	/// @param[in]  digest  The blob's digest.
+	/// @param[out] data    The blob.
+	/// @return     False if there is no such blob.
+	bool Get(const std::string& digest, std::string& data) const;
+
+	/// @{
+	/// Take or drop a reference. A blob can be collected once it has none.
+	/// @return     False if there is no such blob.
+	bool AddRef(const std::string& digest);
+	bool Release(const std::string& digest);
+	/// @}
+
+	/// @{
+	/// Take or drop a reference on every blob a resolved request uses.
+	void AddRefs(const Request& request);
+	void Release(const std::vector<std::string>& digests);
+	/// @}
+
+	/// The digests of the blobs a resolved request uses, appended to digests.
+	static void GetDigests(const Request& request, std::vector<std::string>& digests);
+
+	/// The number of references to a blob.
+	unsigned GetRefs(const std::string& digest) const;
+
+	/// Remove blobs without references that were stored at least minAge ago.
+	///
+	/// @param[in]  minAge  Leaves time for an upload to be referenced.
+	/// @return     The number of blobs removed.
+	size_t CollectGarbage(std::chrono::seconds minAge);
+
+	/// Resolve the blobs of a request before it is handled. Inputs sent by
+	/// digest get their data from the store. On learn, image data sent
+	/// inline is stored and its digests are filled in. No references are
+	/// taken, call AddRefs once the learn is kept.
+	///
+	/// @param[in]  request The request, changed in place.
+	/// @param[in]  learn   True for learn requests.
+	/// @return     OK, FAILED_PRECONDITION if a blob is missing, or INTERNAL.
+	::grpc::Status Resolve(Request& request, bool learn);
+
+	BlobStoreStats GetStats() const;
+
+private:
+	struct Blob {
+		uint64_t size;
+		unsigned refs;
+		std::chrono::steady_clock::time_point stored;
+	};
+	std::string PathOf(const std::string& digest) const;
+	bool Journal(const std::string& digest, int32_t delta);
+	bool RewriteJournal();
+
+	const std::string dir_;
+	mutable std::mutex mu_;
+	std::unordered_map<std::string, Blob> blobs_;
+	int journal_;
+	BlobStoreStats stats_;
+};
+
+}       // namespace lucida
+#endif  // BLOB_STORE_H_5B63EF18_895B_4F69_86B5_4DC58F75BA5D
@@ -32,8 +32,16 @@
 #ifndef CALL_H_910ECA26_7826_48BE_9614_E9738490BE5A
 #define CALL_H_910ECA26_7826_48BE_9614_E9738490BE5A
 
+#include <algorithm>
 #include <cassert>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <grpc/grpc.h>
+#include <grpc++/alarm.h>
 #include <grpc++/server.h>
 #include <grpc++/server_builder.h>
 #include <grpc++/server_context.h>
@@ -41,73 +49,236 @@
 #include <glog/logging.h>
 #include "generated/lucida_service.grpc.pb.h"
 #include "generated/lucida_service.pb.h"
+#include "audio_gateway.h"
+#include "blob_store.h"
+#include "learn_log.h"
+#include "call_scope.h"
+#include "load_report.h"
+#include "log_sink.h"
+#include "query_spec_view.h"
+#include "trace.h"
 
 namespace lucida {
 
 // Forward reference
 template<class U, class V> class TypedCall;
-class AsyncServiceAcceptor;
+struct CreateMethod;
+struct LearnMethod;
+struct InferMethod;
+template<class Handler> class RecognizeCall;
 
-/// Lucida service RPC handler
+/// Lucida service RPC handler with virtual dispatch. Served by
+/// AsyncServiceAcceptor.
+/// @see AsyncServiceHandlerT for statically dispatched handlers.
 class AsyncServiceHandler: public LucidaService::AsyncService
 {
-	friend class AsyncServiceAcceptor;
+	friend struct CreateMethod;
+	friend struct LearnMethod;
+	friend struct InferMethod;
+	friend class RecognizeCall<AsyncServiceHandler>;
 private:
 	virtual void OnCreate(TypedCall<Request, ::google::protobuf::Empty>* call) = 0;
 	virtual void OnLearn(TypedCall<Request, ::google::protobuf::Empty>* call) = 0;
 	virtual void OnInfer(TypedCall<Request, Response>* call) = 0;
 
-	void CreateCallback(TypedCall<Request, ::google::protobuf::Empty>* call, bool ok);
-	void LearnCallback(TypedCall<Request, ::google::protobuf::Empty>* call, bool ok);
-	void InferCallback(TypedCall<Request, Response>* call, bool ok);
+	/// Create the recognizer backend for one streaming recognize call. The
+	/// default has no backend and the call finishes with UNIMPLEMENTED.
+	/// @remarks The caller takes ownership.
+	virtual Recognizer* CreateRecognizer() { return nullptr; }
 public:
-	AsyncServiceHandler() {}
+	/// Serialize state worth keeping across a hot restart, such as caches,
+	/// for the process taking over. Called on the control socket thread
+	/// while calls are still being served. The default has none.
+	/// @return     False if there is no state to hand over.
+	virtual bool ExportWarmState(std::string& state) { return false; }
+
+	/// Restore what the process taken over exported, before serving.
+	virtual void ImportWarmState(const std::string& state) {}
+
+	AsyncServiceHandler(): blobStore_(nullptr), learnLog_(nullptr) {}
 	virtual ~AsyncServiceHandler() {}
+
+	/// Serve offerBlobs and putBlobs from a store, and resolve the blobs
+	/// requests reference before they reach the handler. Without one, blob
+	/// calls finish with UNIMPLEMENTED. Set before serving.
+	/// @remarks The caller keeps ownership.
+	void SetBlobStore(BlobStore* store) { blobStore_ = store; }
+	BlobStore* GetBlobStore() const { return blobStore_; }
+
+	/// Append each learn request to a log before it reaches the handler, so
+	/// the handler's state can be replayed from the log after a restart. A
+	/// learn that cannot be logged finishes with UNAVAILABLE. Set before
+	/// serving.
+	/// @remarks The caller keeps ownership.
+	void SetLearnLog(LearnLog* log) { learnLog_ = log; }
+	LearnLog* GetLearnLog() const { return learnLog_; }
+private:
+	BlobStore* blobStore_;
+	LearnLog* learnLog_;
 };
 
-// TODO: Log if !ok
-inline void AsyncServiceHandler::CreateCallback(TypedCall<Request, ::google::protobuf::Empty>* call, bool ok) {
-	if (ok) OnCreate(call);
-}
 
-inline void AsyncServiceHandler::LearnCallback(TypedCall<Request, ::google::protobuf::Empty>* call, bool ok) {
-	if (ok) OnLearn(call);
-}
+/// Lucida service RPC handler with static dispatch. Served by
+/// AsyncServiceAcceptorT<Derived>, which calls Derived's OnCreate, OnLearn,
+/// OnInfer and CreateRecognizer directly so they can be inlined. Derived
+/// hides the defaults below for the methods it implements.
+template<class Derived>
+class AsyncServiceHandlerT: public LucidaService::AsyncService
+{
+public:
+	AsyncServiceHandlerT(): blobStore_(nullptr), learnLog_(nullptr) {}
+	void OnCreate(TypedCall<Request, ::google::protobuf::Empty>* call);
+	void OnLearn(TypedCall<Request, ::google::protobuf::Empty>* call);
+	void OnInfer(TypedCall<Request, Response>* call);
+	Recognizer* CreateRecognizer() { return nullptr; }
+	/// @see AsyncServiceHandler::ExportWarmState
+	bool ExportWarmState(std::string& state) { return false; }
+	void ImportWarmState(const std::string& state) {}
+
+	/// @see AsyncServiceHandler::SetBlobStore
+	void SetBlobStore(BlobStore* store) { blobStore_ = store; }
+	BlobStore* GetBlobStore() const { return blobStore_; }
+
+	/// @see AsyncServiceHandler::SetLearnLog
+	void SetLearnLog(LearnLog* log) { learnLog_ = log; }
+	LearnLog* GetLearnLog() const { return learnLog_; }
+private:
+	BlobStore* blobStore_;
+	LearnLog* learnLog_;
+};
+
+
+/// Matched calls not yet deleted across all the queues of a server, so a
+/// drain can wait for the last one.
+class CallCounter {
+public:
+	CallCounter(): count_(0) {}
+	void Add() { count_.fetch_add(1); }
+	void Done() {
+		if (--count_ != 0) return;
+		std::lock_guard<std::mutex> guard(mu_);
+		idle_.notify_all();
+	}
+	/// Block until every call counted has been deleted.
+	void Wait() {
+		std::unique_lock<std::mutex> lock(mu_);
+		idle_.wait(lock, [this]() { return count_.load() <= 0; });
+	}
+private:
+	std::atomic<int64_t> count_;
+	std::mutex mu_;
+	/// Signalled under mu_ when count_ drops to zero.
+	std::condition_variable idle_;
+};
 
-inline void AsyncServiceHandler::InferCallback(TypedCall<Request, Response>* call, bool ok) {
-	if (ok) OnInfer(call);
-}
+
+/// Listeners for one method on one completion queue.
+struct ListenerStats {
+	ListenerStats(): method(""), outstanding(0), matched(0), dry(0), expired(0), inFlight(0), cancelled(0),
+		load(nullptr), calls(nullptr) {}
+	const char* method;
+	/// Listeners posted and not yet matched. Only used by the queue's thread.
+	unsigned outstanding;
+	/// Calls matched to a listener.
+	std::atomic<uint64_t> matched;
+	/// Matches that left no listener outstanding.
+	std::atomic<uint64_t> dry;
+	/// Calls dropped before dispatch because they were cancelled or expired.
+	std::atomic<uint64_t> expired;
+	/// Matched calls not yet deleted.
+	std::atomic<int64_t> inFlight;
+	/// Calls still in flight when a drain ran out of time.
+	std::atomic<uint64_t> cancelled;
+	/// The server's load, nullptr unless load reports are enabled.
+	LoadReporter* load;
+	/// The server's calls in flight, nullptr if not counted.
+	CallCounter* calls;
+};
 
 
 class UntypedCall {
 public:
-	UntypedCall(): status_(CREATE) {}
-	virtual ~UntypedCall() {}
+	UntypedCall(): status_(CREATE), listeners_(nullptr), inflight_(nullptr), counted_(false) {}
+	virtual ~UntypedCall() {
+		if (inflight_ != nullptr) --*inflight_;
+		if (counted_) {
+			listeners_->inFlight.fetch_sub(1, std::memory_order_relaxed);
+			if (listeners_->load != nullptr) listeners_->load->AddInFlight(-1);
+			if (listeners_->calls != nullptr) listeners_->calls->Done();
+		}
+	}
 	virtual void Proceed(bool ok) = 0;
 	virtual UntypedCall* CreateListener() = 0;
+	virtual const char* GetMethodName() const = 0;
+
+	/// The tenant a matched call is scheduled under, nullptr if the call is
+	/// not scheduled.
+	virtual const std::string* GetTenant() const { return nullptr; }
+
+	/// Finish a matched call without dispatching it. Calls that cannot be
+	/// rejected are served.
+	virtual void Reject(const ::grpc::Status&) { Proceed(true); }
+
+	/// Called before a matched call waits in a queue, so the call holds the
+	/// references of its other tags while it waits. It is dispatched later
+	/// with Proceed(true).
+	virtual void Hold() {}
+
+	/// The request of a matched call for capture, nullptr if the method is
+	/// not captured.
+	virtual const Request* GetCapturedRequest() const { return nullptr; }
 	
 	// Let's implement a tiny state machine with the following states.
-	enum CallState { CREATE, PROCESS, FINISH };
+	// STREAM is only used by streaming calls once the call has been matched.
+	enum CallState { CREATE, PROCESS, STREAM, FINISH };
 
 	CallState GetStatus() const { return status_; }
+
+	ListenerStats* GetListenerStats() const { return listeners_; }
+	void SetListenerStats(ListenerStats* listeners) { listeners_ = listeners; }
+
+	/// Decremented when the call is deleted. Only used by the queue's thread.
+	void SetInflightCounter(unsigned* inflight) { inflight_ = inflight; }
+
+	/// Count the matched call in its listener pool's inFlight until it is
+	/// deleted.
+	void CountInFlight() {
+		listeners_->inFlight.fetch_add(1, std::memory_order_relaxed);
+		if (listeners_->load != nullptr) listeners_->load->AddInFlight(1);
+		if (listeners_->calls != nullptr) listeners_->calls->Add();
+		counted_ = true;
+	}
 protected:
 	CallState status_;  // The current serving state.
+	ListenerStats* listeners_;  // The listener pool this call was posted from.
+private:
+	unsigned* inflight_;
+	bool counted_;
 };
 
 
+/// @{
+/// The tenant of a request, for fair scheduling.
+template<class RequestType>
+inline const std::string* TenantOf(const RequestType&) { return nullptr; }
+inline const std::string* TenantOf(const Request& request) { return &request.lucid(); }
+/// @}
+
+/// @{
+/// The request to capture. Only create, learn and infer, which take a
+/// Request, are captured.
+template<class RequestType>
+inline const Request* CapturedRequestOf(const RequestType&) { return nullptr; }
+inline const Request* CapturedRequestOf(const Request& request) { return &request; }
+/// @}
+
+
+/// Unary call as seen by handlers. Created by StaticCall, which listens and
+/// dispatches for the method; TypedCall itself is no longer constructed with
+/// listen and handler member pointers.
 template<class RequestType, class ResponseType> 
 class TypedCall: public UntypedCall {
 public:
-	typedef void (AsyncServiceHandler::* ListenFn)
-				(::grpc::ServerContext*, RequestType*, ::grpc::ServerAsyncResponseWriter<ResponseType>*, 
-				 ::grpc::CompletionQueue*, ::grpc::ServerCompletionQueue*, void*);
-
-	typedef void (AsyncServiceHandler::* HandlerFn)(TypedCall*, bool);
-
-	TypedCall(AsyncServiceHandler* service, ListenFn listen, HandlerFn handler, ::grpc::ServerCompletionQueue* cq): 
-		service_(service), cq_(cq), responder_(&ctx_), 
-		handler_(handler), listen_(listen) {
-	}
 	TypedCall(const TypedCall&) = delete;
 	TypedCall& operator = (const TypedCall&) = delete;
 
@@ -116,11 +287,12 @@ public:
 	/// by the default processing with ::grpc::Status::OK
 	void Finish(const ::grpc::Status& status = ::grpc::Status::OK) {
 		if (FINISH != status_) {
-#ifdef DEBUG
-			LOG(INFO) << "TypedCall: finish tag<" << this << ">";
-#endif
+			LUCIDA_LOG_TAG("TypedCall: finish", this);
 			status_ = FINISH;
-			LOG_IF(ERROR, !status.ok()) << "TypedCall: gRPC handler reported status-code=" << int(status.error_code()) << " and message=\'" << status.error_message() << "\'";
+			failed_ = !status.ok();
+			LogSink::Get().LogCall(GetMethodName(), status, GetTenant(), GetElapsedMicros());
+			span_.FinishServer(ctx_, status);
+			ReportLoad();
 			responder_.Finish(response_, status, this);
 		}
 	}
@@ -128,71 +300,599 @@ public:
 	/// Call this to report an error
 	void FinishWithError(const ::grpc::Status& status) {
 		if (FINISH != status_) {
-#ifdef DEBUG
-			LOG(INFO) << "TypedCall: finish with error tag<" << this << ">";
-#endif
+			LUCIDA_LOG_TAG("TypedCall: finish with error", this);
 			status_ = FINISH;
-			LOG(ERROR) << "TypedCall: gRPC handler reported status-code=" << int(status.error_code()) << " and message=\'" << status.error_message() << "\'";
+			failed_ = true;
+			LogSink::Get().LogCall(GetMethodName(), status, GetTenant(), GetElapsedMicros());
+			span_.FinishServer(ctx_, status);
+			ReportLoad();
 			responder_.FinishWithError(status, this);
 		}
 	}
 
+	/// The server context, for metadata and as the parent of downstream calls.
+	::grpc::ServerContext* GetServerContext() { return &ctx_; }
+
+	/// The client's deadline, time_point::max() if it has none.
+	std::chrono::system_clock::time_point GetDeadline() const { return ctx_.deadline(); }
+
+	/// Time left before the deadline, zero if it has passed and
+	/// milliseconds::max() if there is no deadline.
+	std::chrono::milliseconds GetRemaining() const {
+		auto deadline = ctx_.deadline();
+		if (deadline == std::chrono::system_clock::time_point::max())
+			return std::chrono::milliseconds::max();
+		auto now = std::chrono::system_clock::now();
+		if (deadline <= now) return std::chrono::milliseconds(0);
+		return std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now);
+	}
+
+	/// True if the client cancelled the call.
+	/// @remarks A cancellation is seen once the completion queue has delivered
+	/// it, so a long running handler should also check GetRemaining().
+	bool IsCancelled() const { return cancelled_ || ctx_.IsCancelled(); }
+
+	/// True if the result is no longer wanted.
+	bool IsAbandoned() const { return IsCancelled() || GetRemaining().count() <= 0; }
+
+	/// The call's trace span. Not traced unless the client sent a trace id.
+	TraceSpan& GetSpan() { return span_; }
+
+	/// The request's QuerySpec with its command and input types decoded.
+	/// Only for methods taking a Request. Decoded on first use, then shared
+	/// by the dispatch and the handler.
+	const QuerySpecView& GetSpecView() {
+		if (!specView_) specView_.reset(new QuerySpecView(request_.spec()));
+		return *specView_;
+	}
+
+	const std::string* GetTenant() const override { return TenantOf(request_); }
+
+	const Request* GetCapturedRequest() const override { return CapturedRequestOf(request_); }
+
+	/// A cancellation while queued is delivered to the done tag, and the
+	/// call is dropped when it is dispatched.
+	void Hold() override { OnMatched(); }
+
+	/// Reject a matched call, for example when its tenant is over quota.
+	void Reject(const ::grpc::Status& status) override {
+		OnMatched();
+		status_ = FINISH;
+		responder_.FinishWithError(status, this);
+	}
+
+	/// Keep the call open after the handler returns. The handler, or work it
+	/// started, must then call Finish or FinishWithError from the call's
+	/// completion queue thread.
+	void Defer() { deferred_ = true; }
+	bool IsDeferred() const { return deferred_; }
+
+	/// True once the call has been finished with an error.
+	bool IsFailed() const { return failed_; }
+
+	// What we get from the client.
+	RequestType request_;
+	// What we send back to the client.
+	ResponseType response_;
+
+protected:
+	TypedCall(::grpc::ServerCompletionQueue* cq): cq_(cq), responder_(&ctx_), done_(this), refs_(1), held_(false), cancelled_(false), deferred_(false),
+		failed_(false) {
+	}
+
+	/// Ask for a done notification. Call before requesting the call from gRPC.
+	/// Once matched the call is released by both its own tag and the done tag.
+	void NotifyWhenDone() { ctx_.AsyncNotifyWhenDone(&done_); }
+
+	/// The call has been matched, hold a reference for the done tag. Only
+	/// the first call counts, the done tag may have been delivered since.
+	void OnMatched() {
+		if (held_) return;
+		held_ = true;
+		refs_ = 2;
+		matched_ = std::chrono::steady_clock::now();
+	}
+
+	/// Microseconds since the call was matched.
+	uint32_t GetElapsedMicros() const {
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - matched_).count();
+		return uint32_t(std::min<int64_t>(us, UINT32_MAX));
+	}
+
+	/// Record the call's latency and send the server's load in the trailing
+	/// metadata, if load reports are enabled.
+	void ReportLoad() {
+		if (listeners_ == nullptr || listeners_->load == nullptr) return;
+		listeners_->load->RecordCall(GetElapsedMicros());
+		ctx_.AddTrailingMetadata(LoadReport::Key(), listeners_->load->Get().Encode());
+	}
+
+	/// Drop a reference, deleting the call with the last one.
+	void Release() {
+		if (--refs_ == 0) delete this;
+	}
+
+	/// Finish an abandoned call without dispatching it or logging.
+	void Drop() {
+		status_ = FINISH;
+		if (listeners_ != nullptr)
+			listeners_->expired.fetch_add(1, std::memory_order_relaxed);
+		responder_.FinishWithError(cancelled_ || ctx_.IsCancelled()?
+			::grpc::Status::CANCELLED:
+			::grpc::Status(::grpc::StatusCode::DEADLINE_EXCEEDED, "expired before dispatch"), this);
+	}
+
+	// The producer-consumer queue where for asynchronous server notifications.
+	::grpc::ServerCompletionQueue* cq_;
+	// Context for the rpc, allowing to tweak aspects of it such as the use
+	// of compression, authentication, as well as to send metadata back to the
+	// client.
+	::grpc::ServerContext ctx_;
+
+	// The means to get back to the client.
+	::grpc::ServerAsyncResponseWriter<ResponseType> responder_;
+
+	TraceSpan span_;
+
+private:
+	std::unique_ptr<QuerySpecView> specView_;
+
+	/// Delivered by gRPC when the call is over, cancelled or not.
+	class DoneTag: public UntypedCall {
+	public:
+		DoneTag(TypedCall* call): call_(call) { status_ = FINISH; }
+		void Proceed(bool) override {
+			call_->cancelled_ = call_->ctx_.IsCancelled();
+			call_->Release();
+		}
+		UntypedCall* CreateListener() override { return nullptr; }
+		const char* GetMethodName() const override { return call_->GetMethodName(); }
+	private:
+		TypedCall* call_;
+	};
+
+	DoneTag done_;
+	std::chrono::steady_clock::time_point matched_;
+	// Completion queue tags outstanding. Only touched by the queue's thread.
+	unsigned refs_;
+	bool held_;
+	bool cancelled_;
+	bool deferred_;
+	bool failed_;
+};
+
+
+/// Resolve the blobs a request references before it is dispatched.
+///
+/// @param[in]  store   The handler's blob store, may be nullptr.
+/// @param[in]  call    The call, finished with an error if resolving fails.
+/// @param[in]  learn   True for learn, which stores inline images.
+/// @return     True to dispatch the call.
+template<class ResponseType>
+inline bool ResolveBlobs(BlobStore* store, TypedCall<Request, ResponseType>* call, bool learn) {
+	::grpc::Status status;
+	if (store != nullptr) {
+		status = store->Resolve(call->request_, learn);
+	} else {
+		for (const QueryInput& input: call->request_.spec().content()) {
+			if (input.digests_size() != 0) {
+				status = ::grpc::Status(::grpc::StatusCode::FAILED_PRECONDITION, "blobs by digest not supported");
+				break;
+			}
+		}
+	}
+	if (!status.ok()) call->FinishWithError(status);
+	return status.ok();
+}
+
+
+/// Check that QuerySpec.name, if it is a known command, names the method
+/// the request was sent to. Unnamed specs are accepted.
+///
+/// @param[in]  call    The call, finished with INVALID_ARGUMENT on a mismatch.
+/// @param[in]  command The method's command.
+/// @return     True to dispatch the call.
+template<class ResponseType>
+inline bool CheckCommand(TypedCall<Request, ResponseType>* call, ServiceNames::CommandId command) {
+	const QuerySpecView& spec = call->GetSpecView();
+	if (spec.command() == ServiceNames::UNKNOWN_COMMAND || spec.command() == command) return true;
+	call->FinishWithError(::grpc::Status(::grpc::StatusCode::INVALID_ARGUMENT,
+		"command " + spec.name() + " sent to " + call->GetMethodName()));
+	return false;
+}
+
+
+/// @{
+/// Unary method traits. Listen requests the next call from gRPC and Dispatch
+/// hands a matched call to the handler. Both are resolved at compile time.
+struct CreateMethod {
+	static const char* Name() { return "create"; }
+	typedef Request RequestType;
+	typedef ::google::protobuf::Empty ResponseType;
+	template<class Handler>
+	static void Listen(Handler* service, ::grpc::ServerContext* ctx, RequestType* request, 
+			::grpc::ServerAsyncResponseWriter<ResponseType>* responder, ::grpc::ServerCompletionQueue* cq, void* tag) {
+		service->Requestcreate(ctx, request, responder, cq, cq, tag);
+	}
+	template<class Handler>
+	static void Dispatch(Handler* service, TypedCall<RequestType, ResponseType>* call) {
+		if (CheckCommand(call, ServiceNames::CREATE_COMMAND) && ResolveBlobs(service->GetBlobStore(), call, false))
+			service->OnCreate(call);
+	}
+};
+
+struct LearnMethod {
+	static const char* Name() { return "learn"; }
+	typedef Request RequestType;
+	typedef ::google::protobuf::Empty ResponseType;
+	template<class Handler>
+	static void Listen(Handler* service, ::grpc::ServerContext* ctx, RequestType* request, 
+			::grpc::ServerAsyncResponseWriter<ResponseType>* responder, ::grpc::ServerCompletionQueue* cq, void* tag) {
+		service->Requestlearn(ctx, request, responder, cq, cq, tag);
+	}
+	/// The blobs are referenced only once the handler has kept the learn. A
+	/// handler that defers learn calls BlobStore::AddRefs itself. The learn
+	/// log gets the request with its blobs resolved, so replay does not
+	/// depend on the store.
+	template<class Handler>
+	static void Dispatch(Handler* service, TypedCall<RequestType, ResponseType>* call) {
+		BlobStore* store = service->GetBlobStore();
+		if (!CheckCommand(call, ServiceNames::LEARN_COMMAND) || !ResolveBlobs(store, call, true)) return;
+		LearnLog* log = service->GetLearnLog();
+		if (log != nullptr && !log->Append(call->request_)) {
+			call->FinishWithError(::grpc::Status(::grpc::StatusCode::UNAVAILABLE, "cannot log learn"));
+			return;
+		}
+		service->OnLearn(call);
+		if (store != nullptr && !call->IsDeferred() && !call->IsFailed()) store->AddRefs(call->request_);
+	}
+};
+
+struct InferMethod {
+	static const char* Name() { return "infer"; }
+	typedef Request RequestType;
+	typedef Response ResponseType;
+	template<class Handler>
+	static void Listen(Handler* service, ::grpc::ServerContext* ctx, RequestType* request, 
+			::grpc::ServerAsyncResponseWriter<ResponseType>* responder, ::grpc::ServerCompletionQueue* cq, void* tag) {
+		service->Requestinfer(ctx, request, responder, cq, cq, tag);
+	}
+	template<class Handler>
+	static void Dispatch(Handler* service, TypedCall<RequestType, ResponseType>* call) {
+		if (CheckCommand(call, ServiceNames::INFER_COMMAND) && ResolveBlobs(service->GetBlobStore(), call, false))
+			service->OnInfer(call);
+	}
+};
+
+/// Served by the handler's blob store rather than the handler.
+struct OfferBlobsMethod {
+	static const char* Name() { return "offerBlobs"; }
+	typedef BlobOffer RequestType;
+	typedef BlobOfferReply ResponseType;
+	template<class Handler>
+	static void Listen(Handler* service, ::grpc::ServerContext* ctx, RequestType* request, 
+			::grpc::ServerAsyncResponseWriter<ResponseType>* responder, ::grpc::ServerCompletionQueue* cq, void* tag) {
+		service->RequestofferBlobs(ctx, request, responder, cq, cq, tag);
+	}
+	template<class Handler>
+	static void Dispatch(Handler* service, TypedCall<RequestType, ResponseType>* call) {
+		BlobStore* store = service->GetBlobStore();
+		if (store == nullptr) {
+			call->FinishWithError(::grpc::Status(::grpc::StatusCode::UNIMPLEMENTED, Name()));
+			return;
+		}
+		for (const std::string& digest: call->request_.digests()) {
+			if (!store->Contains(digest)) call->response_.add_missing(digest);
+		}
+	}
+};
+
+struct PutBlobsMethod {
+	static const char* Name() { return "putBlobs"; }
+	typedef BlobUpload RequestType;
+	typedef ::google::protobuf::Empty ResponseType;
+	template<class Handler>
+	static void Listen(Handler* service, ::grpc::ServerContext* ctx, RequestType* request, 
+			::grpc::ServerAsyncResponseWriter<ResponseType>* responder, ::grpc::ServerCompletionQueue* cq, void* tag) {
+		service->RequestputBlobs(ctx, request, responder, cq, cq, tag);
+	}
+	template<class Handler>
+	static void Dispatch(Handler* service, TypedCall<RequestType, ResponseType>* call) {
+		BlobStore* store = service->GetBlobStore();
+		if (store == nullptr) {
+			call->FinishWithError(::grpc::Status(::grpc::StatusCode::UNIMPLEMENTED, Name()));
+			return;
+		}
+		for (const std::string& blob: call->request_.blobs()) {
+			if (!store->Put(blob)) {
+				call->FinishWithError(::grpc::Status(::grpc::StatusCode::INTERNAL, "cannot store blob"));
+				return;
+			}
+		}
+	}
+};
+/// @}
+
+
+/// Unary call for one method of a handler type known at compile time.
+template<class Handler, class Method>
+class StaticCall final: public TypedCall<typename Method::RequestType, typename Method::ResponseType> {
+	typedef TypedCall<typename Method::RequestType, typename Method::ResponseType> BaseType;
+	using BaseType::status_;
+	using BaseType::cq_;
+	using BaseType::ctx_;
+	using BaseType::responder_;
+	using BaseType::request_;
+public:
+	StaticCall(Handler* service, ::grpc::ServerCompletionQueue* cq): BaseType(cq), service_(service) {
+	}
+
 	void Proceed(bool ok) override {
-		if (status_ == CREATE) {
+		if (!ok && status_ == UntypedCall::PROCESS) {
+			// Never matched
+			LUCIDA_LOG_TAG("TypedCall: cancelled", this);
+			delete this;
+		} else if (!ok) {
+			LUCIDA_LOG_TAG("TypedCall: cancelled", this);
+			this->Release();
+		} else if (status_ == UntypedCall::CREATE) {
 			// Make this instance progress to the PROCESS state.
-			status_ = PROCESS;
+			status_ = UntypedCall::PROCESS;
 
 			// As part of the initial CREATE state, we *request* that the system
 			// start processing requests. In this request, "this" acts are
 			// the tag uniquely identifying the request (so that different TypedCall
 			// instances can serve different requests concurrently), in this case
 			// the memory address of this TypedCall instance.
-#ifdef DEBUG
-			LOG(INFO) << "TypedCall: listen on tag<" << this << ">";
-#endif
-			(service_->*listen_)(&ctx_, &request_, &responder_, cq_, cq_, (void*)this);
-		} else if (status_ == PROCESS) {
+			LUCIDA_LOG_TAG("TypedCall: listen on", this);
+			this->NotifyWhenDone();
+			Method::Listen(service_, &ctx_, &request_, &responder_, cq_, (void*)this);
+		} else if (status_ == UntypedCall::PROCESS) {
+			this->OnMatched();
+			// Don't start work the client no longer wants.
+			if (this->IsAbandoned()) {
+				this->Drop();
+				return;
+			}
 			// The actual processing.
-			(service_->*handler_)(this, ok); 
-			Finish();
+			this->span_.StartServer(ctx_, Method::Name());
+			CallScope scope(&ctx_, &this->span_, cq_);
+			Method::Dispatch(service_, this); 
+			if (!this->IsDeferred()) this->Finish();
 		} else {
-#ifdef DEBUG
-			LOG(INFO) << "TypedCall: delete tag<" << this << ">";
-#endif
-			assert(status_ == FINISH);
-			// Once in the FINISH state, deallocate ourselves (TypedCall).
-			delete this;
+			LUCIDA_LOG_TAG("TypedCall: delete", this);
+			assert(status_ == UntypedCall::FINISH);
+			// Once in the FINISH state, deallocate ourselves (TypedCall) when
+			// the done tag has also been delivered.
+			this->Release();
 		}
 	}
 
 	UntypedCall* CreateListener() override {
-		return new TypedCall(service_, listen_, handler_, cq_);
+		return new StaticCall(service_, cq_);
 	}
 
-	// What we get from the client.
-	RequestType request_;
-	// What we send back to the client.
-	ResponseType response_;
+	const char* GetMethodName() const override { return Method::Name(); }
 
 private:
 	// The means of communication with the gRPC runtime for an asynchronous
 	// server.
-	AsyncServiceHandler* service_;
-	// The producer-consumer queue where for asynchronous server notifications.
+	Handler* service_;
+};
+
+
+template<class Derived>
+inline void AsyncServiceHandlerT<Derived>::OnCreate(TypedCall<Request, ::google::protobuf::Empty>* call) {
+	call->FinishWithError(::grpc::Status(::grpc::StatusCode::UNIMPLEMENTED, "create"));
+}
+
+template<class Derived>
+inline void AsyncServiceHandlerT<Derived>::OnLearn(TypedCall<Request, ::google::protobuf::Empty>* call) {
+	call->FinishWithError(::grpc::Status(::grpc::StatusCode::UNIMPLEMENTED, "learn"));
+}
+
+template<class Derived>
+inline void AsyncServiceHandlerT<Derived>::OnInfer(TypedCall<Request, Response>* call) {
+	call->FinishWithError(::grpc::Status(::grpc::StatusCode::UNIMPLEMENTED, "infer"));
+}
+
+/// Bidirectional streaming recognize call. Audio chunks are fed through an
+/// AudioGateway and interim transcripts are written back as they change. Only
+/// one read or write is outstanding at any time, so interim transcripts
+/// produced while a write is in flight collapse into the latest one.
+///
+/// Like a unary call it holds a done tag once matched, so a client cancel is
+/// not taken for a half-close: the recognizer is aborted and the call
+/// finishes CANCELLED. It is traced, logged and reports load the same way.
+template<class Handler>
+class RecognizeCall: public UntypedCall {
+public:
+	RecognizeCall(Handler* service, ::grpc::ServerCompletionQueue* cq):
+		service_(service), cq_(cq), stream_(&ctx_), done_(this), refs_(1), writing_(false), started_(false),
+		closing_(false), cancelled_(false) {
+	}
+	RecognizeCall(const RecognizeCall&) = delete;
+	RecognizeCall& operator = (const RecognizeCall&) = delete;
+
+	void Proceed(bool ok) override;
+
+	UntypedCall* CreateListener() override {
+		return new RecognizeCall(service_, cq_);
+	}
+
+	const char* GetMethodName() const override { return "recognize"; }
+
+	const std::string* GetTenant() const override { return started_? &lucid_: nullptr; }
+
+private:
+	/// Delivered by gRPC when the call is over, cancelled or not.
+	class DoneTag: public UntypedCall {
+	public:
+		DoneTag(RecognizeCall* call): call_(call) { status_ = FINISH; }
+		void Proceed(bool) override {
+			call_->cancelled_ = call_->ctx_.IsCancelled();
+			call_->Release();
+		}
+		UntypedCall* CreateListener() override { return nullptr; }
+		const char* GetMethodName() const override { return call_->GetMethodName(); }
+	private:
+		RecognizeCall* call_;
+	};
+
+	/// Log, trace and report load for the finished call.
+	void OnFinish(const ::grpc::Status& status) {
+		status_ = FINISH;
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - matched_).count();
+		uint32_t elapsed = uint32_t(std::min<int64_t>(us, UINT32_MAX));
+		LogSink::Get().LogCall(GetMethodName(), status, GetTenant(), elapsed);
+		span_.FinishServer(ctx_, status);
+		if (listeners_ != nullptr && listeners_->load != nullptr) {
+			listeners_->load->RecordCall(elapsed);
+			ctx_.AddTrailingMetadata(LoadReport::Key(), listeners_->load->Get().Encode());
+		}
+	}
+
+	void Finish(const ::grpc::Status& status) {
+		OnFinish(status);
+		stream_.Finish(status, this);
+	}
+
+	/// Drop a reference, deleting the call with the last one.
+	void Release() {
+		if (--refs_ == 0) delete this;
+	}
+
+	Handler* service_;
 	::grpc::ServerCompletionQueue* cq_;
-	// Context for the rpc, allowing to tweak aspects of it such as the use
-	// of compression, authentication, as well as to send metadata back to the
-	// client.
 	::grpc::ServerContext ctx_;
+	::grpc::ServerAsyncReaderWriter<Transcript, AudioChunk> stream_;
+	std::unique_ptr<AudioGateway> gateway_;
+	TraceSpan span_;
+	DoneTag done_;
+	std::chrono::steady_clock::time_point matched_;
+	// Last chunk read from the client.
+	AudioChunk chunk_;
+	// Transcript being written to the client.
+	Transcript transcript_;
+	// The LUCID from the first chunk.
+	std::string lucid_;
+	// Completion queue tags outstanding. Only touched by the queue's thread.
+	unsigned refs_;
+	// True while a write is outstanding, otherwise a read is outstanding.
+	bool writing_;
+	// True once the recognizer has seen the first chunk.
+	bool started_;
+	// True while closeAlarm_ is set.
+	bool closing_;
+	bool cancelled_;
+	// Lets a done tag queued with a failed read arrive first.
+	::grpc::Alarm closeAlarm_;
+};
 
-	// The means to get back to the client.
-	::grpc::ServerAsyncResponseWriter<ResponseType> responder_;
+template<class Handler>
+inline void RecognizeCall<Handler>::Proceed(bool ok) {
+	if (status_ == CREATE) {
+		status_ = PROCESS;
+		LUCIDA_LOG_TAG("RecognizeCall: listen on", this);
+		ctx_.AsyncNotifyWhenDone(&done_);
+		service_->Requestrecognize(&ctx_, &stream_, cq_, cq_, (void*)this);
+	} else if (status_ == PROCESS) {
+		if (!ok) {
+			// Never matched, so the done tag will not be delivered.
+			delete this;
+			return;
+		}
+		refs_ = 2;
+		matched_ = std::chrono::steady_clock::now();
+		span_.StartServer(ctx_, GetMethodName());
+		Recognizer* recognizer = service_->CreateRecognizer();
+		if (recognizer == nullptr) {
+			Finish(::grpc::Status(::grpc::StatusCode::UNIMPLEMENTED, "no recognizer"));
+			return;
+		}
+		gateway_.reset(new AudioGateway(recognizer));
+		status_ = STREAM;
+		stream_.Read(&chunk_, this);
+	} else if (status_ == STREAM) {
+		// A read also fails when the client cancels, and only the done tag
+		// tells that from a half-close. A cancel queues it along with the
+		// failed read, so look again after one trip through the queue.
+		if (!ok && !writing_ && !closing_ && !cancelled_) {
+			closing_ = true;
+			closeAlarm_.Set(cq_, gpr_now(GPR_CLOCK_MONOTONIC), this);
+			return;
+		}
+		if (closing_) {
+			closing_ = false;
+			ok = false;
+		}
+		if (!ok && (writing_ || cancelled_)) {
+			// The client has gone away.
+			writing_ = false;
+			gateway_->Abort();
+			Finish(::grpc::Status::CANCELLED);
+			return;
+		}
+		if (writing_) {
+			writing_ = false;
+			stream_.Read(&chunk_, this);
+			return;
+		}
+		if (!ok) {
+			// The client half-closed, flush the buffered audio.
+			transcript_.set_msg(gateway_->Drain());
+			transcript_.set_is_final(true);
+			OnFinish(::grpc::Status::OK);
+			stream_.WriteAndFinish(transcript_, ::grpc::WriteOptions(), ::grpc::Status::OK, this);
+			return;
+		}
+		if (!started_) {
+			started_ = true;
+			lucid_ = chunk_.lucid();
+			gateway_->GetRecognizer()->Begin(chunk_.lucid(), chunk_.sample_rate());
+		}
+		std::string interim;
+		if (gateway_->Feed(chunk_.data().data(), chunk_.data().size(), interim)) {
+			transcript_.set_msg(interim);
+			transcript_.set_is_final(false);
+			writing_ = true;
+			stream_.Write(transcript_, this);
+		} else {
+			stream_.Read(&chunk_, this);
+		}
+	} else {
+		LUCIDA_LOG_TAG("RecognizeCall: delete", this);
+		// Deleted once the done tag has also been delivered.
+		Release();
+	}
+}
 
-	// Called during create
-	ListenFn listen_;
-	// Handler for RPC
-	HandlerFn handler_;
-};
+
+/// Open a learn log and replay what it holds into a handler, through
+/// Handler::Learn(const Request&). Call before serving, then pass the log to
+/// SetLearnLog. Learns the handler rejects are skipped, as they were when
+/// first served.
+///
+/// @param[in]  log     The log, not yet opened.
+/// @param[in]  handler The handler.
+/// @return     False if the log cannot be opened.
+template<class Handler>
+bool ReplayLearnLog(LearnLog& log, Handler& handler) {
+	uint64_t replayed = 0, rejected = 0;
+	bool opened = log.Open([&](const LearnEntry& entry) {
+		Request request;
+		if (entry.GetRequest(request) && handler.Learn(request).ok())
+			++replayed;
+		else
+			++rejected;
+	});
+	if (!opened) {
+		LOG(ERROR) << "ReplayLearnLog: cannot open the learn log";
+		return false;
+	}
+	LOG(INFO) << "ReplayLearnLog: replayed " << replayed << " learn(s), skipped " << rejected;
+	return true;
+}
 
 }       // namespace lucida
 #endif  // CALL_H_910ECA26_7826_48BE_9614_E9738490BE5A
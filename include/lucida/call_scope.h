@@ -0,0 +1,109 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef CALL_SCOPE_H_72C63587_F43D_4A75_9103_ADCE30F11A7C
+#define CALL_SCOPE_H_72C63587_F43D_4A75_9103_ADCE30F11A7C
+
+#include <chrono>
+#include <grpc++/server_context.h>
+#include <grpc++/support/status.h>
+
+namespace grpc {
+class ServerCompletionQueue;
+}
+
+namespace lucida {
+class TraceSpan;
+
+/// Marks the server call being handled on this thread. AsyncServiceConnector
+/// derives the deadline and cancellation of downstream calls from it, so
+/// handlers fanning out through the service graph need no extra plumbing.
+///
+/// The async acceptors open a scope around each handler. Synchronous handlers
+/// can open one themselves.
+class CallScope {
+public:
+	/// What a scope marks. Coroutine handlers capture it when they suspend and
+	/// reopen it when they resume.
+	struct Frame {
+		Frame(::grpc::ServerContext* ctx, TraceSpan* span, ::grpc::ServerCompletionQueue* cq):
+			ctx(ctx), span(span), cq(cq) {}
+		::grpc::ServerContext* ctx;
+		TraceSpan* span;
+		/// The queue the call is served on, nullptr for synchronous handlers.
+		::grpc::ServerCompletionQueue* cq;
+	};
+
+	/// @param[in]  ctx     The server call.
+	/// @param[in]  span    The call's trace span, may be nullptr.
+	/// @param[in]  cq      The completion queue the call is served on, may be nullptr.
+	explicit CallScope(::grpc::ServerContext* ctx, TraceSpan* span=nullptr,
+			::grpc::ServerCompletionQueue* cq=nullptr): prev_(Slot()) {
+		Slot() = Frame(ctx, span, cq);
+	}
+	explicit CallScope(const Frame& frame): prev_(Slot()) { Slot() = frame; }
+	~CallScope() { Slot() = prev_; }
+	CallScope(const CallScope&) = delete;
+	CallScope& operator = (const CallScope&) = delete;
+
+	/// The innermost server call on this thread, nullptr if none.
+	static ::grpc::ServerContext* Current() { return Slot().ctx; }
+
+	/// The trace span of the innermost server call, nullptr if none.
+	static TraceSpan* CurrentSpan() { return Slot().span; }
+
+	/// The innermost scope on this thread.
+	static Frame Capture() { return Slot(); }
+
+	/// Check if a server call is still wanted.
+	///
+	/// @param[in]  ctx The server call, may be nullptr.
+	/// @return     OK, CANCELLED if the client went away or DEADLINE_EXCEEDED.
+	static ::grpc::Status Check(const ::grpc::ServerContext* ctx) {
+		if (ctx == nullptr) return ::grpc::Status::OK;
+		if (ctx->IsCancelled())
+			return ::grpc::Status(::grpc::StatusCode::CANCELLED, "parent call cancelled");
+		if (ctx->deadline() <= std::chrono::system_clock::now())
+			return ::grpc::Status(::grpc::StatusCode::DEADLINE_EXCEEDED, "parent deadline exceeded");
+		return ::grpc::Status::OK;
+	}
+
+private:
+	Frame prev_;
+
+	static Frame& Slot() {
+		static thread_local Frame current(nullptr, nullptr, nullptr);
+		return current;
+	}
+};
+
+}       // namespace lucida
+#endif  // CALL_SCOPE_H_72C63587_F43D_4A75_9103_ADCE30F11A7C
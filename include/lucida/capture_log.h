@@ -0,0 +1,177 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CAPTURE_LOG_H_4582D189_50F2_4C9B_9C3B_645EBD44FB64
+#define CAPTURE_LOG_H_4582D189_50F2_4C9B_9C3B_645EBD44FB64
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "generated/lucida_service.pb.h"
+
+namespace lucida {
+
+/// A captured request.
+struct CaptureRecord {
+	CaptureRecord(): arrivalNs(0) {}
+	/// "create", "learn" or "infer".
+	std::string method;
+	/// When the call arrived, in nanoseconds since the epoch.
+	int64_t arrivalNs;
+	Request request;
+};
+
+
+struct CaptureStats {
+	CaptureStats(): seen(0), captured(0), bytes(0), overLimit(0), dropped(0) {}
+	/// Requests offered to the writer.
+	uint64_t seen;
+	/// Requests sampled and written.
+	uint64_t captured;
+	/// The size of the log.
+	uint64_t bytes;
+	/// Sampled requests not written because the log was full.
+	uint64_t overLimit;
+	/// Sampled requests lost to a full thread buffer.
+	uint64_t dropped;
+};
+
+
+/// Appends requests to a capture log for later replay.
+///
+/// The log starts with "LCAP" and a 32 bit version. Each record is a 32 bit
+/// length and a CRC32C of what follows, then the method as one byte, the
+/// arrival time as 64 bit nanoseconds, and the serialized Request. Integers
+/// are little endian.
+///
+/// Like LogSink, capture stays off the completion queue threads' locks and
+/// the file: each capturing thread serializes its records into its own
+/// lock-free ring buffer, and a background thread checksums and writes them.
+/// Records that do not fit in the ring are dropped.
+class CaptureWriter {
+public:
+	CaptureWriter();
+	/// Writes what is buffered and stops the flusher.
+	~CaptureWriter();
+	CaptureWriter(const CaptureWriter&) = delete;
+	CaptureWriter& operator = (const CaptureWriter&) = delete;
+
+	/// Create or truncate a log.
+	///
+	/// @param[in]  path        The log.
+	/// @param[in]  sampleRate  The fraction of requests captured, 0 to 1.
+	/// @param[in]  maxBytes    Stop capturing at this size, 0 for no limit.
+	/// @param[in]  threadBufferBytes   The ring of each capturing thread,
+	///             applies to threads that have not captured yet.
+	/// @return     False if the log cannot be created.
+	bool Open(const std::string& path, double sampleRate=1.0, uint64_t maxBytes=0,
+		size_t threadBufferBytes=4 << 20);
+
+	/// Capture a request, if sampled. Thread safe. Requests not sampled cost
+	/// a random number, so capture can stay on under load.
+	///
+	/// @param[in]  method      "create", "learn" or "infer", others are ignored.
+	/// @param[in]  request     The request.
+	/// @param[in]  arrivalNs   When it arrived, 0 for now.
+	/// @return     True if it was queued for writing.
+	bool Capture(const char* method, const Request& request, int64_t arrivalNs=0);
+
+	/// Wait until the records captured before the call have been written,
+	/// then flush the file.
+	bool Flush();
+
+	CaptureStats GetStats() const;
+
+private:
+	struct ThreadBuffer;
+
+	ThreadBuffer* GetThreadBuffer();
+	void Run();
+	void Drain();
+	/// Checksum and write a record. Called with fileMu_ held.
+	void Append(const std::string& body);
+
+	const uint64_t id_;
+	double sampleRate_;
+	std::atomic<size_t> threadBufferBytes_;
+	std::atomic<uint64_t> seen_;
+	std::atomic<uint64_t> dropped_;
+
+	/// Guards the file and what is written to it.
+	mutable std::mutex fileMu_;
+	FILE* file_;
+	uint64_t maxBytes_;
+	CaptureStats stats_;
+
+	std::mutex mu_;
+	std::condition_variable cv_;
+	std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+	/// Flush requests and completed drains.
+	uint64_t requested_;
+	uint64_t drained_;
+	bool stop_;
+	std::thread flusher_;
+};
+
+
+/// Reads a capture log in order.
+class CaptureReader {
+public:
+	CaptureReader();
+	~CaptureReader();
+	CaptureReader(const CaptureReader&) = delete;
+	CaptureReader& operator = (const CaptureReader&) = delete;
+
+	/// @return     False if the file is missing or not a capture log.
+	bool Open(const std::string& path);
+
+	/// Read the next record.
+	/// @return     False at the end of the log or at a damaged record.
+	bool Next(CaptureRecord& record);
+
+	/// True if reading stopped at a damaged or truncated record, as left by
+	/// a crash while capturing.
+	bool IsDamaged() const { return damaged_; }
+
+private:
+	FILE* file_;
+	bool damaged_;
+};
+
+}       // namespace lucida
+#endif  // CAPTURE_LOG_H_4582D189_50F2_4C9B_9C3B_645EBD44FB64
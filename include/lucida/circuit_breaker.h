@@ -0,0 +1,259 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef CIRCUIT_BREAKER_H_EB83F139_6885_4040_866F_AB1544FD0154
+#define CIRCUIT_BREAKER_H_EB83F139_6885_4040_866F_AB1544FD0154
+
+#include <algorithm>
+#include <cstdint>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <grpc++/support/status_code_enum.h>
+
+namespace lucida {
+
+/// When to stop sending calls to a target.
+struct CircuitBreakerPolicy {
+	CircuitBreakerPolicy(): enabled(false), windowSize(20), minCalls(10), failureRate(0.5),
+		slowCallMs(1000), slowRate(0.8), openMs(5000), probes(3), probeTimeoutMs(5000),
+		failureCodes((1u << ::grpc::StatusCode::UNAVAILABLE) | (1u << ::grpc::StatusCode::DEADLINE_EXCEEDED) |
+			(1u << ::grpc::StatusCode::RESOURCE_EXHAUSTED) | (1u << ::grpc::StatusCode::INTERNAL) |
+			(1u << ::grpc::StatusCode::UNKNOWN)) {}
+	bool enabled;
+	/// The number of recent calls the rates are computed over.
+	unsigned windowSize;
+	/// Calls needed in the window before the breaker can open.
+	unsigned minCalls;
+	/// Open when this fraction of the window failed.
+	double failureRate;
+	/// Calls slower than this count as slow.
+	unsigned slowCallMs;
+	/// Open when this fraction of the window was slow.
+	double slowRate;
+	/// Time spent open before probing.
+	unsigned openMs;
+	/// Probe calls allowed while half open. All must succeed to close.
+	unsigned probes;
+	/// Time half open before probes still unanswered count as failed, so
+	/// the breaker opens again and later re-probes.
+	unsigned probeTimeoutMs;
+	/// Bit mask of status codes that count as failures. Other codes are the
+	/// caller's fault and count as successes.
+	uint32_t failureCodes;
+};
+
+
+/// Per target circuit breaker.
+///
+/// Closed, calls flow and outcomes are kept in a rolling window. If too many
+/// fail or are slow the breaker opens and calls are rejected locally. After
+/// openMs it goes half open and lets a few probes through; if they all
+/// succeed it closes, otherwise it opens again. Outcomes are only counted in
+/// the state their call was allowed in, so a straggler sent before the
+/// breaker opened is not taken for a probe.
+class CircuitBreaker {
+public:
+	enum State { CLOSED, OPEN, HALF_OPEN };
+
+	/// The state an allowed call was sent in.
+	typedef uint64_t Ticket;
+	/// Counts in whatever state the breaker is in.
+	static const Ticket kAnyTicket = ~Ticket(0);
+
+	CircuitBreaker(): state_(CLOSED), epoch_(0), next_(0), calls_(0), failures_(0), slow_(0),
+		probesSent_(0), probesPassed_(0), rejected_(0), opened_(0) {}
+	CircuitBreaker(const CircuitBreaker&) = delete;
+	CircuitBreaker& operator = (const CircuitBreaker&) = delete;
+
+	/// Set the policy and close the breaker.
+	void SetPolicy(const CircuitBreakerPolicy& policy);
+
+	/// Check if a call may be sent.
+	///
+	/// @param[out] ticket  Passed to Record or Release, may be nullptr.
+	/// @return     False if the call must fail locally.
+	bool Allow(Ticket* ticket=nullptr);
+
+	/// Record the outcome of an allowed call.
+	///
+	/// @param[in]  code    The call's status code.
+	/// @param[in]  micros  The call's latency.
+	/// @param[in]  ticket  From Allow. Ignored unless the state is the same.
+	void Record(::grpc::StatusCode code, uint64_t micros, Ticket ticket=kAnyTicket);
+
+	/// Forget an allowed call whose outcome says nothing about the target,
+	/// for example a hedge cancelled after another attempt won. A probe
+	/// slot is returned.
+	/// @param[in]  ticket  From Allow.
+	void Release(Ticket ticket);
+
+	State GetState() const;
+	/// The number of calls rejected while open.
+	uint64_t GetRejected() const;
+	/// The number of times the breaker opened.
+	uint64_t GetOpened() const;
+
+private:
+	enum { FAILED = 1, SLOW = 2 };
+	typedef std::chrono::steady_clock Clock;
+	mutable std::mutex mu_;
+	CircuitBreakerPolicy policy_;
+	State state_;
+	/// Changed on every transition, the tickets handed out.
+	Ticket epoch_;
+	/// When the breaker opened or went half open.
+	Clock::time_point openedAt_;
+	/// Ring of outcome flags.
+	std::vector<unsigned char> window_;
+	unsigned next_;
+	unsigned calls_;
+	unsigned failures_;
+	unsigned slow_;
+	unsigned probesSent_;
+	unsigned probesPassed_;
+	uint64_t rejected_;
+	uint64_t opened_;
+
+	void Open();
+	void Close();
+	bool IsCurrent(Ticket ticket) const { return ticket == kAnyTicket || ticket == epoch_; }
+};
+
+
+inline void CircuitBreaker::SetPolicy(const CircuitBreakerPolicy& policy) {
+	std::lock_guard<std::mutex> guard(mu_);
+	policy_ = policy;
+	window_.assign(policy.windowSize? policy.windowSize: 1, 0);
+	Close();
+}
+
+inline void CircuitBreaker::Close() {
+	state_ = CLOSED;
+	++epoch_;
+	std::fill(window_.begin(), window_.end(), 0);
+	next_ = calls_ = failures_ = slow_ = 0;
+}
+
+inline void CircuitBreaker::Open() {
+	state_ = OPEN;
+	++epoch_;
+	openedAt_ = Clock::now();
+	++opened_;
+}
+
+inline bool CircuitBreaker::Allow(Ticket* ticket) {
+	std::lock_guard<std::mutex> guard(mu_);
+	if (ticket != nullptr) *ticket = epoch_;
+	if (!policy_.enabled || state_ == CLOSED) return true;
+	auto now = Clock::now();
+	// Probes lost or hung, try again later.
+	if (state_ == HALF_OPEN && now - openedAt_ >= std::chrono::milliseconds(policy_.probeTimeoutMs))
+		Open();
+	if (state_ == OPEN) {
+		if (now - openedAt_ < std::chrono::milliseconds(policy_.openMs)) {
+			++rejected_;
+			return false;
+		}
+		state_ = HALF_OPEN;
+		++epoch_;
+		openedAt_ = now;
+		probesSent_ = probesPassed_ = 0;
+	}
+	if (probesSent_ >= policy_.probes) {
+		++rejected_;
+		return false;
+	}
+	++probesSent_;
+	if (ticket != nullptr) *ticket = epoch_;
+	return true;
+}
+
+inline void CircuitBreaker::Release(Ticket ticket) {
+	std::lock_guard<std::mutex> guard(mu_);
+	if (state_ == HALF_OPEN && ticket == epoch_ && probesSent_ > 0) --probesSent_;
+}
+
+inline void CircuitBreaker::Record(::grpc::StatusCode code, uint64_t micros, Ticket ticket) {
+	std::lock_guard<std::mutex> guard(mu_);
+	if (!policy_.enabled) return;
+	// Sent in an earlier state, a straggler.
+	if (!IsCurrent(ticket)) return;
+	bool failed = (unsigned)code < 32 && (policy_.failureCodes & (1u << code)) != 0;
+	bool slow = micros >= policy_.slowCallMs * 1000ull;
+	switch (state_) {
+	case OPEN:
+		// A straggler sent before the breaker opened.
+		break;
+	case HALF_OPEN:
+		if (failed || slow) {
+			Open();
+		} else if (++probesPassed_ >= policy_.probes) {
+			Close();
+		}
+		break;
+	case CLOSED: {
+		unsigned char& outcome = window_[next_];
+		if (calls_ == window_.size()) {
+			failures_ -= (outcome & FAILED)? 1: 0;
+			slow_ -= (outcome & SLOW)? 1: 0;
+		} else {
+			++calls_;
+		}
+		outcome = (failed? FAILED: 0) | (slow? SLOW: 0);
+		failures_ += failed? 1: 0;
+		slow_ += slow? 1: 0;
+		next_ = (next_ + 1) % window_.size();
+		if (calls_ >= policy_.minCalls &&
+				(failures_ >= policy_.failureRate * calls_ || slow_ >= policy_.slowRate * calls_))
+			Open();
+		break;
+	}
+	}
+}
+
+inline CircuitBreaker::State CircuitBreaker::GetState() const {
+	std::lock_guard<std::mutex> guard(mu_);
+	return state_;
+}
+
+inline uint64_t CircuitBreaker::GetRejected() const {
+	std::lock_guard<std::mutex> guard(mu_);
+	return rejected_;
+}
+
+inline uint64_t CircuitBreaker::GetOpened() const {
+	std::lock_guard<std::mutex> guard(mu_);
+	return opened_;
+}
+
+}       // namespace lucida
+#endif  // CIRCUIT_BREAKER_H_EB83F139_6885_4040_866F_AB1544FD0154
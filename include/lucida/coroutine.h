@@ -0,0 +1,218 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef COROUTINE_H_83605289_558C_4FCC_ADF2_021F03D79323
+#define COROUTINE_H_83605289_558C_4FCC_ADF2_021F03D79323
+
+// Coroutine handlers need C++20, configure with --enable-coroutines. Older
+// standards see an empty header.
+#if defined(LUCIDA_REQUIRE_COROUTINES) && !defined(__cpp_impl_coroutine)
+#error "coroutines are enabled but the compiler does not provide them"
+#endif
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define LUCIDA_HAS_COROUTINES 1
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <grpc++/alarm.h>
+#include "call.h"
+#include "call_scope.h"
+#include "service_connector.h"
+
+namespace lucida {
+
+/// The return type of a coroutine handler. The coroutine starts running
+/// straight away on the completion queue thread and frees itself when it
+/// returns.
+class CallTask {
+	struct State {
+		State(): done(false), failed(false) {}
+		bool done;
+		/// The coroutine threw.
+		bool failed;
+		std::function<void(bool)> onDone;
+	};
+public:
+	class promise_type {
+	public:
+		promise_type(): state_(std::make_shared<State>()) {}
+		CallTask get_return_object() { return CallTask(state_); }
+		std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+		/// Runs the completion and lets the frame go.
+		struct FinalAwaiter {
+			std::shared_ptr<State> state;
+			bool await_ready() noexcept {
+				state->done = true;
+				if (state->onDone) state->onDone(state->failed);
+				return true;
+			}
+			void await_suspend(std::coroutine_handle<>) noexcept {}
+			void await_resume() noexcept {}
+		};
+		FinalAwaiter final_suspend() noexcept { return FinalAwaiter{state_}; }
+		void return_void() {}
+		void unhandled_exception() { state_->failed = true; }
+	private:
+		std::shared_ptr<State> state_;
+	};
+
+	/// A task that has already completed, for handlers that need not suspend.
+	CallTask() {}
+
+	bool IsDone() const { return !state_ || state_->done; }
+
+	/// Finish the call when the coroutine returns. The call is deferred if the
+	/// coroutine is suspended, otherwise the acceptor finishes it as usual.
+	///
+	/// @param[in]  call    The call the coroutine is handling.
+	template<class RequestType, class ResponseType>
+	void FinishWhenDone(TypedCall<RequestType, ResponseType>* call) {
+		auto finish = [call](bool failed) {
+			if (failed)
+				call->FinishWithError(::grpc::Status(::grpc::StatusCode::INTERNAL, "handler threw"));
+			else
+				call->Finish();
+		};
+		if (!IsDone()) {
+			call->Defer();
+			state_->onDone = finish;
+		} else if (state_ && state_->failed) {
+			finish(true);
+		}
+	}
+
+private:
+	explicit CallTask(const std::shared_ptr<State>& state): state_(state) {}
+	std::shared_ptr<State> state_;
+};
+
+
+/// Resumes a coroutine on a server completion queue, inside the call scope
+/// it was suspended in.
+class ResumeTag: public UntypedCall {
+public:
+	/// Post a resumption. Safe from any thread.
+	///
+	/// @param[in]  handle  The suspended coroutine.
+	/// @param[in]  frame   The call scope, frame.cq must be set.
+	static void Post(std::coroutine_handle<> handle, const CallScope::Frame& frame) {
+		ResumeTag* tag = new ResumeTag(handle, frame);
+		tag->alarm_.Set(frame.cq, gpr_now(GPR_CLOCK_MONOTONIC), tag);
+	}
+
+	void Proceed(bool) override {
+		{
+			CallScope scope(frame_);
+			handle_.resume();
+		}
+		delete this;
+	}
+	UntypedCall* CreateListener() override { return nullptr; }
+	const char* GetMethodName() const override { return "resume"; }
+
+private:
+	ResumeTag(std::coroutine_handle<> handle, const CallScope::Frame& frame): handle_(handle), frame_(frame) {
+		status_ = FINISH;
+	}
+	::grpc::Alarm alarm_;
+	std::coroutine_handle<> handle_;
+	CallScope::Frame frame_;
+};
+
+
+/// Awaits a connector call. Inside a server call the coroutine resumes on
+/// that call's completion queue thread. Elsewhere it resumes on the
+/// connector's thread.
+class RpcAwaiter {
+public:
+	explicit RpcAwaiter(std::shared_ptr<RpcCall> call): call_(std::move(call)) {}
+	bool await_ready() const { return call_->IsDone(); }
+	void await_suspend(std::coroutine_handle<> handle) {
+		CallScope::Frame frame = CallScope::Capture();
+		if (frame.cq == nullptr)
+			call_->Then([handle]() { handle.resume(); });
+		else
+			call_->Then([handle, frame]() { ResumeTag::Post(handle, frame); });
+	}
+	std::shared_ptr<RpcCall> await_resume() { return std::move(call_); }
+private:
+	std::shared_ptr<RpcCall> call_;
+};
+
+/// Lets a coroutine write co_await connector.inferAsync(request).
+inline RpcAwaiter operator co_await(std::shared_ptr<RpcCall> call) {
+	return RpcAwaiter(std::move(call));
+}
+
+
+/// Statically dispatched handler whose methods are coroutines. Derived hides
+/// CoCreate, CoLearn and CoInfer for the methods it implements. The call is
+/// finished when the coroutine returns unless it finished the call itself.
+/// @remarks Don't co_await after finishing the call, the server may have
+/// shut down its completion queues.
+template<class Derived>
+class CoroutineServiceHandlerT: public AsyncServiceHandlerT<Derived>
+{
+public:
+	void OnCreate(TypedCall<Request, ::google::protobuf::Empty>* call) {
+		derived()->CoCreate(call).FinishWhenDone(call);
+	}
+	void OnLearn(TypedCall<Request, ::google::protobuf::Empty>* call) {
+		derived()->CoLearn(call).FinishWhenDone(call);
+	}
+	void OnInfer(TypedCall<Request, Response>* call) {
+		derived()->CoInfer(call).FinishWhenDone(call);
+	}
+
+	CallTask CoCreate(TypedCall<Request, ::google::protobuf::Empty>* call) {
+		call->FinishWithError(::grpc::Status(::grpc::StatusCode::UNIMPLEMENTED, "create"));
+		return CallTask();
+	}
+	CallTask CoLearn(TypedCall<Request, ::google::protobuf::Empty>* call) {
+		call->FinishWithError(::grpc::Status(::grpc::StatusCode::UNIMPLEMENTED, "learn"));
+		return CallTask();
+	}
+	CallTask CoInfer(TypedCall<Request, Response>* call) {
+		call->FinishWithError(::grpc::Status(::grpc::StatusCode::UNIMPLEMENTED, "infer"));
+		return CallTask();
+	}
+protected:
+	Derived* derived() { return static_cast<Derived*>(this); }
+};
+
+}       // namespace lucida
+#endif  // __has_include(<coroutine>)
+#endif  // __cpp_impl_coroutine
+#endif  // COROUTINE_H_83605289_558C_4FCC_ADF2_021F03D79323
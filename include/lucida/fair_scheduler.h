@@ -0,0 +1,144 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FAIR_SCHEDULER_H_71FD70CD_98E2_4232_93E6_3C7D5979CCCC
+#define FAIR_SCHEDULER_H_71FD70CD_98E2_4232_93E6_3C7D5979CCCC
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace lucida {
+class UntypedCall;
+
+/// How matched calls are shared between tenants, keyed by Request.LUCID.
+struct FairSchedulerPolicy {
+	FairSchedulerPolicy(): enabled(false), defaultWeight(1), maxInflight(0), maxQueued(0), maxIdleTenants(4096) {}
+	bool enabled;
+	/// Calls a tenant may dispatch per round.
+	unsigned defaultWeight;
+	/// Weights for named tenants.
+	std::map<std::string, unsigned> weights;
+	/// Calls of one tenant dispatched and not yet over, per completion queue.
+	/// Zero for no limit.
+	unsigned maxInflight;
+	/// Calls of one tenant waiting, per completion queue. Further calls are
+	/// failed with RESOURCE_EXHAUSTED. Zero for no limit.
+	unsigned maxQueued;
+	/// Forget idle tenants once there are more than this.
+	unsigned maxIdleTenants;
+
+	unsigned WeightOf(const std::string& tenant) const {
+		auto it = weights.find(tenant);
+		return (it == weights.end() || it->second == 0)? defaultWeight: it->second;
+	}
+};
+
+
+/// Counters for one tenant.
+struct TenantReport {
+	TenantReport(): weight(0), dispatched(0), shed(0) {}
+	std::string tenant;
+	unsigned weight;
+	uint64_t dispatched;
+	/// Calls failed because the tenant's queue was full.
+	uint64_t shed;
+};
+
+
+/// Deficit round robin over per tenant queues, one per completion queue and
+/// only used by that queue's thread. Each call costs one, so in every round
+/// a tenant dispatches up to its weight before the next tenant's turn.
+class FairScheduler {
+public:
+	explicit FairScheduler(const FairSchedulerPolicy& policy): policy_(policy), queued_(0) {}
+	FairScheduler(const FairScheduler&) = delete;
+	FairScheduler& operator = (const FairScheduler&) = delete;
+	~FairScheduler();
+
+	/// Queue a matched call, or reject it if its tenant's queue is full.
+	///
+	/// @param[in]  tenant  The call's tenant.
+	/// @param[in]  call    The call.
+	void Push(const std::string& tenant, UntypedCall* call);
+
+	/// True if a queued call can be dispatched now.
+	bool Runnable() const;
+
+	/// Take the next call to dispatch, nullptr if none can be. The call
+	/// counts as in flight until it is deleted.
+	UntypedCall* Pop();
+
+	/// Calls waiting.
+	size_t Queued() const { return queued_; }
+
+	/// Append each tenant's counters. Safe from any thread.
+	void Report(std::vector<TenantReport>& report) const;
+
+private:
+	struct Tenant {
+		Tenant(const std::string& name, unsigned weight): name(name), weight(weight),
+			deficit(0), inflight(0), active(false), dispatched(0), shed(0) {}
+		const std::string name;
+		const unsigned weight;
+		unsigned deficit;
+		unsigned inflight;
+		bool active;
+		std::deque<UntypedCall*> queue;
+		std::atomic<uint64_t> dispatched;
+		std::atomic<uint64_t> shed;
+	};
+
+	bool Blocked(const Tenant* t) const {
+		return policy_.maxInflight != 0 && t->inflight >= policy_.maxInflight;
+	}
+	Tenant* Find(const std::string& name);
+	void PruneIdle();
+
+	const FairSchedulerPolicy policy_;
+	/// Guards the map against readers of the report. Only this queue's
+	/// thread changes it so lookups need no lock.
+	mutable std::mutex mu_;
+	std::unordered_map<std::string, std::unique_ptr<Tenant>> tenants_;
+	/// Tenants with queued calls in round robin order, the front has the turn.
+	std::deque<Tenant*> active_;
+	size_t queued_;
+};
+
+}       // namespace lucida
+#endif  // FAIR_SCHEDULER_H_71FD70CD_98E2_4232_93E6_3C7D5979CCCC
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HOT_RESTART_H_3094EA6E_3D44_4807_94F4_27280DFFF37C
+#define HOT_RESTART_H_3094EA6E_3D44_4807_94F4_27280DFFF37C
+
+#include <string>
+
+namespace lucida {
+
+/// Hot restart hands a listening socket from a running process to its
+/// replacement over a Unix domain socket, the control socket, so the port
+/// never closes: connections arriving during the handover wait in the
+/// listen backlog. The running process passes the socket with SCM_RIGHTS,
+/// followed by an opaque warm state blob, then stops accepting and drains
+/// the calls it has in flight.
+///
+/// Whoever can connect to the control socket can take the listener and the
+/// warm state, so keep it in a directory only the service user can write.
+/// @see AsyncServiceAcceptorBase::EnableHotRestart
+
+
+/// Create a listening TCP socket.
+///
+/// @param[in]  hostAndPort The hostname, or ip address, and port. A bracketed
+///             ipv6 address, 0.0.0.0 or [::] for all interfaces.
+/// @param[in]  backlog     The listen backlog.
+/// @return     The socket, or -1 on error.
+int ListenTcp(const std::string& hostAndPort, int backlog=1024);
+
+
+/// Create a control socket, replacing whatever is at path.
+///
+/// @param[in]  path    The Unix socket path.
+/// @return     The listening socket, or -1 on error.
+int ListenControl(const std::string& path);
+
+
+/// Take over from the process listening on a control socket.
+///
+/// @param[in]  path        The Unix socket path.
+/// @param[out] warmState   The state the process handed over, may be empty.
+/// @param[in]  timeoutMs   Give up if the process stalls this long.
+/// @return     The listening socket, or -1 if no process handed one over.
+int ReceiveListener(const std::string& path, std::string& warmState, unsigned timeoutMs=10000);
+
+
+/// Hand a listening socket to a successor connected to the control socket.
+///
+/// @param[in]  conn        The successor's connection.
+/// @param[in]  listenFd    The listening socket, still owned by the caller.
+/// @param[in]  warmState   Handed over after the socket.
+/// @return     False if the successor could not be sent everything.
+bool SendListener(int conn, int listenFd, const std::string& warmState);
+
+}       // namespace lucida
+#endif  // HOT_RESTART_H_3094EA6E_3D44_4807_94F4_27280DFFF37C
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef IMAGE_MATCH_H_E8031CFF_7570_4E4B_A6E9_544736763EEF
+#define IMAGE_MATCH_H_E8031CFF_7570_4E4B_A6E9_544736763EEF
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "call.h"
+#include "lucid_store.h"
+#include "vector_index.h"
+
+namespace lucida {
+
+/// Turns an image into an embedding. Implementations must be thread safe.
+class FeatureExtractor {
+public:
+	virtual ~FeatureExtractor() {}
+
+	/// The dimension of the embeddings.
+	virtual size_t Dimension() const = 0;
+
+	/// @param[in]  image       The encoded image.
+	/// @param[out] features    Its embedding, Dimension() long.
+	/// @return     False if the image cannot be decoded.
+	virtual bool Extract(const std::string& image, std::vector<float>& features) const = 0;
+};
+
+
+/// Deterministic stand-in for a vision model, for tests and for trying the
+/// service without one. Hashes the byte trigrams of an image into signed
+/// buckets, so identical images have identical embeddings and images that
+/// share most of their bytes have close ones.
+class HashFeatureExtractor: public FeatureExtractor {
+public:
+	explicit HashFeatureExtractor(size_t dim=128): dim_(dim) {}
+	size_t Dimension() const override { return dim_; }
+	bool Extract(const std::string& image, std::vector<float>& features) const override;
+private:
+	size_t dim_;
+};
+
+
+/// A user's images, and the blobs they were learned from when the handler
+/// has a BlobStore.
+struct LearnedImages {
+	VectorIndex index;
+	/// Digests the learns referenced, released when the images are forgotten.
+	std::vector<std::string> blobs;
+};
+
+inline size_t MemoryUsageOf(const LearnedImages& images) {
+	return MemoryUsageOf(images.index) + MemoryUsageOf(images.blobs);
+}
+
+
+/// Image matching service. Learn adds the images of a request to the
+/// user's index, labelled by the input's tags. A learn with an unlearn
+/// input first forgets all the user's images, so it replaces them. Infer
+/// answers with the labels of the images closest to the request's first
+/// image, closest first and one per line.
+///
+/// Each user has a VectorIndex in a LucidStore, so infer calls search in
+/// parallel and only learn calls for the same user contend.
+class ImageMatchHandler: public AsyncServiceHandlerT<ImageMatchHandler> {
+public:
+	/// @param[in]  extractor   Takes ownership.
+	/// @param[in]  options     For each user's index.
+	/// @param[in]  topK        The number of labels infer returns.
+	ImageMatchHandler(FeatureExtractor* extractor, const VectorIndexOptions& options=VectorIndexOptions(), unsigned topK=1);
+
+	void OnCreate(TypedCall<Request, ::google::protobuf::Empty>* call);
+	void OnLearn(TypedCall<Request, ::google::protobuf::Empty>* call);
+	void OnInfer(TypedCall<Request, Response>* call);
+
+	/// Learn a request outside a call, for example one replayed from a
+	/// LearnLog at startup. Blob references are left alone, the store
+	/// journals its own.
+	/// @return     OK, or INVALID_ARGUMENT if there is no image to learn.
+	::grpc::Status Learn(const Request& request);
+
+	const LucidStore<LearnedImages>& GetStore() const { return store_; }
+
+private:
+	/// @param[out] forgotten   The blobs of the knowledge an unlearn dropped.
+	::grpc::Status Learn(const Request& request, const QuerySpecView& spec, std::vector<std::string>& forgotten);
+
+	std::unique_ptr<FeatureExtractor> extractor_;
+	VectorIndexOptions options_;
+	unsigned topK_;
+	LucidStore<LearnedImages> store_;
+};
+
+}       // namespace lucida
+#endif  // IMAGE_MATCH_H_E8031CFF_7570_4E4B_A6E9_544736763EEF
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef LATENCY_HISTOGRAM_H_96F5F113_C4E9_47B6_ABE7_279F33BD15B8
+#define LATENCY_HISTOGRAM_H_96F5F113_C4E9_47B6_ABE7_279F33BD15B8
+
+#include <cstdint>
+#include <atomic>
+
+namespace lucida {
+
+/// Lock-free log-linear latency histogram.
+///
+/// Each power of two is split into four buckets so a percentile is accurate
+/// to within 25%. Record() may be called from any thread; readers see an
+/// approximate but consistent-enough view for picking timeouts.
+class LatencyHistogram {
+public:
+	static const unsigned kSubBuckets = 4;
+	static const unsigned kBucketCount = kSubBuckets + 40 * kSubBuckets;
+
+	LatencyHistogram(): count_(0) {
+		for (unsigned i = 0; i < kBucketCount; ++i)
+			buckets_[i].store(0, std::memory_order_relaxed);
+	}
+	LatencyHistogram(const LatencyHistogram&) = delete;
+	LatencyHistogram& operator = (const LatencyHistogram&) = delete;
+
+	/// Add a sample.
+	///
+	/// @param[in]  micros  The latency in microseconds.
+	void Record(uint64_t micros) {
+		buckets_[BucketOf(micros)].fetch_add(1, std::memory_order_relaxed);
+		count_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	/// The number of samples since construction or the last Decay().
+	uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+
+	/// Get the upper bound of the bucket holding the percentile.
+	///
+	/// @param[in]  p   The percentile in the range [0,1].
+	/// @return     The latency in microseconds, zero if there are no samples.
+	uint64_t Percentile(double p) const;
+
+	/// Halve every bucket so old samples fade out.
+	void Decay();
+
+	/// @{
+	/// Bucket arithmetic, exposed for testing.
+	static unsigned BucketOf(uint64_t micros);
+	static uint64_t BucketLimit(unsigned bucket);
+	/// @}
+
+private:
+	std::atomic<uint64_t> count_;
+	std::atomic<uint64_t> buckets_[kBucketCount];
+};
+
+
+inline unsigned LatencyHistogram::BucketOf(uint64_t micros) {
+	if (micros < kSubBuckets) return (unsigned)micros;
+	unsigned msb = 63 - __builtin_clzll(micros);
+	unsigned bucket = kSubBuckets + (msb - 2) * kSubBuckets + ((micros >> (msb - 2)) & (kSubBuckets - 1));
+	return (bucket < kBucketCount)? bucket: kBucketCount - 1;
+}
+
+inline uint64_t LatencyHistogram::BucketLimit(unsigned bucket) {
+	if (bucket < kSubBuckets) return bucket + 1;
+	unsigned shift = (bucket - kSubBuckets) / kSubBuckets;
+	uint64_t mantissa = kSubBuckets + (bucket - kSubBuckets) % kSubBuckets;
+	return (mantissa + 1) << shift;
+}
+
+inline uint64_t LatencyHistogram::Percentile(double p) const {
+	uint64_t counts[kBucketCount];
+	uint64_t total = 0;
+	for (unsigned i = 0; i < kBucketCount; ++i)
+		total += (counts[i] = buckets_[i].load(std::memory_order_relaxed));
+	if (total == 0) return 0;
+	uint64_t rank = (uint64_t)(p * total);
+	if (rank >= total) rank = total - 1;
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < kBucketCount; ++i) {
+		seen += counts[i];
+		if (seen > rank) return BucketLimit(i);
+	}
+	return BucketLimit(kBucketCount - 1);
+}
+
+inline void LatencyHistogram::Decay() {
+	uint64_t total = 0;
+	for (unsigned i = 0; i < kBucketCount; ++i) {
+		uint64_t n = buckets_[i].load(std::memory_order_relaxed) / 2;
+		buckets_[i].store(n, std::memory_order_relaxed);
+		total += n;
+	}
+	count_.store(total, std::memory_order_relaxed);
+}
+
+}       // namespace lucida
+#endif  // LATENCY_HISTOGRAM_H_96F5F113_C4E9_47B6_ABE7_279F33BD15B8
@@ -0,0 +1,218 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LEARN_LOG_H_2800AAF0_DC50_440D_B86E_A415930B41EF
+#define LEARN_LOG_H_2800AAF0_DC50_440D_B86E_A415930B41EF
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "generated/lucida_service.pb.h"
+
+namespace lucida {
+
+/// On disk record header, followed by the LUCID and the data. The CRC-32C
+/// covers everything after the crc field.
+struct LearnRecordHeader {
+	uint32_t crc;
+	uint32_t lucidSize;
+	uint32_t dataSize;
+	uint32_t reserved;
+};
+
+
+/// A learn record. Points into a mapping or a read buffer, valid only for
+/// the duration of the callback it is passed to.
+struct LearnEntry {
+	const char* lucid;
+	uint32_t lucidSize;
+	const char* data;
+	uint32_t dataSize;
+
+	std::string GetLucid() const { return std::string(lucid, lucidSize); }
+	std::string GetData() const { return std::string(data, dataSize); }
+	/// Parse a record written by LearnLog::Append(const Request&).
+	bool GetRequest(Request& request) const { return request.ParseFromArray(data, dataSize); }
+};
+
+
+/// Compacted learn records, grouped by LUCID and mapped read-only. Serve
+/// straight from it, or replay it into handler state.
+class LearnSnapshot {
+public:
+	/// Map a snapshot.
+	///
+	/// @param[in]  path    The file.
+	/// @return     The snapshot, nullptr if the file is missing or corrupt.
+	static LearnSnapshot* Open(const std::string& path);
+
+	~LearnSnapshot();
+	LearnSnapshot(const LearnSnapshot&) = delete;
+	LearnSnapshot& operator = (const LearnSnapshot&) = delete;
+
+	/// Visit all records, each user's in the order they were learned.
+	///
+	/// @param[in]  fn  Called with each record.
+	/// @return     False if a record is corrupt. Records before it were visited.
+	bool ForEach(const std::function<void(const LearnEntry&)>& fn) const;
+
+	/// Visit one user's records, in the order they were learned.
+	///
+	/// @param[in]  lucid   The user.
+	/// @param[in]  fn      Called with each record.
+	/// @return     The number of records visited.
+	size_t Find(const std::string& lucid, const std::function<void(const LearnEntry&)>& fn) const;
+
+	uint64_t GetRecords() const;
+	uint64_t GetUsers() const;
+	/// The first log segment not included.
+	uint64_t GetNextSequence() const;
+
+private:
+	LearnSnapshot(void* base, size_t size);
+	void* base_;
+	size_t size_;
+};
+
+
+struct LearnLogOptions {
+	LearnLogOptions(): segmentBytes(64u << 20), syncEachAppend(false), compactBytes(0) {}
+	/// Start a new segment once the active one is this large.
+	size_t segmentBytes;
+	/// fdatasync after every append. Otherwise records reach the disk when
+	/// the kernel writes them back, or on Sync().
+	bool syncEachAppend;
+	/// Compact in the background once the segments hold this many bytes.
+	/// Zero to compact only when Compact() is called.
+	size_t compactBytes;
+};
+
+
+/// Counters for a learn log.
+struct LearnLogStats {
+	LearnLogStats(): snapshotRecords(0), snapshotUsers(0), tailRecords(0), tailBytes(0), segments(0), compactions(0) {}
+	uint64_t snapshotRecords;
+	uint64_t snapshotUsers;
+	/// Records in the segments, not yet compacted.
+	uint64_t tailRecords;
+	uint64_t tailBytes;
+	unsigned segments;
+	uint64_t compactions;
+};
+
+
+/// Durable log of what handlers learn, so a restarted service need not be
+/// fed every learn request again.
+///
+/// Records are appended to numbered segment files, each record checksummed.
+/// Compaction folds the snapshot and the full segments into a new snapshot
+/// grouped by LUCID. On restart the snapshot is mapped and only the
+/// segments written since are replayed. A torn record at the end of the
+/// last segment is cut off.
+///
+/// Directory layout: segment.<seq>.log and snapshot.<seq>, where a
+/// snapshot holds every segment numbered below its seq.
+class LearnLog {
+public:
+	/// @param[in]  dir     The directory, created if missing.
+	/// @param[in]  options Segment size, durability and compaction.
+	LearnLog(const std::string& dir, const LearnLogOptions& options=LearnLogOptions());
+	~LearnLog();
+	LearnLog(const LearnLog&) = delete;
+	LearnLog& operator = (const LearnLog&) = delete;
+
+	/// Recover and open for appending. Call once, before Append.
+	///
+	/// @param[in]  fn              Called with each recovered record.
+	/// @param[in]  replaySnapshot  Also replay the snapshot's records. Pass
+	///             false to serve from GetSnapshot() and replay only the tail.
+	/// @return     False if the directory cannot be used.
+	bool Open(const std::function<void(const LearnEntry&)>& fn, bool replaySnapshot=true);
+
+	/// Append a record. Thread safe.
+	///
+	/// @param[in]  lucid   The user.
+	/// @param[in]  data    The record.
+	/// @param[in]  size    Its size.
+	/// @return     False on a write error.
+	bool Append(const std::string& lucid, const void* data, size_t size);
+
+	/// Append a learn request, keyed by its LUCID.
+	bool Append(const Request& request);
+
+	/// Flush appended records to disk.
+	bool Sync();
+
+	/// Fold the full segments into a new snapshot. Appends continue while it
+	/// runs. Thread safe.
+	///
+	/// @return     False on error, the old snapshot and segments are kept.
+	bool Compact();
+
+	/// The current snapshot, nullptr if there is none yet.
+	std::shared_ptr<const LearnSnapshot> GetSnapshot() const;
+
+	LearnLogStats GetStats() const;
+
+private:
+	bool OpenSegment(uint64_t seq);
+	bool ReplaySegment(uint64_t seq, bool last, const std::function<void(const LearnEntry&)>& fn);
+	std::string SegmentPath(uint64_t seq) const;
+	std::string SnapshotPath(uint64_t seq) const;
+	void CompactLoop();
+
+	const std::string dir_;
+	const LearnLogOptions options_;
+	/// Guards the active segment, the snapshot pointer and the counters.
+	mutable std::mutex mu_;
+	int fd_;
+	uint64_t activeSeq_;
+	size_t activeBytes_;
+	/// The first segment not in the snapshot.
+	uint64_t firstSeq_;
+	uint64_t tailRecords_;
+	uint64_t tailBytes_;
+	uint64_t compactions_;
+	std::shared_ptr<const LearnSnapshot> snapshot_;
+	/// One compaction at a time.
+	std::mutex compactMu_;
+	std::condition_variable compactCv_;
+	bool stopping_;
+	std::thread compactor_;
+};
+
+}       // namespace lucida
+#endif  // LEARN_LOG_H_2800AAF0_DC50_440D_B86E_A415930B41EF
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOAD_REPORT_H_48C91A01_C2BC_4890_99C8_A3C677DAFF51
+#define LOAD_REPORT_H_48C91A01_C2BC_4890_99C8_A3C677DAFF51
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace lucida {
+
+/// A server's load, sent in the trailing metadata of every call it finishes
+/// when load reporting is enabled, so clients can route by load. There is no
+/// load RPC: a client already has a report from its last reply to each
+/// target, and polling would cost a round trip for one no fresher.
+/// @see AsyncServiceAcceptorBase::EnableLoadReports
+/// @see AsyncServiceConnector::SetLeastLoadRouting
+struct LoadReport {
+	LoadReport(): inFlight(0), queued(0), utilization(0), latencyUs(0), qps(0) {}
+	/// Calls matched and not yet over, including the one carrying the report.
+	uint32_t inFlight;
+	/// Calls waiting for the fair scheduler.
+	uint32_t queued;
+	/// CPU used by the process recently, as a fraction of the CPUs it may run
+	/// on.
+	float utilization;
+	/// Moving average of the time from matching a call to finishing it.
+	uint32_t latencyUs;
+	/// Calls finished per second recently.
+	uint32_t qps;
+
+	/// The trailing metadata key.
+	static const char* Key() { return "lucida-load"; }
+
+	/// Encode as "inFlight,queued,utilization permille,latencyUs,qps".
+	std::string Encode() const;
+
+	/// Parse an encoded report.
+	///
+	/// @param[in]  s       The encoded report.
+	/// @param[out] report  The report, unchanged on error.
+	/// @return     False if s is malformed.
+	static bool Parse(const std::string& s, LoadReport& report);
+};
+
+
+/// Keeps a server's load up to date. Calls update the counters as they come
+/// and go, and the CPU and rate samples are refreshed by whichever thread
+/// asks for a report once they are older than the interval.
+/// @remarks Threadsafe
+class LoadReporter {
+public:
+	/// @param[in]  intervalMs  The age at which samples are refreshed.
+	explicit LoadReporter(unsigned intervalMs=100);
+
+	void AddInFlight(int64_t delta) { inFlight_.fetch_add(delta, std::memory_order_relaxed); }
+	void AddQueued(int64_t delta) { queued_.fetch_add(delta, std::memory_order_relaxed); }
+
+	/// Record a finished call.
+	///
+	/// @param[in]  micros  The time from matching the call to finishing it.
+	void RecordCall(uint32_t micros) {
+		// Updates racing on the average may be lost, which is harmless. The
+		// first call seeds it.
+		int64_t avg = latencyUs_.load(std::memory_order_relaxed);
+		avg = (avg == 0)? micros: avg + (int64_t(micros) - avg) / 8;
+		latencyUs_.store(uint32_t(std::max<int64_t>(avg, 1)), std::memory_order_relaxed);
+		finished_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	/// The current load, refreshing the samples if they are due.
+	LoadReport Get();
+
+private:
+	void Sample(int64_t now);
+
+	const int64_t intervalNs_;
+	const unsigned cpus_;
+	std::atomic<int64_t> inFlight_;
+	std::atomic<int64_t> queued_;
+	std::atomic<uint32_t> latencyUs_;
+	std::atomic<uint64_t> finished_;
+	std::atomic<int64_t> sampledAt_;
+	std::atomic<uint32_t> utilizationPermille_;
+	std::atomic<uint32_t> qps_;
+	/// Held by the thread taking a sample, which owns the fields below.
+	std::mutex sampleMu_;
+	int64_t lastCpuNs_;
+	uint64_t lastFinished_;
+};
+
+}       // namespace lucida
+#endif  // LOAD_REPORT_H_48C91A01_C2BC_4890_99C8_A3C677DAFF51
@@ -0,0 +1,194 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOG_SINK_H_A72DF527_8842_4A15_A751_64E72A3C032F
+#define LOG_SINK_H_A72DF527_8842_4A15_A751_64E72A3C032F
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <grpc++/support/status.h>
+
+namespace lucida {
+
+/// One call's log record. Fixed size, so logging a call neither allocates
+/// nor formats on the calling thread.
+struct CallLogRecord {
+	/// System clock, ns since the epoch.
+	int64_t timeNs;
+	/// Static storage, for example the method name.
+	const char* method;
+	/// Time since the call was matched, 0 if unknown.
+	uint32_t latencyUs;
+	/// The gRPC status code, or tagCode for a DEBUG tag trace.
+	int32_t code;
+	/// NUL terminated and truncated to fit.
+	char tenant[48];
+	char message[128];
+
+	static const int32_t tagCode = -1;
+};
+
+
+/// What LogSink keeps.
+struct LogPolicy {
+	LogPolicy(): errorsPerSecond(10), burst(20), okSampleRate(0), flushIntervalMs(50), threadBufferBytes(64 << 10) {}
+	/// Error records admitted per second for each status code, 0 for all.
+	unsigned errorsPerSecond;
+	/// Error records admitted at once for each status code.
+	unsigned burst;
+	/// The fraction of successful calls logged.
+	double okSampleRate;
+	unsigned flushIntervalMs;
+	/// Buffer of each logging thread. Records that do not fit are dropped.
+	size_t threadBufferBytes;
+};
+
+
+/// Counters of a LogSink.
+struct LogSinkStats {
+	/// Records buffered.
+	uint64_t logged;
+	/// Records rate limited away.
+	uint64_t suppressed;
+	/// Records lost to a full thread buffer.
+	uint64_t dropped;
+	/// Records handed to the writer.
+	uint64_t written;
+};
+
+
+/// Keeps glog off the completion queue threads. Each logging thread writes
+/// fixed size records to its own lock-free ring buffer and a background
+/// thread formats and writes them. Error records are rate limited for each
+/// status code, so an error storm costs a clock read per call and logs a
+/// count of what it suppressed.
+class LogSink {
+public:
+	/// Receives records on the flusher thread.
+	typedef std::function<void(const CallLogRecord&)> Writer;
+
+	/// @param[in]  policy  What to keep.
+	/// @param[in]  writer  Where records go, glog if empty.
+	explicit LogSink(const LogPolicy& policy=LogPolicy(), Writer writer=Writer());
+
+	/// Writes what is buffered and stops the flusher.
+	~LogSink();
+
+	LogSink(const LogSink&) = delete;
+	LogSink& operator = (const LogSink&) = delete;
+
+	/// The process wide sink, writing to glog. Created on first use and
+	/// never destroyed, so it can be used while the process exits.
+	static LogSink& Get();
+
+	/// Log a finished call. Successful calls are sampled and errors are
+	/// rate limited.
+	///
+	/// @param[in]  method      The method name, must have static storage.
+	/// @param[in]  status      How the call finished.
+	/// @param[in]  tenant      The caller's LUCID, may be nullptr.
+	/// @param[in]  latencyUs   Time spent on the call, 0 if unknown.
+	void LogCall(const char* method, const ::grpc::Status& status, const std::string* tenant=nullptr, uint32_t latencyUs=0) {
+		if (status.ok() && okThreshold_.load(std::memory_order_relaxed) == 0) return;
+		LogCallSlow(method, status, tenant, latencyUs);
+	}
+
+	/// Trace a completion queue tag. Never rate limited, for DEBUG builds.
+	///
+	/// @param[in]  what    Static storage, for example "TypedCall: finish".
+	/// @param[in]  tag     The tag.
+	void LogTag(const char* what, const void* tag);
+
+	/// Change the policy. The buffer size applies to threads that have not
+	/// logged yet.
+	void SetPolicy(const LogPolicy& policy);
+
+	/// Wait until the records logged before the call have been written.
+	void Flush();
+
+	LogSinkStats GetStats() const;
+
+private:
+	struct ThreadBuffer;
+	static const int codeCount = 17;
+
+	void LogCallSlow(const char* method, const ::grpc::Status& status, const std::string* tenant, uint32_t latencyUs);
+	/// True if the rate limit of code admits a record.
+	bool Admit(int code);
+	void Push(const CallLogRecord& record);
+	ThreadBuffer* GetThreadBuffer();
+	void Run();
+	void Drain();
+
+	const uint64_t id_;
+	Writer writer_;
+	std::atomic<int64_t> intervalNs_;
+	std::atomic<int64_t> toleranceNs_;
+	/// okSampleRate scaled to 2^32.
+	std::atomic<uint64_t> okThreshold_;
+	std::atomic<unsigned> flushIntervalMs_;
+	std::atomic<size_t> threadBufferBytes_;
+	/// Theoretical arrival time of each code's next record, for GCRA.
+	std::atomic<int64_t> tat_[codeCount];
+	std::atomic<uint64_t> suppressedByCode_[codeCount];
+	std::atomic<uint64_t> logged_;
+	std::atomic<uint64_t> suppressed_;
+	std::atomic<uint64_t> dropped_;
+	std::atomic<uint64_t> written_;
+
+	std::mutex mu_;
+	std::condition_variable cv_;
+	std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+	/// Flush requests and completed drains.
+	uint64_t requested_;
+	uint64_t drained_;
+	bool stop_;
+	std::thread flusher_;
+};
+
+}       // namespace lucida
+
+/// Trace a completion queue tag in DEBUG builds.
+#ifdef DEBUG
+#define LUCIDA_LOG_TAG(what, tag) ::lucida::LogSink::Get().LogTag(what, tag)
+#else
+#define LUCIDA_LOG_TAG(what, tag) ((void)0)
+#endif
+
+#endif  // LOG_SINK_H_A72DF527_8842_4A15_A751_64E72A3C032F
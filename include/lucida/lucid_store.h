@@ -0,0 +1,334 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LUCID_STORE_H_13F443F0_D350_459C_9D08_CDBED2AE6CF3
+#define LUCID_STORE_H_13F443F0_D350_459C_9D08_CDBED2AE6CF3
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+
+namespace lucida {
+
+/// Reader-writer lock. Writers are preferred so a steady stream of infer
+/// calls cannot starve learn.
+class RwLock {
+public:
+	RwLock() {
+		pthread_rwlockattr_t attr;
+		pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+		pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+		pthread_rwlock_init(&lock_, &attr);
+		pthread_rwlockattr_destroy(&attr);
+	}
+	~RwLock() { pthread_rwlock_destroy(&lock_); }
+	RwLock(const RwLock&) = delete;
+	RwLock& operator = (const RwLock&) = delete;
+
+	void lock_shared() { pthread_rwlock_rdlock(&lock_); }
+	void unlock_shared() { pthread_rwlock_unlock(&lock_); }
+	void lock() { pthread_rwlock_wrlock(&lock_); }
+	void unlock() { pthread_rwlock_unlock(&lock_); }
+
+	/// Scoped shared ownership.
+	class ReadGuard {
+	public:
+		explicit ReadGuard(RwLock& lock): lock_(lock) { lock_.lock_shared(); }
+		~ReadGuard() { lock_.unlock_shared(); }
+		ReadGuard(const ReadGuard&) = delete;
+		ReadGuard& operator = (const ReadGuard&) = delete;
+	private:
+		RwLock& lock_;
+	};
+	/// Scoped exclusive ownership.
+	class WriteGuard {
+	public:
+		explicit WriteGuard(RwLock& lock): lock_(lock) { lock_.lock(); }
+		~WriteGuard() { lock_.unlock(); }
+		WriteGuard(const WriteGuard&) = delete;
+		WriteGuard& operator = (const WriteGuard&) = delete;
+	private:
+		RwLock& lock_;
+	};
+
+private:
+	pthread_rwlock_t lock_;
+};
+
+
+/// @{
+/// Approximate bytes used by a value, including what it owns on the heap.
+/// Overload for your own types, or give LucidStore a Sizer.
+template<class T>
+inline size_t MemoryUsageOf(const T&) { return sizeof(T); }
+
+inline size_t MemoryUsageOf(const std::string& s) {
+	return sizeof(std::string) + s.capacity();
+}
+
+template<class T>
+inline size_t MemoryUsageOf(const std::vector<T>& v) {
+	size_t n = sizeof(v) + (v.capacity() - v.size()) * sizeof(T);
+	for (const T& e: v) n += MemoryUsageOf(e);
+	return n;
+}
+/// @}
+
+/// The default LucidStore sizer.
+struct DefaultSizer {
+	template<class T>
+	size_t operator () (const T& v) const { return MemoryUsageOf(v); }
+};
+
+
+/// Concurrent map from LUCID to per-user state.
+///
+/// Users are spread over shards, each with its own lock that is only held
+/// to find or insert a user. Each user's state has its own reader-writer
+/// lock, so calls for different users never contend and infer calls for one
+/// user run in parallel.
+///
+/// Memory is accounted per user by applying Sizer to the state after each
+/// write.
+template<class T, class Sizer=DefaultSizer>
+class LucidStore {
+private:
+	struct Entry {
+		explicit Entry(const std::string& lucid): lucid(lucid), bytes(0), erased(false) {}
+		const std::string lucid;
+		RwLock lock;
+		T value;
+		std::atomic<size_t> bytes;
+		/// No longer accounted. Guarded by lock.
+		bool erased;
+	};
+
+	struct Shard {
+		RwLock lock;
+		std::unordered_map<std::string, std::shared_ptr<Entry>> users;
+		// Keep neighbouring shards' locks off this cache line.
+		char pad[64];
+	};
+
+public:
+	/// @param[in]  shards  The number of shards, rounded up to a power of two.
+	/// @param[in]  sizer   Measures a user's state.
+	explicit LucidStore(unsigned shards=64, const Sizer& sizer=Sizer()): mask_(0), sizer_(sizer), size_(0), bytes_(0) {
+		unsigned n = 1;
+		while (n < shards) n <<= 1;
+		mask_ = n - 1;
+		shards_.reset(new Shard[n]);
+	}
+	LucidStore(const LucidStore&) = delete;
+	LucidStore& operator = (const LucidStore&) = delete;
+
+	/// Create a user's state if it does not exist.
+	///
+	/// @param[in]  lucid   The user.
+	/// @return     True if the user was created.
+	bool Create(const std::string& lucid) {
+		bool created = false;
+		GetOrCreate(lucid, created, [](T&) {});
+		return created;
+	}
+
+	/// Create a user's state and initialize it.
+	///
+	/// @param[in]  lucid   The user.
+	/// @param[in]  init    Called with the new state, under its write lock,
+	///             before any other call can see the user.
+	/// @return     True if the user was created, false if it existed.
+	template<class Fn>
+	bool Create(const std::string& lucid, Fn init) {
+		bool created = false;
+		GetOrCreate(lucid, created, init);
+		return created;
+	}
+
+	/// Remove a user. Callers still reading the state keep it alive.
+	///
+	/// @param[in]  lucid   The user.
+	/// @return     True if the user existed.
+	bool Erase(const std::string& lucid) {
+		Shard& s = ShardOf(lucid);
+		std::shared_ptr<Entry> e;
+		{
+			RwLock::WriteGuard guard(s.lock);
+			auto it = s.users.find(lucid);
+			if (it == s.users.end()) return false;
+			e = std::move(it->second);
+			s.users.erase(it);
+		}
+		size_.fetch_sub(1, std::memory_order_relaxed);
+		RwLock::WriteGuard guard(e->lock);
+		e->erased = true;
+		bytes_.fetch_sub(e->bytes.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+		return true;
+	}
+
+	/// Read a user's state.
+	///
+	/// @param[in]  lucid   The user.
+	/// @param[in]  fn      Called with const T&, under the user's read lock.
+	/// @return     False if the user does not exist.
+	template<class Fn>
+	bool Read(const std::string& lucid, Fn fn) const {
+		std::shared_ptr<Entry> e = Find(lucid);
+		if (!e) return false;
+		RwLock::ReadGuard guard(e->lock);
+		fn(static_cast<const T&>(e->value));
+		return true;
+	}
+
+	/// Change a user's state.
+	///
+	/// @param[in]  lucid   The user.
+	/// @param[in]  fn      Called with T&, under the user's write lock.
+	/// @param[in]  create  Create the user if it does not exist.
+	/// @return     False if the user does not exist and was not created.
+	template<class Fn>
+	bool Write(const std::string& lucid, Fn fn, bool create=false) {
+		std::shared_ptr<Entry> e;
+		if (create) {
+			bool created;
+			e = GetOrCreate(lucid, created, [](T&) {});
+		} else if (!(e = Find(lucid))) {
+			return false;
+		}
+		Update(*e, fn);
+		return true;
+	}
+
+	/// Visit every user. Users created or erased during the walk may be missed.
+	///
+	/// @param[in]  fn  Called with the LUCID and const T&, under the user's
+	///             read lock.
+	template<class Fn>
+	void ForEach(Fn fn) const {
+		std::vector<std::shared_ptr<Entry>> entries;
+		for (size_t i = 0; i <= mask_; ++i) {
+			entries.clear();
+			{
+				RwLock::ReadGuard guard(shards_[i].lock);
+				for (auto& kv: shards_[i].users)
+					entries.push_back(kv.second);
+			}
+			for (auto& e: entries) {
+				RwLock::ReadGuard guard(e->lock);
+				fn(e->lucid, static_cast<const T&>(e->value));
+			}
+		}
+	}
+
+	bool Contains(const std::string& lucid) const { return static_cast<bool>(Find(lucid)); }
+
+	/// The number of users.
+	size_t Size() const { return size_.load(std::memory_order_relaxed); }
+
+	/// Bytes used by all users' state, as last measured.
+	size_t MemoryUsage() const { return bytes_.load(std::memory_order_relaxed); }
+
+	/// Bytes used by a user's state, as last measured. Zero if it does not exist.
+	size_t MemoryUsage(const std::string& lucid) const {
+		std::shared_ptr<Entry> e = Find(lucid);
+		return e? e->bytes.load(std::memory_order_relaxed): 0;
+	}
+
+private:
+	Shard& ShardOf(const std::string& lucid) const {
+		return shards_[std::hash<std::string>()(lucid) & mask_];
+	}
+
+	std::shared_ptr<Entry> Find(const std::string& lucid) const {
+		Shard& s = ShardOf(lucid);
+		RwLock::ReadGuard guard(s.lock);
+		auto it = s.users.find(lucid);
+		return (it == s.users.end())? std::shared_ptr<Entry>(): it->second;
+	}
+
+	/// Find a user, or create it and run init on the new state. The state's
+	/// write lock is taken before the shard lock is released, so no other
+	/// call sees the user until init returns.
+	template<class Fn>
+	std::shared_ptr<Entry> GetOrCreate(const std::string& lucid, bool& created, Fn init) {
+		created = false;
+		std::shared_ptr<Entry> e = Find(lucid);
+		if (e) return e;
+		Shard& s = ShardOf(lucid);
+		std::unique_lock<RwLock> entryGuard;
+		{
+			RwLock::WriteGuard guard(s.lock);
+			std::shared_ptr<Entry>& slot = s.users[lucid];
+			if (slot) return slot;
+			slot = std::make_shared<Entry>(lucid);
+			e = slot;
+			entryGuard = std::unique_lock<RwLock>(e->lock);
+		}
+		created = true;
+		size_.fetch_add(1, std::memory_order_relaxed);
+		init(e->value);
+		Account(*e);
+		return e;
+	}
+
+	template<class Fn>
+	void Update(Entry& e, Fn fn) {
+		RwLock::WriteGuard guard(e.lock);
+		fn(e.value);
+		Account(e);
+	}
+
+	/// Measure a user's state. Called under its write lock.
+	void Account(Entry& e) {
+		if (e.erased) return;
+		size_t bytes = sizeof(Entry) + e.lucid.capacity() + sizer_(static_cast<const T&>(e.value));
+		size_t old = e.bytes.exchange(bytes, std::memory_order_relaxed);
+		bytes_.fetch_add(bytes - old, std::memory_order_relaxed);
+	}
+
+	size_t mask_;
+	std::unique_ptr<Shard[]> shards_;
+	Sizer sizer_;
+	std::atomic<size_t> size_;
+	std::atomic<size_t> bytes_;
+};
+
+}       // namespace lucida
+#endif  // LUCID_STORE_H_13F443F0_D350_459C_9D08_CDBED2AE6CF3
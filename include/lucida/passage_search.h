@@ -0,0 +1,76 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PASSAGE_SEARCH_H_AE69690A_3D7B_40A8_AF25_8E13C8DD3B06
+#define PASSAGE_SEARCH_H_AE69690A_3D7B_40A8_AF25_8E13C8DD3B06
+
+#include <string>
+#include "call.h"
+#include "lucid_store.h"
+#include "text_index.h"
+
+namespace lucida {
+
+/// Question answering by passage retrieval. Learn indexes each text entry
+/// of a request as a passage of the user's knowledge. Infer answers with
+/// the passages that best match the request's text, best first and one
+/// per line.
+///
+/// Each user has a TextIndex in a LucidStore, so infer calls search in
+/// parallel and only learn calls for the same user contend.
+class PassageSearchHandler: public AsyncServiceHandlerT<PassageSearchHandler> {
+public:
+	/// @param[in]  params  For each user's index.
+	/// @param[in]  topK    The number of passages infer returns.
+	PassageSearchHandler(const Bm25Params& params=Bm25Params(), unsigned topK=1): params_(params), topK_(topK) {}
+
+	void OnCreate(TypedCall<Request, ::google::protobuf::Empty>* call);
+	void OnLearn(TypedCall<Request, ::google::protobuf::Empty>* call);
+	void OnInfer(TypedCall<Request, Response>* call);
+
+	/// Learn a request outside a call, for example one replayed from a
+	/// LearnLog at startup.
+	/// @return     OK, or INVALID_ARGUMENT if it has no text.
+	::grpc::Status Learn(const Request& request);
+
+	const LucidStore<TextIndex>& GetStore() const { return store_; }
+
+private:
+	::grpc::Status Learn(const Request& request, const QuerySpecView& spec);
+
+	Bm25Params params_;
+	unsigned topK_;
+	LucidStore<TextIndex> store_;
+};
+
+}       // namespace lucida
+#endif  // PASSAGE_SEARCH_H_AE69690A_3D7B_40A8_AF25_8E13C8DD3B06
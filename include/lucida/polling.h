@@ -0,0 +1,88 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef POLLING_H_D88BC7C0_6122_4E1F_A038_910070470928
+#define POLLING_H_D88BC7C0_6122_4E1F_A038_910070470928
+
+#include <string>
+#include <vector>
+#include <grpc++/completion_queue.h>
+
+namespace lucida {
+
+/// Where completion queue threads run and how they wait, for deployments
+/// that trade CPU for latency.
+struct PollingPolicy {
+	PollingPolicy(): cpusPerThread(1), localMemory(true), busyPollUs(0) {}
+	/// CPUs for the completion queue threads. Thread i is pinned to the
+	/// cpusPerThread CPUs starting at cpus[i * cpusPerThread], wrapping
+	/// around. Empty leaves the threads to the scheduler.
+	std::vector<int> cpus;
+	unsigned cpusPerThread;
+	/// Allocate a pinned thread's memory on its own NUMA node, even if the
+	/// process runs under another memory policy such as numactl --interleave.
+	bool localMemory;
+	/// Poll the queue without blocking for up to this long before waiting
+	/// in the kernel, 0 to always wait.
+	unsigned busyPollUs;
+};
+
+
+/// Parse a CPU list such as "0-3,8,10-11".
+///
+/// @param[in]  list    The list, may be empty.
+/// @param[out] cpus    The CPUs in list order.
+/// @return     False if list is malformed.
+bool ParseCpuList(const std::string& list, std::vector<int>& cpus);
+
+
+/// Apply a policy's placement to the calling thread. Call first thing on a
+/// new completion queue thread, so what it allocates is local to its CPUs.
+///
+/// @param[in]  policy  The policy.
+/// @param[in]  index   The thread's index among the completion queue threads.
+/// @return     False if the thread could not be pinned.
+bool PlaceThread(const PollingPolicy& policy, unsigned index);
+
+
+/// Wait for the next event like CompletionQueue::Next, polling without
+/// blocking for up to spinUs first.
+///
+/// @param[in]  cq      The completion queue.
+/// @param[out] tag     The event's tag.
+/// @param[out] ok      The event's status.
+/// @param[in]  spinUs  The time to poll for.
+/// @return     False once the queue is shut down and drained.
+bool PollNext(::grpc::CompletionQueue* cq, void** tag, bool* ok, unsigned spinUs);
+
+}       // namespace lucida
+#endif  // POLLING_H_D88BC7C0_6122_4E1F_A038_910070470928
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef QUERY_SPEC_VIEW_H_FCB9A86C_00E9_4588_AFD3_D3FF2067CE43
+#define QUERY_SPEC_VIEW_H_FCB9A86C_00E9_4588_AFD3_D3FF2067CE43
+
+#include <vector>
+#include "generated/lucida_service.pb.h"
+#include "service_names.h"
+
+namespace lucida {
+
+/// A QuerySpec with its command and input type names decoded once, so
+/// handlers and graph hops switch on enums instead of comparing strings.
+class QuerySpecView {
+public:
+	/// Decode a QuerySpec.
+	///
+	/// @param[in]  spec    The query spec. Must outlive the view.
+	explicit QuerySpecView(const QuerySpec& spec);
+
+	const QuerySpec& spec() const { return *spec_; }
+	const std::string& name() const { return spec_->name(); }
+	ServiceNames::CommandId command() const { return command_; }
+
+	/// The number of query inputs.
+	int size() const { return spec_->content_size(); }
+	const QueryInput& input(int i) const { return spec_->content(i); }
+	ServiceNames::TypeId type(int i) const { return ServiceNames::TypeId(types_[i]); }
+
+private:
+	const QuerySpec* spec_;
+	ServiceNames::CommandId command_;
+	std::vector<unsigned char> types_;
+};
+
+inline QuerySpecView::QuerySpecView(const QuerySpec& spec):
+	spec_(&spec), command_(ServiceNames::toCommandId(spec.name())), types_(spec.content_size()) {
+	for (int i = 0; i < spec.content_size(); ++i)
+		types_[i] = ServiceNames::toTypeId(spec.content(i).type());
+}
+
+
+/// Fixed size dispatch table keyed by a decoded name. Fn can be any callable,
+/// for example a function pointer or a pointer to member of a handler.
+///
+/// @tparam Fn      The handler type.
+/// @tparam Id      The enum used as the key.
+/// @tparam Count   The number of enum values.
+template<class Fn, class Id, unsigned Count>
+class DispatchTable {
+public:
+	/// Create a table where every entry is fallback.
+	explicit DispatchTable(const Fn& fallback) {
+		for (unsigned i = 0; i < Count; ++i) table_[i] = fallback;
+	}
+
+	/// Set the handler for id.
+	DispatchTable& On(Id id, const Fn& fn) {
+		table_[id] = fn;
+		return *this;
+	}
+
+	const Fn& operator [] (Id id) const { return table_[id]; }
+
+private:
+	Fn table_[Count];
+};
+
+template<class Fn>
+using CommandDispatchTable = DispatchTable<Fn, ServiceNames::CommandId, ServiceNames::COMMAND_COUNT>;
+
+template<class Fn>
+using TypeDispatchTable = DispatchTable<Fn, ServiceNames::TypeId, ServiceNames::TYPE_COUNT>;
+
+}       // namespace lucida
+#endif  // QUERY_SPEC_VIEW_H_FCB9A86C_00E9_4588_AFD3_D3FF2067CE43
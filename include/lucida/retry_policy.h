@@ -0,0 +1,128 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef RETRY_POLICY_H_8704CDDB_DE7A_43A9_82EF_C7A263F6617E
+#define RETRY_POLICY_H_8704CDDB_DE7A_43A9_82EF_C7A263F6617E
+
+#include <cstdint>
+#include <chrono>
+#include <mutex>
+#include <algorithm>
+#include <grpc++/support/status_code_enum.h>
+
+namespace lucida {
+
+/// Send another attempt if the first has not completed within a percentile
+/// of the target's recent latency. The first attempt to succeed wins and the
+/// others are cancelled.
+struct HedgePolicy {
+	HedgePolicy(): enabled(false), percentile(0.95), minDelayMs(1), defaultDelayMs(50), minSamples(20), maxAttempts(2) {}
+	bool enabled;
+	/// The percentile of the target's latency used as the hedge delay.
+	double percentile;
+	/// Lower bound on the hedge delay.
+	unsigned minDelayMs;
+	/// Hedge delay used until the target has minSamples samples.
+	unsigned defaultDelayMs;
+	unsigned minSamples;
+	/// Maximum attempts in flight, including the first.
+	unsigned maxAttempts;
+};
+
+
+/// Retry failed attempts on the next target.
+struct RetryPolicy {
+	RetryPolicy(): maxAttempts(1), backoffMs(5), retryableCodes(1u << ::grpc::StatusCode::UNAVAILABLE) {}
+	/// Maximum attempts including the first. One disables retries.
+	unsigned maxAttempts;
+	/// Delay before a retry is sent.
+	unsigned backoffMs;
+	/// Bit mask of retryable status codes.
+	uint32_t retryableCodes;
+
+	bool IsRetryable(::grpc::StatusCode code) const {
+		return (unsigned)code < 32 && (retryableCodes & (1u << code)) != 0;
+	}
+};
+
+
+/// Token bucket limiting hedges and retries to a fraction of requests, so a
+/// struggling backend does not see its load multiplied.
+///
+/// Every request deposits ratio tokens and every extra attempt withdraws one.
+/// A reserve of minPerSecond tokens is added each second so low traffic can
+/// still retry.
+class RetryBudget {
+public:
+	/// @param[in]  ratio           Extra attempts allowed per request.
+	/// @param[in]  minPerSecond    Extra attempts always allowed per second.
+	RetryBudget(double ratio=0.1, unsigned minPerSecond=10):
+		ratio_(ratio), minPerSecond_(minPerSecond), tokens_(minPerSecond),
+		maxTokens_(std::max(minPerSecond * 10.0, 100.0)), refilled_(std::chrono::steady_clock::now()) {}
+
+	/// Credit the budget for a new request.
+	void Deposit() {
+		std::lock_guard<std::mutex> guard(mu_);
+		tokens_ = std::min(tokens_ + ratio_, maxTokens_);
+	}
+
+	/// Take a token for an extra attempt.
+	///
+	/// @return     True if a token was available.
+	bool TryWithdraw() {
+		std::lock_guard<std::mutex> guard(mu_);
+		auto now = std::chrono::steady_clock::now();
+		double seconds = std::chrono::duration<double>(now - refilled_).count();
+		if (seconds >= 1.0) {
+			tokens_ = std::min(tokens_ + minPerSecond_ * seconds, maxTokens_);
+			refilled_ = now;
+		}
+		if (tokens_ < 1.0) return false;
+		tokens_ -= 1.0;
+		return true;
+	}
+
+	double GetTokens() const {
+		std::lock_guard<std::mutex> guard(mu_);
+		return tokens_;
+	}
+
+private:
+	mutable std::mutex mu_;
+	double ratio_;
+	double minPerSecond_;
+	double tokens_;
+	double maxTokens_;
+	std::chrono::steady_clock::time_point refilled_;
+};
+
+}       // namespace lucida
+#endif  // RETRY_POLICY_H_8704CDDB_DE7A_43A9_82EF_C7A263F6617E
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef RING_BUFFER_H_30709888_E13C_4044_A946_D2285E73A17A
+#define RING_BUFFER_H_30709888_E13C_4044_A946_D2285E73A17A
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <atomic>
+#include <memory>
+
+namespace lucida {
+
+/// Lock-free single producer, single consumer byte ring buffer.
+///
+/// One thread may call Write() while another calls Read(), Peek() or
+/// Consume() without any locking. The capacity is rounded up to a power
+/// of two so positions wrap with a mask.
+class RingBuffer {
+public:
+	/// Create a ring buffer.
+	///
+	/// @param[in]  capacity    Minimum capacity in bytes.
+	explicit RingBuffer(size_t capacity);
+	RingBuffer(const RingBuffer&) = delete;
+	RingBuffer& operator = (const RingBuffer&) = delete;
+
+	/// Copy up to size bytes into the buffer. Producer only.
+	///
+	/// @param[in]  data    The bytes to write.
+	/// @param[in]  size    The number of bytes to write.
+	/// @return     The number of bytes written, less than size if the buffer is full.
+	size_t Write(const void* data, size_t size);
+
+	/// Copy up to size bytes out of the buffer without consuming them. Consumer only.
+	///
+	/// @param[out] data    The destination.
+	/// @param[in]  size    The maximum number of bytes to copy.
+	/// @return     The number of bytes copied.
+	size_t Peek(void* data, size_t size) const;
+
+	/// Discard up to size bytes. Consumer only.
+	///
+	/// @param[in]  size    The number of bytes to discard.
+	/// @return     The number of bytes discarded.
+	size_t Consume(size_t size);
+
+	/// Copy and consume up to size bytes. Consumer only.
+	size_t Read(void* data, size_t size) { return Consume(Peek(data, size)); }
+
+	/// The number of bytes available for reading.
+	size_t Size() const {
+		return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+	}
+
+	/// The number of bytes that can be written before the buffer is full.
+	size_t Space() const { return capacity_ - Size(); }
+
+	size_t Capacity() const { return capacity_; }
+
+private:
+	size_t capacity_;
+	size_t mask_;
+	std::unique_ptr<char[]> data_;
+	// Positions increase monotonically and are masked on access. The producer
+	// owns head_ and the consumer owns tail_; keep them on separate cache lines.
+	char pad0_[64];
+	std::atomic<size_t> head_;
+	char pad1_[64 - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> tail_;
+};
+
+
+inline RingBuffer::RingBuffer(size_t capacity): capacity_(1), head_(0), tail_(0) {
+	while (capacity_ < capacity) capacity_ <<= 1;
+	mask_ = capacity_ - 1;
+	data_.reset(new char[capacity_]);
+}
+
+inline size_t RingBuffer::Write(const void* data, size_t size) {
+	const size_t head = head_.load(std::memory_order_relaxed);
+	const size_t tail = tail_.load(std::memory_order_acquire);
+	const size_t n = std::min(size, capacity_ - (head - tail));
+	const size_t offset = head & mask_;
+	const size_t first = std::min(n, capacity_ - offset);
+	memcpy(data_.get() + offset, data, first);
+	memcpy(data_.get(), static_cast<const char*>(data) + first, n - first);
+	head_.store(head + n, std::memory_order_release);
+	return n;
+}
+
+inline size_t RingBuffer::Peek(void* data, size_t size) const {
+	const size_t tail = tail_.load(std::memory_order_relaxed);
+	const size_t head = head_.load(std::memory_order_acquire);
+	const size_t n = std::min(size, head - tail);
+	const size_t offset = tail & mask_;
+	const size_t first = std::min(n, capacity_ - offset);
+	memcpy(data, data_.get() + offset, first);
+	memcpy(static_cast<char*>(data) + first, data_.get(), n - first);
+	return n;
+}
+
+inline size_t RingBuffer::Consume(size_t size) {
+	const size_t tail = tail_.load(std::memory_order_relaxed);
+	const size_t head = head_.load(std::memory_order_acquire);
+	const size_t n = std::min(size, head - tail);
+	tail_.store(tail + n, std::memory_order_release);
+	return n;
+}
+
+}       // namespace lucida
+#endif  // RING_BUFFER_H_30709888_E13C_4044_A946_D2285E73A17A
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ROUTER_H_99697CBD_1EC5_4915_B1FB_29533F11B159
+#define ROUTER_H_99697CBD_1EC5_4915_B1FB_29533F11B159
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <grpc++/grpc++.h>
+#include <grpc++/generic/async_generic_service.h>
+#include <grpc++/generic/generic_stub.h>
+#include "service_connector.h"
+
+namespace lucida {
+
+/// Find Request.LUCID in a serialized Request without parsing the rest of
+/// it. Only the top level fields are visited and the spec is skipped by its
+/// length, so the cost does not grow with the images carried.
+///
+/// @param[in]  request The serialized Request, in any number of slices.
+/// @param[out] lucid   The LUCID, empty if the request has none.
+/// @return     False if the request is malformed.
+bool PeekLucid(const ::grpc::ByteBuffer& request, std::string& lucid);
+
+
+/// Counters of a Router.
+struct RouterStats {
+	RouterStats(): calls(0), rejected(0), errors(0), spills(0) {}
+	/// Calls received.
+	uint64_t calls;
+	/// Calls refused without forwarding, malformed or streaming.
+	uint64_t rejected;
+	/// Forwarded calls the backend failed.
+	uint64_t errors;
+	/// Calls sent past their user's first backend, which was over the load
+	/// bound.
+	uint64_t spills;
+	/// Calls forwarded to each backend.
+	std::vector<uint64_t> forwarded;
+};
+
+
+/// A front for replicas of LucidaService, sharding users by LUCID. Calls are
+/// received by a generic service and forwarded as the bytes received, so
+/// neither the request nor the response is parsed, only the LUCID of create,
+/// learn and infer is peeked. Users are mapped to backends by rendezvous
+/// hashing with a load bound, the same as a connector with an AffinityPolicy,
+/// and calls without a LUCID go round robin. Deadlines, cancellation and metadata pass
+/// through, and the backend's trailing metadata comes back, so load reports
+/// reach the client. Unary methods only, recognize is refused.
+class Router {
+public:
+	/// Starts no threads, so a SignalWatcher may be created after it.
+	/// @param[in]  backends    The host:port of each backend.
+	/// @param[in]  loadBound   See AffinityPolicy::loadBound.
+	Router(const std::vector<std::string>& backends, double loadBound=AffinityPolicy().loadBound);
+	~Router();
+
+	Router(const Router&) = delete;
+	Router& operator = (const Router&) = delete;
+
+	/// Serve until Shutdown() and the calls in flight are over.
+	///
+	/// @param[in]  hostAndPort The address to listen on.
+	/// @param[in]  threads     Threads, each with its own completion queue.
+	/// @return     False if the server could not start.
+	bool Start(const std::string& hostAndPort, unsigned threads=1);
+
+	/// Stop taking calls and give those in flight until the grace period is
+	/// over, then cancel them. Blocks until they are done.
+	/// @param[in]  graceMs The grace period in milliseconds.
+	void Shutdown(unsigned graceMs=30000);
+
+	/// The index of a user's first choice of backend, where their calls go
+	/// while it is within the load bound.
+	unsigned PickBackend(const std::string& lucid) const;
+
+	/// Get the counters.
+	RouterStats GetStats() const;
+
+private:
+	class Call;
+	struct Backend {
+		std::string name;
+		uint64_t hash;
+		std::unique_ptr<::grpc::GenericStub> stub;
+		std::atomic<uint64_t> forwarded;
+		/// Calls forwarded and not yet answered.
+		std::atomic<int64_t> outstanding;
+	};
+
+	std::vector<std::unique_ptr<Backend>> backends_;
+	std::vector<uint64_t> hashes_;
+	double loadBound_;
+	::grpc::AsyncGenericService service_;
+	std::unique_ptr<::grpc::Server> server_;
+	std::vector<std::unique_ptr<::grpc::ServerCompletionQueue>> cqs_;
+	std::vector<std::thread> threads_;
+	std::mutex mu_;
+	/// Signalled under mu_ when inFlight_ drops to zero.
+	std::condition_variable idle_;
+	bool stopping_;
+	std::atomic<unsigned> next_;
+	std::atomic<int64_t> inFlight_;
+	std::atomic<uint64_t> spills_;
+	std::atomic<uint64_t> calls_;
+	std::atomic<uint64_t> rejected_;
+	std::atomic<uint64_t> errors_;
+
+	/// Handle the events of a completion queue until it is shut down.
+	void Serve(::grpc::ServerCompletionQueue* cq);
+
+	/// The backend for a user's next call.
+	Backend& Pick(const std::string& lucid);
+
+	/// A call is over.
+	void Done();
+};
+
+}       // namespace lucida
+#endif  // ROUTER_H_99697CBD_1EC5_4915_B1FB_29533F11B159
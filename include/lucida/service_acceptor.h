@@ -32,8 +32,12 @@
 #ifndef SERVICE_ACCEPTOR_H_62678E0B_8CC9_49E4_BB77_70E6E3ED515C
 #define SERVICE_ACCEPTOR_H_62678E0B_8CC9_49E4_BB77_70E6E3ED515C
 
+#include <atomic>
+#include <functional>
 #include <future>
 #include <memory>
+#include <thread>
+#include <vector>
 #include <grpc/grpc.h>
 #include <grpc++/server.h>
 #include <grpc++/server_builder.h>
@@ -43,41 +47,206 @@
 #include "generated/lucida_service.grpc.pb.h"
 #include "generated/lucida_service.pb.h"
 #include "call.h"
+#include "capture_log.h"
+#include "fair_scheduler.h"
+#include "load_report.h"
+#include "polling.h"
 
 
 namespace lucida {
 
-/// Lucida service
-///
-class AsyncServiceAcceptor {
+/// Listener statistics for one method, summed over completion queues.
+struct ListenerReport {
+	ListenerReport(): depth(0), matched(0), dry(0), expired(0), inFlight(0), cancelled(0) {}
+	std::string method;
+	/// Listeners kept outstanding per completion queue.
+	unsigned depth;
+	/// Calls matched to a listener.
+	uint64_t matched;
+	/// Matches that left no listener outstanding. New calls wait inside gRPC
+	/// until a listener is posted, so a high ratio to matched means the depth
+	/// is too small for the burst size.
+	uint64_t dry;
+	/// Calls dropped before dispatch because the client had cancelled or
+	/// the deadline had passed.
+	uint64_t expired;
+	/// Calls matched and not yet finished.
+	uint64_t inFlight;
+	/// Calls cancelled because they were still in flight when the drain
+	/// grace period ran out.
+	uint64_t cancelled;
+};
+
+
+/// How an acceptor winds down on Shutdown().
+struct DrainPolicy {
+	DrainPolicy(): notReadyMs(0), graceMs(30000) {}
+	/// Report not ready, and keep serving as usual for this long so load
+	/// balancers stop routing new calls here before the port closes.
+	unsigned notReadyMs;
+	/// Then stop accepting calls and wait this long for the calls in flight
+	/// to finish, before cancelling the rest. 0 waits as long as it takes.
+	unsigned graceMs;
+};
+
+
+/// Lifecycle shared by the async service acceptors. Derived classes supply
+/// the service and the listeners for each method.
+class AsyncServiceAcceptorBase {
 protected:
 	enum State { INIT, STARTED, SHUTDOWN, STOPPED, ERROR };
-	std::unique_ptr<AsyncServiceHandler> service_;
-	std::unique_ptr<::grpc::ServerCompletionQueue> cq_;
+	std::vector<std::unique_ptr<::grpc::ServerCompletionQueue>> cqs_;
 	std::unique_ptr<::grpc::Server> server_;
 	std::unique_ptr<::grpc::Alarm> shutdownAlarm_;
+	std::vector<std::unique_ptr<::grpc::Alarm>> cqShutdownAlarms_;
+	/// Shuts the server down off the completion queue threads.
+	std::thread stopper_;
 	State state_;
 	std::mutex mu_;
 	std::string serviceName_;
+	/// The server has been built, guarded by mu_.
+	bool serving_;
+	/// Per completion queue, one entry per method.
+	std::vector<std::unique_ptr<ListenerStats[]>> listeners_;
+	/// Matched calls on every queue, waited on by a drain.
+	CallCounter calls_;
+	unsigned listenerDepth_;
+	FairSchedulerPolicy schedulerPolicy_;
+	/// Per completion queue, empty unless fair scheduling is enabled.
+	std::vector<std::unique_ptr<FairScheduler>> schedulers_;
+	PollingPolicy pollingPolicy_;
+	DrainPolicy drainPolicy_;
+	/// Serving and not draining.
+	std::atomic<bool> ready_;
+	/// Set if load reports are enabled.
+	std::unique_ptr<LoadReporter> load_;
+	/// Set if capture is enabled.
+	std::unique_ptr<CaptureWriter> capture_;
+	/// Hot restart control socket path, empty if not enabled.
+	std::string controlPath_;
+	/// Sockets for hot restart, -1 when not in use. With a listening socket
+	/// the acceptor accepts connections itself and hands them to the server.
+	int listenFd_;
+	int controlFd_;
+	/// Readable once the accept and control threads should exit.
+	int wakeFd_;
+	std::thread acceptThread_;
+	std::thread controlThread_;
+	std::atomic<bool> shuttingDown_;
 	std::promise<void> shutdownPromise_;
 	std::future<void> shutdownFuture_;
 
+	/// The service to register with the server builder.
+	virtual ::grpc::Service* GetService() = 0;
+
+	/// The number of methods served.
+	virtual unsigned MethodCount() const = 0;
+
+	/// Create one listener per method for the completion queue.
+	virtual void CreateListeners(::grpc::ServerCompletionQueue* cq, std::vector<UntypedCall*>& calls) = 0;
+
+	/// Forwarded to the handler for hot restart.
+	virtual bool ExportWarmState(std::string& state) = 0;
+	virtual void ImportWarmState(const std::string& state) = 0;
+
+	AsyncServiceAcceptorBase(const std::string& name);
+
 private:
-	void HandleRpcs();
+	bool Serve(grpc::ServerBuilder& builder, unsigned threads);
+	void HandleRpcs(unsigned index);
+	void PostListener(UntypedCall* call, ListenerStats* stats);
+	void TopUpListeners(UntypedCall* call);
+	void HandleEvent(unsigned index, void* tag, bool ok);
+	bool TakeListener(const std::string& hostAndPort);
+	void AcceptConnections();
+	void ServeSuccessor();
+	void StopAccepting();
+	void CloseSockets();
+	void Drain();
+	void ReportStragglers();
+	void WaitForCalls();
 public:
-	/// Create a service adaptor. 
+	virtual ~AsyncServiceAcceptorBase();
+
+	/// Set the number of listeners kept outstanding for each method on each
+	/// completion queue. A matched listener is replaced before its call is
+	/// processed. Only effective before Start(). The default is one.
 	///
-	/// @param[in]  service The service used to handle requests.
-	/// @param[in  name     The service name used in logs.
-	/// @remarks Takes ownership of the service.
-	AsyncServiceAcceptor(AsyncServiceHandler* service, const std::string& name);
-	~AsyncServiceAcceptor();
+	/// @param[in]  depth   The number of listeners.
+	void SetListenerDepth(unsigned depth);
+
+	/// Get the listener statistics for each method.
+	std::vector<ListenerReport> GetListenerReport();
+
+	/// Share each completion queue between tenants, keyed by Request.LUCID,
+	/// instead of serving matched calls in arrival order. Streaming calls are
+	/// not scheduled. Only effective before Start().
+	///
+	/// @param[in]  policy  Weights and per tenant limits.
+	void SetFairScheduling(const FairSchedulerPolicy& policy);
+
+	/// Get the scheduling counters for each tenant seen.
+	std::vector<TenantReport> GetTenantReport();
+
+	/// Pin the completion queue threads to CPUs and optionally busy poll
+	/// the queues. With CPUs set every queue gets its own thread, so the
+	/// thread calling Start() is left as it was. Only effective before Start().
+	///
+	/// @param[in]  policy  Placement and polling.
+	void SetPollingPolicy(const PollingPolicy& policy);
+
+	/// Set how Shutdown() drains the calls in flight. Only effective before
+	/// Start().
+	///
+	/// @param[in]  policy  The drain phases.
+	void SetDrainPolicy(const DrainPolicy& policy);
+
+	/// True once the server is serving, until Shutdown() is called. Also
+	/// reported by gRPC's default health checking service, if the process
+	/// enabled it before Start().
+	bool IsReady() const { return ready_.load(); }
+
+	/// Send the server's load in the trailing metadata of every unary call,
+	/// under LoadReport::Key(), for clients routing by load. Only effective
+	/// before Start().
+	void EnableLoadReports();
+
+	/// Get the server's load, all zero if load reports are not enabled.
+	LoadReport GetLoadReport();
+
+	/// Append the create, learn and infer requests the service receives to
+	/// a capture log, for replay by lucida_replay. Requests are captured
+	/// when matched, before they are scheduled or their blobs resolved.
+	/// Only effective before Start().
+	///
+	/// @param[in]  path        The log, truncated.
+	/// @param[in]  sampleRate  The fraction of requests captured.
+	/// @param[in]  maxBytes    Stop capturing at this size, 0 for no limit.
+	/// @return     False if the log cannot be created.
+	bool EnableCapture(const std::string& path, double sampleRate=1.0, uint64_t maxBytes=0);
+
+	/// Get the capture counters, all zero if capture is not enabled.
+	CaptureStats GetCaptureStats();
+
+	/// Support zero downtime restarts. Start(hostAndPort) first tries to
+	/// take the listening socket and the handler's warm state over from a
+	/// process serving the control socket, and otherwise listens itself.
+	/// Either way it then serves the control socket, and when a successor
+	/// connects it hands both over, stops accepting connections and shuts
+	/// down once the calls in flight have finished. Clients on the old
+	/// connections are sent GOAWAY and reconnect to the successor.
+	/// Only effective before Start(hostAndPort).
+	/// @see hot_restart.h
+	///
+	/// @param[in]  controlPath The Unix socket path the generations share.
+	void EnableHotRestart(const std::string& controlPath);
 
 	/// Start serving requests on hostAndPort.
 	///
 	/// @param[in]  hostAndPort     The hostname, or ipv4 address, and port.
 	/// @param[in]  workerThreads   Sets the number of worker threads to handle
-	///             requests. Zero for default.t
+	///             requests, each with its own completion queue. Zero for
+	///             default, which is one.
 	/// @return     True if successful.
 	/// @remarks    If successful, returns after shutdown completes.
 	bool Start(const std::string& hostAndPort, unsigned workerThreads=0);
@@ -86,12 +255,15 @@ public:
 	///
 	/// @param[in]  builder The server builder.
 	/// @param[in]  workerThreads   Sets the number of worker threads to handle
-	///             requests. Zero for default.t
+	///             requests, each with its own completion queue. Zero for
+	///             default, which is one.
 	/// @return     True if successful.
 	/// @remarks    If successful, returns after shutdown completes.
 	bool Start(grpc::ServerBuilder& builder, unsigned workerThreads=0);
 
-	/// Initiate shutdown. Typically called in a signal handler.
+	/// Initiate shutdown, draining as set by SetDrainPolicy(). Calls still in
+	/// flight at the end of the grace period are logged and cancelled. Before
+	/// Start() it stops the acceptor from ever serving.
 	/// @remarks Threadsafe
 	void Shutdown();
 	
@@ -102,6 +274,167 @@ public:
 };
 
 
+/// The calls a server listens for. Each is constructed from the handler and
+/// a completion queue.
+template<class... Calls>
+struct ListenerList {
+	enum { count = sizeof...(Calls) };
+
+	/// Create the first listener of each call, in list order.
+	template<class Handler>
+	static void Create(Handler* service, ::grpc::ServerCompletionQueue* cq, std::vector<UntypedCall*>& calls) {
+		UntypedCall* created[] = { new Calls(service, cq)... };
+		calls.insert(calls.end(), created, created + count);
+	}
+};
+
+
+/// Lucida service with the handler type known at compile time. Listening,
+/// dispatch to the handler and finishing are all resolved statically.
+///
+/// @tparam Handler Derived from AsyncServiceHandlerT<Handler>, or
+///         AsyncServiceHandler for virtual dispatch.
+template<class Handler>
+class AsyncServiceAcceptorT: public AsyncServiceAcceptorBase {
+protected:
+	std::unique_ptr<Handler> service_;
+
+	/// The calls served, one listener pool per method.
+	typedef ListenerList<
+		StaticCall<Handler, CreateMethod>,
+		StaticCall<Handler, LearnMethod>,
+		StaticCall<Handler, InferMethod>,
+		StaticCall<Handler, OfferBlobsMethod>,
+		StaticCall<Handler, PutBlobsMethod>,
+		RecognizeCall<Handler>> Listeners;
+
+	::grpc::Service* GetService() override { return service_.get(); }
+	unsigned MethodCount() const override { return Listeners::count; }
+	void CreateListeners(::grpc::ServerCompletionQueue* cq, std::vector<UntypedCall*>& calls) override {
+		Listeners::Create(service_.get(), cq, calls);
+	}
+	bool ExportWarmState(std::string& state) override { return service_->ExportWarmState(state); }
+	void ImportWarmState(const std::string& state) override { service_->ImportWarmState(state); }
+
+public:
+	/// Create a service adaptor. 
+	///
+	/// @param[in]  service The service used to handle requests.
+	/// @param[in  name     The service name used in logs.
+	/// @remarks Takes ownership of the service.
+	AsyncServiceAcceptorT(Handler* service, const std::string& name):
+		AsyncServiceAcceptorBase(name), service_(service) {
+	}
+	~AsyncServiceAcceptorT() {
+		// Must complete before the service is destroyed.
+		Shutdown();
+		BlockUntilShutdown();
+	}
+
+	Handler* GetHandler() { return service_.get(); }
+};
+
+
+/// Lucida service for handlers derived from AsyncServiceHandler. The acceptor
+/// is static but dispatch to the handler goes through its virtual methods.
+///
+class AsyncServiceAcceptor: public AsyncServiceAcceptorT<AsyncServiceHandler> {
+public:
+	/// Create a service adaptor. 
+	///
+	/// @param[in]  service The service used to handle requests.
+	/// @param[in  name     The service name used in logs.
+	/// @remarks Takes ownership of the service.
+	AsyncServiceAcceptor(AsyncServiceHandler* service, const std::string& name):
+		AsyncServiceAcceptorT<AsyncServiceHandler>(service, name) {
+	}
+};
+
+
+/// Shared-nothing serving. Each shard is an AsyncServiceAcceptorT with its
+/// own server, handler, completion queue thread and listeners, and all of
+/// them listen on the same port with SO_REUSEPORT, so the kernel spreads
+/// connections across shards and they share nothing but what gRPC keeps
+/// process wide. Pin the shards to cores with SetPollingPolicy.
+///
+/// A connection stays on one shard. Handlers keeping per-user state only see
+/// the users whose connections landed on their shard, so this suits
+/// stateless handlers or clients that keep a user on one connection.
+///
+/// @tparam Handler As for AsyncServiceAcceptorT.
+template<class Handler>
+class ShardedAcceptorT {
+public:
+	/// Creates the handler of a shard.
+	typedef std::function<Handler*(unsigned shard)> HandlerFactory;
+
+	/// @param[in]  shards  The number of shards, at least one.
+	/// @param[in]  factory Called once per shard, the shards take ownership.
+	/// @param[in]  name    The service name used in logs.
+	ShardedAcceptorT(unsigned shards, const HandlerFactory& factory, const std::string& name): stopping_(false) {
+		for (unsigned i = 0; i < std::max(shards, 1u); ++i)
+			shards_.emplace_back(new AsyncServiceAcceptorT<Handler>(factory(i), name));
+	}
+
+	unsigned ShardCount() const { return unsigned(shards_.size()); }
+
+	/// A shard, to configure before Start() or to read its reports.
+	AsyncServiceAcceptorT<Handler>& GetShard(unsigned i) { return *shards_[i]; }
+
+	/// Give each shard its own slice of the policy's CPUs, cpusPerThread
+	/// each, as if the shards were the threads of one acceptor.
+	void SetPollingPolicy(const PollingPolicy& policy) {
+		const size_t n = policy.cpus.size();
+		const unsigned per = std::max(policy.cpusPerThread, 1u);
+		for (unsigned i = 0; i < shards_.size(); ++i) {
+			PollingPolicy shard = policy;
+			shard.cpus.clear();
+			for (unsigned k = 0; k < per && n != 0; ++k)
+				shard.cpus.push_back(policy.cpus[(i * per + k) % n]);
+			shards_[i]->SetPollingPolicy(shard);
+		}
+	}
+
+	/// Start every shard on hostAndPort, each on its own thread. If one
+	/// cannot start the others are shut down.
+	///
+	/// @param[in]  hostAndPort The hostname, or ipv4 address, and port. Port 0
+	///             would give each shard a different port.
+	/// @return     True if every shard started.
+	/// @remarks    Returns after every shard has shut down.
+	bool Start(const std::string& hostAndPort) {
+		std::atomic<unsigned> failed(0);
+		std::vector<std::thread> threads;
+		for (unsigned i = 0; i < shards_.size(); ++i) {
+			threads.emplace_back([this, i, &hostAndPort, &failed]() {
+				::grpc::ServerBuilder builder;
+				builder.AddListeningPort(hostAndPort, ::grpc::InsecureServerCredentials());
+				builder.AddChannelArgument(GRPC_ARG_ALLOW_REUSEPORT, 1);
+				if (!shards_[i]->Start(builder, 1) && !stopping_.load()) {
+					++failed;
+					Shutdown();
+				}
+			});
+		}
+		for (auto& t: threads)
+			t.join();
+		return failed.load() == 0;
+	}
+
+	/// Initiate shutdown of every shard.
+	/// @remarks Threadsafe
+	void Shutdown() {
+		stopping_.store(true);
+		for (auto& shard: shards_)
+			shard->Shutdown();
+	}
+
+private:
+	std::vector<std::unique_ptr<AsyncServiceAcceptorT<Handler>>> shards_;
+	std::atomic<bool> stopping_;
+};
+
+
 /// Lucida service
 ///
 class ServiceAcceptor {
@@ -32,22 +32,44 @@
 #ifndef SERVICE_CONNECTOR_H_C20388E5_21FE_4195_86F9_ED8E5772041A
 #define SERVICE_CONNECTOR_H_C20388E5_21FE_4195_86F9_ED8E5772041A
 #include <cassert>
+#include <functional>
 #include <future>
+#include <mutex>
 #include <thread>
 #include <atomic>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 #include <grpc++/grpc++.h>
 #include "generated/lucida_service.grpc.pb.h"
 #include "generated/lucida_service.pb.h"
 #include "refcount.h"
+#include "latency_histogram.h"
+#include "retry_policy.h"
+#include "circuit_breaker.h"
+#include "load_report.h"
+#include "polling.h"
+#include "call_scope.h"
+#include "trace.h"
 
 namespace lucida {
 class AsyncServiceConnector;
 
+/// A tag on the connector's completion queue.
+class ClientTag {
+public:
+	virtual ~ClientTag() {}
+	/// Called on the completion queue thread.
+	virtual void Complete(bool ok) = 0;
+};
+
+
 /// Generic untyped gRPC call
-class RpcCall: public RefCounted {
+class RpcCall: public RefCounted, public ClientTag {
 	friend class AsyncServiceConnector;
 protected:
-	RpcCall(): ok_(false) {}
+	RpcCall(): ok_(false), done_(false) {}
 	/// True if no errors
 	bool ok_;
 	/// Storage for the status of the RPC upon completion.
@@ -55,55 +77,421 @@ protected:
 	/// For waiting
 	std::future<void> fut_;
 	std::promise<void> promise_;
+	/// Wake up waiters and run the continuation. Call once, after status_ and ok_ are set.
+	void Signal() {
+		promise_.set_value();
+		std::function<void()> then;
+		{
+			std::lock_guard<std::mutex> guard(thenMu_);
+			done_ = true;
+			then.swap(then_);
+		}
+		if (then) then();
+	}
+private:
+	mutable std::mutex thenMu_;
+	bool done_;
+	std::function<void()> then_;
 public:
 	virtual ~RpcCall() {}
 	const ::grpc::Status& GetStatus() const { return status_; }
 	bool IsOK() const { return ok_ && status_.ok(); }
 	bool Wait(unsigned timeoutInSeconds=0) const;
 	std::future<void>& GetFuture() { return fut_; }
+	/// True once the call has completed.
+	bool IsDone() const {
+		std::lock_guard<std::mutex> guard(thenMu_);
+		return done_;
+	}
+	/// Run a continuation when the call completes. It runs on the connector's
+	/// completion queue thread, or on the calling thread if the call is already
+	/// done, so it must be short. Only one continuation may be set.
+	///
+	/// @param[in]  fn  The continuation.
+	void Then(std::function<void()> fn) {
+		{
+			std::lock_guard<std::mutex> guard(thenMu_);
+			if (!done_) {
+				then_ = std::move(fn);
+				return;
+			}
+		}
+		fn();
+	}
 	/// Get the response
 	virtual bool Get(::google::protobuf::Empty*& p) { p=nullptr; return false; } 
 	virtual bool Get(Response*& p) { p=nullptr; return false; } 
+	void Complete(bool ok) override {
+		ok_ = ok;
+		Signal();
+		Unref();
+	}
+};
+
+
+/// Counters of learnDedup.
+struct BlobDedupStats {
+	BlobDedupStats(): offered(0), uploaded(0), bytesSaved(0), fallbacks(0) {}
+	/// Distinct images offered to the service.
+	uint64_t offered;
+	/// Images the service was missing and were uploaded.
+	uint64_t uploaded;
+	/// Image bytes sent by digest instead of inline.
+	uint64_t bytesSaved;
+	/// Learns resent inline because the service lost a blob.
+	uint64_t fallbacks;
+};
+
+
+/// Routing by Request.LUCID, so each user's calls reach the replica keeping
+/// their state and caches.
+struct AffinityPolicy {
+	AffinityPolicy(): enabled(false), loadBound(1.25) {}
+	bool enabled;
+	/// A target takes calls only while its calls in flight stay within this
+	/// multiple of the average, otherwise they spill to the user's next
+	/// choice. At least 1.
+	double loadBound;
+};
+
+
+/// A hash of a LUCID or a target name, the same in every process so
+/// connectors and routers agree on each user's targets.
+uint64_t RendezvousHash(const std::string& s);
+
+/// The score of a user on a target, both hashed by RendezvousHash. A user's
+/// first choice is the target with the highest score.
+uint64_t RendezvousScore(uint64_t user, uint64_t target);
+
+/// Order a user's targets for routing under a load bound. Targets whose calls
+/// in flight, counting this call, would exceed loadBound times the average
+/// come after all the others. Within each group, targets follow the user's
+/// preference. Some target is always within the bound.
+///
+/// @param[in]  user        The user, hashed by RendezvousHash.
+/// @param[in]  hashes      Each target, hashed by RendezvousHash.
+/// @param[in]  loads       The calls in flight on each target.
+/// @param[in]  loadBound   See AffinityPolicy::loadBound.
+/// @param[out] order       The index of each target in the order to try it,
+///                         with its rank in the user's preference, zero for
+///                         the first choice.
+/// @return     The number of targets within the bound, first in order.
+size_t BoundedLoadOrder(uint64_t user, const std::vector<uint64_t>& hashes, const std::vector<int64_t>& loads,
+	double loadBound, std::vector<std::pair<size_t, size_t>>& order);
+
+
+/// Per target counters.
+struct TargetStats {
+	TargetStats(): attempts(0), hedges(0), retries(0), wins(0), errors(0), p50Micros(0), p99Micros(0),
+		breaker(CircuitBreaker::CLOSED), rejected(0), ejections(0), spills(0) {}
+	std::string target;
+	/// All attempts sent, including hedges and retries.
+	uint64_t attempts;
+	/// Hedged attempts sent.
+	uint64_t hedges;
+	/// Retries sent.
+	uint64_t retries;
+	/// Attempts whose response was returned to the caller.
+	uint64_t wins;
+	/// Attempts that failed, excluding cancelled losers.
+	uint64_t errors;
+	/// Recent latency of successful attempts.
+	uint64_t p50Micros;
+	uint64_t p99Micros;
+	CircuitBreaker::State breaker;
+	/// Calls failed locally by the circuit breaker.
+	uint64_t rejected;
+	/// The number of times the circuit breaker opened.
+	uint64_t ejections;
+	/// The target's latest load report, all zero if it sent none.
+	LoadReport load;
+	/// Calls routed here by affinity although the user prefers a target that
+	/// was over the load bound or had its breaker open.
+	uint64_t spills;
 };
 
 
 class AsyncServiceConnector {
 private:
+	/// A replica of the service.
+	struct Target {
+		Target(const std::string& name, std::shared_ptr<::grpc::Channel> channel);
+		std::string name;
+		/// The target's rendezvous hash seed.
+		const uint64_t hash;
+		std::shared_ptr<::grpc::Channel> channel;
+		std::unique_ptr<LucidaService::Stub> stub;
+		LatencyHistogram latency;
+		std::atomic<uint64_t> attempts;
+		std::atomic<uint64_t> hedges;
+		std::atomic<uint64_t> retries;
+		std::atomic<uint64_t> wins;
+		std::atomic<uint64_t> errors;
+		CircuitBreaker breaker;
+		/// Calls of this connector in flight to the target.
+		std::atomic<int> outstanding;
+		mutable std::mutex loadMu;
+		LoadReport load;
+		bool hasLoad;
+		std::atomic<uint64_t> spills;
+		/// Digests the target is known to hold, guarded by blobMu_.
+		std::unordered_set<std::string> knownBlobs;
+
+		/// Keep the load report in a finished call's trailing metadata.
+		void UpdateLoad(const ::grpc::ClientContext& ctx);
+		/// The latest load report, false if there is none.
+		bool GetLoad(LoadReport& report) const;
+	};
 	template <class ResponseType>
 	class TypedRpcCall: public RpcCall {
 		friend class AsyncServiceConnector;
 	private:
 		std::unique_ptr<::grpc::ClientAsyncResponseReader<ResponseType>> rpc_;
+		/// Set if the connector made the context.
+		std::unique_ptr<::grpc::ClientContext> context_;
+		/// The context the call was made with.
+		::grpc::ClientContext* ctx_;
+		TraceSpan span_;
+		Target* target_;
+		CircuitBreaker::Ticket ticket_;
+		std::chrono::steady_clock::time_point start_;
 		void Finish() { 
-			rpc_->Finish(&response_, &status_, dynamic_cast<RpcCall*>(this)); 
 			fut_ = std::move(promise_.get_future());
+			rpc_->Finish(&response_, &status_, static_cast<ClientTag*>(this)); 
+		}
+		/// Complete without sending.
+		void Fail(const ::grpc::Status& status) {
+			fut_ = std::move(promise_.get_future());
+			status_ = status;
+			ok_ = true;
+			Signal();
 		}
 	public:
-		TypedRpcCall(std::unique_ptr<::grpc::ClientAsyncResponseReader<ResponseType>>&& rpc):
-			rpc_(std::move(rpc)) {}
+		TypedRpcCall(std::unique_ptr<::grpc::ClientAsyncResponseReader<ResponseType>>&& rpc, Target* target,
+				CircuitBreaker::Ticket ticket):
+			rpc_(std::move(rpc)), ctx_(nullptr), target_(target), ticket_(ticket), start_(std::chrono::steady_clock::now()) {}
 		ResponseType response_;
 		bool Get(ResponseType*& p) override {
 			p = &response_;
 			return true;
 		} 
+		void Complete(bool ok) override {
+			auto elapsed = std::chrono::steady_clock::now() - start_;
+			::grpc::StatusCode code = ok? status_.error_code(): ::grpc::StatusCode::UNAVAILABLE;
+			target_->breaker.Record(code, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count(), ticket_);
+			--target_->outstanding;
+			if (ok) target_->UpdateLoad(*ctx_);
+			(code == ::grpc::StatusCode::OK? target_->wins: target_->errors).fetch_add(1, std::memory_order_relaxed);
+			span_.FinishClient(ctx_, ::grpc::Status(code, ""));
+			RpcCall::Complete(ok);
+		}
+	};
+
+	/// A recognize stream on a picked target. Its outcome is recorded with
+	/// the target on Finish(), like a unary call's.
+	class RecognizeStream: public ::grpc::ClientReaderWriterInterface<AudioChunk, Transcript> {
+	public:
+		RecognizeStream(::grpc::ClientContext* ctx, Target* target, CircuitBreaker::Ticket ticket):
+			ctx_(ctx), target_(target), ticket_(ticket), finished_(false) {
+			if (span_.StartClient("recognize")) span_.Inject(*ctx);
+			target_->attempts.fetch_add(1, std::memory_order_relaxed);
+			++target_->outstanding;
+			stream_ = target_->stub->recognize(ctx);
+		}
+		~RecognizeStream() {
+			if (finished_) return;
+			// Abandoned, says nothing about the target.
+			--target_->outstanding;
+			target_->breaker.Release(ticket_);
+		}
+		void WaitForInitialMetadata() override { stream_->WaitForInitialMetadata(); }
+		bool NextMessageSize(uint32_t* sz) override { return stream_->NextMessageSize(sz); }
+		bool Read(Transcript* msg) override { return stream_->Read(msg); }
+		using ::grpc::ClientReaderWriterInterface<AudioChunk, Transcript>::Write;
+		bool Write(const AudioChunk& msg, ::grpc::WriteOptions options) override { return stream_->Write(msg, options); }
+		bool WritesDone() override { return stream_->WritesDone(); }
+		::grpc::Status Finish() override {
+			::grpc::Status status = stream_->Finish();
+			finished_ = true;
+			--target_->outstanding;
+			// A stream lasts as long as its audio, so only its status counts.
+			target_->breaker.Record(status.error_code(), 0, ticket_);
+			(status.ok()? target_->wins: target_->errors).fetch_add(1, std::memory_order_relaxed);
+			target_->UpdateLoad(*ctx_);
+			span_.FinishClient(ctx_, status);
+			return status;
+		}
+	private:
+		::grpc::ClientContext* ctx_;
+		Target* target_;
+		CircuitBreaker::Ticket ticket_;
+		TraceSpan span_;
+		std::unique_ptr<::grpc::ClientReaderWriter<AudioChunk, Transcript>> stream_;
+		bool finished_;
 	};
 
+	class HedgedCall;
+
 	std::shared_ptr<::grpc::CompletionQueue> cq_;
 	::grpc::ClientContext context_;
 	std::shared_ptr<::grpc::Channel> channel_;
 	std::unique_ptr<LucidaService::Stub> stub_;
+	std::vector<std::unique_ptr<Target>> targets_;
+	std::atomic<unsigned> nextTarget_;
+	bool leastLoad_;
+	AffinityPolicy affinity_;
+	HedgePolicy hedgePolicy_;
+	RetryPolicy retryPolicy_;
+	RetryBudget retryBudget_;
+	PollingPolicy pollingPolicy_;
 	std::thread cqThread_;
 	std::atomic<unsigned> errorCount_;
 	std::atomic<bool> runningAsync_;
+	BlobDedupStats blobStats_;
+	mutable std::mutex blobMu_;
+
+	/// Upload blobs in batches below the default message size limit.
+	/// @return The status of the first failed batch.
+	::grpc::Status UploadBlobs(const std::vector<const std::string*>& blobs, ::grpc::ClientContext* context,
+		Target* target);
+
+	bool IsHedged() const { return hedgePolicy_.enabled || retryPolicy_.maxAttempts > 1; }
+
+	/// Choose the context of a downstream call. Inside a CallScope a child of
+	/// the server call is made so its deadline and cancellation propagate,
+	/// and a caller's context has its deadline capped at the server call's.
+	///
+	/// @param[in]  context The caller's context, may be nullptr.
+	/// @param[out] owned   Holds a context made here.
+	/// @param[out] status  Why the call must not be made.
+	/// @return     The context, nullptr if the server call is already over.
+	::grpc::ClientContext* ContextFor(::grpc::ClientContext* context, 
+		std::unique_ptr<::grpc::ClientContext>& owned, ::grpc::Status& status);
+
+	/// Of two targets chosen at random, the one with the least expected wait
+	/// whose circuit breaker allows a call, otherwise any target allowing one.
+	/// @return     The target, nullptr if every breaker is open.
+	Target* PickLeastLoaded(CircuitBreaker::Ticket& ticket);
+
+	/// The user's targets in rendezvous order, the first target taking
+	/// calls within the load bound and allowed by its breaker, otherwise the
+	/// first allowed.
+	/// @return     The target, nullptr if every breaker is open.
+	Target* PickByAffinity(const std::string& lucid, CircuitBreaker::Ticket& ticket);
+
+	/// The target of a call, nullptr if its breaker is open. Calls for a user
+	/// are routed by affinity if it is enabled, balanced calls by load if
+	/// least load routing is enabled, and the rest go to the first target.
+	///
+	/// @param[in]  lucid       The user, nullptr if the call has none.
+	/// @param[in]  balanced    The call may go to any target.
+	/// @param[out] ticket      The breaker's ticket for the call.
+	Target* AllowTarget(const std::string* lucid, bool balanced, CircuitBreaker::Ticket& ticket) {
+		if (affinity_.enabled && lucid != nullptr && !lucid->empty()) return PickByAffinity(*lucid, ticket);
+		if (balanced && leastLoad_) return PickLeastLoaded(ticket);
+		return targets_[0]->breaker.Allow(&ticket)? targets_[0].get(): nullptr;
+	}
+
+	/// Start an async call on a target allowed by AllowTarget().
+	template<class ResponseType, class StartFn>
+	std::shared_ptr<RpcCall> StartAsync(const char* method, ::grpc::ClientContext* context,
+		const std::string* lucid, bool balanced, StartFn start);
+
+	/// Make a blocking call on a target allowed by AllowTarget().
+	template<class CallFn>
+	::grpc::Status CallTarget(const char* method, ::grpc::ClientContext* context,
+		const std::string* lucid, bool balanced, CallFn call) {
+		return CallPicked(method, context, [&](CircuitBreaker::Ticket& ticket) {
+			return AllowTarget(lucid, balanced, ticket);
+		}, call);
+	}
+
+	/// Make a blocking call on the given target unless its breaker is open.
+	template<class CallFn>
+	::grpc::Status CallOn(const char* method, ::grpc::ClientContext* context, Target* target, CallFn call) {
+		return CallPicked(method, context, [target](CircuitBreaker::Ticket& ticket) {
+			return target->breaker.Allow(&ticket)? target: nullptr;
+		}, call);
+	}
+
+	/// Make a blocking call on the target picked, nullptr if none may be called.
+	template<class PickFn, class CallFn>
+	::grpc::Status CallPicked(const char* method, ::grpc::ClientContext* context, PickFn pick, CallFn call);
+
+	/// Make a blocking call on the first target unless its breaker is open.
+	template<class CallFn>
+	::grpc::Status CallFirstTarget(const char* method, ::grpc::ClientContext* context, CallFn call) {
+		return CallTarget(method, context, nullptr, false, [&call](::grpc::ClientContext* ctx, Target*) { return call(ctx); });
+	}
 public:
+	/// The status of calls failed locally by an open circuit breaker.
+	static ::grpc::Status CircuitOpenStatus() {
+		return ::grpc::Status(::grpc::StatusCode::UNAVAILABLE, "circuit breaker open");
+	}
+
 	AsyncServiceConnector(const char* hostAndPort);
 	AsyncServiceConnector(std::shared_ptr<::grpc::Channel> channel);
+
+	/// Connect to replicas of a service. The blocking and streaming methods
+	/// use the first replica. Hedges and retries of infer are spread over all
+	/// of them, and with least load routing infer itself. With affinity
+	/// routing each user's calls go to their replica.
+	///
+	/// @param[in]  hostsAndPorts   The replicas, at least one.
+	AsyncServiceConnector(const std::vector<std::string>& hostsAndPorts);
 	~AsyncServiceConnector();
 
 	void Start();
 	void Shutdown();
 	unsigned GetErrorCount() const { return errorCount_.load(); }
 
+	/// @{
+	/// Set the hedging and retry policies for infer, the only idempotent
+	/// method. Both are off by default. Call before Start().
+	void SetHedgePolicy(const HedgePolicy& policy) { hedgePolicy_ = policy; }
+	void SetRetryPolicy(const RetryPolicy& policy) { retryPolicy_ = policy; }
+	/// @}
+
+	/// Set the circuit breaker policy of every target. Off by default.
+	/// Calls to a target with an open breaker fail with CircuitOpenStatus().
+	/// Hedges and retries skip such targets. Call before Start().
+	void SetCircuitBreakerPolicy(const CircuitBreakerPolicy& policy);
+
+	/// Route each infer, and the first attempt of a hedged infer, to the
+	/// target with the least expected wait, using the load reports targets
+	/// send in their trailing metadata. The expected wait is the target's
+	/// latency times the calls ahead of this one, this connector's in flight
+	/// plus the target's queued, inflated as the target's CPU runs out, so a
+	/// faster replica takes a larger share. Targets without reports are
+	/// assumed to have the average latency. Off by default, when infer goes
+	/// to the first target. Call before Start().
+	/// @see AsyncServiceAcceptorBase::EnableLoadReports
+	void SetLeastLoadRouting(bool enabled) { leastLoad_ = enabled; }
+
+	/// Route create, learn, infer and learnDedup by Request.LUCID with
+	/// rendezvous hashing: each user ranks the targets by a hash of the LUCID
+	/// and the target name, and calls go to the first target in the user's
+	/// order that is within the load bound and allowed by its breaker. Every
+	/// connector with the same targets agrees on the order, and removing a
+	/// target only moves the users it was first for. Calls without a LUCID
+	/// are routed as if affinity were off. Hedges and retries still rotate
+	/// over the targets. Off by default. Call before Start().
+	void SetAffinityPolicy(const AffinityPolicy& policy) { affinity_ = policy; }
+
+	/// The index of the user's first choice of target, regardless of load
+	/// and breakers.
+	unsigned PreferredTarget(const std::string& lucid) const;
+
+	/// Pin the completion queue thread, thread 0 of the policy, and
+	/// optionally busy poll its queue. Call before Start().
+	void SetPollingPolicy(const PollingPolicy& policy) { pollingPolicy_ = policy; }
+
+	/// The budget shared by hedges and retries.
+	RetryBudget& GetRetryBudget() { return retryBudget_; }
+
+	/// Get the counters of each target, in construction order.
+	std::vector<TargetStats> GetTargetStats() const;
+
 	/// @{ 
 	/// Async interface. The caller can choose to ignore the returned value.
 	/// @param[in] request	The request data.
@@ -111,6 +499,10 @@ public:
 	///                     extra information to the server and/or tweak certain
 	///                     RPC behaviors.
 	/// @return The rpc call.
+	/// @remarks If hedging or retries are enabled infer attempts use their own
+	/// context with the deadline copied from context.
+	/// @remarks Called from a handler, the call inherits the handler's deadline
+	/// and, if context is nullptr, its cancellation. @see CallScope.
 	std::shared_ptr<RpcCall> learnAsync(const Request& request, ::grpc::ClientContext* context=nullptr);
 	std::shared_ptr<RpcCall> createAsync(const Request& request, ::grpc::ClientContext* context=nullptr);
 	std::shared_ptr<RpcCall> inferAsync(const Request& request, ::grpc::ClientContext* context=nullptr);
@@ -127,18 +519,96 @@ public:
 	::grpc::Status create(const Request& request, ::grpc::ClientContext* context=nullptr);
 	::grpc::Status infer(const Request& request, Response& response, ::grpc::ClientContext* context=nullptr);
 	/// @}
+
+	/// Learn, sending images by their SHA-256 digest. The digests are offered
+	/// first and only the images the service is missing are uploaded, so an
+	/// image learned by many courses crosses the wire once. Falls back to a
+	/// plain learn if the service has no blob store, and resends inline if it
+	/// lost a blob since it was offered. With affinity routing every step goes
+	/// to the user's first choice of target, which keeps their digests.
+	/// @param[in] request	The request data.
+	/// @param[in] context	Its deadline applies to every step. Not reused.
+	/// @return The status of the learn.
+	::grpc::Status learnDedup(const Request& request, ::grpc::ClientContext* context=nullptr);
+
+	/// Get the counters of learnDedup.
+	BlobDedupStats GetBlobDedupStats() const;
+
+	/// Open a streaming recognize call. Write AudioChunk's, read interim
+	/// Transcript's, then call WritesDone() and read until the final transcript.
+	/// The target is picked like learn's, skipping targets whose circuit
+	/// breaker is open, and Finish() records the outcome with it. Streams are
+	/// not hedged, the audio already sent cannot be replayed to a second
+	/// target.
+	/// @param[in] context	Context for the stream. Must outlive the stream.
+	/// @param[in] lucid	The user, for affinity routing. May be nullptr.
+	/// @return The stream, nullptr if every breaker is open.
+	std::unique_ptr<::grpc::ClientReaderWriterInterface<AudioChunk, Transcript>> recognize(::grpc::ClientContext* context,
+		const std::string* lucid=nullptr);
 };
 
+template<class PickFn, class CallFn>
+inline ::grpc::Status AsyncServiceConnector::CallPicked(const char* method, ::grpc::ClientContext* context,
+		PickFn pick, CallFn call) {
+	std::unique_ptr<::grpc::ClientContext> owned;
+	::grpc::Status status;
+	::grpc::ClientContext* ctx = ContextFor(context, owned, status);
+	if (ctx == nullptr) return status;
+	CircuitBreaker::Ticket ticket;
+	Target* target = pick(ticket);
+	if (target == nullptr) return CircuitOpenStatus();
+	TraceSpan span;
+	if (span.StartClient(method)) span.Inject(*ctx);
+	auto start = std::chrono::steady_clock::now();
+	target->attempts.fetch_add(1, std::memory_order_relaxed);
+	++target->outstanding;
+	status = call(ctx, target);
+	--target->outstanding;
+	(status.ok()? target->wins: target->errors).fetch_add(1, std::memory_order_relaxed);
+	uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	target->breaker.Record(status.error_code(), micros, ticket);
+	target->UpdateLoad(*ctx);
+	span.FinishClient(ctx, status);
+	// Time the handler spent blocked downstream.
+	TraceSpan* parent = CallScope::CurrentSpan();
+	if (parent != nullptr) parent->AddDownstream(micros);
+	return status;
+}
 inline ::grpc::Status AsyncServiceConnector::learn(const Request& request, ::grpc::ClientContext* context) {
-	::google::protobuf::Empty e;
-	return stub_->learn((context == nullptr)? &context_: context, request, &e);
+	return CallTarget("learn", context, &request.lucid(), false, [&](::grpc::ClientContext* ctx, Target* target) {
+		::google::protobuf::Empty e;
+		return target->stub->learn(ctx, request, &e);
+	});
 }
 inline ::grpc::Status AsyncServiceConnector::create(const Request& request, ::grpc::ClientContext* context) {
-	::google::protobuf::Empty e;
-	return stub_->create((context == nullptr)? &context_: context, request, &e);
+	return CallTarget("create", context, &request.lucid(), false, [&](::grpc::ClientContext* ctx, Target* target) {
+		::google::protobuf::Empty e;
+		return target->stub->create(ctx, request, &e);
+	});
 }
 inline ::grpc::Status AsyncServiceConnector::infer(const Request& request, Response& response, ::grpc::ClientContext* context) {
-	return stub_->infer((context == nullptr)? &context_: context, request, &response);
+	if (IsHedged() && runningAsync_.load()) {
+		auto start = std::chrono::steady_clock::now();
+		std::shared_ptr<RpcCall> call = inferAsync(request, context);
+		Response* r = nullptr;
+		call->Wait();
+		TraceSpan* parent = CallScope::CurrentSpan();
+		if (parent != nullptr)
+			parent->AddDownstream(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+		if (call->Get(r)) response.Swap(r);
+		return call->GetStatus();
+	}
+	return CallTarget("infer", context, &request.lucid(), true, [&](::grpc::ClientContext* ctx, Target* target) {
+		return target->stub->infer(ctx, request, &response);
+	});
+}
+inline std::unique_ptr<::grpc::ClientReaderWriterInterface<AudioChunk, Transcript>> AsyncServiceConnector::recognize(
+		::grpc::ClientContext* context, const std::string* lucid) {
+	CircuitBreaker::Ticket ticket;
+	Target* target = AllowTarget(lucid, false, ticket);
+	if (target == nullptr) return nullptr;
+	return std::unique_ptr<::grpc::ClientReaderWriterInterface<AudioChunk, Transcript>>(
+		new RecognizeStream(context, target, ticket));
 }
 inline bool RpcCall::Wait(unsigned timeoutInSeconds) const {
 	if (0 == timeoutInSeconds) {
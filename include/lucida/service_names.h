@@ -32,10 +32,90 @@
 #ifndef SERVICE_NAMES_H_CD45B40B_85AC_43B7_B080_BE7ABF5BAE5A
 #define SERVICE_NAMES_H_CD45B40B_85AC_43B7_B080_BE7ABF5BAE5A
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 
 namespace lucida {
 
+namespace detail {
+
+/// Seeded FNV-1a hash usable at compile time.
+constexpr uint32_t NameHash(const char* s, size_t n, uint32_t h) {
+	return (n == 0)? h: NameHash(s + 1, n - 1, (h ^ uint8_t(*s)) * 16777619u);
+}
+
+constexpr size_t NameLength(const char* s) {
+	return (*s == '\0')? 0: 1 + NameLength(s + 1);
+}
+
+/// Map a name to one of 2^bits slots using the high bits of the hash.
+constexpr unsigned NameSlot(const char* s, size_t n, uint32_t seed, unsigned bits) {
+	return NameHash(s, n, 2166136261u ^ seed) >> (32 - bits);
+}
+
+constexpr unsigned NameSlot(const char* s, uint32_t seed, unsigned bits) {
+	return NameSlot(s, NameLength(s), seed, bits);
+}
+
+// Index zero of a name table is the unknown name and is never hashed.
+
+/// True if names[i] does not share a slot with any of names[j..i).
+constexpr bool IsSlotUnique(const char* const* names, unsigned i, unsigned j, uint32_t seed, unsigned bits) {
+	return (j == i)? true: (NameSlot(names[i], seed, bits) != NameSlot(names[j], seed, bits) &&
+		IsSlotUnique(names, i, j + 1, seed, bits));
+}
+
+/// True if all names[1..count) map to different slots.
+constexpr bool IsPerfectHash(const char* const* names, unsigned count, uint32_t seed, unsigned bits, unsigned i = 2) {
+	return (i >= count)? true: (IsSlotUnique(names, i, 1, seed, bits) && IsPerfectHash(names, count, seed, bits, i + 1));
+}
+
+/// Search for the first seed giving a perfect hash.
+constexpr uint32_t FindPerfectHashSeed(const char* const* names, unsigned count, unsigned bits, uint32_t seed = 0) {
+	return IsPerfectHash(names, count, seed, bits)? seed: FindPerfectHashSeed(names, count, bits, seed + 1);
+}
+
+/// The index of the name occupying slot, or zero if the slot is empty.
+constexpr unsigned PerfectHashSlotOwner(const char* const* names, unsigned count, uint32_t seed, unsigned bits, unsigned slot, unsigned i = 1) {
+	return (i == count)? 0: ((NameSlot(names[i], seed, bits) == slot)? i: 
+		PerfectHashSlotOwner(names, count, seed, bits, slot, i + 1));
+}
+
+/// The owner of each of N slots.
+template<unsigned N>
+struct SlotTable {
+	unsigned char owners[N];
+	constexpr unsigned operator [] (unsigned slot) const { return owners[slot]; }
+};
+
+template<unsigned... Slots>
+struct SlotList {};
+
+/// SlotList<0, 1, ..., N - 1>.
+template<unsigned N, unsigned... Slots>
+struct MakeSlotList: MakeSlotList<N - 1, N - 1, Slots...> {};
+
+template<unsigned... Slots>
+struct MakeSlotList<0, Slots...> {
+	typedef SlotList<Slots...> type;
+};
+
+template<unsigned... Slots>
+constexpr SlotTable<sizeof...(Slots)> BuildSlotTable(const char* const* names, unsigned count, uint32_t seed, unsigned bits,
+		SlotList<Slots...>) {
+	return SlotTable<sizeof...(Slots)>{ { (unsigned char)PerfectHashSlotOwner(names, count, seed, bits, Slots)... } };
+}
+
+/// The slot table of a perfect hash with 2^bits slots.
+template<unsigned bits>
+constexpr SlotTable<1u << bits> BuildSlotTable(const char* const* names, unsigned count, uint32_t seed) {
+	return BuildSlotTable(names, count, seed, bits, typename MakeSlotList<1u << bits>::type());
+}
+
+}       // namespace detail
+
+
 /// Lucida service names and type names.
 class ServiceNames {
 private:
@@ -44,21 +124,64 @@ private:
 	ServiceNames& operator = (const ServiceNames&);
 
 public:
-	static const char* learnCommandName;
-	static const char* createCommandName;
-	static const char* inferCommandName;
-	static const char* textTypeName;
-	static const char* urlTypeName;
-	static const char* imageTypeName;
-	static const char* unlearnTypeName;
+	static constexpr const char* learnCommandName = "knowledge";
+	static constexpr const char* createCommandName = "create";
+	static constexpr const char* inferCommandName = "query";
+	static constexpr const char* textTypeName = "text";
+	static constexpr const char* urlTypeName = "url";
+	static constexpr const char* imageTypeName = "image";
+	static constexpr const char* unlearnTypeName = "unlearn";
+
+	/// Decoded QuerySpec.name
+	enum CommandId { UNKNOWN_COMMAND = 0, LEARN_COMMAND, CREATE_COMMAND, INFER_COMMAND, COMMAND_COUNT };
+
+	/// Decoded QueryInput.type
+	enum TypeId { UNKNOWN_TYPE = 0, TEXT_TYPE, URL_TYPE, IMAGE_TYPE, UNLEARN_TYPE, TYPE_COUNT };
+
+	/// Names indexed by CommandId and TypeId.
+	static constexpr const char* const commandNames[COMMAND_COUNT] = {
+		"", learnCommandName, createCommandName, inferCommandName
+	};
+	static constexpr const char* const typeNames[TYPE_COUNT] = {
+		"", textTypeName, urlTypeName, imageTypeName, unlearnTypeName
+	};
+
+	/// The perfect hash tables have 2^hashBits slots. The seeds and slot
+	/// tables are built at compile time, so adding a name only requires
+	/// extending the enums and name tables above, and raising hashBits if
+	/// the static_asserts below fail.
+	static constexpr unsigned hashBits = 2;
+	static constexpr uint32_t commandSeed = detail::FindPerfectHashSeed(commandNames, COMMAND_COUNT, hashBits);
+	static constexpr uint32_t typeSeed = detail::FindPerfectHashSeed(typeNames, TYPE_COUNT, hashBits);
+	static constexpr detail::SlotTable<1u << hashBits> commandSlots =
+		detail::BuildSlotTable<hashBits>(commandNames, COMMAND_COUNT, commandSeed);
+	static constexpr detail::SlotTable<1u << hashBits> typeSlots =
+		detail::BuildSlotTable<hashBits>(typeNames, TYPE_COUNT, typeSeed);
+
+	/// Decode a command name.
+	///
+	/// @param  cmdName  The command name.
+	/// @return The command id, or UNKNOWN_COMMAND.
+	static CommandId toCommandId(const std::string& cmdName) {
+		const unsigned i = commandSlots[detail::NameSlot(cmdName.data(), cmdName.size(), commandSeed, hashBits)];
+		return (i != 0 && cmdName.compare(commandNames[i]) == 0)? CommandId(i): UNKNOWN_COMMAND;
+	}
+
+	/// Decode a type name.
+	///
+	/// @param  typeName The type name.
+	/// @return The type id, or UNKNOWN_TYPE.
+	static TypeId toTypeId(const std::string& typeName) {
+		const unsigned i = typeSlots[detail::NameSlot(typeName.data(), typeName.size(), typeSeed, hashBits)];
+		return (i != 0 && typeName.compare(typeNames[i]) == 0)? TypeId(i): UNKNOWN_TYPE;
+	}
 
 	/// Check validity of a type name.
 	///
 	/// @param  typeName The type name to test.
 	/// @return True if typeName is a valid type.
 	static bool isTypeName(const std::string& typeName) {
-		return typeName == imageTypeName || typeName == urlTypeName || typeName == textTypeName ||
-			typeName == unlearnTypeName;
+		return toTypeId(typeName) != UNKNOWN_TYPE;
 	}
 
 	/// Check validity of a command name.
@@ -66,8 +189,16 @@ public:
 	/// @param  cmdName  The command name to test.
 	/// @return True if cmdName is a valid command.
 	static bool isCommandName(const std::string& cmdName) {
-		return cmdName == learnCommandName || cmdName == createCommandName || cmdName == inferCommandName;
+		return toCommandId(cmdName) != UNKNOWN_COMMAND;
 	}
 };
+
+static_assert(detail::IsPerfectHash(ServiceNames::commandNames, ServiceNames::COMMAND_COUNT, 
+	ServiceNames::commandSeed, ServiceNames::hashBits), "command names need more hash bits");
+static_assert(detail::IsPerfectHash(ServiceNames::typeNames, ServiceNames::TYPE_COUNT, 
+	ServiceNames::typeSeed, ServiceNames::hashBits), "type names need more hash bits");
+static_assert(ServiceNames::COMMAND_COUNT <= (1 << ServiceNames::hashBits) + 1 &&
+	ServiceNames::TYPE_COUNT <= (1 << ServiceNames::hashBits) + 1, "too many names for hashBits");
+
 }       // namespace lucida
 #endif  // SERVICE_NAMES_H_CD45B40B_85AC_43B7_B080_BE7ABF5BAE5A
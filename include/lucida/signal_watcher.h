@@ -0,0 +1,84 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SIGNAL_WATCHER_H_44DCC714_7172_42C7_8D04_CA08874CEDF5
+#define SIGNAL_WATCHER_H_44DCC714_7172_42C7_8D04_CA08874CEDF5
+
+#include <csignal>
+#include <functional>
+#include <pthread.h>
+#include <thread>
+#include "service_acceptor.h"
+
+namespace lucida {
+
+/// Shuts a server down on SIGINT or SIGTERM. Shutdown is not safe to call
+/// from a signal handler, so the signals are blocked and taken by sigwait on
+/// a thread of our own. Create the watcher before any other threads so they
+/// inherit the blocked signals.
+class SignalWatcher {
+public:
+	/// @param[in]  server  The server to shut down. Must outlive the watcher.
+	explicit SignalWatcher(AsyncServiceAcceptorBase* server):
+		SignalWatcher([server]() { server->Shutdown(); }) {
+	}
+
+	/// @param[in]  shutdown    Shuts the server down, for example a
+	///             ShardedAcceptorT. Called at most once.
+	explicit SignalWatcher(std::function<void()> shutdown) {
+		sigemptyset(&signals_);
+		sigaddset(&signals_, SIGINT);
+		sigaddset(&signals_, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &signals_, nullptr);
+		thread_ = std::thread([this, shutdown]() {
+			int sig = 0;
+			sigwait(&signals_, &sig);
+			shutdown();
+		});
+	}
+
+	/// Stops watching. Shutting down a server that has stopped does nothing.
+	~SignalWatcher() {
+		pthread_kill(thread_.native_handle(), SIGTERM);
+		thread_.join();
+	}
+
+	SignalWatcher(const SignalWatcher&) = delete;
+	SignalWatcher& operator = (const SignalWatcher&) = delete;
+
+private:
+	sigset_t signals_;
+	std::thread thread_;
+};
+
+}       // namespace lucida
+#endif  // SIGNAL_WATCHER_H_44DCC714_7172_42C7_8D04_CA08874CEDF5
@@ -0,0 +1,165 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SIMULATOR_H_67BD9F3B_42EE_4790_AD1B_0B12AEB4D40A
+#define SIMULATOR_H_67BD9F3B_42EE_4790_AD1B_0B12AEB4D40A
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include "call.h"
+#include "service_connector.h"
+
+namespace lucida {
+
+/// The time a simulated method waits, in microseconds. The wait does not
+/// use the completion queue thread, so it models I/O or a remote model.
+struct LatencyModel {
+	enum Kind {
+		FIXED,          ///< Always a.
+		UNIFORM,        ///< Uniform in [a, b].
+		EXPONENTIAL,    ///< Exponential with mean a.
+		LOGNORMAL       ///< Log-normal with median a and shape sigma b.
+	};
+	LatencyModel(): kind(FIXED), a(0), b(0) {}
+	Kind kind;
+	double a;
+	double b;
+
+	/// Draw a latency.
+	uint64_t Sample(std::mt19937_64& rng) const;
+};
+
+
+/// How a simulated method behaves.
+struct MethodProfile {
+	MethodProfile(): cpuUs(0), responseBytes(0), errorRate(0), errorCode(::grpc::StatusCode::UNAVAILABLE) {}
+	LatencyModel latency;
+	/// Busy time on the completion queue thread, in microseconds.
+	uint32_t cpuUs;
+	/// Size of the infer response message. Create and learn answer Empty.
+	uint32_t responseBytes;
+	/// The fraction of calls failed with errorCode.
+	double errorRate;
+	::grpc::StatusCode errorCode;
+};
+
+/// Parse a profile such as "latency=lognormal:2000:0.5,cpu=300,size=512,errors=0.01".
+/// The latency is one of N, fixed:N, uniform:LO:HI, exp:MEAN or
+/// lognormal:MEDIAN:SIGMA in microseconds. code sets the gRPC status code of
+/// injected errors. Keys left out keep their value in profile.
+///
+/// @param[in]  spec    The profile, may be empty.
+/// @param[out] profile The parsed profile.
+/// @return     False if spec is malformed.
+bool ParseMethodProfile(const std::string& spec, MethodProfile& profile);
+
+
+/// @{
+/// A request can carry a service graph. Each QueryInput is a node. Its first
+/// tag is the host:port of the node's service and its other tags are the
+/// indices of its children. The service receiving the request is node 0.
+
+/// The valid children of node 0.
+std::vector<int> GraphChildren(const Request& request);
+
+/// The request to send to a child of node 0. Nodes 0 and child swap places,
+/// so the child sees itself as node 0, and node 0 loses its children. Each
+/// hop removes the children of one node, so a graph with cycles still ends.
+///
+/// @param[in]  request The request node 0 received.
+/// @param[in]  child   One of GraphChildren(request).
+Request ForwardedRequest(const Request& request, int child);
+/// @}
+
+
+/// Counters of a SimulatorHandler.
+struct SimulatorStats {
+	uint64_t calls;
+	/// Calls failed on purpose.
+	uint64_t injected;
+	/// Requests sent to children.
+	uint64_t forwarded;
+	/// Children that failed, failing their parent call.
+	uint64_t downstreamErrors;
+};
+
+
+/// Fake Lucida service for benchmarking service graphs without the real
+/// services. Each method burns CPU, waits a sampled latency, fails at a
+/// configured rate and answers infer with a message of a configured size.
+/// Calls carrying a service graph are forwarded to the children of node 0
+/// after the wait, in parallel and with the same method, and finish when all
+/// of them have. Infer appends the children's messages to its own.
+class SimulatorHandler: public AsyncServiceHandlerT<SimulatorHandler> {
+public:
+	/// @param[in]  create  The profile of create.
+	/// @param[in]  learn   The profile of learn.
+	/// @param[in]  infer   The profile of infer.
+	/// @param[in]  seed    Seeds latency and error draws.
+	SimulatorHandler(const MethodProfile& create, const MethodProfile& learn, const MethodProfile& infer, uint64_t seed=42);
+	~SimulatorHandler();
+
+	void OnCreate(TypedCall<Request, ::google::protobuf::Empty>* call);
+	void OnLearn(TypedCall<Request, ::google::protobuf::Empty>* call);
+	void OnInfer(TypedCall<Request, Response>* call);
+
+	SimulatorStats GetStats() const;
+
+private:
+	enum Method { CREATE, LEARN, INFER };
+	template<class ResponseType> class Run;
+
+	template<class ResponseType>
+	void Simulate(TypedCall<Request, ResponseType>* call, Method method);
+
+	/// The connector to a child, started on first use.
+	AsyncServiceConnector* GetConnector(const std::string& hostAndPort);
+
+	MethodProfile profiles_[3];
+	std::mutex rngMu_;
+	std::mt19937_64 rng_;
+	std::mutex connectorsMu_;
+	std::map<std::string, std::unique_ptr<AsyncServiceConnector>> connectors_;
+	std::atomic<uint64_t> calls_;
+	std::atomic<uint64_t> injected_;
+	std::atomic<uint64_t> forwarded_;
+	std::atomic<uint64_t> downstreamErrors_;
+};
+
+}       // namespace lucida
+#endif  // SIMULATOR_H_67BD9F3B_42EE_4790_AD1B_0B12AEB4D40A
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TEXT_INDEX_H_CEFB15CB_93F1_41F4_BF0F_65B63CC757D1
+#define TEXT_INDEX_H_CEFB15CB_93F1_41F4_BF0F_65B63CC757D1
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace lucida {
+
+/// Split text into lower case terms, runs of letters and digits. Bytes
+/// above 0x7f are kept as letters so UTF-8 words stay whole.
+///
+/// @param[in]  text    The text.
+/// @param[out] terms   Its terms, in order.
+void Tokenize(const std::string& text, std::vector<std::string>& terms);
+
+
+struct Bm25Params {
+	Bm25Params(): k1(1.2f), b(0.75f) {}
+	/// How quickly repeating a term stops adding to the score.
+	float k1;
+	/// How much long passages are penalized, 0 to 1.
+	float b;
+};
+
+
+/// A search result.
+struct ScoredPassage {
+	uint32_t id;
+	float score;
+};
+
+
+/// Inverted index of passages ranked by BM25.
+///
+/// Each term's postings are doc id gaps and term frequencies, varint coded
+/// and split into blocks of 128. Each block records its last doc id, so a
+/// cursor can skip blocks. Passages get increasing ids, so learning more
+/// appends to the postings without rebuilding them.
+///
+/// Searches use MaxScore: once the k-th best score is above what the
+/// lowest weighted terms can add up to, those terms stop proposing
+/// passages and are only looked up in passages the others propose. The
+/// postings of common terms are then mostly skipped.
+///
+/// Not thread safe. Concurrent searches are fine if nothing is added.
+class TextIndex {
+public:
+	explicit TextIndex(const Bm25Params& params=Bm25Params()): params_(params), totalLength_(0) {}
+
+	void SetParams(const Bm25Params& params) { params_ = params; }
+
+	/// Index a passage.
+	/// @return     Its id.
+	uint32_t Add(const std::string& passage);
+
+	/// Find the passages that best match a query.
+	///
+	/// @param[in]  query   The query text.
+	/// @param[in]  k       The number of results.
+	/// @param[out] results The best first, fewer than k if fewer match.
+	void Search(const std::string& query, size_t k, std::vector<ScoredPassage>& results) const;
+
+	/// Search by scoring every passage that has a query term.
+	void SearchExact(const std::string& query, size_t k, std::vector<ScoredPassage>& results) const;
+
+	const std::string& GetPassage(uint32_t id) const { return passages_[id]; }
+	size_t Size() const { return passages_.size(); }
+	size_t Terms() const { return postings_.size(); }
+
+	/// Approximate bytes used.
+	size_t MemoryUsage() const;
+
+private:
+	static const uint32_t kBlockSize = 128;
+
+	struct Block {
+		/// Where the block starts in PostingList::bytes.
+		uint32_t offset;
+		uint32_t count;
+		uint32_t lastDoc;
+	};
+	struct PostingList {
+		PostingList(): docs(0), maxTf(0), minLength(UINT32_MAX) {}
+		std::string bytes;
+		std::vector<Block> blocks;
+		/// Passages with the term.
+		uint32_t docs;
+		/// For the term's score upper bound, which grows with the term
+		/// frequency and shrinks with the passage length.
+		uint32_t maxTf;
+		uint32_t minLength;
+	};
+	class Cursor;
+
+	Bm25Params params_;
+	std::unordered_map<std::string, PostingList> postings_;
+	std::vector<std::string> passages_;
+	std::vector<uint32_t> lengths_;
+	uint64_t totalLength_;
+
+	float Idf(const PostingList& list) const;
+
+	/// The postings of the distinct terms of a query that are indexed.
+	void Lookup(const std::string& query, std::vector<const PostingList*>& lists) const;
+};
+
+/// For LucidStore accounting.
+inline size_t MemoryUsageOf(const TextIndex& index) { return index.MemoryUsage(); }
+
+}       // namespace lucida
+#endif  // TEXT_INDEX_H_CEFB15CB_93F1_41F4_BF0F_65B63CC757D1
@@ -0,0 +1,253 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TRACE_H_DAF70A46_149E_4813_A586_287B6B24D0AE
+#define TRACE_H_DAF70A46_149E_4813_A586_287B6B24D0AE
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <grpc++/client_context.h>
+#include <grpc++/server_context.h>
+#include <grpc++/support/status.h>
+
+namespace lucida {
+
+/// @{
+/// Trace metadata keys.
+static constexpr const char* kTraceIdKey = "lucida-trace-id";
+static constexpr const char* kSpanIdKey = "lucida-span-id";
+/// Wall clock nanoseconds when the client sent the call.
+static constexpr const char* kSentKey = "lucida-sent-ns";
+/// Trailing metadata, "queue=<us>,handler=<us>,downstream=<us>".
+static constexpr const char* kServerTimingKey = "lucida-server-timing";
+/// @}
+
+
+/// One span as stored in a trace ring. 64 bytes so a record never straddles
+/// a cache line.
+struct SpanRecord {
+	enum Kind { CLIENT = 1, SERVER = 2 };
+	/// Sequence lock, odd while the record is being written.
+	std::atomic<uint32_t> seq;
+	uint8_t kind;
+	uint8_t status;
+	uint16_t reserved;
+	uint64_t traceId;
+	uint64_t spanId;
+	uint64_t parentId;
+	/// Wall clock nanoseconds, comparable across local processes.
+	int64_t startNs;
+	/// Server: time from the client's send to dispatch. Client: unused.
+	uint32_t queueUs;
+	/// Server: handler time. Client: time until the result arrived.
+	uint32_t durationUs;
+	/// Server: time blocked on downstream calls. Client: the server's handler
+	/// time reported in trailing metadata.
+	uint32_t downstreamUs;
+	uint32_t reserved2;
+	char method[8];
+};
+static_assert(sizeof(SpanRecord) == 64, "SpanRecord must be one cache line");
+
+
+/// Header of a trace ring file. The records follow.
+struct TraceRingHeader {
+	static const uint32_t kMagic = 0x4352544c;  // "LTRC"
+	static const uint32_t kVersion = 1;
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity;
+	uint32_t recordSize;
+	int32_t pid;
+	int32_t tid;
+	/// Records written, the next goes to head % capacity.
+	std::atomic<uint64_t> head;
+	char service[32];
+};
+static_assert(sizeof(TraceRingHeader) == 64, "TraceRingHeader must be one cache line");
+
+
+/// Single writer ring of span records in a memory mapped file. Each thread
+/// writes its own ring without locks; readers in other processes use the
+/// per-record sequence lock to skip records caught mid-write.
+class TraceRing {
+public:
+	/// Create the ring file, replacing any existing file.
+	///
+	/// @param[in]  path        The file.
+	/// @param[in]  service     The service name stored in the header.
+	/// @param[in]  capacity    The number of records.
+	/// @return     The ring, nullptr on error.
+	static TraceRing* Create(const std::string& path, const std::string& service, unsigned capacity);
+
+	/// Map an existing ring read-only.
+	///
+	/// @param[in]  path    The file.
+	/// @return     The ring, nullptr if the file is not a trace ring.
+	static TraceRing* Open(const std::string& path);
+
+	~TraceRing();
+	TraceRing(const TraceRing&) = delete;
+	TraceRing& operator = (const TraceRing&) = delete;
+
+	/// Append a record, overwriting the oldest when full. Writer only.
+	void Append(const SpanRecord& record);
+
+	/// Copy a record if it was not being written.
+	///
+	/// @param[in]  index   Absolute record index, less than GetHeader().head.
+	/// @param[out] record  The copy.
+	/// @return     True if the copy is consistent.
+	bool Read(uint64_t index, SpanRecord& record) const;
+
+	const TraceRingHeader& GetHeader() const { return *header_; }
+
+private:
+	TraceRing(void* base, size_t size);
+	void* base_;
+	size_t size_;
+	TraceRingHeader* header_;
+	SpanRecord* records_;
+};
+
+
+/// A span read back from a trace ring.
+struct SpanInfo {
+	std::string service;
+	int pid;
+	int tid;
+	SpanRecord::Kind kind;
+	::grpc::StatusCode status;
+	uint64_t traceId;
+	uint64_t spanId;
+	uint64_t parentId;
+	int64_t startNs;
+	uint32_t queueUs;
+	uint32_t durationUs;
+	uint32_t downstreamUs;
+	std::string method;
+};
+
+
+/// Read every consistent record from the rings in a directory.
+///
+/// @param[in]  dir     The trace directory.
+/// @param[in]  traceId Only this trace, zero for all.
+/// @return     The spans ordered by start time.
+std::vector<SpanInfo> ReadTraceRings(const std::string& dir, uint64_t traceId=0);
+
+
+/// Process wide trace settings. Rings are written to dir, one file per
+/// thread, named <service>.<pid>.<tid>.ring.
+class Tracer {
+public:
+	/// Start recording spans. Calls already carrying a trace id are always
+	/// propagated; this also starts new traces at the edge and records spans
+	/// locally.
+	///
+	/// @param[in]  dir         Directory for the rings, must exist.
+	/// @param[in]  service     The service name.
+	/// @param[in]  capacity    Records per thread.
+	static void Enable(const std::string& dir, const std::string& service, unsigned capacity=4096);
+
+	/// Stop recording. Rings already open are closed by their threads.
+	static void Disable();
+
+	static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+	/// Append a record to this thread's ring if enabled.
+	static void Record(const SpanRecord& record);
+
+	/// A random non-zero id.
+	static uint64_t NewId();
+
+	/// Wall clock nanoseconds.
+	static int64_t NowNs();
+
+private:
+	static std::atomic<bool> enabled_;
+	static std::atomic<unsigned> generation_;
+};
+
+
+/// A span in progress. Server spans are owned by the call and client spans
+/// by the connector's call.
+class TraceSpan {
+public:
+	TraceSpan(): traceId_(0), spanId_(0), parentId_(0), startNs_(0), queueUs_(0), downstreamUs_(0), method_("") {}
+
+	/// Start a server span from the call's metadata.
+	/// @return     True if the call is traced.
+	bool StartServer(const ::grpc::ServerContext& ctx, const char* method);
+
+	/// Finish a server span and add the server timing to the trailing metadata.
+	void FinishServer(::grpc::ServerContext& ctx, const ::grpc::Status& status);
+
+	/// Start a client span, a child of the current server span if any.
+	/// @return     True if the call is traced.
+	bool StartClient(const char* method);
+
+	/// Add the trace metadata to a call. Call before the call starts.
+	void Inject(::grpc::ClientContext& ctx) const;
+
+	/// Finish a client span.
+	/// @param[in]  ctx     The finished call, for the server timing. May be nullptr.
+	/// @param[in]  status  The call's status.
+	void FinishClient(const ::grpc::ClientContext* ctx, const ::grpc::Status& status);
+
+	/// Add blocking downstream time to a server span.
+	void AddDownstream(uint64_t micros) { downstreamUs_ += micros; }
+
+	bool IsTraced() const { return traceId_ != 0; }
+	uint64_t GetTraceId() const { return traceId_; }
+	uint64_t GetSpanId() const { return spanId_; }
+
+	/// Parse a server timing value.
+	/// @return     True if handler was found.
+	static bool ParseServerTiming(const std::string& value, uint64_t& queueUs, uint64_t& handlerUs, uint64_t& downstreamUs);
+
+private:
+	uint64_t traceId_;
+	uint64_t spanId_;
+	uint64_t parentId_;
+	int64_t startNs_;
+	uint64_t queueUs_;
+	uint64_t downstreamUs_;
+	const char* method_;
+
+	void Fill(SpanRecord& r, SpanRecord::Kind kind, const ::grpc::Status& status, uint64_t durationUs) const;
+};
+
+}       // namespace lucida
+#endif  // TRACE_H_DAF70A46_149E_4813_A586_287B6B24D0AE
@@ -0,0 +1,148 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef VECTOR_INDEX_H_EFDF27C8_018D_42EB_A6F8_40BA475DA559
+#define VECTOR_INDEX_H_EFDF27C8_018D_42EB_A6F8_40BA475DA559
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace lucida {
+
+/// @{
+/// Similarity kernels. They use AVX-512 or AVX2 when the CPU has them,
+/// chosen once at run time.
+float DotProduct(const float* a, const float* b, size_t n);
+float SquaredL2(const float* a, const float* b, size_t n);
+/// @}
+
+/// The instruction set the kernels use: "avx512f", "avx2" or "portable".
+const char* SimdLevel();
+
+/// Scale a vector to unit length. A zero vector is left alone.
+void Normalize(float* v, size_t n);
+
+
+/// A search result.
+struct Neighbor {
+	uint32_t id;
+	/// Cosine similarity to the query, higher is closer.
+	float score;
+};
+
+
+struct VectorIndexOptions {
+	VectorIndexOptions(): graphThreshold(20000), m(16), efConstruction(200), efSearch(64), seed(42) {}
+	/// Scan every vector below this many, build an HNSW graph at it.
+	/// A scan of a few thousand vectors is faster than walking a graph.
+	size_t graphThreshold;
+	/// Graph links per node on the upper layers, twice this on the bottom.
+	unsigned m;
+	/// Candidates kept while linking a new node.
+	unsigned efConstruction;
+	/// Candidates kept while searching, at least k.
+	unsigned efSearch;
+	/// Seeds the choice of node levels, so builds are reproducible.
+	uint32_t seed;
+};
+
+
+class HnswGraph;
+
+/// Nearest neighbour index of labelled vectors, compared by cosine
+/// similarity. Vectors are normalized and stored contiguously. Small
+/// indexes are searched exactly by a vectorized scan. Once an index reaches
+/// VectorIndexOptions::graphThreshold an HNSW graph is built over it and
+/// kept up to date, and searches are approximate.
+///
+/// Not thread safe. Concurrent searches are fine if nothing is added.
+class VectorIndex {
+public:
+	explicit VectorIndex(const VectorIndexOptions& options=VectorIndexOptions());
+	~VectorIndex();
+	VectorIndex(const VectorIndex&) = delete;
+	VectorIndex& operator = (const VectorIndex&) = delete;
+
+	/// Change the options. efSearch applies at once, the others when the
+	/// graph is built.
+	void SetOptions(const VectorIndexOptions& options) { options_ = options; }
+
+	/// Add a vector. The first vector sets the dimension.
+	///
+	/// @param[in]  label   Returned with search results.
+	/// @param[in]  v       The vector.
+	/// @param[in]  dim     Its dimension.
+	/// @return     False if dim differs from the index's.
+	bool Add(const std::string& label, const float* v, size_t dim);
+
+	/// Find the k vectors closest to a query.
+	///
+	/// @param[in]  query   The query, need not be normalized.
+	/// @param[in]  dim     Its dimension.
+	/// @param[in]  k       The number of results.
+	/// @param[out] results The closest first, fewer than k if the index is
+	///             small, none on a dimension mismatch.
+	void Search(const float* query, size_t dim, size_t k, std::vector<Neighbor>& results) const;
+
+	/// Remove every vector. The next vector added sets the dimension again.
+	void Clear();
+
+	/// Search by scanning every vector, even if a graph is built.
+	void SearchExact(const float* query, size_t dim, size_t k, std::vector<Neighbor>& results) const;
+
+	const std::string& GetLabel(uint32_t id) const { return labels_[id]; }
+	const float* GetVector(uint32_t id) const { return &vectors_[size_t(id) * dim_]; }
+	size_t Size() const { return labels_.size(); }
+	size_t Dimension() const { return dim_; }
+	bool HasGraph() const { return static_cast<bool>(graph_); }
+
+	/// Approximate bytes used.
+	size_t MemoryUsage() const;
+
+private:
+	VectorIndexOptions options_;
+	size_t dim_;
+	std::vector<float> vectors_;
+	std::vector<std::string> labels_;
+	std::unique_ptr<HnswGraph> graph_;
+
+	void BuildGraph();
+};
+
+/// For LucidStore accounting.
+inline size_t MemoryUsageOf(const VectorIndex& index) { return index.MemoryUsage(); }
+
+}       // namespace lucida
+#endif  // VECTOR_INDEX_H_EFDF27C8_018D_42EB_A6F8_40BA475DA559
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <lucida/audio_gateway.h>
+#include <algorithm>
+#include <cassert>
+
+namespace lucida {
+
+AudioGateway::AudioGateway(Recognizer* recognizer):
+	recognizer_(recognizer), frameSize_(recognizer->FrameSize()), frames_(0) {
+	assert(frameSize_ > 0);
+	partial_.reserve(frameSize_);
+}
+
+
+bool AudioGateway::Process(const char* frame, std::string& interim) {
+	++frames_;
+	return recognizer_->Process(frame, interim);
+}
+
+
+bool AudioGateway::Feed(const char* data, size_t size, std::string& interim) {
+	bool updated = false;
+	if (!partial_.empty()) {
+		size_t n = std::min(size, frameSize_ - partial_.size());
+		partial_.insert(partial_.end(), data, data + n);
+		data += n;
+		size -= n;
+		if (partial_.size() < frameSize_) return false;
+		updated = Process(partial_.data(), interim);
+		partial_.clear();
+	}
+	for (; size >= frameSize_; data += frameSize_, size -= frameSize_) {
+		if (Process(data, interim))
+			updated = true;
+	}
+	partial_.assign(data, data + size);
+	return updated;
+}
+
+
+std::string AudioGateway::Drain() {
+	std::string transcript = recognizer_->End(partial_.data(), partial_.size());
+	partial_.clear();
+	return transcript;
+}
+
+
+void AudioGateway::Abort() {
+	partial_.clear();
+	recognizer_->Abort();
+}
+
+} // namespace lucida
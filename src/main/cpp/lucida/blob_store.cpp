@@ -0,0 +1,403 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <lucida/blob_store.h>
+#include <lucida/crc32c.h>
+#include <lucida/service_names.h>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <glog/logging.h>
+
+namespace lucida {
+namespace {
+
+/// A reference count change in refs.log.
+struct JournalRecord {
+	uint8_t digest[BlobStore::kDigestSize];
+	int32_t delta;
+	/// Covers the fields above.
+	uint32_t crc;
+};
+
+
+bool FromHex(const char* hex, std::string& digest) {
+	if (strlen(hex) != 2 * BlobStore::kDigestSize) return false;
+	digest.resize(BlobStore::kDigestSize);
+	for (size_t i = 0; i < BlobStore::kDigestSize; ++i) {
+		unsigned v;
+		if (sscanf(hex + 2 * i, "%2x", &v) != 1) return false;
+		digest[i] = char(v);
+	}
+	return true;
+}
+
+
+bool WriteFile(const std::string& path, const std::string& data) {
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return false;
+	const char* p = data.data();
+	size_t n = data.size();
+	bool ok = true;
+	while (ok && n > 0) {
+		ssize_t w = write(fd, p, n);
+		if (w < 0 && errno == EINTR) continue;
+		ok = w > 0;
+		if (ok) {
+			p += w;
+			n -= w;
+		}
+	}
+	ok = ok && fdatasync(fd) == 0;
+	return (close(fd) == 0) && ok;
+}
+
+}       // namespace
+
+
+std::string BlobStore::Digest(const void* data, size_t size) {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int len = 0;
+	EVP_Digest(data, size, md, &len, EVP_sha256(), nullptr);
+	return std::string(reinterpret_cast<const char*>(md), len);
+}
+
+
+std::string BlobStore::ToHex(const std::string& digest) {
+	static const char hex[] = "0123456789abcdef";
+	std::string s;
+	s.reserve(2 * digest.size());
+	for (unsigned char c: digest) {
+		s.push_back(hex[c >> 4]);
+		s.push_back(hex[c & 15]);
+	}
+	return s;
+}
+
+
+BlobStore::BlobStore(const std::string& dir): dir_(dir), journal_(-1) {
+}
+
+
+BlobStore::~BlobStore() {
+	if (journal_ >= 0) close(journal_);
+}
+
+
+std::string BlobStore::PathOf(const std::string& digest) const {
+	std::string hex = ToHex(digest);
+	return dir_ + "/" + hex.substr(0, 2) + "/" + hex;
+}
+
+
+bool BlobStore::Open() {
+	if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+		LOG(ERROR) << "BlobStore: cannot create " << dir_;
+		return false;
+	}
+	std::lock_guard<std::mutex> guard(mu_);
+	auto now = std::chrono::steady_clock::now();
+	for (unsigned b = 0; b < 256; ++b) {
+		char sub[4];
+		snprintf(sub, sizeof(sub), "%02x", b);
+		std::string subdir = dir_ + "/" + sub;
+		DIR* d = opendir(subdir.c_str());
+		if (d == nullptr) continue;
+		while (struct dirent* ent = readdir(d)) {
+			std::string digest;
+			struct stat st;
+			if (!FromHex(ent->d_name, digest) || stat((subdir + "/" + ent->d_name).c_str(), &st) != 0)
+				continue;
+			Blob blob = { uint64_t(st.st_size), 0, now };
+			blobs_[digest] = blob;
+			++stats_.blobs;
+			stats_.bytes += blob.size;
+		}
+		closedir(d);
+	}
+
+	// Replay the references.
+	std::string path = dir_ + "/refs.log";
+	FILE* f = fopen(path.c_str(), "rb");
+	if (f != nullptr) {
+		JournalRecord r;
+		while (fread(&r, sizeof(r), 1, f) == 1) {
+			if (Crc32c(&r, offsetof(JournalRecord, crc)) != r.crc) {
+				LOG(WARNING) << "BlobStore: " << path << " has a torn record, ignored the rest";
+				break;
+			}
+			auto it = blobs_.find(std::string(reinterpret_cast<const char*>(r.digest), kDigestSize));
+			if (it == blobs_.end()) continue;
+			int64_t refs = int64_t(it->second.refs) + r.delta;
+			it->second.refs = refs < 0? 0: unsigned(refs);
+		}
+		fclose(f);
+	}
+	for (auto& kv: blobs_)
+		stats_.referencedBytes += kv.second.size * kv.second.refs;
+	LOG(INFO) << "BlobStore: " << stats_.blobs << " blob(s), " << stats_.bytes << " bytes in " << dir_;
+	return RewriteJournal();
+}
+
+
+bool BlobStore::RewriteJournal() {
+	// Start again from the current counts so the journal stays small.
+	std::string path = dir_ + "/refs.log";
+	std::string tmp = path + ".tmp";
+	std::string data;
+	for (auto& kv: blobs_) {
+		if (kv.second.refs == 0) continue;
+		JournalRecord r;
+		memcpy(r.digest, kv.first.data(), kDigestSize);
+		r.delta = int32_t(kv.second.refs);
+		r.crc = Crc32c(&r, offsetof(JournalRecord, crc));
+		data.append(reinterpret_cast<const char*>(&r), sizeof(r));
+	}
+	if (!WriteFile(tmp, data) || rename(tmp.c_str(), path.c_str()) != 0) {
+		LOG(ERROR) << "BlobStore: cannot write " << path;
+		return false;
+	}
+	if (journal_ >= 0) close(journal_);
+	journal_ = open(path.c_str(), O_WRONLY | O_APPEND);
+	return journal_ >= 0;
+}
+
+
+bool BlobStore::Journal(const std::string& digest, int32_t delta) {
+	JournalRecord r;
+	memcpy(r.digest, digest.data(), kDigestSize);
+	r.delta = delta;
+	r.crc = Crc32c(&r, offsetof(JournalRecord, crc));
+	if (journal_ < 0 || write(journal_, &r, sizeof(r)) != ssize_t(sizeof(r))) {
+		LOG(ERROR) << "BlobStore: cannot journal reference to " << ToHex(digest);
+		return false;
+	}
+	return true;
+}
+
+
+bool BlobStore::Put(const std::string& data, std::string* digestOut) {
+	std::string digest = Digest(data.data(), data.size());
+	if (digestOut != nullptr) *digestOut = digest;
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		++stats_.puts;
+		auto it = blobs_.find(digest);
+		if (it != blobs_.end()) {
+			++stats_.duplicatePuts;
+			it->second.stored = std::chrono::steady_clock::now();
+			return true;
+		}
+	}
+	// Write aside and rename so readers never see part of a blob.
+	static std::atomic<uint64_t> counter(0);
+	std::string path = PathOf(digest);
+	std::string subdir = path.substr(0, path.rfind('/'));
+	std::string tmp = dir_ + "/tmp." + std::to_string(getpid()) + "." + std::to_string(counter.fetch_add(1));
+	if ((mkdir(subdir.c_str(), 0755) != 0 && errno != EEXIST) || !WriteFile(tmp, data)) {
+		LOG(ERROR) << "BlobStore: cannot write " << tmp;
+		unlink(tmp.c_str());
+		return false;
+	}
+	// Rename under the lock so CollectGarbage cannot unlink the file after
+	// it is in place.
+	std::lock_guard<std::mutex> guard(mu_);
+	auto it = blobs_.find(digest);
+	if (it != blobs_.end()) {
+		unlink(tmp.c_str());
+		it->second.stored = std::chrono::steady_clock::now();
+		return true;
+	}
+	if (rename(tmp.c_str(), path.c_str()) != 0) {
+		LOG(ERROR) << "BlobStore: cannot write " << path;
+		unlink(tmp.c_str());
+		return false;
+	}
+	Blob blob = { data.size(), 0, std::chrono::steady_clock::now() };
+	blobs_.emplace(digest, blob);
+	++stats_.blobs;
+	stats_.bytes += data.size();
+	return true;
+}
+
+
+bool BlobStore::Contains(const std::string& digest) const {
+	std::lock_guard<std::mutex> guard(mu_);
+	return blobs_.count(digest) != 0;
+}
+
+
+bool BlobStore::Get(const std::string& digest, std::string& data) const {
+	uint64_t size;
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		auto it = blobs_.find(digest);
+		if (it == blobs_.end()) return false;
+		size = it->second.size;
+	}
+	std::string path = PathOf(digest);
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	data.resize(size);
+	size_t got = 0;
+	while (got < size) {
+		ssize_t r = read(fd, &data[got], size - got);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) break;
+		got += r;
+	}
+	close(fd);
+	if (got != size) {
+		LOG(ERROR) << "BlobStore: short read of " << path;
+		return false;
+	}
+	return true;
+}
+
+
+bool BlobStore::AddRef(const std::string& digest) {
+	std::lock_guard<std::mutex> guard(mu_);
+	auto it = blobs_.find(digest);
+	if (it == blobs_.end()) return false;
+	++it->second.refs;
+	stats_.referencedBytes += it->second.size;
+	return Journal(digest, 1);
+}
+
+
+bool BlobStore::Release(const std::string& digest) {
+	std::lock_guard<std::mutex> guard(mu_);
+	auto it = blobs_.find(digest);
+	if (it == blobs_.end() || it->second.refs == 0) return false;
+	--it->second.refs;
+	stats_.referencedBytes -= it->second.size;
+	// Give it a full grace period from now.
+	if (it->second.refs == 0) it->second.stored = std::chrono::steady_clock::now();
+	return Journal(digest, -1);
+}
+
+
+void BlobStore::AddRefs(const Request& request) {
+	std::vector<std::string> digests;
+	GetDigests(request, digests);
+	for (auto& digest: digests) {
+		if (!AddRef(digest))
+			LOG(ERROR) << "BlobStore: cannot reference " << ToHex(digest);
+	}
+}
+
+
+void BlobStore::Release(const std::vector<std::string>& digests) {
+	for (auto& digest: digests)
+		Release(digest);
+}
+
+
+void BlobStore::GetDigests(const Request& request, std::vector<std::string>& digests) {
+	for (const QueryInput& input: request.spec().content())
+		digests.insert(digests.end(), input.digests().begin(), input.digests().end());
+}
+
+
+unsigned BlobStore::GetRefs(const std::string& digest) const {
+	std::lock_guard<std::mutex> guard(mu_);
+	auto it = blobs_.find(digest);
+	return (it == blobs_.end())? 0: it->second.refs;
+}
+
+
+size_t BlobStore::CollectGarbage(std::chrono::seconds minAge) {
+	// Unlink under the lock, otherwise a Put of the same blob could rename
+	// its file into place and record it before the stale unlink.
+	std::lock_guard<std::mutex> guard(mu_);
+	size_t dead = 0;
+	auto cutoff = std::chrono::steady_clock::now() - minAge;
+	for (auto it = blobs_.begin(); it != blobs_.end();) {
+		if (it->second.refs == 0 && it->second.stored <= cutoff) {
+			--stats_.blobs;
+			stats_.bytes -= it->second.size;
+			unlink(PathOf(it->first).c_str());
+			++dead;
+			it = blobs_.erase(it);
+		} else {
+			++it;
+		}
+	}
+	RewriteJournal();
+	return dead;
+}
+
+
+::grpc::Status BlobStore::Resolve(Request& request, bool learn) {
+	for (QueryInput& input: *request.mutable_spec()->mutable_content()) {
+		if (input.digests_size() != 0 && input.digests_size() != input.data_size())
+			return ::grpc::Status(::grpc::StatusCode::INVALID_ARGUMENT, "digests and data differ in length");
+		if (learn && input.digests_size() == 0 && ServiceNames::toTypeId(input.type()) == ServiceNames::IMAGE_TYPE) {
+			for (int i = 0; i < input.data_size(); ++i)
+				input.add_digests();
+		}
+		for (int i = 0; i < input.digests_size(); ++i) {
+			const std::string& digest = input.digests(i);
+			std::string* data = input.mutable_data(i);
+			if (data->empty()) {
+				if (!Get(digest, *data))
+					return ::grpc::Status(::grpc::StatusCode::FAILED_PRECONDITION, "missing blob " + ToHex(digest));
+			} else if (learn) {
+				// Sent inline, keep it so later learns can send the digest.
+				std::string stored;
+				if (!Put(*data, &stored))
+					return ::grpc::Status(::grpc::StatusCode::INTERNAL, "cannot store blob");
+				if (digest.empty()) {
+					*input.mutable_digests(i) = stored;
+				} else if (digest != stored) {
+					return ::grpc::Status(::grpc::StatusCode::INVALID_ARGUMENT, "blob does not match digest " + ToHex(digest));
+				}
+			}
+		}
+	}
+	return ::grpc::Status::OK;
+}
+
+
+BlobStoreStats BlobStore::GetStats() const {
+	std::lock_guard<std::mutex> guard(mu_);
+	return stats_;
+}
+
+}       // namespace lucida
@@ -0,0 +1,335 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <lucida/capture_log.h>
+#include <lucida/crc32c.h>
+#include <lucida/ring_buffer.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <glog/logging.h>
+
+namespace lucida {
+namespace {
+
+const char kMagic[4] = { 'L', 'C', 'A', 'P' };
+const uint32_t kVersion = 1;
+/// Method byte, arrival time.
+const size_t kFixedSize = 1 + 8;
+/// Larger records are taken as damage.
+const uint32_t kMaxRecord = 64 << 20;
+/// How often the flusher writes what the threads captured.
+const unsigned kFlushIntervalMs = 50;
+
+std::atomic<uint64_t> nextWriterId(1);
+
+const char* const kMethods[] = { "create", "learn", "infer" };
+
+int MethodCode(const char* method) {
+	for (int i = 0; i < 3; ++i) {
+		if (strcmp(method, kMethods[i]) == 0) return i;
+	}
+	return -1;
+}
+
+void PutFixed32(std::string& out, uint32_t v) {
+	for (int i = 0; i < 4; ++i) out.push_back(char(v >> (8 * i)));
+}
+
+void PutFixed64(std::string& out, uint64_t v) {
+	for (int i = 0; i < 8; ++i) out.push_back(char(v >> (8 * i)));
+}
+
+uint64_t GetFixed(const uint8_t* p, int bytes) {
+	uint64_t v = 0;
+	for (int i = 0; i < bytes; ++i) v |= uint64_t(p[i]) << (8 * i);
+	return v;
+}
+
+/// Per thread xorshift, uniform in [0, 1).
+double Uniform() {
+	thread_local uint64_t state = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return (state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int64_t NowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+
+struct CaptureWriter::ThreadBuffer {
+	explicit ThreadBuffer(size_t bytes): ring(bytes), done(false) {}
+	RingBuffer ring;
+	/// The thread has exited, free the buffer once it is drained.
+	std::atomic<bool> done;
+};
+
+
+CaptureWriter::CaptureWriter(): id_(nextWriterId.fetch_add(1)), sampleRate_(1.0), threadBufferBytes_(4 << 20),
+	seen_(0), dropped_(0), file_(nullptr), maxBytes_(0), requested_(0), drained_(0), stop_(false) {
+	flusher_ = std::thread(&CaptureWriter::Run, this);
+}
+
+
+CaptureWriter::~CaptureWriter() {
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		stop_ = true;
+	}
+	cv_.notify_all();
+	flusher_.join();
+	if (file_ != nullptr) fclose(file_);
+}
+
+
+bool CaptureWriter::Open(const std::string& path, double sampleRate, uint64_t maxBytes, size_t threadBufferBytes) {
+	// Records captured so far belong to the old log.
+	Flush();
+	std::lock_guard<std::mutex> guard(fileMu_);
+	if (file_ != nullptr) fclose(file_);
+	file_ = fopen(path.c_str(), "wb");
+	if (file_ == nullptr) {
+		LOG(ERROR) << "CaptureWriter: cannot create " << path;
+		return false;
+	}
+	setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+	sampleRate_ = sampleRate;
+	maxBytes_ = maxBytes;
+	threadBufferBytes_.store(threadBufferBytes);
+	std::string header(kMagic, sizeof(kMagic));
+	PutFixed32(header, kVersion);
+	stats_ = CaptureStats();
+	stats_.bytes = header.size();
+	return fwrite(header.data(), 1, header.size(), file_) == header.size();
+}
+
+
+bool CaptureWriter::Capture(const char* method, const Request& request, int64_t arrivalNs) {
+	seen_.fetch_add(1, std::memory_order_relaxed);
+	if (sampleRate_ < 1.0 && Uniform() >= sampleRate_) return false;
+	int code = MethodCode(method);
+	if (code < 0) return false;
+	// The body length, then the body. The flusher adds the checksum. The
+	// scratch keeps its capacity, so a steady load does not allocate.
+	static thread_local std::string entry;
+	entry.assign(4, '\0');
+	entry.push_back(char(code));
+	PutFixed64(entry, arrivalNs != 0? arrivalNs: NowNs());
+	if (!request.AppendToString(&entry)) return false;
+	uint32_t length = entry.size() - 4;
+	for (int i = 0; i < 4; ++i)
+		entry[i] = char(length >> (8 * i));
+	RingBuffer& ring = GetThreadBuffer()->ring;
+	// Only this thread writes, so the space cannot shrink before the write.
+	if (ring.Space() < entry.size()) {
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	ring.Write(entry.data(), entry.size());
+	return true;
+}
+
+
+CaptureWriter::ThreadBuffer* CaptureWriter::GetThreadBuffer() {
+	// A thread's buffers, one per writer it has captured to.
+	struct Owned {
+		~Owned() {
+			for (auto& b: buffers)
+				b.second->done.store(true, std::memory_order_release);
+		}
+		std::vector<std::pair<uint64_t, std::shared_ptr<ThreadBuffer>>> buffers;
+	};
+	static thread_local Owned owned;
+	for (auto& b: owned.buffers)
+		if (b.first == id_) return b.second.get();
+	auto buffer = std::make_shared<ThreadBuffer>(threadBufferBytes_.load());
+	owned.buffers.emplace_back(id_, buffer);
+	std::lock_guard<std::mutex> guard(mu_);
+	buffers_.push_back(buffer);
+	return buffer.get();
+}
+
+
+bool CaptureWriter::Flush() {
+	{
+		std::unique_lock<std::mutex> lock(mu_);
+		uint64_t ticket = ++requested_;
+		cv_.notify_all();
+		cv_.wait(lock, [this, ticket]() { return drained_ >= ticket; });
+	}
+	std::lock_guard<std::mutex> guard(fileMu_);
+	return file_ != nullptr && fflush(file_) == 0;
+}
+
+
+void CaptureWriter::Run() {
+	std::unique_lock<std::mutex> lock(mu_);
+	for (;;) {
+		cv_.wait_for(lock, std::chrono::milliseconds(kFlushIntervalMs),
+			[this]() { return stop_ || requested_ > drained_; });
+		uint64_t ticket = requested_;
+		bool stop = stop_;
+		lock.unlock();
+		Drain();
+		lock.lock();
+		drained_ = ticket;
+		cv_.notify_all();
+		if (stop) return;
+	}
+}
+
+
+void CaptureWriter::Drain() {
+	std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		buffers = buffers_;
+	}
+	std::string body;
+	bool exited = false;
+	for (auto& buffer: buffers) {
+		// Check before reading so nothing written before the exit is missed.
+		bool done = buffer->done.load(std::memory_order_acquire);
+		RingBuffer& ring = buffer->ring;
+		// Entries are written whole, so a length is always followed by its body.
+		uint8_t prefix[4];
+		while (ring.Size() >= sizeof(prefix)) {
+			ring.Read(prefix, sizeof(prefix));
+			body.resize(GetFixed(prefix, 4));
+			ring.Read(&body[0], body.size());
+			std::lock_guard<std::mutex> guard(fileMu_);
+			Append(body);
+		}
+		exited = exited || done;
+	}
+	if (exited) {
+		std::lock_guard<std::mutex> guard(mu_);
+		buffers_.erase(std::remove_if(buffers_.begin(), buffers_.end(), [](const std::shared_ptr<ThreadBuffer>& b) {
+			return b->done.load(std::memory_order_acquire) && b->ring.Size() == 0;
+		}), buffers_.end());
+	}
+}
+
+
+void CaptureWriter::Append(const std::string& body) {
+	if (file_ == nullptr) return;
+	std::string prefix;
+	PutFixed32(prefix, body.size());
+	PutFixed32(prefix, Crc32c(body.data(), body.size()));
+	if (maxBytes_ != 0 && stats_.bytes + prefix.size() + body.size() > maxBytes_) {
+		++stats_.overLimit;
+		return;
+	}
+	if (fwrite(prefix.data(), 1, prefix.size(), file_) != prefix.size() ||
+		fwrite(body.data(), 1, body.size(), file_) != body.size()) {
+		// Likely out of space, stop rather than fail every record.
+		LOG(ERROR) << "CaptureWriter: write failed, capture stopped";
+		fclose(file_);
+		file_ = nullptr;
+		return;
+	}
+	++stats_.captured;
+	stats_.bytes += prefix.size() + body.size();
+}
+
+
+CaptureStats CaptureWriter::GetStats() const {
+	std::lock_guard<std::mutex> guard(fileMu_);
+	CaptureStats stats = stats_;
+	stats.seen = seen_.load(std::memory_order_relaxed);
+	stats.dropped = dropped_.load(std::memory_order_relaxed);
+	return stats;
+}
+
+
+CaptureReader::CaptureReader(): file_(nullptr), damaged_(false) {
+}
+
+
+CaptureReader::~CaptureReader() {
+	if (file_ != nullptr) fclose(file_);
+}
+
+
+bool CaptureReader::Open(const std::string& path) {
+	if (file_ != nullptr) fclose(file_);
+	damaged_ = false;
+	file_ = fopen(path.c_str(), "rb");
+	if (file_ == nullptr) {
+		LOG(ERROR) << "CaptureReader: cannot open " << path;
+		return false;
+	}
+	uint8_t header[8];
+	if (fread(header, 1, sizeof(header), file_) != sizeof(header) || memcmp(header, kMagic, sizeof(kMagic)) != 0 ||
+		GetFixed(header + 4, 4) != kVersion) {
+		LOG(ERROR) << "CaptureReader: " << path << " is not a capture log";
+		fclose(file_);
+		file_ = nullptr;
+		return false;
+	}
+	return true;
+}
+
+
+bool CaptureReader::Next(CaptureRecord& record) {
+	if (file_ == nullptr || damaged_) return false;
+	uint8_t prefix[8];
+	size_t n = fread(prefix, 1, sizeof(prefix), file_);
+	if (n == 0 && feof(file_)) return false;
+	uint32_t length = GetFixed(prefix, 4);
+	if (n != sizeof(prefix) || length < kFixedSize || length > kMaxRecord) {
+		damaged_ = true;
+		return false;
+	}
+	std::string body(length, '\0');
+	if (fread(&body[0], 1, length, file_) != length || Crc32c(body.data(), length) != GetFixed(prefix + 4, 4)) {
+		damaged_ = true;
+		return false;
+	}
+	const uint8_t* p = reinterpret_cast<const uint8_t*>(body.data());
+	if (p[0] >= 3 || !record.request.ParseFromArray(p + kFixedSize, length - kFixedSize)) {
+		damaged_ = true;
+		return false;
+	}
+	record.method = kMethods[p[0]];
+	record.arrivalNs = GetFixed(p + 1, 8);
+	return true;
+}
+
+} // namespace lucida
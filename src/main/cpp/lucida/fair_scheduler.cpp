@@ -0,0 +1,135 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <lucida/fair_scheduler.h>
+#include <lucida/call.h>
+#include <glog/logging.h>
+
+namespace lucida {
+
+FairScheduler::~FairScheduler() {
+	LOG_IF(ERROR, queued_ != 0) << "FairScheduler: destroyed with " << queued_ << " call(s) queued";
+}
+
+
+FairScheduler::Tenant* FairScheduler::Find(const std::string& name) {
+	auto it = tenants_.find(name);
+	if (it != tenants_.end()) return it->second.get();
+	if (tenants_.size() >= policy_.maxIdleTenants) PruneIdle();
+	std::unique_ptr<Tenant> t(new Tenant(name, policy_.WeightOf(name)));
+	Tenant* p = t.get();
+	std::lock_guard<std::mutex> guard(mu_);
+	tenants_.emplace(name, std::move(t));
+	return p;
+}
+
+
+void FairScheduler::PruneIdle() {
+	std::lock_guard<std::mutex> guard(mu_);
+	for (auto it = tenants_.begin(); it != tenants_.end();) {
+		if (!it->second->active && it->second->inflight == 0)
+			it = tenants_.erase(it);
+		else
+			++it;
+	}
+}
+
+
+void FairScheduler::Push(const std::string& name, UntypedCall* call) {
+	Tenant* t = Find(name);
+	if (policy_.maxQueued != 0 && t->queue.size() >= policy_.maxQueued) {
+		t->shed.fetch_add(1, std::memory_order_relaxed);
+		call->Reject(::grpc::Status(::grpc::StatusCode::RESOURCE_EXHAUSTED, "too many queued calls for LUCID"));
+		return;
+	}
+	t->queue.push_back(call);
+	++queued_;
+	if (!t->active) {
+		t->active = true;
+		t->deficit = 0;
+		active_.push_back(t);
+	}
+}
+
+
+bool FairScheduler::Runnable() const {
+	for (const Tenant* t: active_) {
+		if (!Blocked(t)) return true;
+	}
+	return false;
+}
+
+
+UntypedCall* FairScheduler::Pop() {
+	// Tenants at their in-flight limit keep their deficit and go to the back.
+	for (size_t skipped = 0; skipped < active_.size(); ++skipped) {
+		Tenant* t = active_.front();
+		if (Blocked(t)) {
+			active_.pop_front();
+			active_.push_back(t);
+			continue;
+		}
+		// A new turn
+		if (t->deficit == 0) t->deficit = t->weight;
+		UntypedCall* call = t->queue.front();
+		t->queue.pop_front();
+		--queued_;
+		--t->deficit;
+		++t->inflight;
+		call->SetInflightCounter(&t->inflight);
+		t->dispatched.fetch_add(1, std::memory_order_relaxed);
+		if (t->queue.empty()) {
+			t->active = false;
+			t->deficit = 0;
+			active_.pop_front();
+		} else if (t->deficit == 0) {
+			active_.pop_front();
+			active_.push_back(t);
+		}
+		return call;
+	}
+	return nullptr;
+}
+
+
+void FairScheduler::Report(std::vector<TenantReport>& report) const {
+	std::lock_guard<std::mutex> guard(mu_);
+	for (auto& kv: tenants_) {
+		TenantReport r;
+		r.tenant = kv.first;
+		r.weight = kv.second->weight;
+		r.dispatched = kv.second->dispatched.load(std::memory_order_relaxed);
+		r.shed = kv.second->shed.load(std::memory_order_relaxed);
+		report.push_back(r);
+	}
+}
+
+}       // namespace lucida
@@ -0,0 +1,238 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <glog/logging.h>
+#include <lucida/hot_restart.h>
+
+namespace lucida {
+
+// The successor acknowledges with this byte once it has everything, so the
+// running process only stops accepting when the socket has a new owner.
+static const char kAck = 'A';
+
+
+static bool MakeUnixAddress(const std::string& path, sockaddr_un& addr) {
+	addr = sockaddr_un();
+	addr.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+		LOG(ERROR) << "HotRestart: bad control socket path " << path;
+		return false;
+	}
+	memcpy(addr.sun_path, path.data(), path.size());
+	return true;
+}
+
+
+static void SetTimeout(int fd, unsigned timeoutMs) {
+	timeval tv;
+	tv.tv_sec = timeoutMs / 1000;
+	tv.tv_usec = (timeoutMs % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+
+static bool WriteAll(int fd, const char* p, size_t n) {
+	while (n != 0) {
+		ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return false;
+		p += r;
+		n -= size_t(r);
+	}
+	return true;
+}
+
+
+static bool ReadAll(int fd, char* p, size_t n) {
+	while (n != 0) {
+		ssize_t r = recv(fd, p, n, 0);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return false;
+		p += r;
+		n -= size_t(r);
+	}
+	return true;
+}
+
+
+int ListenTcp(const std::string& hostAndPort, int backlog) {
+	size_t colon = hostAndPort.rfind(':');
+	if (colon == std::string::npos) {
+		LOG(ERROR) << "HotRestart: no port in " << hostAndPort;
+		return -1;
+	}
+	std::string host = hostAndPort.substr(0, colon);
+	std::string port = hostAndPort.substr(colon + 1);
+	if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+		host = host.substr(1, host.size() - 2);
+
+	addrinfo hints = addrinfo();
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	addrinfo* results = nullptr;
+	int err = getaddrinfo(host.empty()? nullptr: host.c_str(), port.c_str(), &hints, &results);
+	if (err != 0) {
+		LOG(ERROR) << "HotRestart: cannot resolve " << hostAndPort << ": " << gai_strerror(err);
+		return -1;
+	}
+	int fd = -1;
+	for (addrinfo* ai = results; ai != nullptr && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0) continue;
+		int one = 1, zero = 0;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		// [::] takes ipv4 too.
+		if (ai->ai_family == AF_INET6)
+			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, backlog) != 0) {
+			err = errno;
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(results);
+	if (fd < 0)
+		LOG(ERROR) << "HotRestart: cannot listen on " << hostAndPort << ": " << strerror(err);
+	return fd;
+}
+
+
+int ListenControl(const std::string& path) {
+	sockaddr_un addr;
+	if (!MakeUnixAddress(path, addr)) return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		LOG(ERROR) << "HotRestart: cannot create control socket: " << strerror(errno);
+		return -1;
+	}
+	// Left behind by the process taken over, or one that died.
+	unlink(path.c_str());
+	if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+		LOG(ERROR) << "HotRestart: cannot listen on " << path << ": " << strerror(errno);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+int ReceiveListener(const std::string& path, std::string& warmState, unsigned timeoutMs) {
+	sockaddr_un addr;
+	if (!MakeUnixAddress(path, addr)) return -1;
+	int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (conn < 0) return -1;
+	if (connect(conn, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+		// Nothing to take over.
+		close(conn);
+		return -1;
+	}
+	SetTimeout(conn, timeoutMs);
+
+	uint64_t size = 0;
+	iovec iov;
+	iov.iov_base = &size;
+	iov.iov_len = sizeof(size);
+	char control[CMSG_SPACE(sizeof(int))];
+	msghdr msg = msghdr();
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t r;
+	do {
+		r = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+	} while (r < 0 && errno == EINTR);
+	int fd = -1;
+	cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (r > 0 && cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+	bool ok = fd >= 0 && r > 0 && !(msg.msg_flags & MSG_CTRUNC) &&
+		(size_t(r) == sizeof(size) || ReadAll(conn, reinterpret_cast<char*>(&size) + r, sizeof(size) - r));
+	if (ok) {
+		std::string state(size, '\0');
+		ok = ReadAll(conn, &state[0], state.size()) && WriteAll(conn, &kAck, 1);
+		if (ok) warmState.swap(state);
+	}
+	close(conn);
+	if (!ok) {
+		LOG(ERROR) << "HotRestart: incomplete handover from " << path;
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+bool SendListener(int conn, int listenFd, const std::string& warmState) {
+	SetTimeout(conn, 10000);
+	uint64_t size = warmState.size();
+	iovec iov;
+	iov.iov_base = &size;
+	iov.iov_len = sizeof(size);
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	msghdr msg = msghdr();
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &listenFd, sizeof(listenFd));
+	ssize_t r;
+	do {
+		r = sendmsg(conn, &msg, MSG_NOSIGNAL);
+	} while (r < 0 && errno == EINTR);
+	char ack = 0;
+	bool ok = r > 0 &&
+		WriteAll(conn, reinterpret_cast<char*>(&size) + r, sizeof(size) - r) &&
+		WriteAll(conn, warmState.data(), warmState.size()) &&
+		ReadAll(conn, &ack, 1) && ack == kAck;
+	if (!ok)
+		LOG(ERROR) << "HotRestart: successor did not take the listener";
+	return ok;
+}
+
+}       // namespace lucida
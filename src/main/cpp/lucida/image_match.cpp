@@ -0,0 +1,177 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <lucida/image_match.h>
+#include <lucida/blob_store.h>
+#include <lucida/service_names.h>
+
+using ::google::protobuf::Empty;
+
+namespace lucida {
+
+bool HashFeatureExtractor::Extract(const std::string& image, std::vector<float>& features) const {
+	features.assign(dim_, 0.0f);
+	if (image.empty() || dim_ == 0) return false;
+	const uint8_t* p = reinterpret_cast<const uint8_t*>(image.data());
+	for (size_t i = 0; i + 3 <= image.size(); ++i) {
+		// FNV-1a of the trigram, the top bit picks the sign.
+		uint32_t h = 2166136261u;
+		for (size_t j = 0; j < 3; ++j)
+			h = (h ^ p[i + j]) * 16777619u;
+		features[h % dim_] += (h & 0x80000000u)? -1.0f: 1.0f;
+	}
+	Normalize(features.data(), dim_);
+	return true;
+}
+
+
+namespace {
+
+/// What a learn request asks for.
+struct LearnBatch {
+	LearnBatch(): unlearn(false) {}
+	std::vector<std::vector<float>> features;
+	std::vector<const std::string*> labels;
+	bool unlearn;
+};
+
+/// Adds one input of a learn request to the batch.
+/// @return False if the input cannot be learned.
+typedef bool (*LearnInputFn)(const FeatureExtractor& extractor, const QueryInput& input, LearnBatch& batch);
+
+bool SkipInput(const FeatureExtractor&, const QueryInput&, LearnBatch&) {
+	return true;
+}
+
+bool LearnImages(const FeatureExtractor& extractor, const QueryInput& input, LearnBatch& batch) {
+	for (int i = 0; i < input.data_size(); ++i) {
+		batch.features.emplace_back();
+		if (!extractor.Extract(input.data(i), batch.features.back())) return false;
+		batch.labels.push_back(i < input.tags_size()? &input.tags(i): nullptr);
+	}
+	return true;
+}
+
+bool Unlearn(const FeatureExtractor&, const QueryInput&, LearnBatch& batch) {
+	batch.unlearn = true;
+	return true;
+}
+
+const TypeDispatchTable<LearnInputFn>& LearnInputs() {
+	static const TypeDispatchTable<LearnInputFn> table = TypeDispatchTable<LearnInputFn>(SkipInput)
+		.On(ServiceNames::IMAGE_TYPE, LearnImages)
+		.On(ServiceNames::UNLEARN_TYPE, Unlearn);
+	return table;
+}
+
+} // namespace
+
+
+ImageMatchHandler::ImageMatchHandler(FeatureExtractor* extractor, const VectorIndexOptions& options, unsigned topK):
+	extractor_(extractor), options_(options), topK_(topK) {
+}
+
+
+void ImageMatchHandler::OnCreate(TypedCall<Request, Empty>* call) {
+	store_.Create(call->request_.lucid(), [this](LearnedImages& images) { images.index.SetOptions(options_); });
+}
+
+
+void ImageMatchHandler::OnLearn(TypedCall<Request, Empty>* call) {
+	// The dispatch references the request's blobs once this returns.
+	std::vector<std::string> forgotten;
+	::grpc::Status status = Learn(call->request_, call->GetSpecView(), forgotten);
+	if (!status.ok()) call->FinishWithError(status);
+	if (!forgotten.empty()) GetBlobStore()->Release(forgotten);
+}
+
+
+::grpc::Status ImageMatchHandler::Learn(const Request& request) {
+	std::vector<std::string> forgotten;
+	return Learn(request, QuerySpecView(request.spec()), forgotten);
+}
+
+
+::grpc::Status ImageMatchHandler::Learn(const Request& request, const QuerySpecView& spec, std::vector<std::string>& forgotten) {
+	// Extract outside the user's lock, it is the slow part.
+	LearnBatch batch;
+	for (int i = 0; i < spec.size(); ++i) {
+		if (!LearnInputs()[spec.type(i)](*extractor_, spec.input(i), batch))
+			return ::grpc::Status(::grpc::StatusCode::INVALID_ARGUMENT, "cannot decode image");
+	}
+	const std::vector<std::vector<float>>& features = batch.features;
+	const std::vector<const std::string*>& labels = batch.labels;
+	if (features.empty() && !batch.unlearn)
+		return ::grpc::Status(::grpc::StatusCode::INVALID_ARGUMENT, "no image to learn");
+	store_.Write(request.lucid(), [&](LearnedImages& images) {
+		VectorIndex& index = images.index;
+		if (batch.unlearn) {
+			index.Clear();
+			forgotten.swap(images.blobs);
+		}
+		if (index.Size() == 0) index.SetOptions(options_);
+		for (size_t i = 0; i < features.size(); ++i) {
+			std::string label = labels[i]? *labels[i]: "image" + std::to_string(index.Size());
+			index.Add(label, features[i].data(), features[i].size());
+		}
+		if (GetBlobStore() != nullptr) BlobStore::GetDigests(request, images.blobs);
+	}, true);
+	return ::grpc::Status::OK;
+}
+
+
+void ImageMatchHandler::OnInfer(TypedCall<Request, Response>* call) {
+	const QuerySpecView& spec = call->GetSpecView();
+	const std::string* image = nullptr;
+	for (int i = 0; i < spec.size() && image == nullptr; ++i) {
+		if (spec.type(i) == ServiceNames::IMAGE_TYPE && spec.input(i).data_size() != 0)
+			image = &spec.input(i).data(0);
+	}
+	std::vector<float> features;
+	if (image == nullptr || !extractor_->Extract(*image, features)) {
+		call->FinishWithError(::grpc::Status(::grpc::StatusCode::INVALID_ARGUMENT, "no image to match"));
+		return;
+	}
+	std::vector<Neighbor> neighbors;
+	std::string& msg = *call->response_.mutable_msg();
+	bool found = store_.Read(call->request_.lucid(), [&](const LearnedImages& images) {
+		const VectorIndex& index = images.index;
+		index.Search(features.data(), features.size(), topK_, neighbors);
+		for (const Neighbor& n: neighbors) {
+			if (!msg.empty()) msg += '\n';
+			msg += index.GetLabel(n.id);
+		}
+	});
+	if (!found)
+		call->FinishWithError(::grpc::Status(::grpc::StatusCode::NOT_FOUND, "unknown LUCID"));
+}
+
+} // namespace lucida
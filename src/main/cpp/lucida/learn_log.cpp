@@ -0,0 +1,610 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <lucida/learn_log.h>
+#include <lucida/crc32c.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glog/logging.h>
+
+namespace lucida {
+namespace {
+
+const uint32_t kSegmentMagic = 0x474f4c4c;     // "LLOG"
+const uint32_t kSnapshotMagic = 0x504e534c;    // "LSNP"
+const uint32_t kVersion = 1;
+const uint32_t kMaxField = 1u << 30;
+
+struct SegmentHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t seq;
+};
+
+struct SnapshotHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t records;
+	uint64_t users;
+	uint64_t indexOffset;
+	uint64_t nextSeq;
+	uint32_t indexCrc;
+	/// Covers the fields above.
+	uint32_t crc;
+};
+
+/// Records of one user in a snapshot.
+struct IndexEntry {
+	uint64_t offset;
+	uint64_t count;
+};
+
+
+/// Parse and check the record at p.
+///
+/// @return     The record's size, zero if it is torn or corrupt.
+size_t ParseRecord(const char* p, size_t avail, LearnEntry& e) {
+	LearnRecordHeader h;
+	if (avail < sizeof(h)) return 0;
+	memcpy(&h, p, sizeof(h));
+	uint64_t body = uint64_t(h.lucidSize) + h.dataSize;
+	if (body > avail - sizeof(h)) return 0;
+	if (Crc32c(p + sizeof(h.crc), sizeof(h) - sizeof(h.crc) + body) != h.crc) return 0;
+	e.lucid = p + sizeof(h);
+	e.lucidSize = h.lucidSize;
+	e.data = e.lucid + h.lucidSize;
+	e.dataSize = h.dataSize;
+	return sizeof(h) + body;
+}
+
+
+/// A read-only mapping of a whole file.
+class Mapping {
+public:
+	Mapping(): base_(nullptr), size_(0) {}
+	~Mapping() { if (base_ != nullptr) munmap(base_, size_); }
+	Mapping(const Mapping&) = delete;
+	Mapping& operator = (const Mapping&) = delete;
+
+	bool Map(const std::string& path) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		void* base = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
+			base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (base == MAP_FAILED) return false;
+		base_ = base;
+		size_ = st.st_size;
+		return true;
+	}
+	const char* Data() const { return static_cast<const char*>(base_); }
+	size_t Size() const { return size_; }
+	/// Give up the mapping to a new owner.
+	void* Release() { void* base = base_; base_ = nullptr; return base; }
+
+private:
+	void* base_;
+	size_t size_;
+};
+
+
+bool WriteAll(int fd, const char* p, size_t n) {
+	while (n > 0) {
+		ssize_t w = write(fd, p, n);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		p += w;
+		n -= w;
+	}
+	return true;
+}
+
+
+void SyncDir(const std::string& dir) {
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+}       // namespace
+
+
+LearnSnapshot::LearnSnapshot(void* base, size_t size): base_(base), size_(size) {
+}
+
+
+LearnSnapshot::~LearnSnapshot() {
+	munmap(base_, size_);
+}
+
+
+LearnSnapshot* LearnSnapshot::Open(const std::string& path) {
+	Mapping m;
+	if (!m.Map(path)) return nullptr;
+	SnapshotHeader h;
+	if (m.Size() < sizeof(h)) return nullptr;
+	memcpy(&h, m.Data(), sizeof(h));
+	if (h.magic != kSnapshotMagic || h.version != kVersion ||
+			Crc32c(&h, offsetof(SnapshotHeader, crc)) != h.crc ||
+			h.indexOffset > m.Size() || h.users > (m.Size() - h.indexOffset) / sizeof(IndexEntry) ||
+			Crc32c(m.Data() + h.indexOffset, h.users * sizeof(IndexEntry)) != h.indexCrc) {
+		LOG(ERROR) << "LearnSnapshot: " << path << " is corrupt";
+		return nullptr;
+	}
+	size_t size = m.Size();
+	return new LearnSnapshot(m.Release(), size);
+}
+
+
+uint64_t LearnSnapshot::GetRecords() const {
+	return static_cast<const SnapshotHeader*>(base_)->records;
+}
+
+
+uint64_t LearnSnapshot::GetUsers() const {
+	return static_cast<const SnapshotHeader*>(base_)->users;
+}
+
+
+uint64_t LearnSnapshot::GetNextSequence() const {
+	return static_cast<const SnapshotHeader*>(base_)->nextSeq;
+}
+
+
+bool LearnSnapshot::ForEach(const std::function<void(const LearnEntry&)>& fn) const {
+	const char* base = static_cast<const char*>(base_);
+	const SnapshotHeader* h = static_cast<const SnapshotHeader*>(base_);
+	size_t offset = sizeof(SnapshotHeader);
+	for (uint64_t i = 0; i < h->records; ++i) {
+		LearnEntry e;
+		size_t len = ParseRecord(base + offset, h->indexOffset - offset, e);
+		if (len == 0) {
+			LOG(ERROR) << "LearnSnapshot: corrupt record at offset " << offset;
+			return false;
+		}
+		fn(e);
+		offset += len;
+	}
+	return true;
+}
+
+
+size_t LearnSnapshot::Find(const std::string& lucid, const std::function<void(const LearnEntry&)>& fn) const {
+	const char* base = static_cast<const char*>(base_);
+	const SnapshotHeader* h = static_cast<const SnapshotHeader*>(base_);
+	const char* index = base + h->indexOffset;
+	// The first record of each user holds its LUCID.
+	auto lucidAt = [&](uint64_t i, IndexEntry& entry) {
+		memcpy(&entry, index + i * sizeof(IndexEntry), sizeof(entry));
+		LearnRecordHeader rh;
+		memcpy(&rh, base + entry.offset, sizeof(rh));
+		return std::string(base + entry.offset + sizeof(rh), rh.lucidSize);
+	};
+	uint64_t lo = 0, hi = h->users;
+	IndexEntry entry;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (lucidAt(mid, entry) < lucid) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == h->users || lucidAt(lo, entry) != lucid) return 0;
+	size_t offset = entry.offset;
+	for (uint64_t i = 0; i < entry.count; ++i) {
+		LearnEntry e;
+		size_t len = ParseRecord(base + offset, h->indexOffset - offset, e);
+		if (len == 0) {
+			LOG(ERROR) << "LearnSnapshot: corrupt record at offset " << offset;
+			return i;
+		}
+		fn(e);
+		offset += len;
+	}
+	return entry.count;
+}
+
+
+LearnLog::LearnLog(const std::string& dir, const LearnLogOptions& options):
+	dir_(dir), options_(options), fd_(-1), activeSeq_(0), activeBytes_(0), firstSeq_(1),
+	tailRecords_(0), tailBytes_(0), compactions_(0), stopping_(false) {
+}
+
+
+LearnLog::~LearnLog() {
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		stopping_ = true;
+	}
+	compactCv_.notify_all();
+	if (compactor_.joinable()) compactor_.join();
+	if (fd_ >= 0) {
+		fdatasync(fd_);
+		close(fd_);
+	}
+}
+
+
+std::string LearnLog::SegmentPath(uint64_t seq) const {
+	char name[40];
+	snprintf(name, sizeof(name), "/segment.%016llx.log", (unsigned long long)seq);
+	return dir_ + name;
+}
+
+
+std::string LearnLog::SnapshotPath(uint64_t seq) const {
+	char name[40];
+	snprintf(name, sizeof(name), "/snapshot.%016llx", (unsigned long long)seq);
+	return dir_ + name;
+}
+
+
+bool LearnLog::OpenSegment(uint64_t seq) {
+	if (fd_ >= 0) close(fd_);
+	std::string path = SegmentPath(seq);
+	fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd_ < 0) {
+		LOG(ERROR) << "LearnLog: cannot create " << path;
+		return false;
+	}
+	SegmentHeader h = { kSegmentMagic, kVersion, seq };
+	if (!WriteAll(fd_, reinterpret_cast<const char*>(&h), sizeof(h))) {
+		LOG(ERROR) << "LearnLog: cannot write " << path;
+		close(fd_);
+		fd_ = -1;
+		return false;
+	}
+	if (options_.syncEachAppend) SyncDir(dir_);
+	activeSeq_ = seq;
+	activeBytes_ = sizeof(h);
+	return true;
+}
+
+
+bool LearnLog::ReplaySegment(uint64_t seq, bool last, const std::function<void(const LearnEntry&)>& fn) {
+	std::string path = SegmentPath(seq);
+	Mapping m;
+	SegmentHeader h;
+	if (!m.Map(path) || m.Size() < sizeof(h)) {
+		// Created but never written
+		unlink(path.c_str());
+		return true;
+	}
+	memcpy(&h, m.Data(), sizeof(h));
+	if (h.magic != kSegmentMagic || h.version != kVersion || h.seq != seq) {
+		LOG(ERROR) << "LearnLog: " << path << " is not a learn log segment";
+		return false;
+	}
+	size_t offset = sizeof(h);
+	while (offset < m.Size()) {
+		LearnEntry e;
+		size_t len = ParseRecord(m.Data() + offset, m.Size() - offset, e);
+		if (len == 0) break;
+		fn(e);
+		++tailRecords_;
+		tailBytes_ += len;
+		offset += len;
+	}
+	if (offset < m.Size()) {
+		if (!last) {
+			LOG(ERROR) << "LearnLog: " << path << " is corrupt at offset " << offset << ", skipped the rest";
+		} else {
+			// A write cut short by a crash
+			LOG(WARNING) << "LearnLog: truncating torn record at " << path << " offset " << offset;
+			if (truncate(path.c_str(), offset) != 0)
+				LOG(ERROR) << "LearnLog: cannot truncate " << path;
+		}
+	}
+	return true;
+}
+
+
+bool LearnLog::Open(const std::function<void(const LearnEntry&)>& fn, bool replaySnapshot) {
+	if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+		LOG(ERROR) << "LearnLog: cannot create " << dir_;
+		return false;
+	}
+	DIR* d = opendir(dir_.c_str());
+	if (d == nullptr) {
+		LOG(ERROR) << "LearnLog: cannot read " << dir_;
+		return false;
+	}
+	std::vector<uint64_t> segments;
+	std::vector<uint64_t> snapshots;
+	while (struct dirent* ent = readdir(d)) {
+		unsigned long long seq;
+		char tail;
+		if (sscanf(ent->d_name, "segment.%llx.lo%c", &seq, &tail) == 2 && tail == 'g')
+			segments.push_back(seq);
+		else if (sscanf(ent->d_name, "snapshot.%llx%c", &seq, &tail) == 1)
+			snapshots.push_back(seq);
+	}
+	closedir(d);
+	std::sort(segments.begin(), segments.end());
+	std::sort(snapshots.rbegin(), snapshots.rend());
+
+	std::lock_guard<std::mutex> guard(mu_);
+	// The newest snapshot that maps wins.
+	for (uint64_t seq: snapshots) {
+		if (!snapshot_) {
+			snapshot_.reset(LearnSnapshot::Open(SnapshotPath(seq)));
+			if (snapshot_) {
+				firstSeq_ = snapshot_->GetNextSequence();
+				continue;
+			}
+		}
+		unlink(SnapshotPath(seq).c_str());
+	}
+	if (!snapshot_ && !segments.empty()) firstSeq_ = segments.front();
+	if (snapshot_ && replaySnapshot && !snapshot_->ForEach(fn))
+		LOG(ERROR) << "LearnLog: snapshot replay stopped early";
+	uint64_t next = firstSeq_;
+	for (size_t i = 0; i < segments.size(); ++i) {
+		if (segments[i] < firstSeq_) {
+			// Compacted, the crash came before it was removed.
+			unlink(SegmentPath(segments[i]).c_str());
+			continue;
+		}
+		if (!ReplaySegment(segments[i], i + 1 == segments.size(), fn)) return false;
+		next = segments[i] + 1;
+	}
+	LOG(INFO) << "LearnLog: recovered " << (snapshot_? snapshot_->GetRecords(): 0) << " snapshot and "
+		<< tailRecords_ << " tail record(s) from " << dir_;
+	if (!OpenSegment(next)) return false;
+	if (options_.compactBytes != 0)
+		compactor_ = std::thread(&LearnLog::CompactLoop, this);
+	return true;
+}
+
+
+bool LearnLog::Append(const std::string& lucid, const void* data, size_t size) {
+	if (lucid.size() >= kMaxField || size >= kMaxField) {
+		LOG(ERROR) << "LearnLog: record too large";
+		return false;
+	}
+	static thread_local std::string buf;
+	LearnRecordHeader h = { 0, uint32_t(lucid.size()), uint32_t(size), 0 };
+	buf.resize(sizeof(h) + lucid.size() + size);
+	char* p = &buf[0];
+	memcpy(p + sizeof(h), lucid.data(), lucid.size());
+	memcpy(p + sizeof(h) + lucid.size(), data, size);
+	memcpy(p, &h, sizeof(h));
+	h.crc = Crc32c(p + sizeof(h.crc), buf.size() - sizeof(h.crc));
+	memcpy(p, &h.crc, sizeof(h.crc));
+
+	bool compact = false;
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		if (fd_ < 0) return false;
+		if (activeBytes_ + buf.size() > options_.segmentBytes && activeBytes_ > sizeof(SegmentHeader)) {
+			if (!OpenSegment(activeSeq_ + 1)) return false;
+		}
+		if (!WriteAll(fd_, p, buf.size())) {
+			LOG(ERROR) << "LearnLog: write failed: " << strerror(errno);
+			// Don't leave half a record in front of the next one.
+			if (ftruncate(fd_, activeBytes_) != 0)
+				LOG(ERROR) << "LearnLog: cannot truncate segment " << activeSeq_;
+			return false;
+		}
+		if (options_.syncEachAppend && fdatasync(fd_) != 0) {
+			LOG(ERROR) << "LearnLog: sync failed: " << strerror(errno);
+			return false;
+		}
+		activeBytes_ += buf.size();
+		++tailRecords_;
+		tailBytes_ += buf.size();
+		compact = options_.compactBytes != 0 && tailBytes_ >= options_.compactBytes;
+	}
+	if (compact) compactCv_.notify_one();
+	return true;
+}
+
+
+bool LearnLog::Append(const Request& request) {
+	std::string data;
+	if (!request.SerializeToString(&data)) return false;
+	return Append(request.lucid(), data.data(), data.size());
+}
+
+
+bool LearnLog::Sync() {
+	std::lock_guard<std::mutex> guard(mu_);
+	return fd_ >= 0 && fdatasync(fd_) == 0;
+}
+
+
+bool LearnLog::Compact() {
+	std::lock_guard<std::mutex> compacting(compactMu_);
+	uint64_t from, to;
+	std::shared_ptr<const LearnSnapshot> old;
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		if (fd_ < 0) return false;
+		// Fold everything written so far; appends go to a new segment.
+		if (activeBytes_ > sizeof(SegmentHeader)) {
+			fdatasync(fd_);
+			if (!OpenSegment(activeSeq_ + 1)) return false;
+		}
+		from = firstSeq_;
+		to = activeSeq_;
+		old = snapshot_;
+	}
+	if (from == to) return true;
+
+	struct Ref {
+		const char* record;
+		size_t size;
+		const char* lucid;
+		uint32_t lucidSize;
+	};
+	std::vector<Ref> refs;
+	auto collect = [&refs](const LearnEntry& e) {
+		const char* record = e.lucid - sizeof(LearnRecordHeader);
+		Ref r = { record, sizeof(LearnRecordHeader) + e.lucidSize + e.dataSize, e.lucid, e.lucidSize };
+		refs.push_back(r);
+	};
+	if (old && !old->ForEach(collect)) return false;
+	std::vector<std::unique_ptr<Mapping>> segments;
+	uint64_t folded = 0, foldedBytes = 0;
+	for (uint64_t seq = from; seq < to; ++seq) {
+		std::unique_ptr<Mapping> m(new Mapping());
+		if (!m->Map(SegmentPath(seq))) continue;
+		size_t offset = sizeof(SegmentHeader);
+		while (offset < m->Size()) {
+			LearnEntry e;
+			size_t len = ParseRecord(m->Data() + offset, m->Size() - offset, e);
+			if (len == 0) break;
+			collect(e);
+			++folded;
+			foldedBytes += len;
+			offset += len;
+		}
+		segments.push_back(std::move(m));
+	}
+	// Group by user, keeping each user's records in learn order.
+	std::stable_sort(refs.begin(), refs.end(), [](const Ref& a, const Ref& b) {
+		int c = memcmp(a.lucid, b.lucid, std::min(a.lucidSize, b.lucidSize));
+		return c < 0 || (c == 0 && a.lucidSize < b.lucidSize);
+	});
+
+	std::string tmp = dir_ + "/snapshot.tmp";
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if (f == nullptr) {
+		LOG(ERROR) << "LearnLog: cannot create " << tmp;
+		return false;
+	}
+	std::vector<char> buffer(1 << 20);
+	setvbuf(f, buffer.data(), _IOFBF, buffer.size());
+	SnapshotHeader h;
+	memset(&h, 0, sizeof(h));
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+	std::vector<IndexEntry> index;
+	uint64_t offset = sizeof(h);
+	for (size_t i = 0; ok && i < refs.size(); ++i) {
+		const Ref& r = refs[i];
+		if (i == 0 || r.lucidSize != refs[i - 1].lucidSize || memcmp(r.lucid, refs[i - 1].lucid, r.lucidSize) != 0) {
+			IndexEntry entry = { offset, 0 };
+			index.push_back(entry);
+		}
+		++index.back().count;
+		ok = fwrite(r.record, r.size, 1, f) == 1;
+		offset += r.size;
+	}
+	// Align the index.
+	static const char zeros[8] = { 0 };
+	size_t pad = (8 - offset % 8) % 8;
+	if (ok && pad != 0) ok = fwrite(zeros, pad, 1, f) == 1;
+	h.magic = kSnapshotMagic;
+	h.version = kVersion;
+	h.records = refs.size();
+	h.users = index.size();
+	h.indexOffset = offset + pad;
+	h.nextSeq = to;
+	h.indexCrc = Crc32c(index.data(), index.size() * sizeof(IndexEntry));
+	h.crc = Crc32c(&h, offsetof(SnapshotHeader, crc));
+	if (ok && !index.empty()) ok = fwrite(index.data(), sizeof(IndexEntry), index.size(), f) == index.size();
+	if (ok) ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+	if (ok) ok = fflush(f) == 0 && fdatasync(fileno(f)) == 0;
+	ok = (fclose(f) == 0) && ok;
+	std::string path = SnapshotPath(to);
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+		LOG(ERROR) << "LearnLog: cannot write " << path;
+		unlink(tmp.c_str());
+		return false;
+	}
+	SyncDir(dir_);
+	std::shared_ptr<const LearnSnapshot> snapshot(LearnSnapshot::Open(path));
+	if (!snapshot) return false;
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		snapshot_ = snapshot;
+		firstSeq_ = to;
+		tailRecords_ -= folded;
+		tailBytes_ -= foldedBytes;
+		++compactions_;
+	}
+	segments.clear();
+	for (uint64_t seq = from; seq < to; ++seq)
+		unlink(SegmentPath(seq).c_str());
+	if (old) unlink(SnapshotPath(from).c_str());
+	LOG(INFO) << "LearnLog: compacted " << refs.size() << " record(s) of " << index.size() << " user(s) into " << path;
+	return true;
+}
+
+
+void LearnLog::CompactLoop() {
+	std::unique_lock<std::mutex> lock(mu_);
+	while (!stopping_) {
+		compactCv_.wait(lock, [this]() { return stopping_ || tailBytes_ >= options_.compactBytes; });
+		if (stopping_) break;
+		lock.unlock();
+		bool ok = Compact();
+		lock.lock();
+		// Don't spin on a persistent error.
+		if (!ok) compactCv_.wait_for(lock, std::chrono::seconds(10), [this]() { return stopping_; });
+	}
+}
+
+
+std::shared_ptr<const LearnSnapshot> LearnLog::GetSnapshot() const {
+	std::lock_guard<std::mutex> guard(mu_);
+	return snapshot_;
+}
+
+
+LearnLogStats LearnLog::GetStats() const {
+	std::lock_guard<std::mutex> guard(mu_);
+	LearnLogStats stats;
+	if (snapshot_) {
+		stats.snapshotRecords = snapshot_->GetRecords();
+		stats.snapshotUsers = snapshot_->GetUsers();
+	}
+	stats.tailRecords = tailRecords_;
+	stats.tailBytes = tailBytes_;
+	stats.segments = unsigned(activeSeq_ - firstSeq_ + 1);
+	stats.compactions = compactions_;
+	return stats;
+}
+
+}       // namespace lucida
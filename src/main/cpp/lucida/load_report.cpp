@@ -0,0 +1,125 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <sched.h>
+#include <thread>
+#include <time.h>
+#include <lucida/load_report.h>
+
+namespace lucida {
+
+static int64_t NowNs(clockid_t clock) {
+	timespec ts;
+	clock_gettime(clock, &ts);
+	return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+
+// The CPUs the process may run on.
+static unsigned CpuCount() {
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+		return unsigned(CPU_COUNT(&set));
+	return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+
+std::string LoadReport::Encode() const {
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%u,%u,%u,%u,%u", inFlight, queued,
+		unsigned(std::min(std::max(utilization, 0.0f), 1.0f) * 1000 + 0.5f), latencyUs, qps);
+	return buf;
+}
+
+
+bool LoadReport::Parse(const std::string& s, LoadReport& report) {
+	unsigned long fields[5];
+	const char* p = s.c_str();
+	for (unsigned i = 0; i < 5; ++i) {
+		char* end = nullptr;
+		if (*p < '0' || *p > '9') return false;
+		fields[i] = strtoul(p, &end, 10);
+		if (fields[i] > UINT32_MAX || *end != (i < 4? ',': '\0')) return false;
+		p = end + (i < 4);
+	}
+	report.inFlight = uint32_t(fields[0]);
+	report.queued = uint32_t(fields[1]);
+	report.utilization = std::min(fields[2], 1000ul) / 1000.0f;
+	report.latencyUs = uint32_t(fields[3]);
+	report.qps = uint32_t(fields[4]);
+	return true;
+}
+
+
+LoadReporter::LoadReporter(unsigned intervalMs):
+	intervalNs_(int64_t(std::max(intervalMs, 1u)) * 1000000), cpus_(CpuCount()),
+	inFlight_(0), queued_(0), latencyUs_(0), finished_(0),
+	sampledAt_(NowNs(CLOCK_MONOTONIC)), utilizationPermille_(0), qps_(0),
+	lastCpuNs_(NowNs(CLOCK_PROCESS_CPUTIME_ID)), lastFinished_(0) {
+}
+
+
+void LoadReporter::Sample(int64_t now) {
+	int64_t wallNs = now - sampledAt_.load(std::memory_order_relaxed);
+	if (wallNs < intervalNs_) return;
+	int64_t cpuNs = NowNs(CLOCK_PROCESS_CPUTIME_ID);
+	uint64_t finished = finished_.load(std::memory_order_relaxed);
+	double utilization = double(cpuNs - lastCpuNs_) / (double(wallNs) * cpus_);
+	utilizationPermille_.store(uint32_t(std::min(std::max(utilization, 0.0), 1.0) * 1000 + 0.5),
+		std::memory_order_relaxed);
+	qps_.store(uint32_t(double(finished - lastFinished_) * 1e9 / wallNs + 0.5), std::memory_order_relaxed);
+	lastCpuNs_ = cpuNs;
+	lastFinished_ = finished;
+	sampledAt_.store(now, std::memory_order_relaxed);
+}
+
+
+LoadReport LoadReporter::Get() {
+	int64_t now = NowNs(CLOCK_MONOTONIC);
+	if (now - sampledAt_.load(std::memory_order_relaxed) >= intervalNs_) {
+		// One thread samples, the others report the previous sample.
+		std::unique_lock<std::mutex> lock(sampleMu_, std::try_to_lock);
+		if (lock.owns_lock()) Sample(now);
+	}
+	LoadReport report;
+	report.inFlight = uint32_t(std::max<int64_t>(inFlight_.load(std::memory_order_relaxed), 0));
+	report.queued = uint32_t(std::max<int64_t>(queued_.load(std::memory_order_relaxed), 0));
+	report.utilization = utilizationPermille_.load(std::memory_order_relaxed) / 1000.0f;
+	report.latencyUs = latencyUs_.load(std::memory_order_relaxed);
+	report.qps = qps_.load(std::memory_order_relaxed);
+	return report;
+}
+
+}       // namespace lucida
@@ -0,0 +1,303 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <glog/logging.h>
+#include <lucida/log_sink.h>
+#include <lucida/ring_buffer.h>
+
+namespace lucida {
+
+namespace {
+
+std::atomic<uint64_t> nextSinkId(1);
+
+void CopyTruncated(char* dst, size_t capacity, const char* src, size_t size) {
+	size = std::min(size, capacity - 1);
+	memcpy(dst, src, size);
+	dst[size] = '\0';
+}
+
+
+int64_t SteadyNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+int64_t SystemNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+// Per thread xorshift for sampling successful calls.
+uint32_t NextRandom() {
+	static thread_local uint32_t state = 0;
+	if (state == 0)
+		state = uint32_t(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1u;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+
+void WriteToGlog(const CallLogRecord& r) {
+	if (r.code == CallLogRecord::tagCode) {
+		LOG(INFO) << r.method << " tag<" << r.message << ">";
+		return;
+	}
+	std::ostringstream os;
+	os << r.method << ": status-code=" << r.code << " and message='" << r.message << "'";
+	if (r.tenant[0] != '\0') os << " lucid=" << r.tenant;
+	if (r.latencyUs != 0) os << " latency=" << r.latencyUs << "us";
+	if (r.code == 0)
+		LOG(INFO) << os.str();
+	else
+		LOG(ERROR) << os.str();
+}
+
+} // namespace
+
+
+struct LogSink::ThreadBuffer {
+	explicit ThreadBuffer(size_t bytes): ring(bytes), done(false) {}
+	RingBuffer ring;
+	/// The thread has exited, free the buffer once it is drained.
+	std::atomic<bool> done;
+};
+
+
+LogSink::LogSink(const LogPolicy& policy, Writer writer):
+	id_(nextSinkId.fetch_add(1)), writer_(writer? writer: Writer(WriteToGlog)),
+	logged_(0), suppressed_(0), dropped_(0), written_(0),
+	requested_(0), drained_(0), stop_(false) {
+	for (int c = 0; c < codeCount; ++c) {
+		tat_[c].store(0);
+		suppressedByCode_[c].store(0);
+	}
+	SetPolicy(policy);
+	flusher_ = std::thread(&LogSink::Run, this);
+}
+
+
+LogSink::~LogSink() {
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		stop_ = true;
+	}
+	cv_.notify_all();
+	flusher_.join();
+}
+
+
+LogSink& LogSink::Get() {
+	static LogSink* sink = new LogSink();
+	return *sink;
+}
+
+
+void LogSink::SetPolicy(const LogPolicy& policy) {
+	int64_t interval = (policy.errorsPerSecond == 0)? 0: int64_t(1000000000) / policy.errorsPerSecond;
+	intervalNs_.store(interval);
+	toleranceNs_.store(interval * (std::max(policy.burst, 1u) - 1));
+	double rate = std::min(std::max(policy.okSampleRate, 0.0), 1.0);
+	okThreshold_.store(uint64_t(rate * 4294967296.0));
+	flushIntervalMs_.store(std::max(policy.flushIntervalMs, 1u));
+	threadBufferBytes_.store(std::max(policy.threadBufferBytes, sizeof(CallLogRecord)));
+}
+
+
+// Generic cell rate algorithm: a record is admitted unless it comes more
+// than the tolerance ahead of the code's schedule.
+bool LogSink::Admit(int code) {
+	const int64_t interval = intervalNs_.load(std::memory_order_relaxed);
+	if (interval == 0) return true;
+	const int64_t tolerance = toleranceNs_.load(std::memory_order_relaxed);
+	const int64_t now = SteadyNs();
+	std::atomic<int64_t>& tat = tat_[code];
+	int64_t t = tat.load(std::memory_order_relaxed);
+	for (;;) {
+		if (now < t - tolerance) return false;
+		if (tat.compare_exchange_weak(t, std::max(t, now) + interval, std::memory_order_relaxed))
+			return true;
+	}
+}
+
+
+void LogSink::LogCallSlow(const char* method, const ::grpc::Status& status, const std::string* tenant, uint32_t latencyUs) {
+	int code = int(status.error_code());
+	if (code < 0 || code >= codeCount) code = int(::grpc::StatusCode::UNKNOWN);
+	if (status.ok()) {
+		if (NextRandom() >= okThreshold_.load(std::memory_order_relaxed)) return;
+	} else if (!Admit(code)) {
+		suppressedByCode_[code].fetch_add(1, std::memory_order_relaxed);
+		suppressed_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	CallLogRecord r;
+	r.timeNs = SystemNs();
+	r.method = method;
+	r.latencyUs = latencyUs;
+	r.code = code;
+	if (tenant != nullptr)
+		CopyTruncated(r.tenant, sizeof(r.tenant), tenant->data(), tenant->size());
+	else
+		r.tenant[0] = '\0';
+	const std::string& message = status.error_message();
+	CopyTruncated(r.message, sizeof(r.message), message.data(), message.size());
+	Push(r);
+}
+
+
+void LogSink::LogTag(const char* what, const void* tag) {
+	CallLogRecord r;
+	r.timeNs = SystemNs();
+	r.method = what;
+	r.latencyUs = 0;
+	r.code = CallLogRecord::tagCode;
+	r.tenant[0] = '\0';
+	snprintf(r.message, sizeof(r.message), "%p", tag);
+	Push(r);
+}
+
+
+void LogSink::Push(const CallLogRecord& record) {
+	RingBuffer& ring = GetThreadBuffer()->ring;
+	// Only this thread writes, so the space cannot shrink before the write.
+	if (ring.Space() < sizeof(record)) {
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	ring.Write(&record, sizeof(record));
+	logged_.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+LogSink::ThreadBuffer* LogSink::GetThreadBuffer() {
+	// A thread's buffers, one per sink it has logged to.
+	struct Owned {
+		~Owned() {
+			for (auto& b: buffers)
+				b.second->done.store(true, std::memory_order_release);
+		}
+		std::vector<std::pair<uint64_t, std::shared_ptr<ThreadBuffer>>> buffers;
+	};
+	static thread_local Owned owned;
+	for (auto& b: owned.buffers)
+		if (b.first == id_) return b.second.get();
+	auto buffer = std::make_shared<ThreadBuffer>(threadBufferBytes_.load());
+	owned.buffers.emplace_back(id_, buffer);
+	std::lock_guard<std::mutex> guard(mu_);
+	buffers_.push_back(buffer);
+	return buffer.get();
+}
+
+
+void LogSink::Flush() {
+	std::unique_lock<std::mutex> lock(mu_);
+	uint64_t ticket = ++requested_;
+	cv_.notify_all();
+	cv_.wait(lock, [this, ticket]() { return drained_ >= ticket; });
+}
+
+
+void LogSink::Run() {
+	std::unique_lock<std::mutex> lock(mu_);
+	for (;;) {
+		cv_.wait_for(lock, std::chrono::milliseconds(flushIntervalMs_.load()),
+			[this]() { return stop_ || requested_ > drained_; });
+		uint64_t ticket = requested_;
+		bool stop = stop_;
+		lock.unlock();
+		Drain();
+		lock.lock();
+		drained_ = ticket;
+		cv_.notify_all();
+		if (stop) return;
+	}
+}
+
+
+void LogSink::Drain() {
+	std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		buffers = buffers_;
+	}
+	CallLogRecord r;
+	bool exited = false;
+	for (auto& buffer: buffers) {
+		// Check before reading so nothing written before the exit is missed.
+		bool done = buffer->done.load(std::memory_order_acquire);
+		while (buffer->ring.Size() >= sizeof(r)) {
+			buffer->ring.Read(&r, sizeof(r));
+			writer_(r);
+			written_.fetch_add(1, std::memory_order_relaxed);
+		}
+		exited = exited || done;
+	}
+	if (exited) {
+		std::lock_guard<std::mutex> guard(mu_);
+		buffers_.erase(std::remove_if(buffers_.begin(), buffers_.end(), [](const std::shared_ptr<ThreadBuffer>& b) {
+			return b->done.load(std::memory_order_acquire) && b->ring.Size() == 0;
+		}), buffers_.end());
+	}
+	for (int c = 0; c < codeCount; ++c) {
+		uint64_t n = suppressedByCode_[c].exchange(0, std::memory_order_relaxed);
+		if (n == 0) continue;
+		r.timeNs = SystemNs();
+		r.method = "LogSink";
+		r.latencyUs = 0;
+		r.code = c;
+		r.tenant[0] = '\0';
+		snprintf(r.message, sizeof(r.message), "suppressed %llu records", (unsigned long long)n);
+		writer_(r);
+	}
+}
+
+
+LogSinkStats LogSink::GetStats() const {
+	LogSinkStats stats;
+	stats.logged = logged_.load(std::memory_order_relaxed);
+	stats.suppressed = suppressed_.load(std::memory_order_relaxed);
+	stats.dropped = dropped_.load(std::memory_order_relaxed);
+	stats.written = written_.load(std::memory_order_relaxed);
+	return stats;
+}
+
+}       // namespace lucida
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <lucida/passage_search.h>
+#include <lucida/service_names.h>
+
+using ::google::protobuf::Empty;
+
+namespace lucida {
+
+void PassageSearchHandler::OnCreate(TypedCall<Request, Empty>* call) {
+	store_.Create(call->request_.lucid(), [this](TextIndex& index) { index.SetParams(params_); });
+}
+
+
+void PassageSearchHandler::OnLearn(TypedCall<Request, Empty>* call) {
+	::grpc::Status status = Learn(call->request_, call->GetSpecView());
+	if (!status.ok()) call->FinishWithError(status);
+}
+
+
+::grpc::Status PassageSearchHandler::Learn(const Request& request) {
+	return Learn(request, QuerySpecView(request.spec()));
+}
+
+
+::grpc::Status PassageSearchHandler::Learn(const Request& request, const QuerySpecView& spec) {
+	bool any = false;
+	for (int i = 0; i < spec.size(); ++i)
+		any = any || (spec.type(i) == ServiceNames::TEXT_TYPE && spec.input(i).data_size() != 0);
+	if (!any)
+		return ::grpc::Status(::grpc::StatusCode::INVALID_ARGUMENT, "no text to learn");
+	store_.Write(request.lucid(), [&](TextIndex& index) {
+		if (index.Size() == 0) index.SetParams(params_);
+		for (int i = 0; i < spec.size(); ++i) {
+			if (spec.type(i) != ServiceNames::TEXT_TYPE) continue;
+			for (const std::string& passage: spec.input(i).data())
+				index.Add(passage);
+		}
+	}, true);
+	return ::grpc::Status::OK;
+}
+
+
+void PassageSearchHandler::OnInfer(TypedCall<Request, Response>* call) {
+	const QuerySpecView& spec = call->GetSpecView();
+	std::string query;
+	for (int i = 0; i < spec.size(); ++i) {
+		if (spec.type(i) != ServiceNames::TEXT_TYPE) continue;
+		for (const std::string& text: spec.input(i).data()) {
+			if (!query.empty()) query += ' ';
+			query += text;
+		}
+	}
+	if (query.empty()) {
+		call->FinishWithError(::grpc::Status(::grpc::StatusCode::INVALID_ARGUMENT, "no question"));
+		return;
+	}
+	std::vector<ScoredPassage> results;
+	std::string& msg = *call->response_.mutable_msg();
+	bool found = store_.Read(call->request_.lucid(), [&](const TextIndex& index) {
+		index.Search(query, topK_, results);
+		for (const ScoredPassage& r: results) {
+			if (!msg.empty()) msg += '\n';
+			msg += index.GetPassage(r.id);
+		}
+	});
+	if (!found)
+		call->FinishWithError(::grpc::Status(::grpc::StatusCode::NOT_FOUND, "unknown LUCID"));
+}
+
+} // namespace lucida
@@ -0,0 +1,118 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <glog/logging.h>
+#include <lucida/polling.h>
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+
+namespace lucida {
+
+bool ParseCpuList(const std::string& list, std::vector<int>& cpus) {
+	std::vector<int> parsed;
+	const char* p = list.c_str();
+	while (*p != '\0') {
+		char* end = nullptr;
+		long first = strtol(p, &end, 10);
+		if (end == p || first < 0) return false;
+		long last = first;
+		p = end;
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1 || last < first) return false;
+			p = end;
+		}
+		if (last >= CPU_SETSIZE) return false;
+		for (long cpu = first; cpu <= last; ++cpu)
+			parsed.push_back(int(cpu));
+		if (*p == ',') ++p;
+		else if (*p != '\0') return false;
+	}
+	cpus.swap(parsed);
+	return true;
+}
+
+
+bool PlaceThread(const PollingPolicy& policy, unsigned index) {
+	if (policy.cpus.empty()) return true;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	const size_t n = policy.cpus.size();
+	const size_t per = std::max(policy.cpusPerThread, 1u);
+	for (size_t i = 0; i < per; ++i)
+		CPU_SET(policy.cpus[(index * per + i) % n], &set);
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err != 0) {
+		LOG(ERROR) << "PlaceThread: cannot pin thread " << index << ": " << strerror(err);
+		return false;
+	}
+	// First touch then puts the thread's pages, including its malloc arena
+	// and the listeners it creates, on the node it now runs on.
+	if (policy.localMemory && syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) != 0)
+		LOG(ERROR) << "PlaceThread: cannot set local memory policy: " << strerror(errno);
+	return true;
+#else
+	LOG(ERROR) << "PlaceThread: CPU affinity is not supported on this platform";
+	return false;
+#endif
+}
+
+
+bool PollNext(::grpc::CompletionQueue* cq, void** tag, bool* ok, unsigned spinUs) {
+	if (spinUs != 0) {
+		auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(spinUs);
+		do {
+			switch (cq->AsyncNext(tag, ok, gpr_time_0(GPR_CLOCK_MONOTONIC))) {
+			case ::grpc::CompletionQueue::GOT_EVENT:
+				return true;
+			case ::grpc::CompletionQueue::SHUTDOWN:
+				return false;
+			case ::grpc::CompletionQueue::TIMEOUT:
+				break;
+			}
+		} while (std::chrono::steady_clock::now() < end);
+	}
+	return cq->Next(tag, ok);
+}
+
+}       // namespace lucida
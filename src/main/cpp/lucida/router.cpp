@@ -0,0 +1,382 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <lucida/router.h>
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <glog/logging.h>
+
+using ::grpc::ByteBuffer;
+using ::grpc::ClientContext;
+using ::grpc::ServerCompletionQueue;
+using ::grpc::Slice;
+using ::grpc::Status;
+
+namespace lucida {
+
+namespace {
+
+/// Reads a message spread over slices without joining them.
+class SliceReader {
+public:
+	explicit SliceReader(const std::vector<Slice>& slices): slices_(slices), slice_(0), pos_(0) {}
+
+	bool AtEnd() {
+		Skip();
+		return slice_ == slices_.size();
+	}
+
+	bool ReadVarint(uint64_t& value) {
+		value = 0;
+		for (unsigned shift = 0; shift < 64; shift += 7) {
+			if (AtEnd()) return false;
+			uint8_t b = slices_[slice_].begin()[pos_++];
+			value |= uint64_t(b & 0x7f) << shift;
+			if ((b & 0x80) == 0) return true;
+		}
+		return false;
+	}
+
+	/// Skip n bytes, appending them to out unless it is nullptr.
+	bool Read(uint64_t n, std::string* out) {
+		while (n != 0) {
+			if (AtEnd()) return false;
+			size_t take = size_t(std::min<uint64_t>(n, slices_[slice_].size() - pos_));
+			if (out != nullptr) out->append(reinterpret_cast<const char*>(slices_[slice_].begin()) + pos_, take);
+			pos_ += take;
+			n -= take;
+		}
+		return true;
+	}
+
+private:
+	const std::vector<Slice>& slices_;
+	size_t slice_;
+	size_t pos_;
+
+	void Skip() {
+		while (slice_ < slices_.size() && pos_ == slices_[slice_].size()) {
+			++slice_;
+			pos_ = 0;
+		}
+	}
+};
+
+/// Methods whose request is a Request.
+bool IsKeyed(const std::string& method) {
+	return method == "/lucida.LucidaService/create" || method == "/lucida.LucidaService/learn" ||
+		method == "/lucida.LucidaService/infer";
+}
+
+/// Metadata gRPC sets itself.
+bool IsReserved(const ::grpc::string_ref& key) {
+	return key.starts_with(":") || key.starts_with("grpc-") || key == "user-agent" ||
+		key == "content-type" || key == "te";
+}
+
+} // namespace
+
+
+bool PeekLucid(const ByteBuffer& request, std::string& lucid) {
+	lucid.clear();
+	std::vector<Slice> slices;
+	if (!request.Dump(&slices).ok()) return false;
+	SliceReader reader(slices);
+	// Fields may come in any order and the last LUCID wins.
+	while (!reader.AtEnd()) {
+		uint64_t key, length;
+		if (!reader.ReadVarint(key)) return false;
+		switch (key & 7) {
+		case 0:
+			if (!reader.ReadVarint(length)) return false;
+			break;
+		case 1:
+			if (!reader.Read(8, nullptr)) return false;
+			break;
+		case 2:
+			if (!reader.ReadVarint(length)) return false;
+			if ((key >> 3) == 1) {
+				lucid.clear();
+				if (!reader.Read(length, &lucid)) return false;
+			} else if (!reader.Read(length, nullptr)) {
+				return false;
+			}
+			break;
+		case 5:
+			if (!reader.Read(4, nullptr)) return false;
+			break;
+		default:
+			return false;
+		}
+		if ((key >> 3) == 1 && (key & 7) != 2) return false;
+	}
+	return true;
+}
+
+
+/// A call through the router. Its states complete on the queue of the
+/// thread that received it.
+class Router::Call {
+public:
+	Call(Router* router, ServerCompletionQueue* cq):
+		router_(router), cq_(cq), stream_(&ctx_), state_(REQUEST), counted_(false), backend_(nullptr) {
+		router_->service_.RequestCall(&ctx_, &stream_, cq_, cq_, this);
+	}
+
+	~Call() {
+		if (counted_) router_->Done();
+	}
+
+	void Proceed(bool ok) {
+		switch (state_) {
+		case REQUEST:
+			// The server is shutting down.
+			if (!ok) break;
+			new Call(router_, cq_);
+			++router_->inFlight_;
+			counted_ = true;
+			router_->calls_.fetch_add(1, std::memory_order_relaxed);
+			if (ctx_.method() == "/lucida.LucidaService/recognize") {
+				Reject(Status(::grpc::StatusCode::UNIMPLEMENTED, "the router forwards unary calls only"));
+				return;
+			}
+			state_ = READ;
+			stream_.Read(&request_, this);
+			return;
+		case READ:
+			if (!ok) {
+				Reject(Status(::grpc::StatusCode::CANCELLED, "no request"));
+				return;
+			}
+			Forward();
+			return;
+		case FORWARD:
+			--backend_->outstanding;
+			Reply();
+			return;
+		case FINISH:
+			break;
+		}
+		delete this;
+	}
+
+private:
+	enum State { REQUEST, READ, FORWARD, FINISH };
+
+	Router* router_;
+	ServerCompletionQueue* cq_;
+	::grpc::GenericServerContext ctx_;
+	::grpc::GenericServerAsyncReaderWriter stream_;
+	State state_;
+	bool counted_;
+	Backend* backend_;
+	ByteBuffer request_;
+	ByteBuffer response_;
+	Status status_;
+	std::unique_ptr<ClientContext> client_;
+	std::unique_ptr<::grpc::GenericClientAsyncResponseReader> rpc_;
+
+	void Reject(const Status& status) {
+		router_->rejected_.fetch_add(1, std::memory_order_relaxed);
+		state_ = FINISH;
+		stream_.Finish(status, this);
+	}
+
+	void Forward() {
+		const std::string& method = ctx_.method();
+		std::string lucid;
+		if (IsKeyed(method) && !PeekLucid(request_, lucid)) {
+			Reject(Status(::grpc::StatusCode::INVALID_ARGUMENT, "malformed request"));
+			return;
+		}
+		Backend& backend = router_->Pick(lucid);
+		backend.forwarded.fetch_add(1, std::memory_order_relaxed);
+		++backend.outstanding;
+		backend_ = &backend;
+		// A child of the server call so its deadline and cancellation propagate.
+		client_ = ClientContext::FromServerContext(ctx_);
+		for (auto& md: ctx_.client_metadata()) {
+			if (!IsReserved(md.first))
+				client_->AddMetadata(std::string(md.first.data(), md.first.size()),
+					std::string(md.second.data(), md.second.size()));
+		}
+		rpc_ = backend.stub->PrepareUnaryCall(client_.get(), method, request_, cq_);
+		rpc_->StartCall();
+		state_ = FORWARD;
+		rpc_->Finish(&response_, &status_, this);
+	}
+
+	void Reply() {
+		for (auto& md: client_->GetServerTrailingMetadata()) {
+			if (!IsReserved(md.first))
+				ctx_.AddTrailingMetadata(std::string(md.first.data(), md.first.size()),
+					std::string(md.second.data(), md.second.size()));
+		}
+		state_ = FINISH;
+		if (status_.ok()) {
+			stream_.WriteAndFinish(response_, ::grpc::WriteOptions(), status_, this);
+		} else {
+			router_->errors_.fetch_add(1, std::memory_order_relaxed);
+			stream_.Finish(status_, this);
+		}
+	}
+};
+
+
+Router::Router(const std::vector<std::string>& backends, double loadBound):
+	loadBound_(loadBound), stopping_(false), next_(0), inFlight_(0), spills_(0), calls_(0), rejected_(0), errors_(0) {
+	assert(!backends.empty());
+	for (auto& hostAndPort: backends) {
+		Backend* backend = new Backend;
+		backend->name = hostAndPort;
+		backend->hash = RendezvousHash(hostAndPort);
+		backend->forwarded = 0;
+		backend->outstanding = 0;
+		backends_.emplace_back(backend);
+		hashes_.push_back(backend->hash);
+	}
+}
+
+
+Router::~Router() {
+	Shutdown(0);
+}
+
+
+bool Router::Start(const std::string& hostAndPort, unsigned threads) {
+	::grpc::ServerBuilder builder;
+	int port = 0;
+	builder.AddListeningPort(hostAndPort, ::grpc::InsecureServerCredentials(), &port);
+	builder.RegisterAsyncGenericService(&service_);
+	threads = std::max(threads, 1u);
+	for (unsigned i = 0; i < threads; ++i)
+		cqs_.push_back(builder.AddCompletionQueue());
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		if (stopping_ || server_.get() != nullptr) return false;
+		for (auto& backend: backends_)
+			backend->stub.reset(new ::grpc::GenericStub(
+				::grpc::CreateChannel(backend->name, ::grpc::InsecureChannelCredentials())));
+		server_ = builder.BuildAndStart();
+		if (server_.get() == nullptr || port == 0) {
+			LOG(ERROR) << "Router: failed to listen on " << hostAndPort;
+			server_.reset();
+			cqs_.clear();
+			return false;
+		}
+		for (auto& cq: cqs_)
+			threads_.emplace_back(&Router::Serve, this, cq.get());
+	}
+	LOG(INFO) << "Router: listening on " << hostAndPort << " for " << backends_.size() << " backends";
+	server_->Wait();
+	// Calls cancelled at the deadline may still be finishing, and their
+	// queues must stay open until they are.
+	{
+		std::unique_lock<std::mutex> lock(mu_);
+		idle_.wait(lock, [this]() { return inFlight_.load() == 0; });
+	}
+	for (auto& cq: cqs_)
+		cq->Shutdown();
+	for (auto& t: threads_)
+		t.join();
+	threads_.clear();
+	LOG(INFO) << "Router: stopped listening on " << hostAndPort;
+	return true;
+}
+
+
+void Router::Shutdown(unsigned graceMs) {
+	std::lock_guard<std::mutex> guard(mu_);
+	if (stopping_) return;
+	stopping_ = true;
+	if (server_.get() != nullptr)
+		server_->Shutdown(std::chrono::system_clock::now() + std::chrono::milliseconds(graceMs));
+}
+
+
+void Router::Serve(ServerCompletionQueue* cq) {
+	new Call(this, cq);
+	void* tag;
+	bool ok;
+	while (cq->Next(&tag, &ok))
+		static_cast<Call*>(tag)->Proceed(ok);
+}
+
+
+Router::Backend& Router::Pick(const std::string& lucid) {
+	const size_t n = backends_.size();
+	if (lucid.empty() || n == 1)
+		return *backends_[lucid.empty()? next_.fetch_add(1, std::memory_order_relaxed) % n: 0];
+	std::vector<int64_t> loads(n);
+	for (size_t i = 0; i < n; ++i)
+		loads[i] = backends_[i]->outstanding.load(std::memory_order_relaxed);
+	std::vector<std::pair<size_t, size_t>> order;
+	BoundedLoadOrder(RendezvousHash(lucid), hashes_, loads, loadBound_, order);
+	if (order[0].second != 0) spills_.fetch_add(1, std::memory_order_relaxed);
+	return *backends_[order[0].first];
+}
+
+
+void Router::Done() {
+	if (--inFlight_ != 0) return;
+	std::lock_guard<std::mutex> guard(mu_);
+	idle_.notify_all();
+}
+
+
+unsigned Router::PickBackend(const std::string& lucid) const {
+	const uint64_t user = RendezvousHash(lucid);
+	unsigned best = 0;
+	uint64_t bestScore = 0;
+	for (size_t i = 0; i < backends_.size(); ++i) {
+		uint64_t score = RendezvousScore(user, backends_[i]->hash);
+		if (i == 0 || score > bestScore) {
+			best = unsigned(i);
+			bestScore = score;
+		}
+	}
+	return best;
+}
+
+
+RouterStats Router::GetStats() const {
+	RouterStats stats;
+	stats.calls = calls_.load(std::memory_order_relaxed);
+	stats.rejected = rejected_.load(std::memory_order_relaxed);
+	stats.errors = errors_.load(std::memory_order_relaxed);
+	stats.spills = spills_.load(std::memory_order_relaxed);
+	for (auto& backend: backends_)
+		stats.forwarded.push_back(backend->forwarded.load(std::memory_order_relaxed));
+	return stats;
+}
+
+} // namespace lucida
@@ -30,7 +30,20 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <lucida/service_acceptor.h>
+#include <lucida/hot_restart.h>
 #include <glog/logging.h>
+#include <grpc++/server_posix.h>
+#include <grpc++/health_check_service_interface.h>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 using grpc::Server;
 using grpc::ServerBuilder;
@@ -42,19 +55,61 @@ using grpc::Status;
 
 namespace lucida {
 
-AsyncServiceAcceptor::AsyncServiceAcceptor(AsyncServiceHandler* service, const std::string& name):
-	service_(service), state_(INIT), serviceName_(name),
+// Completion queue events handled at most between two dispatches of queued
+// calls. Several times the events a dispatched call produces, so new
+// arrivals still reach the fair scheduler first.
+static const unsigned kEventsPerDispatch = 16;
+
+AsyncServiceAcceptorBase::AsyncServiceAcceptorBase(const std::string& name):
+	state_(INIT), serviceName_(name), serving_(false), listenerDepth_(1),
+	ready_(false), listenFd_(-1), controlFd_(-1), wakeFd_(-1), shuttingDown_(false),
 	shutdownPromise_(), shutdownFuture_(shutdownPromise_.get_future())  {
 }
 
 
-AsyncServiceAcceptor::~AsyncServiceAcceptor() {
-	Shutdown();
-	BlockUntilShutdown();
+AsyncServiceAcceptorBase::~AsyncServiceAcceptorBase() {
+	// Derived classes shutdown before their service is destroyed.
+	assert(STARTED != state_ && SHUTDOWN != state_);
+}
+
+
+void AsyncServiceAcceptorBase::SetListenerDepth(unsigned depth) {
+	std::lock_guard<std::mutex> guard(mu_);
+	if (state_ == INIT) listenerDepth_ = std::max(depth, 1u);
 }
 
 
-bool AsyncServiceAcceptor::Start(const std::string& hostAndPort, unsigned threads) {
+void AsyncServiceAcceptorBase::SetFairScheduling(const FairSchedulerPolicy& policy) {
+	std::lock_guard<std::mutex> guard(mu_);
+	if (state_ == INIT) schedulerPolicy_ = policy;
+}
+
+
+void AsyncServiceAcceptorBase::SetPollingPolicy(const PollingPolicy& policy) {
+	std::lock_guard<std::mutex> guard(mu_);
+	if (state_ == INIT) pollingPolicy_ = policy;
+}
+
+
+void AsyncServiceAcceptorBase::SetDrainPolicy(const DrainPolicy& policy) {
+	std::lock_guard<std::mutex> guard(mu_);
+	if (state_ == INIT) drainPolicy_ = policy;
+}
+
+
+void AsyncServiceAcceptorBase::EnableLoadReports() {
+	std::lock_guard<std::mutex> guard(mu_);
+	if (state_ == INIT && !load_) load_.reset(new LoadReporter);
+}
+
+
+LoadReport AsyncServiceAcceptorBase::GetLoadReport() {
+	std::lock_guard<std::mutex> guard(mu_);
+	return load_? load_->Get(): LoadReport();
+}
+
+
+bool AsyncServiceAcceptorBase::Start(const std::string& hostAndPort, unsigned threads) {
 	{
 		std::lock_guard<std::mutex> guard(mu_);
 		if (state_ != INIT) return false;
@@ -62,79 +117,436 @@ bool AsyncServiceAcceptor::Start(const std::string& hostAndPort, unsigned thread
 	}
 	ServerBuilder builder;
 
-	builder.AddListeningPort(hostAndPort, grpc::InsecureServerCredentials())
-		.RegisterService(service_.get());
-	cq_ = builder.AddCompletionQueue();
-	server_ = builder.BuildAndStart();
-	if (server_.get() == nullptr) {
-		LOG(ERROR) << "AsyncServiceAcceptor: failed to start";
+	if (controlPath_.empty()) {
+		builder.AddListeningPort(hostAndPort, grpc::InsecureServerCredentials());
+	} else if (!TakeListener(hostAndPort)) {
 		std::lock_guard<std::mutex> guard(mu_);
 		state_ = ERROR;
 		return false;
 	}
-	LOG(INFO) << "AsyncServiceAcceptor: server started->listening on " << hostAndPort;
-	HandleRpcs();
+	if (!Serve(builder, threads)) return false;
+	LOG(INFO) << "AsyncServiceAcceptor: server stopped listening on " << hostAndPort;
 	return true;
 }
 
 
-bool AsyncServiceAcceptor::Start(grpc::ServerBuilder& builder, unsigned threads) {
+bool AsyncServiceAcceptorBase::Start(grpc::ServerBuilder& builder, unsigned threads) {
 	{
 		std::lock_guard<std::mutex> guard(mu_);
 		if (state_ != INIT) return false;
 		state_ = STARTED;
 	}
-	builder.RegisterService(service_.get());
-	cq_ = builder.AddCompletionQueue();
+	return Serve(builder, threads);
+}
+
+
+bool AsyncServiceAcceptorBase::Serve(grpc::ServerBuilder& builder, unsigned threads) {
+	builder.RegisterService(GetService());
+	threads = std::max(threads, 1u);
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		for (unsigned i = 0; i < threads; ++i) {
+			cqs_.push_back(builder.AddCompletionQueue());
+			listeners_.emplace_back(new ListenerStats[MethodCount()]);
+			for (unsigned m = 0; m < MethodCount(); ++m) {
+				listeners_.back()[m].load = load_.get();
+				listeners_.back()[m].calls = &calls_;
+			}
+			if (schedulerPolicy_.enabled)
+				schedulers_.emplace_back(new FairScheduler(schedulerPolicy_));
+		}
+	}
 	server_ = builder.BuildAndStart();
 	if (server_.get() == nullptr) {
 		LOG(ERROR) << "AsyncServiceAcceptor: failed to start";
+		CloseSockets();
 		std::lock_guard<std::mutex> guard(mu_);
 		state_ = ERROR;
 		return false;
 	}
-	LOG(INFO) << "AsyncServiceAcceptor: server started";
-	HandleRpcs();
+	LOG(INFO) << "AsyncServiceAcceptor: server started with " << threads << " completion queue(s)";
+	bool stopping;
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		serving_ = true;
+		stopping = (state_ == SHUTDOWN);
+		ready_.store(!stopping);
+		if (listenFd_ >= 0)
+			acceptThread_ = std::thread(&AsyncServiceAcceptorBase::AcceptConnections, this);
+		if (controlFd_ >= 0)
+			controlThread_ = std::thread(&AsyncServiceAcceptorBase::ServeSuccessor, this);
+	}
+	// Shutdown was called while the server was being built.
+	if (stopping)
+		shutdownAlarm_.reset(new ::grpc::Alarm(cqs_[0].get(), gpr_now(GPR_CLOCK_MONOTONIC), nullptr));
+
+	// One thread per completion queue. The first runs on the caller's thread
+	// unless the threads are pinned, which would leave the caller pinned.
+	const unsigned first = pollingPolicy_.cpus.empty()? 1: 0;
+	std::vector<std::thread> workers;
+	for (unsigned i = first; i < threads; ++i)
+		workers.push_back(std::thread(&AsyncServiceAcceptorBase::HandleRpcs, this, i));
+	if (first != 0)
+		HandleRpcs(0);
+	for (auto& t: workers)
+		t.join();
+	if (stopper_.joinable())
+		stopper_.join();
+	StopAccepting();
+	if (controlThread_.joinable())
+		controlThread_.join();
+	CloseSockets();
+	if (capture_) capture_->Flush();
+	// Write out the calls the queues logged.
+	LogSink::Get().Flush();
+
+	LOG(INFO) << "AsyncServiceAcceptor: server stopped";    
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		state_ = STOPPED;        
+	}
+	shutdownPromise_.set_value();
 	return true;
 }
 
 
-void AsyncServiceAcceptor::Shutdown() {
+void AsyncServiceAcceptorBase::Shutdown() {
 	// Borrowed from tensorflow source
 	bool did_shutdown = false;
 	{
 		std::lock_guard<std::mutex> guard(mu_);
-		if (state_ == STARTED) {
+		if (state_ == INIT) {
+			// Never serve.
+			state_ = STOPPED;
+			shutdownPromise_.set_value();
+		} else if (state_ == STARTED) {
 			LOG(INFO) << "AsyncServiceAcceptor: initiating shutdown";
 			state_ = SHUTDOWN;
-			did_shutdown = true;
+			// Until the server is built Serve posts the alarm.
+			did_shutdown = serving_;
 		}
 	}
 	if (did_shutdown) {
 		// This enqueues a special event (with a null tag) that causes the completion
-		// queue to be shut down on the polling thread.
-		::grpc::Alarm* a = new ::grpc::Alarm(cq_.get(), gpr_now(GPR_CLOCK_MONOTONIC), nullptr);
+		// queues to be shut down on the polling thread.
+		::grpc::Alarm* a = new ::grpc::Alarm(cqs_[0].get(), gpr_now(GPR_CLOCK_MONOTONIC), nullptr);
 		shutdownAlarm_.reset(a);
 	}
 }
 
 
-// This can be run in multiple threads if needed.
-void AsyncServiceAcceptor::HandleRpcs() {
-	// Spawn a new CallData instance to serve new clients.
-	bool shutdown = false;	
+std::vector<ListenerReport> AsyncServiceAcceptorBase::GetListenerReport() {
+	std::lock_guard<std::mutex> guard(mu_);
+	std::vector<ListenerReport> report(MethodCount());
+	for (unsigned m = 0; m < report.size(); ++m) {
+		report[m].depth = listenerDepth_;
+		for (auto& stats: listeners_) {
+			report[m].method = stats[m].method;
+			report[m].matched += stats[m].matched.load(std::memory_order_relaxed);
+			report[m].dry += stats[m].dry.load(std::memory_order_relaxed);
+			report[m].expired += stats[m].expired.load(std::memory_order_relaxed);
+			report[m].inFlight += std::max<int64_t>(stats[m].inFlight.load(std::memory_order_relaxed), 0);
+			report[m].cancelled += stats[m].cancelled.load(std::memory_order_relaxed);
+		}
+	}
+	return report;
+}
+
+
+std::vector<TenantReport> AsyncServiceAcceptorBase::GetTenantReport() {
+	std::lock_guard<std::mutex> guard(mu_);
+	std::vector<TenantReport> all;
+	for (auto& scheduler: schedulers_)
+		scheduler->Report(all);
+	// Merge the queues' counters for each tenant.
+	std::map<std::string, TenantReport> merged;
+	for (auto& r: all) {
+		TenantReport& m = merged[r.tenant];
+		m.tenant = r.tenant;
+		m.weight = r.weight;
+		m.dispatched += r.dispatched;
+		m.shed += r.shed;
+	}
+	std::vector<TenantReport> report;
+	for (auto& kv: merged)
+		report.push_back(kv.second);
+	return report;
+}
+
+
+bool AsyncServiceAcceptorBase::EnableCapture(const std::string& path, double sampleRate, uint64_t maxBytes) {
+	std::lock_guard<std::mutex> guard(mu_);
+	if (state_ != INIT) return false;
+	std::unique_ptr<CaptureWriter> capture(new CaptureWriter);
+	if (!capture->Open(path, sampleRate, maxBytes)) return false;
+	capture_ = std::move(capture);
+	LOG(INFO) << "AsyncServiceAcceptor: capturing " << sampleRate * 100 << "% of requests to " << path;
+	return true;
+}
+
+
+CaptureStats AsyncServiceAcceptorBase::GetCaptureStats() {
+	std::lock_guard<std::mutex> guard(mu_);
+	return capture_? capture_->GetStats(): CaptureStats();
+}
+
+
+void AsyncServiceAcceptorBase::EnableHotRestart(const std::string& controlPath) {
+	std::lock_guard<std::mutex> guard(mu_);
+	if (state_ == INIT) controlPath_ = controlPath;
+}
+
+
+bool AsyncServiceAcceptorBase::TakeListener(const std::string& hostAndPort) {
+	wakeFd_ = eventfd(0, EFD_CLOEXEC);
+	if (wakeFd_ < 0) {
+		LOG(ERROR) << "AsyncServiceAcceptor: cannot create eventfd: " << strerror(errno);
+		return false;
+	}
+	std::string state;
+	listenFd_ = ReceiveListener(controlPath_, state);
+	if (listenFd_ >= 0) {
+		LOG(INFO) << "AsyncServiceAcceptor: took over the listener on " << hostAndPort
+			<< " with " << state.size() << " bytes of warm state";
+		if (!state.empty()) ImportWarmState(state);
+	} else if ((listenFd_ = ListenTcp(hostAndPort)) < 0) {
+		CloseSockets();
+		return false;
+	}
+	// Generations may accept concurrently during a handover, so a ready
+	// listener can be empty by the time accept is called.
+	fcntl(listenFd_, F_SETFL, fcntl(listenFd_, F_GETFL) | O_NONBLOCK);
+	// If the listener was taken over its old owner is already draining, so
+	// serve without a successor rather than not at all.
+	controlFd_ = ListenControl(controlPath_);
+	if (controlFd_ >= 0)
+		LOG(INFO) << "AsyncServiceAcceptor: hot restart control socket on " << controlPath_;
+	return true;
+}
+
+
+void AsyncServiceAcceptorBase::AcceptConnections() {
+	pollfd fds[2] = { { listenFd_, POLLIN, 0 }, { wakeFd_, POLLIN, 0 } };
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			LOG(ERROR) << "AsyncServiceAcceptor: poll failed: " << strerror(errno);
+			return;
+		}
+		if (fds[1].revents != 0) return;
+		int conn = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (conn < 0) {
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				// The connection stays in the backlog, back off rather than spin.
+				LOG(ERROR) << "AsyncServiceAcceptor: accept failed: " << strerror(errno);
+				poll(&fds[1], 1, 10);
+			}
+			continue;
+		}
+		int one = 1;
+		setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		// The server owns the connection from here.
+		::grpc::AddInsecureChannelFromFd(server_.get(), conn);
+	}
+}
+
+
+void AsyncServiceAcceptorBase::ServeSuccessor() {
+	pollfd fds[2] = { { controlFd_, POLLIN, 0 }, { wakeFd_, POLLIN, 0 } };
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			LOG(ERROR) << "AsyncServiceAcceptor: poll failed: " << strerror(errno);
+			return;
+		}
+		if (fds[1].revents != 0) return;
+		int conn = accept4(controlFd_, nullptr, nullptr, SOCK_CLOEXEC);
+		if (conn < 0) continue;
+		std::string state;
+		if (!ExportWarmState(state)) state.clear();
+		bool handed = SendListener(conn, listenFd_, state);
+		close(conn);
+		if (handed) {
+			LOG(INFO) << "AsyncServiceAcceptor: handed the listener to a successor, draining";
+			StopAccepting();
+			Shutdown();
+			return;
+		}
+	}
+}
+
+
+void AsyncServiceAcceptorBase::StopAccepting() {
+	if (wakeFd_ < 0) return;
+	uint64_t one = 1;
+	if (write(wakeFd_, &one, sizeof(one)) < 0)
+		LOG(ERROR) << "AsyncServiceAcceptor: cannot wake the accept thread: " << strerror(errno);
+	std::thread t;
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		t.swap(acceptThread_);
+	}
+	if (t.joinable()) t.join();
+}
+
+
+void AsyncServiceAcceptorBase::Drain() {
+	ready_.store(false);
+	::grpc::HealthCheckServiceInterface* health = server_->GetHealthCheckService();
+	if (health != nullptr)
+		health->SetServingStatus(false);
+	if (drainPolicy_.notReadyMs != 0) {
+		LOG(INFO) << "AsyncServiceAcceptor: not ready, stop accepting in " << drainPolicy_.notReadyMs << "ms";
+		std::this_thread::sleep_for(std::chrono::milliseconds(drainPolicy_.notReadyMs));
+	}
+	shuttingDown_.store(true);
+	StopAccepting();
+	if (drainPolicy_.graceMs == 0) {
+		server_->Shutdown();
+		WaitForCalls();
+		return;
+	}
+	// The server cancels what is left at the deadline, so whatever is still
+	// in flight then is reported first.
+	auto deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(drainPolicy_.graceMs);
+	std::mutex mu;
+	std::condition_variable cv;
+	bool drained = false;
+	std::thread watchdog([this, deadline, &mu, &cv, &drained]() {
+		std::unique_lock<std::mutex> lock(mu);
+		if (!cv.wait_until(lock, deadline, [&drained]() { return drained; }))
+			ReportStragglers();
+	});
+	server_->Shutdown(deadline);
+	{
+		std::lock_guard<std::mutex> guard(mu);
+		drained = true;
+	}
+	cv.notify_one();
+	watchdog.join();
+	WaitForCalls();
+}
+
+
+void AsyncServiceAcceptorBase::WaitForCalls() {
+	// Cancelled calls are over as far as the server is concerned, but a
+	// deferred call still finishes through its completion queue, so the
+	// queues stay up until every matched call has been deleted.
+	calls_.Wait();
+}
+
+
+void AsyncServiceAcceptorBase::ReportStragglers() {
+	std::lock_guard<std::mutex> guard(mu_);
+	for (unsigned m = 0; m < MethodCount(); ++m) {
+		int64_t stragglers = 0;
+		for (auto& stats: listeners_) {
+			int64_t n = stats[m].inFlight.load(std::memory_order_relaxed);
+			if (n <= 0) continue;
+			stats[m].cancelled.fetch_add(uint64_t(n), std::memory_order_relaxed);
+			stragglers += n;
+		}
+		if (stragglers != 0)
+			LOG(WARNING) << "AsyncServiceAcceptor: drain timed out, cancelling " << stragglers
+				<< " " << listeners_[0][m].method << " call(s)";
+	}
+}
+
+
+void AsyncServiceAcceptorBase::CloseSockets() {
+	for (int* fd: { &listenFd_, &controlFd_, &wakeFd_ }) {
+		if (*fd >= 0) close(*fd);
+		*fd = -1;
+	}
+}
+
+
+void AsyncServiceAcceptorBase::PostListener(UntypedCall* call, ListenerStats* stats) {
+	call->SetListenerStats(stats);
+	++stats->outstanding;
+	call->Proceed(true);
+}
+
+
+void AsyncServiceAcceptorBase::TopUpListeners(UntypedCall* call) {
+	ListenerStats* stats = call->GetListenerStats();
+	stats->matched.fetch_add(1, std::memory_order_relaxed);
+	// If this was the last outstanding listener, calls arriving since it was
+	// matched have been queued inside gRPC.
+	if (--stats->outstanding == 0)
+		stats->dry.fetch_add(1, std::memory_order_relaxed);
+	while (stats->outstanding < listenerDepth_)
+		PostListener(call->CreateListener(), stats);
+}
+
+
+void AsyncServiceAcceptorBase::HandleEvent(unsigned index, void* tag, bool ok) {
+	LUCIDA_LOG_TAG("AsyncServiceAcceptor: got", tag);
+	if (tag == nullptr) {
+		LOG(INFO) << "AsyncServiceAcceptor: shutdown alarm received";
+		// Draining waits for the calls in flight, and deferred calls need
+		// their queue polled to finish, so wait elsewhere.
+		stopper_ = std::thread([this]() {
+			Drain();
+			// Always shutdown the completion queues after the server. Each
+			// queue is shutdown by its own thread since only that thread
+			// posts listeners to it.
+			std::lock_guard<std::mutex> guard(mu_);
+			for (auto& q: cqs_)
+				cqShutdownAlarms_.emplace_back(new ::grpc::Alarm(q.get(), gpr_now(GPR_CLOCK_MONOTONIC), &cqShutdownAlarms_));
+		});
+		return;
+	}
+	if (tag == &cqShutdownAlarms_) {
+		cqs_[index]->Shutdown();
+		return;
+	}
+	UntypedCall* call = static_cast<UntypedCall*>(tag);
+	bool matched = ok && call->GetStatus() == UntypedCall::PROCESS;
+	if (matched)
+		call->CountInFlight();
+	// If not shutting down replace the matched listener
+	if (matched && !shuttingDown_.load(std::memory_order_relaxed))
+		TopUpListeners(call);
+	const Request* request = nullptr;
+	if (matched && capture_ && (request = call->GetCapturedRequest()) != nullptr)
+		capture_->Capture(call->GetMethodName(), *request);
+	const std::string* tenant = nullptr;
+	if (matched && !schedulers_.empty() && (tenant = call->GetTenant()) != nullptr) {
+		FairScheduler* scheduler = schedulers_[index].get();
+		size_t queued = scheduler->Queued();
+		// The done tag may be delivered while the call waits.
+		call->Hold();
+		scheduler->Push(*tenant, call);
+		if (load_) load_->AddQueued(int64_t(scheduler->Queued()) - int64_t(queued));
+		return;
+	}
+	// Calls handle !ok themselves since streaming calls see it on half-close.
+	call->Proceed(ok);
+}
+
+
+// Run once per completion queue, each in its own thread.
+void AsyncServiceAcceptorBase::HandleRpcs(unsigned index) {
+	::grpc::ServerCompletionQueue* cq = cqs_[index].get();
+	// Before the thread allocates its listeners.
+	PlaceThread(pollingPolicy_, index);
+	ListenerStats* stats = listeners_[index].get();
 	bool ok = true;
 	void* tag;  // uniquely identifies a request.
 
 #ifdef DEBUG
-	LOG(INFO) << "AsyncServiceAcceptor: enqueueing listeners";
+	LOG(INFO) << "AsyncServiceAcceptor: enqueueing listeners on cq<" << cq << ">";
 #endif
-	(new TypedCall<Request, ::google::protobuf::Empty>(service_.get(), 
-		&AsyncServiceHandler::Requestcreate, &AsyncServiceHandler::CreateCallback, cq_.get()))->Proceed(true);
-	(new TypedCall<Request, ::google::protobuf::Empty>(service_.get(),
-		&AsyncServiceHandler::Requestlearn, &AsyncServiceHandler::LearnCallback, cq_.get()))->Proceed(true);
-	(new TypedCall<Request, Response>(service_.get(),
-		&AsyncServiceHandler::Requestinfer, &AsyncServiceHandler::InferCallback, cq_.get()))->Proceed(true);
+	std::vector<UntypedCall*> calls;
+	CreateListeners(cq, calls);
+	assert(calls.size() == MethodCount());
+	for (unsigned m = 0; m < calls.size(); ++m) {
+		stats[m].method = calls[m]->GetMethodName();
+		PostListener(calls[m], &stats[m]);
+		while (stats[m].outstanding < listenerDepth_)
+			PostListener(calls[m]->CreateListener(), &stats[m]);
+	}
 #ifdef DEBUG
 	LOG(INFO) << "AsyncServiceAcceptor: listeners ready";
 #endif
@@ -143,50 +555,39 @@ void AsyncServiceAcceptor::HandleRpcs() {
 	// event is uniquely identified by its tag, which in this case is the
 	// memory address of a TypedCall instance.
 	// The return value of Next should always be checked. This return value
-	// tells us whether there is any kind of event or cq_ is shutting down.
-	while (cq_->Next(&tag, &ok)) {
-#ifdef DEBUG
-		LOG(INFO) << "AsyncServiceAcceptor: got tag<" << tag << ">";
-#endif
-		//assert(ok);
-		if (tag == nullptr) {
-			if (!shutdown) {
-				LOG(INFO) << "AsyncServiceAcceptor: shutdown alarm received";
-				// Shutdown requested
-				server_->Shutdown();
-				// Always shutdown the completion queue after the server.
-				cq_->Shutdown();
-				shutdown = true;
+	// tells us whether there is any kind of event or cq is shutting down.
+	FairScheduler* scheduler = schedulers_.empty()? nullptr: schedulers_[index].get();
+	// Events handled since a queued call was last dispatched.
+	unsigned events = 0;
+	for (;;) {
+		if (scheduler != nullptr && scheduler->Runnable()) {
+			// Take whatever else is ready first, so calls that just arrived
+			// compete for the next turn. A queue that is never empty would
+			// starve the queued calls, so one is dispatched at least every
+			// kEventsPerDispatch events.
+			auto next = (events >= kEventsPerDispatch)? ::grpc::CompletionQueue::TIMEOUT:
+				cq->AsyncNext(&tag, &ok, gpr_time_0(GPR_CLOCK_MONOTONIC));
+			if (next == ::grpc::CompletionQueue::SHUTDOWN) break;
+			if (next == ::grpc::CompletionQueue::TIMEOUT) {
+				events = 0;
+				if (load_) load_->AddQueued(-1);
+				// Calls abandoned while queued are dropped.
+				scheduler->Pop()->Proceed(true);
+				continue;
 			}
-			continue;
+			++events;
+		} else if (!PollNext(cq, &tag, &ok, pollingPolicy_.busyPollUs)) {
+			break;
 		}
-		// If not shutting down continue to listen
-		if (ok) {
-			if (!shutdown && static_cast<UntypedCall*>(tag)->GetStatus() == UntypedCall::PROCESS)
-				static_cast<UntypedCall*>(tag)->CreateListener()->Proceed(true);
-			static_cast<UntypedCall*>(tag)->Proceed(ok);            
-		} else {
+		HandleEvent(index, tag, ok);
+	}
 #ifdef DEBUG
-			LOG(INFO) << "AsyncServiceAcceptor: flushing completion queue<" << cq_.get() << ">";
+	LOG(INFO) << "AsyncServiceAcceptor: drained cq<" << cq << ">";
 #endif
-			delete static_cast<UntypedCall*>(tag); 
-		}
-	}
-
-	if (!shutdown) {
-		server_->Shutdown();
-		cq_->Shutdown();
-	}
-	LOG(INFO) << "AsyncServiceAcceptor: server stopped";    
-	{
-		std::lock_guard<std::mutex> guard(mu_);
-		state_ = STOPPED;        
-	}
-	shutdownPromise_.set_value();
 }
 
 
-bool AsyncServiceAcceptor::BlockUntilShutdown(unsigned maxWaitTimeInSeconds) {
+bool AsyncServiceAcceptorBase::BlockUntilShutdown(unsigned maxWaitTimeInSeconds) {
 	{
 		std::lock_guard<std::mutex> guard(mu_);
 		if (SHUTDOWN != state_ && STARTED != state_)
@@ -196,10 +597,7 @@ bool AsyncServiceAcceptor::BlockUntilShutdown(unsigned maxWaitTimeInSeconds) {
 		shutdownFuture_.wait();
 		return true;
 	}
-	if (std::future_status::ready == shutdownFuture_.wait_for(std::chrono::seconds(maxWaitTimeInSeconds))) {
-		std::lock_guard<std::mutex> guard(mu_);
-	}
-	return true;
+	return std::future_status::ready == shutdownFuture_.wait_for(std::chrono::seconds(maxWaitTimeInSeconds));
 }
 
 
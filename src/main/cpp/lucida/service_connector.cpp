@@ -30,26 +30,381 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <lucida/service_connector.h>
+#include <lucida/blob_store.h>
+#include <lucida/log_sink.h>
+#include <lucida/service_names.h>
+#include <algorithm>
+#include <cmath>
 #include <grpc++/alarm.h>
 #include <glog/logging.h>
 
 using ::google::protobuf::Empty;
 using ::grpc::Channel;
+using ::grpc::ClientContext;
 using ::grpc::CompletionQueue;
+using ::grpc::ServerContext;
 using ::grpc::Status;
 
 namespace lucida {
 
+// Samples kept per target before the histogram is decayed.
+static const uint64_t kLatencyWindow = 4096;
+
+
+uint64_t RendezvousHash(const std::string& s) {
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ull;
+	for (unsigned char c: s) {
+		h ^= c;
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+
+uint64_t RendezvousScore(uint64_t user, uint64_t target) {
+	// splitmix64's finalizer, so a user's scores over the targets are
+	// independent.
+	uint64_t z = user ^ target;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+
+size_t BoundedLoadOrder(uint64_t user, const std::vector<uint64_t>& hashes, const std::vector<int64_t>& loads,
+		double loadBound, std::vector<std::pair<size_t, size_t>>& order) {
+	const size_t n = hashes.size();
+	std::vector<std::pair<uint64_t, size_t>> scores(n);
+	int64_t total = 0;
+	for (size_t i = 0; i < n; ++i) {
+		scores[i] = std::make_pair(RendezvousScore(user, hashes[i]), i);
+		total += std::max<int64_t>(loads[i], 0);
+	}
+	std::sort(scores.begin(), scores.end(), std::greater<std::pair<uint64_t, size_t>>());
+	// Counting this call no target may hold more than its bounded share, and
+	// some target is always below it.
+	const double bound = std::ceil(std::max(loadBound, 1.0) * double(total + 1) / n);
+	order.clear();
+	std::vector<std::pair<size_t, size_t>> over;
+	for (size_t r = 0; r < n; ++r) {
+		const size_t i = scores[r].second;
+		if (std::max<int64_t>(loads[i], 0) + 1 > bound) over.push_back(std::make_pair(i, r));
+		else order.push_back(std::make_pair(i, r));
+	}
+	const size_t within = order.size();
+	order.insert(order.end(), over.begin(), over.end());
+	return within;
+}
+
+
+AsyncServiceConnector::Target::Target(const std::string& name, std::shared_ptr<Channel> channel):
+	name(name), hash(RendezvousHash(name)), channel(channel), stub(LucidaService::NewStub(channel)),
+	attempts(0), hedges(0), retries(0), wins(0), errors(0), outstanding(0), hasLoad(false), spills(0) {
+}
+
+
+void AsyncServiceConnector::Target::UpdateLoad(const ClientContext& ctx) {
+	const auto& metadata = ctx.GetServerTrailingMetadata();
+	auto it = metadata.find(LoadReport::Key());
+	if (it == metadata.end()) return;
+	LoadReport report;
+	if (!LoadReport::Parse(std::string(it->second.data(), it->second.size()), report)) return;
+	std::lock_guard<std::mutex> guard(loadMu);
+	load = report;
+	hasLoad = true;
+}
+
+
+bool AsyncServiceConnector::Target::GetLoad(LoadReport& report) const {
+	std::lock_guard<std::mutex> guard(loadMu);
+	report = load;
+	return hasLoad;
+}
+
+
+/// An infer call made of one or more attempts. Attempts and timers complete
+/// on the connector's queue; the first successful attempt wins.
+class AsyncServiceConnector::HedgedCall: public RpcCall {
+private:
+	struct Attempt: public ClientTag {
+		HedgedCall* call;
+		Target* target;
+		CircuitBreaker::Ticket ticket;
+		std::unique_ptr<ClientContext> ctx;
+		std::unique_ptr<::grpc::ClientAsyncResponseReader<Response>> rpc;
+		Response response;
+		Status status;
+		std::chrono::steady_clock::time_point start;
+		bool done;
+		void Complete(bool ok) override { call->OnAttempt(this, ok); }
+	};
+	struct Timer: public ClientTag {
+		HedgedCall* call;
+		::grpc::Alarm alarm;
+		bool retry;
+		bool pending;
+		void Complete(bool ok) override { call->OnTimer(this, ok); }
+	};
+
+	AsyncServiceConnector* conn_;
+	Request request_;
+	Response response_;
+	bool hasDeadline_;
+	std::chrono::system_clock::time_point deadline_;
+	/// The server call this call was made from. Only valid in Start().
+	ServerContext* parent_;
+	TraceSpan span_;
+	std::mutex mu_;
+	std::vector<std::unique_ptr<Attempt>> attempts_;
+	std::vector<std::unique_ptr<Timer>> timers_;
+	unsigned next_;
+	unsigned outstanding_;
+	unsigned pendingTimers_;
+	bool done_;
+	Status lastStatus_;
+
+	Target* PickTarget(CircuitBreaker::Ticket& ticket);
+	void Launch(Target* target, CircuitBreaker::Ticket ticket);
+	void ArmTimer(bool retry, uint64_t micros);
+	void ArmHedge();
+	void FinishLocked(const Status& status, const ClientContext* ctx=nullptr);
+	void OnAttempt(Attempt* attempt, bool ok);
+	void OnTimer(Timer* timer, bool ok);
+public:
+	HedgedCall(AsyncServiceConnector* conn, const Request& request, ClientContext* context);
+	void Start();
+	bool Get(Response*& p) override {
+		p = &response_;
+		return true;
+	}
+};
+
+
+AsyncServiceConnector::HedgedCall::HedgedCall(AsyncServiceConnector* conn, const Request& request, ClientContext* context):
+	conn_(conn), request_(request), hasDeadline_(context != nullptr), parent_(CallScope::Current()),
+	next_(conn->nextTarget_.fetch_add(1, std::memory_order_relaxed)),
+	outstanding_(0), pendingTimers_(0), done_(false) {
+	if (hasDeadline_) deadline_ = context->deadline();
+	if (parent_ != nullptr && (!hasDeadline_ || parent_->deadline() < deadline_)) {
+		hasDeadline_ = true;
+		deadline_ = parent_->deadline();
+	}
+	fut_ = promise_.get_future();
+}
+
+
+void AsyncServiceConnector::HedgedCall::Start() {
+	std::lock_guard<std::mutex> guard(mu_);
+	conn_->retryBudget_.Deposit();
+	span_.StartClient("infer");
+	Status status = CallScope::Check(parent_);
+	if (!status.ok()) {
+		FinishLocked(status);
+		Signal();
+		return;
+	}
+	Target* target;
+	CircuitBreaker::Ticket ticket;
+	if (conn_->affinity_.enabled && !request_.lucid().empty())
+		target = conn_->PickByAffinity(request_.lucid(), ticket);
+	else
+		target = conn_->leastLoad_? conn_->PickLeastLoaded(ticket): PickTarget(ticket);
+	if (target == nullptr) {
+		FinishLocked(CircuitOpenStatus());
+		Signal();
+		return;
+	}
+	Launch(target, ticket);
+	// Later attempts may outlive the server call, they only copy its deadline.
+	parent_ = nullptr;
+	ArmHedge();
+}
+
+
+// The next target in rotation whose circuit breaker allows a call.
+AsyncServiceConnector::Target* AsyncServiceConnector::HedgedCall::PickTarget(CircuitBreaker::Ticket& ticket) {
+	const size_t n = conn_->targets_.size();
+	for (size_t i = 0; i < n; ++i) {
+		Target* target = conn_->targets_[(next_ + i) % n].get();
+		if (target->breaker.Allow(&ticket)) {
+			next_ += i + 1;
+			return target;
+		}
+	}
+	return nullptr;
+}
+
+
+// Send an attempt. Each attempt is a reference.
+void AsyncServiceConnector::HedgedCall::Launch(Target* target, CircuitBreaker::Ticket ticket) {
+	Attempt* a = new Attempt;
+	attempts_.emplace_back(a);
+	a->call = this;
+	a->target = target;
+	a->ticket = ticket;
+	a->done = false;
+	// The first attempt is a child of the server call so a cancellation
+	// propagates.
+	if (parent_ != nullptr)
+		a->ctx = ClientContext::FromServerContext(*parent_);
+	else
+		a->ctx.reset(new ClientContext);
+	if (hasDeadline_) a->ctx->set_deadline(deadline_);
+	span_.Inject(*a->ctx);
+	a->start = std::chrono::steady_clock::now();
+	target->attempts.fetch_add(1, std::memory_order_relaxed);
+	++target->outstanding;
+	Ref();
+	++outstanding_;
+	a->rpc = target->stub->Asyncinfer(a->ctx.get(), request_, conn_->cq_.get());
+	a->rpc->Finish(&a->response, &a->status, static_cast<ClientTag*>(a));
+}
+
+
+// Each timer is a reference.
+void AsyncServiceConnector::HedgedCall::ArmTimer(bool retry, uint64_t micros) {
+	Timer* t = new Timer;
+	timers_.emplace_back(t);
+	t->call = this;
+	t->retry = retry;
+	t->pending = true;
+	Ref();
+	++pendingTimers_;
+	gpr_timespec when = gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC), gpr_time_from_micros(micros, GPR_TIMESPAN));
+	t->alarm.Set(conn_->cq_.get(), when, static_cast<ClientTag*>(t));
+}
+
+
+// Hedge after the latest target's percentile latency.
+void AsyncServiceConnector::HedgedCall::ArmHedge() {
+	const HedgePolicy& policy = conn_->hedgePolicy_;
+	if (!policy.enabled || attempts_.size() >= policy.maxAttempts) return;
+	const LatencyHistogram& latency = attempts_.back()->target->latency;
+	uint64_t micros = (latency.Count() >= policy.minSamples)?
+		latency.Percentile(policy.percentile): policy.defaultDelayMs * 1000ull;
+	ArmTimer(false, std::max<uint64_t>(micros, policy.minDelayMs * 1000ull));
+}
+
+
+void AsyncServiceConnector::HedgedCall::FinishLocked(const Status& status, const ClientContext* ctx) {
+	done_ = true;
+	span_.FinishClient(ctx, status);
+	for (auto& a: attempts_) {
+		if (!a->done) a->ctx->TryCancel();
+	}
+	for (auto& t: timers_) {
+		if (t->pending) t->alarm.Cancel();
+	}
+	status_ = status;
+	ok_ = true;
+}
+
+
+void AsyncServiceConnector::HedgedCall::OnAttempt(Attempt* a, bool ok) {
+	bool finished = false;
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		bool wasDone = done_;
+		--outstanding_;
+		a->done = true;
+		if (!ok) a->status = Status(::grpc::StatusCode::INTERNAL, "completion queue error");
+		Target* target = a->target;
+		--target->outstanding;
+		if (ok) target->UpdateLoad(*a->ctx);
+		uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - a->start).count();
+		if (a->status.ok()) {
+			target->latency.Record(micros);
+			if (target->latency.Count() > kLatencyWindow) target->latency.Decay();
+		}
+		// Cancelling a loser says nothing about the target's health, but
+		// gives back its probe.
+		if (!done_ || a->status.error_code() != ::grpc::StatusCode::CANCELLED)
+			target->breaker.Record(a->status.error_code(), micros, a->ticket);
+		else
+			target->breaker.Release(a->ticket);
+		if (done_) {
+			// A cancelled loser
+		} else if (a->status.ok()) {
+			target->wins.fetch_add(1, std::memory_order_relaxed);
+			response_.Swap(&a->response);
+			FinishLocked(a->status, a->ctx.get());
+		} else {
+			target->errors.fetch_add(1, std::memory_order_relaxed);
+			lastStatus_ = a->status;
+			const RetryPolicy& policy = conn_->retryPolicy_;
+			if (policy.IsRetryable(a->status.error_code()) && attempts_.size() < policy.maxAttempts &&
+					conn_->retryBudget_.TryWithdraw()) {
+				ArmTimer(true, policy.backoffMs * 1000ull);
+			} else if (outstanding_ == 0) {
+				FinishLocked(lastStatus_);
+			}
+		}
+		finished = !wasDone && done_;
+	}
+	// Outside the lock, the continuation may issue further calls.
+	if (finished) Signal();
+	Unref();
+}
+
+
+void AsyncServiceConnector::HedgedCall::OnTimer(Timer* t, bool ok) {
+	bool finished = false;
+	{
+		std::lock_guard<std::mutex> guard(mu_);
+		bool wasDone = done_;
+		t->pending = false;
+		--pendingTimers_;
+		if (!done_ && ok) {
+			// Take the budget before picking a target so a half open breaker
+			// never hands out a probe that is not sent.
+			Target* target = nullptr;
+			CircuitBreaker::Ticket ticket;
+			if (t->retry) {
+				if ((target = PickTarget(ticket)) != nullptr) {
+					Launch(target, ticket);
+					target->retries.fetch_add(1, std::memory_order_relaxed);
+				}
+			} else if (outstanding_ > 0 && conn_->retryBudget_.TryWithdraw()) {
+				if ((target = PickTarget(ticket)) != nullptr) {
+					Launch(target, ticket);
+					target->hedges.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+			if (target != nullptr) ArmHedge();
+		}
+		if (!done_ && outstanding_ == 0 && pendingTimers_ == 0)
+			FinishLocked(lastStatus_);
+		finished = !wasDone && done_;
+	}
+	if (finished) Signal();
+	Unref();
+}
+
 
 AsyncServiceConnector::AsyncServiceConnector(const char* hostAndPort):
 	channel_(::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials())),
-	stub_(LucidaService::NewStub(channel_)), errorCount_(0), runningAsync_(false) {
+	stub_(LucidaService::NewStub(channel_)), nextTarget_(0), leastLoad_(false), errorCount_(0), runningAsync_(false) {
+	targets_.emplace_back(new Target(hostAndPort, channel_));
 }
 
 
 AsyncServiceConnector::AsyncServiceConnector(std::shared_ptr<Channel> channel):
 	channel_(channel), stub_(LucidaService::NewStub(channel)), 
-	errorCount_(0), runningAsync_(false) {
+	nextTarget_(0), leastLoad_(false), errorCount_(0), runningAsync_(false) {
+	targets_.emplace_back(new Target("", channel_));
+}
+
+
+AsyncServiceConnector::AsyncServiceConnector(const std::vector<std::string>& hostsAndPorts):
+	nextTarget_(0), leastLoad_(false), errorCount_(0), runningAsync_(false) {
+	assert(!hostsAndPorts.empty());
+	for (auto& hostAndPort: hostsAndPorts)
+		targets_.emplace_back(new Target(hostAndPort,
+			::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials())));
+	channel_ = targets_[0]->channel;
+	stub_ = LucidaService::NewStub(channel_);
 }
 
 AsyncServiceConnector::~AsyncServiceConnector() {
@@ -60,16 +415,15 @@ void AsyncServiceConnector::Start() {
 	// FIXME: should either use atomic load or mutex and 
 	if (runningAsync_.exchange(true)) return;
 	cq_.reset(new CompletionQueue);
-	auto functor = [](std::shared_ptr<CompletionQueue> cq, std::atomic<unsigned>& errs) ->void {
+	auto functor = [](std::shared_ptr<CompletionQueue> cq, std::atomic<unsigned>& errs, PollingPolicy polling) ->void {
 		bool ok;
 		void* tag;
 #ifdef DEBUG
 			LOG(INFO) << "AsyncServiceConnector: worker thread started cq<" << cq << ">";
 #endif        
-		while (cq->Next(&tag, &ok)) {
-#ifdef DEBUG
-			LOG(INFO) << "AsyncServiceConnector: got tag<" << tag << ">";
-#endif
+		PlaceThread(polling, 0);
+		while (PollNext(cq.get(), &tag, &ok, polling.busyPollUs)) {
+			LUCIDA_LOG_TAG("AsyncServiceConnector: got", tag);
 			if (tag == nullptr) {
 #ifdef DEBUG
 				LOG(INFO) << "AsyncServiceConnector: shutdown received";
@@ -78,13 +432,11 @@ void AsyncServiceConnector::Start() {
 				break;
 			}
 			if (!ok) ++errs;
-			static_cast<RpcCall*>(tag)->ok_ = ok;
-			static_cast<RpcCall*>(tag)->promise_.set_value();
-			static_cast<RpcCall*>(tag)->Unref();
+			static_cast<ClientTag*>(tag)->Complete(ok);
 		}
 		cq->Shutdown();
 	};
-	cqThread_ = std::thread(functor, cq_, std::ref(errorCount_));
+	cqThread_ = std::thread(functor, cq_, std::ref(errorCount_), pollingPolicy_);
 }
 
 
@@ -102,33 +454,307 @@ void AsyncServiceConnector::Shutdown() {
 }
 
 
-std::shared_ptr<RpcCall> AsyncServiceConnector::learnAsync(const Request& request, ::grpc::ClientContext* context) {
-	typedef TypedRpcCall<Empty> _RpcCall;
+ClientContext* AsyncServiceConnector::ContextFor(ClientContext* context, 
+		std::unique_ptr<ClientContext>& owned, Status& status) {
+	ServerContext* parent = CallScope::Current();
+	if (parent == nullptr) {
+		if (context != nullptr) return context;
+		// Trace metadata must not pile up on the shared context.
+		if (!Tracer::IsEnabled()) return &context_;
+		owned.reset(new ClientContext);
+		return owned.get();
+	}
+	status = CallScope::Check(parent);
+	if (!status.ok()) return nullptr;
+	if (context != nullptr) {
+		if (context->deadline() > parent->deadline())
+			context->set_deadline(parent->deadline());
+		return context;
+	}
+	owned = ClientContext::FromServerContext(*parent);
+	return owned.get();
+}
+
+
+AsyncServiceConnector::Target* AsyncServiceConnector::PickLeastLoaded(CircuitBreaker::Ticket& ticket) {
+	const size_t n = targets_.size();
+	if (n == 1) return targets_[0]->breaker.Allow(&ticket)? targets_[0].get(): nullptr;
+	// Targets yet to report are assumed to have the average latency.
+	std::vector<LoadReport> loads(n);
+	std::vector<bool> reported(n);
+	double sum = 0;
+	unsigned count = 0;
+	for (size_t i = 0; i < n; ++i) {
+		reported[i] = targets_[i]->GetLoad(loads[i]) && loads[i].latencyUs != 0;
+		if (reported[i]) {
+			sum += loads[i].latencyUs;
+			++count;
+		}
+	}
+	const double average = count? sum / count: 1;
+	auto cost = [&](size_t i) {
+		double latency = reported[i]? loads[i].latencyUs: average;
+		double ahead = std::max(targets_[i]->outstanding.load(std::memory_order_relaxed), 0) + loads[i].queued + 1;
+		return latency * ahead / std::max(1.0 - loads[i].utilization, 0.05);
+	};
+	// Two choices rather than the minimum, so connectors acting on the same
+	// reports do not all pile onto one target.
+	uint64_t r = nextTarget_.fetch_add(1, std::memory_order_relaxed) * 0x9E3779B97F4A7C15ull;
+	r ^= r >> 29;
+	size_t a = size_t(r % n);
+	size_t b = (a + 1 + size_t((r >> 32) % (n - 1))) % n;
+	if (cost(b) < cost(a)) std::swap(a, b);
+	if (targets_[a]->breaker.Allow(&ticket)) return targets_[a].get();
+	if (targets_[b]->breaker.Allow(&ticket)) return targets_[b].get();
+	for (size_t i = 0; i < n; ++i) {
+		if (i != a && i != b && targets_[i]->breaker.Allow(&ticket)) return targets_[i].get();
+	}
+	return nullptr;
+}
+
+
+unsigned AsyncServiceConnector::PreferredTarget(const std::string& lucid) const {
+	const uint64_t user = RendezvousHash(lucid);
+	unsigned best = 0;
+	uint64_t bestScore = 0;
+	for (size_t i = 0; i < targets_.size(); ++i) {
+		uint64_t score = RendezvousScore(user, targets_[i]->hash);
+		if (i == 0 || score > bestScore) {
+			best = unsigned(i);
+			bestScore = score;
+		}
+	}
+	return best;
+}
+
+
+AsyncServiceConnector::Target* AsyncServiceConnector::PickByAffinity(const std::string& lucid,
+		CircuitBreaker::Ticket& ticket) {
+	const size_t n = targets_.size();
+	if (n == 1) return targets_[0]->breaker.Allow(&ticket)? targets_[0].get(): nullptr;
+	std::vector<uint64_t> hashes(n);
+	std::vector<int64_t> loads(n);
+	for (size_t i = 0; i < n; ++i) {
+		hashes[i] = targets_[i]->hash;
+		loads[i] = targets_[i]->outstanding.load(std::memory_order_relaxed);
+	}
+	std::vector<std::pair<size_t, size_t>> order;
+	BoundedLoadOrder(RendezvousHash(lucid), hashes, loads, affinity_.loadBound, order);
+	// When the targets within the bound are all ejected, overload the others.
+	for (auto& choice: order) {
+		Target* target = targets_[choice.first].get();
+		if (!target->breaker.Allow(&ticket)) continue;
+		if (choice.second != 0) target->spills.fetch_add(1, std::memory_order_relaxed);
+		return target;
+	}
+	return nullptr;
+}
+
+
+template<class ResponseType, class StartFn>
+std::shared_ptr<RpcCall> AsyncServiceConnector::StartAsync(const char* method, ClientContext* context,
+		const std::string* lucid, bool balanced, StartFn start) {
+	typedef TypedRpcCall<ResponseType> _RpcCall;
 	assert(runningAsync_.load());
-	_RpcCall* tag = new _RpcCall(stub_->Asynclearn((context == nullptr)? &context_: context, request, cq_.get()));
-	tag->Ref(); // one for worker thread
-	tag->Finish();
+	std::unique_ptr<ClientContext> owned;
+	Status status;
+	ClientContext* ctx = ContextFor(context, owned, status);
+	CircuitBreaker::Ticket ticket;
+	Target* target = (ctx != nullptr)? AllowTarget(lucid, balanced, ticket): nullptr;
+	_RpcCall* tag;
+	if (target != nullptr) {
+		TraceSpan span;
+		if (span.StartClient(method)) span.Inject(*ctx);
+		target->attempts.fetch_add(1, std::memory_order_relaxed);
+		++target->outstanding;
+		tag = new _RpcCall(start(ctx, target), target, ticket);
+		tag->context_ = std::move(owned);
+		tag->ctx_ = ctx;
+		tag->span_ = span;
+		tag->Ref(); // one for worker thread
+		tag->Finish();
+	} else {
+		tag = new _RpcCall(nullptr, targets_[0].get(), CircuitBreaker::kAnyTicket);
+		tag->Fail((ctx == nullptr)? status: CircuitOpenStatus());
+	}
 	return std::shared_ptr<RpcCall>(dynamic_cast<RpcCall*>(tag), RefDeleter<RpcCall>());
 }
 
 
+std::shared_ptr<RpcCall> AsyncServiceConnector::learnAsync(const Request& request, ::grpc::ClientContext* context) {
+	return StartAsync<Empty>("learn", context, &request.lucid(), false, [&](ClientContext* ctx, Target* target) {
+		return target->stub->Asynclearn(ctx, request, cq_.get());
+	});
+}
+
+
 std::shared_ptr<RpcCall> AsyncServiceConnector::createAsync(const Request& request, ::grpc::ClientContext* context) {
-	typedef TypedRpcCall<Empty> _RpcCall;
-	assert(runningAsync_.load());
-	_RpcCall* tag = new _RpcCall(stub_->Asynccreate((context == nullptr)? &context_: context, request, cq_.get()));
-	tag->Ref(); // one for worker thread
-	tag->Finish();
-	return std::shared_ptr<RpcCall>(dynamic_cast<RpcCall*>(tag), RefDeleter<RpcCall>());
+	return StartAsync<Empty>("create", context, &request.lucid(), false, [&](ClientContext* ctx, Target* target) {
+		return target->stub->Asynccreate(ctx, request, cq_.get());
+	});
 }
 
 
 std::shared_ptr<RpcCall> AsyncServiceConnector::inferAsync(const Request& request, ::grpc::ClientContext* context) {
-	typedef TypedRpcCall<Response> _RpcCall;
 	assert(runningAsync_.load());
-	_RpcCall* tag = new _RpcCall(stub_->Asyncinfer((context == nullptr)? &context_: context, request, cq_.get())); 
-	tag->Ref(); // one for worker thread
-	tag->Finish();
-	return std::shared_ptr<RpcCall>(dynamic_cast<RpcCall*>(tag), RefDeleter<RpcCall>());
+	if (IsHedged()) {
+		HedgedCall* call = new HedgedCall(this, request, context);
+		call->Start();
+		return std::shared_ptr<RpcCall>(call, RefDeleter<RpcCall>());
+	}
+	return StartAsync<Response>("infer", context, &request.lucid(), true, [&](ClientContext* ctx, Target* target) {
+		return target->stub->Asyncinfer(ctx, request, cq_.get());
+	});
+}
+
+
+void AsyncServiceConnector::SetCircuitBreakerPolicy(const CircuitBreakerPolicy& policy) {
+	for (auto& target: targets_)
+		target->breaker.SetPolicy(policy);
+}
+
+
+std::vector<TargetStats> AsyncServiceConnector::GetTargetStats() const {
+	std::vector<TargetStats> stats(targets_.size());
+	for (size_t i = 0; i < targets_.size(); ++i) {
+		const Target& t = *targets_[i];
+		stats[i].target = t.name;
+		stats[i].attempts = t.attempts.load(std::memory_order_relaxed);
+		stats[i].hedges = t.hedges.load(std::memory_order_relaxed);
+		stats[i].retries = t.retries.load(std::memory_order_relaxed);
+		stats[i].wins = t.wins.load(std::memory_order_relaxed);
+		stats[i].errors = t.errors.load(std::memory_order_relaxed);
+		stats[i].p50Micros = t.latency.Percentile(0.5);
+		stats[i].p99Micros = t.latency.Percentile(0.99);
+		stats[i].breaker = t.breaker.GetState();
+		stats[i].rejected = t.breaker.GetRejected();
+		stats[i].ejections = t.breaker.GetOpened();
+		t.GetLoad(stats[i].load);
+		stats[i].spills = t.spills.load(std::memory_order_relaxed);
+	}
+	return stats;
+}
+
+
+namespace {
+
+/// Batches of blobs stay under gRPC's default 4MB receive limit.
+const size_t kMaxUploadBytes = 3 << 20;
+/// Forget the known digests past this many.
+const size_t kMaxKnownBlobs = 1 << 16;
+
+/// Give a step of learnDedup its own context with the caller's deadline.
+void CopyDeadline(ClientContext& ctx, ClientContext* caller) {
+	if (caller != nullptr) ctx.set_deadline(caller->deadline());
+}
+
+} // namespace
+
+
+Status AsyncServiceConnector::UploadBlobs(const std::vector<const std::string*>& blobs, ClientContext* context, Target* target) {
+	BlobUpload upload;
+	size_t bytes = 0;
+	for (size_t i = 0; i < blobs.size(); ++i) {
+		upload.add_blobs(*blobs[i]);
+		bytes += blobs[i]->size();
+		if (bytes < kMaxUploadBytes && i + 1 < blobs.size()) continue;
+		ClientContext ctx;
+		CopyDeadline(ctx, context);
+		Status status = CallOn("putBlobs", &ctx, target, [&](ClientContext* c, Target* t) {
+			Empty e;
+			return t->stub->putBlobs(c, upload, &e);
+		});
+		if (!status.ok()) return status;
+		upload.clear_blobs();
+		bytes = 0;
+	}
+	return Status::OK;
+}
+
+
+Status AsyncServiceConnector::learnDedup(const Request& request, ClientContext* context) {
+	Request slim(request);
+	BlobOffer offer;
+	std::vector<const std::string*> blobs;
+	std::unordered_set<std::string> offered;
+	uint64_t bytes = 0;
+	// Every step goes to the target keeping the user's blobs, even one over
+	// the load bound.
+	Target* home = (affinity_.enabled && !request.lucid().empty())?
+		targets_[PreferredTarget(request.lucid())].get(): targets_[0].get();
+	{
+		std::lock_guard<std::mutex> guard(blobMu_);
+		for (int c = 0; c < slim.spec().content_size(); ++c) {
+			QueryInput* input = slim.mutable_spec()->mutable_content(c);
+			if (input->digests_size() != 0 || ServiceNames::toTypeId(input->type()) != ServiceNames::IMAGE_TYPE) continue;
+			const QueryInput& original = request.spec().content(c);
+			for (int i = 0; i < original.data_size(); ++i) {
+				const std::string& data = original.data(i);
+				std::string digest = BlobStore::Digest(data.data(), data.size());
+				input->add_digests(digest);
+				input->mutable_data(i)->clear();
+				bytes += data.size();
+				if (home->knownBlobs.count(digest) == 0 && offered.insert(digest).second) {
+					offer.add_digests(digest);
+					blobs.push_back(&data);
+				}
+			}
+		}
+	}
+	if (bytes == 0) return learn(request, context);
+
+	if (offer.digests_size() != 0) {
+		BlobOfferReply reply;
+		ClientContext ctx;
+		CopyDeadline(ctx, context);
+		Status status = CallOn("offerBlobs", &ctx, home, [&](ClientContext* c, Target* t) {
+			return t->stub->offerBlobs(c, offer, &reply);
+		});
+		if (status.error_code() == ::grpc::StatusCode::UNIMPLEMENTED) return learn(request, context);
+		if (!status.ok()) return status;
+		std::unordered_set<std::string> missing(reply.missing().begin(), reply.missing().end());
+		std::vector<const std::string*> upload;
+		for (int i = 0; i < offer.digests_size(); ++i) {
+			if (missing.count(offer.digests(i)) != 0) upload.push_back(blobs[i]);
+		}
+		status = UploadBlobs(upload, context, home);
+		if (!status.ok()) return status;
+		std::lock_guard<std::mutex> guard(blobMu_);
+		if (home->knownBlobs.size() + offered.size() > kMaxKnownBlobs) home->knownBlobs.clear();
+		home->knownBlobs.insert(offered.begin(), offered.end());
+		blobStats_.offered += offer.digests_size();
+		blobStats_.uploaded += upload.size();
+		for (const std::string* blob: upload) bytes -= blob->size();
+	}
+
+	ClientContext ctx;
+	CopyDeadline(ctx, context);
+	Status status = CallOn("learn", &ctx, home, [&](ClientContext* c, Target* t) {
+		Empty e;
+		return t->stub->learn(c, slim, &e);
+	});
+	if (status.error_code() == ::grpc::StatusCode::FAILED_PRECONDITION) {
+		// The service lost a blob, garbage collected or restarted.
+		{
+			std::lock_guard<std::mutex> guard(blobMu_);
+			home->knownBlobs.clear();
+			++blobStats_.fallbacks;
+		}
+		ClientContext retry;
+		CopyDeadline(retry, context);
+		return learn(request, &retry);
+	}
+	if (status.ok()) {
+		std::lock_guard<std::mutex> guard(blobMu_);
+		blobStats_.bytesSaved += bytes;
+	}
+	return status;
+}
+
+
+BlobDedupStats AsyncServiceConnector::GetBlobDedupStats() const {
+	std::lock_guard<std::mutex> guard(blobMu_);
+	return blobStats_;
 }
 
 } // namespace lucida
@@ -33,12 +33,16 @@
 
 namespace lucida {
 
-const char* ServiceNames::learnCommandName = "knowledge";
-const char* ServiceNames::createCommandName = "create";
-const char* ServiceNames::inferCommandName = "query";
-const char* ServiceNames::textTypeName = "text";
-const char* ServiceNames::urlTypeName = "url";
-const char* ServiceNames::imageTypeName = "image";
-const char* ServiceNames::unlearnTypeName = "unlearn";
+constexpr const char* ServiceNames::learnCommandName;
+constexpr const char* ServiceNames::createCommandName;
+constexpr const char* ServiceNames::inferCommandName;
+constexpr const char* ServiceNames::textTypeName;
+constexpr const char* ServiceNames::urlTypeName;
+constexpr const char* ServiceNames::imageTypeName;
+constexpr const char* ServiceNames::unlearnTypeName;
+constexpr const char* const ServiceNames::commandNames[ServiceNames::COMMAND_COUNT];
+constexpr const char* const ServiceNames::typeNames[ServiceNames::TYPE_COUNT];
+constexpr detail::SlotTable<1u << ServiceNames::hashBits> ServiceNames::commandSlots;
+constexpr detail::SlotTable<1u << ServiceNames::hashBits> ServiceNames::typeSlots;
 
 } // namespace lucida
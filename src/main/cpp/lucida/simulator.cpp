@@ -0,0 +1,425 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <glog/logging.h>
+#include <grpc++/alarm.h>
+#include <lucida/call_scope.h>
+#include <lucida/simulator.h>
+
+using ::google::protobuf::Empty;
+
+namespace lucida {
+
+namespace {
+
+// Waits are capped at an hour.
+const double maxLatencyUs = 3600.0 * 1e6;
+
+bool ParseNumber(const std::string& s, double& value) {
+	if (s.empty()) return false;
+	char* end = nullptr;
+	value = strtod(s.c_str(), &end);
+	return *end == '\0' && std::isfinite(value) && value >= 0;
+}
+
+
+std::vector<std::string> Split(const std::string& s, char sep) {
+	std::vector<std::string> parts;
+	size_t start = 0;
+	for (size_t i = 0; i <= s.size(); ++i) {
+		if (i == s.size() || s[i] == sep) {
+			parts.push_back(s.substr(start, i - start));
+			start = i + 1;
+		}
+	}
+	return parts;
+}
+
+
+bool ParseLatency(const std::string& s, LatencyModel& model) {
+	std::vector<std::string> parts = Split(s, ':');
+	std::string kind = (parts.size() > 1)? parts[0]: "fixed";
+	std::vector<double> args;
+	for (size_t i = (parts.size() > 1)? 1: 0; i < parts.size(); ++i) {
+		double v;
+		if (!ParseNumber(parts[i], v)) return false;
+		args.push_back(v);
+	}
+	if (kind == "fixed" && args.size() == 1) {
+		model.kind = LatencyModel::FIXED;
+	} else if (kind == "uniform" && args.size() == 2 && args[0] <= args[1]) {
+		model.kind = LatencyModel::UNIFORM;
+	} else if (kind == "exp" && args.size() == 1) {
+		model.kind = LatencyModel::EXPONENTIAL;
+	} else if (kind == "lognormal" && args.size() == 2) {
+		model.kind = LatencyModel::LOGNORMAL;
+	} else {
+		return false;
+	}
+	model.a = args[0];
+	model.b = (args.size() > 1)? args[1]: 0;
+	return true;
+}
+
+
+// A graph node index, -1 if the tag is not one.
+int ParseIndex(const std::string& tag) {
+	if (tag.empty()) return -1;
+	char* end = nullptr;
+	long i = strtol(tag.c_str(), &end, 10);
+	return (*end == '\0' && i >= 0 && i < (1 << 20))? int(i): -1;
+}
+
+
+// Keep the completion queue thread busy.
+void BurnCpu(uint32_t us) {
+	if (us == 0) return;
+	auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
+	uint64_t x = 88172645463325252ull;
+	do {
+		for (unsigned i = 0; i < 256; ++i) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+		}
+		// Keep the loop from being optimized away.
+		__asm__ __volatile__("" : : "r"(x));
+	} while (std::chrono::steady_clock::now() < end);
+}
+
+
+void AppendPayload(Response& response, uint32_t bytes) {
+	response.mutable_msg()->append(bytes, 'x');
+}
+
+void AppendPayload(Empty&, uint32_t) {}
+
+void AppendChild(Response& response, RpcCall& rpc) {
+	Response* child = nullptr;
+	if (rpc.Get(child) && child != nullptr)
+		response.mutable_msg()->append(child->msg());
+}
+
+void AppendChild(Empty&, RpcCall&) {}
+
+
+/// Runs a function on a server completion queue, inside a call scope, once
+/// an alarm fires.
+class AlarmTag: public UntypedCall {
+public:
+	/// Post fn. Safe from any thread.
+	///
+	/// @param[in]  frame   The call scope, frame.cq must be set.
+	/// @param[in]  us      Delay in microseconds.
+	/// @param[in]  fn      What to run.
+	static void Post(const CallScope::Frame& frame, uint64_t us, std::function<void()> fn) {
+		AlarmTag* tag = new AlarmTag(frame, std::move(fn));
+		gpr_timespec when = gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC), gpr_time_from_micros(us, GPR_TIMESPAN));
+		tag->alarm_.Set(frame.cq, when, tag);
+	}
+
+	void Proceed(bool) override {
+		{
+			CallScope scope(frame_);
+			fn_();
+		}
+		delete this;
+	}
+	UntypedCall* CreateListener() override { return nullptr; }
+	const char* GetMethodName() const override { return "alarm"; }
+
+private:
+	AlarmTag(const CallScope::Frame& frame, std::function<void()> fn): frame_(frame), fn_(std::move(fn)) {
+		status_ = FINISH;
+	}
+	::grpc::Alarm alarm_;
+	CallScope::Frame frame_;
+	std::function<void()> fn_;
+};
+
+} // namespace
+
+
+uint64_t LatencyModel::Sample(std::mt19937_64& rng) const {
+	double us = 0;
+	switch (kind) {
+	case FIXED:
+		us = a;
+		break;
+	case UNIFORM:
+		us = std::uniform_real_distribution<double>(a, b)(rng);
+		break;
+	case EXPONENTIAL:
+		if (a > 0) us = std::exponential_distribution<double>(1.0 / a)(rng);
+		break;
+	case LOGNORMAL:
+		if (a > 0) us = std::lognormal_distribution<double>(std::log(a), b)(rng);
+		break;
+	}
+	return uint64_t(std::min(std::max(us, 0.0), maxLatencyUs));
+}
+
+
+bool ParseMethodProfile(const std::string& spec, MethodProfile& profile) {
+	if (spec.empty()) return true;
+	MethodProfile parsed = profile;
+	for (const std::string& item: Split(spec, ',')) {
+		size_t eq = item.find('=');
+		std::string key = item.substr(0, eq);
+		std::string value = (eq == std::string::npos)? std::string(): item.substr(eq + 1);
+		double v = 0;
+		bool ok = false;
+		if (key == "latency") {
+			ok = ParseLatency(value, parsed.latency);
+		} else if (key == "cpu") {
+			ok = ParseNumber(value, v) && v <= maxLatencyUs;
+			parsed.cpuUs = uint32_t(v);
+		} else if (key == "size") {
+			ok = ParseNumber(value, v) && v < (1u << 30);
+			parsed.responseBytes = uint32_t(v);
+		} else if (key == "errors") {
+			ok = ParseNumber(value, v) && v <= 1;
+			parsed.errorRate = v;
+		} else if (key == "code") {
+			ok = ParseNumber(value, v) && v >= 1 && v <= 16 && v == std::floor(v);
+			parsed.errorCode = ::grpc::StatusCode(int(v));
+		}
+		if (!ok) {
+			LOG(ERROR) << "ParseMethodProfile: bad item '" << item << "' in '" << spec << "'";
+			return false;
+		}
+	}
+	profile = parsed;
+	return true;
+}
+
+
+std::vector<int> GraphChildren(const Request& request) {
+	std::vector<int> children;
+	const auto& content = request.spec().content();
+	if (content.size() == 0) return children;
+	const QueryInput& root = content.Get(0);
+	for (int t = 1; t < root.tags_size(); ++t) {
+		int i = ParseIndex(root.tags(t));
+		if (i <= 0 || i >= content.size()) continue;
+		const QueryInput& child = content.Get(i);
+		if (child.tags_size() == 0 || child.tags(0).empty()) continue;
+		if (std::find(children.begin(), children.end(), i) == children.end())
+			children.push_back(i);
+	}
+	return children;
+}
+
+
+Request ForwardedRequest(const Request& request, int child) {
+	Request forwarded(request);
+	auto* content = forwarded.mutable_spec()->mutable_content();
+	// Node 0 has been served.
+	QueryInput* root = content->Mutable(0);
+	while (root->tags_size() > 1)
+		root->mutable_tags()->RemoveLast();
+	const std::string childTag = std::to_string(child);
+	for (QueryInput& node: *content) {
+		for (int t = 1; t < node.tags_size(); ++t) {
+			int i = ParseIndex(node.tags(t));
+			if (i == 0)
+				node.set_tags(t, childTag);
+			else if (i == child)
+				node.set_tags(t, "0");
+		}
+	}
+	content->SwapElements(0, child);
+	return forwarded;
+}
+
+
+/// A deferred call: waits, forwards to the children of node 0 and finishes
+/// when they have. Everything but the continuations of the children runs on
+/// the call's completion queue thread.
+template<class ResponseType>
+class SimulatorHandler::Run: public std::enable_shared_from_this<Run<ResponseType>> {
+public:
+	Run(SimulatorHandler* handler, TypedCall<Request, ResponseType>* call, Method method,
+			bool fail, const CallScope::Frame& frame):
+		handler_(handler), call_(call), method_(method), fail_(fail), frame_(frame), pending_(0) {
+	}
+
+	void Start(uint64_t waitUs) {
+		auto self = this->shared_from_this();
+		AlarmTag::Post(frame_, waitUs, [self]() { self->Forward(); });
+	}
+
+private:
+	void Forward() {
+		::grpc::Status status = CallScope::Check(call_->GetServerContext());
+		if (!status.ok()) {
+			call_->FinishWithError(status);
+			return;
+		}
+		if (fail_) {
+			handler_->injected_.fetch_add(1, std::memory_order_relaxed);
+			call_->FinishWithError(::grpc::Status(handler_->profiles_[method_].errorCode, "injected error"));
+			return;
+		}
+		std::vector<int> children = GraphChildren(call_->request_);
+		if (children.empty()) {
+			Done();
+			return;
+		}
+		rpcs_.resize(children.size());
+		pending_.store(children.size());
+		auto self = this->shared_from_this();
+		for (size_t i = 0; i < children.size(); ++i) {
+			Request request = ForwardedRequest(call_->request_, children[i]);
+			AsyncServiceConnector* connector = handler_->GetConnector(request.spec().content(0).tags(0));
+			switch (method_) {
+			case CREATE: rpcs_[i] = connector->createAsync(request); break;
+			case LEARN: rpcs_[i] = connector->learnAsync(request); break;
+			case INFER: rpcs_[i] = connector->inferAsync(request); break;
+			}
+			handler_->forwarded_.fetch_add(1, std::memory_order_relaxed);
+			// The last child to finish hops back to the server's queue.
+			rpcs_[i]->Then([self]() {
+				if (self->pending_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+					AlarmTag::Post(self->frame_, 0, [self]() { self->Done(); });
+			});
+		}
+	}
+
+	void Done() {
+		for (auto& rpc: rpcs_) {
+			if (!rpc->IsOK()) {
+				handler_->downstreamErrors_.fetch_add(1, std::memory_order_relaxed);
+				call_->FinishWithError(rpc->GetStatus().ok()?
+					::grpc::Status(::grpc::StatusCode::UNAVAILABLE, "child call failed"): rpc->GetStatus());
+				return;
+			}
+		}
+		AppendPayload(call_->response_, handler_->profiles_[method_].responseBytes);
+		for (auto& rpc: rpcs_)
+			AppendChild(call_->response_, *rpc);
+		call_->Finish();
+	}
+
+	SimulatorHandler* handler_;
+	TypedCall<Request, ResponseType>* call_;
+	Method method_;
+	bool fail_;
+	CallScope::Frame frame_;
+	std::vector<std::shared_ptr<RpcCall>> rpcs_;
+	std::atomic<size_t> pending_;
+};
+
+
+SimulatorHandler::SimulatorHandler(const MethodProfile& create, const MethodProfile& learn, const MethodProfile& infer, uint64_t seed):
+	rng_(seed), calls_(0), injected_(0), forwarded_(0), downstreamErrors_(0) {
+	profiles_[CREATE] = create;
+	profiles_[LEARN] = learn;
+	profiles_[INFER] = infer;
+}
+
+
+SimulatorHandler::~SimulatorHandler() {
+	for (auto& c: connectors_)
+		c.second->Shutdown();
+}
+
+
+void SimulatorHandler::OnCreate(TypedCall<Request, Empty>* call) {
+	Simulate(call, CREATE);
+}
+
+
+void SimulatorHandler::OnLearn(TypedCall<Request, Empty>* call) {
+	Simulate(call, LEARN);
+}
+
+
+void SimulatorHandler::OnInfer(TypedCall<Request, Response>* call) {
+	Simulate(call, INFER);
+}
+
+
+template<class ResponseType>
+void SimulatorHandler::Simulate(TypedCall<Request, ResponseType>* call, Method method) {
+	const MethodProfile& profile = profiles_[method];
+	calls_.fetch_add(1, std::memory_order_relaxed);
+	BurnCpu(profile.cpuUs);
+	bool fail;
+	uint64_t waitUs;
+	{
+		std::lock_guard<std::mutex> guard(rngMu_);
+		fail = profile.errorRate > 0 && std::uniform_real_distribution<double>()(rng_) < profile.errorRate;
+		waitUs = profile.latency.Sample(rng_);
+	}
+	CallScope::Frame frame = CallScope::Capture();
+	if (frame.cq == nullptr || (waitUs == 0 && (fail || GraphChildren(call->request_).empty()))) {
+		// Nothing to wait for, or not served by an async acceptor.
+		if (fail) {
+			injected_.fetch_add(1, std::memory_order_relaxed);
+			call->FinishWithError(::grpc::Status(profile.errorCode, "injected error"));
+		} else {
+			AppendPayload(call->response_, profile.responseBytes);
+		}
+		return;
+	}
+	call->Defer();
+	std::make_shared<Run<ResponseType>>(this, call, method, fail, frame)->Start(waitUs);
+}
+
+
+AsyncServiceConnector* SimulatorHandler::GetConnector(const std::string& hostAndPort) {
+	std::lock_guard<std::mutex> guard(connectorsMu_);
+	std::unique_ptr<AsyncServiceConnector>& connector = connectors_[hostAndPort];
+	if (!connector) {
+		connector.reset(new AsyncServiceConnector(hostAndPort.c_str()));
+		connector->Start();
+	}
+	return connector.get();
+}
+
+
+SimulatorStats SimulatorHandler::GetStats() const {
+	SimulatorStats stats;
+	stats.calls = calls_.load(std::memory_order_relaxed);
+	stats.injected = injected_.load(std::memory_order_relaxed);
+	stats.forwarded = forwarded_.load(std::memory_order_relaxed);
+	stats.downstreamErrors = downstreamErrors_.load(std::memory_order_relaxed);
+	return stats;
+}
+
+}       // namespace lucida
@@ -0,0 +1,332 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <lucida/text_index.h>
+#include <algorithm>
+#include <cmath>
+
+namespace lucida {
+namespace {
+
+/// Gaps are from the previous doc id, which before the first is kNone so
+/// that doc id 0 has a gap of 1.
+const uint32_t kNone = UINT32_MAX;
+/// Doc id of an exhausted cursor.
+const uint32_t kEnd = UINT32_MAX;
+
+void PutVarint(std::string& out, uint32_t v) {
+	while (v >= 0x80) {
+		out.push_back(char(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back(char(v));
+}
+
+uint32_t GetVarint(const uint8_t*& p) {
+	uint32_t v = *p & 0x7f;
+	for (unsigned shift = 7; *p++ & 0x80; shift += 7)
+		v |= uint32_t(*p & 0x7f) << shift;
+	return v;
+}
+
+bool IsWordByte(unsigned char c) {
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+/// Best first by score.
+struct Better {
+	bool operator () (const ScoredPassage& a, const ScoredPassage& b) const { return a.score > b.score; }
+};
+
+/// BM25 of one term, with the length normalization of the collection
+/// worked out once per search.
+class Bm25 {
+public:
+	Bm25(const Bm25Params& params, uint64_t totalLength, size_t passages):
+		k1_(params.k1), base_(params.k1 * (1.0f - params.b)),
+		perLength_(params.k1 * params.b * passages / std::max<uint64_t>(totalLength, 1)) {}
+	float operator () (float idf, uint32_t tf, uint32_t length) const {
+		return idf * tf * (k1_ + 1.0f) / (tf + base_ + perLength_ * length);
+	}
+private:
+	float k1_;
+	float base_;
+	float perLength_;
+};
+
+/// Keep the best k in a heap with the worst on top.
+/// @return True if the passage was kept.
+bool Offer(std::vector<ScoredPassage>& heap, size_t k, uint32_t id, float score) {
+	if (heap.size() < k) {
+		heap.push_back(ScoredPassage{ id, score });
+		std::push_heap(heap.begin(), heap.end(), Better());
+		return true;
+	}
+	if (score <= heap.front().score) return false;
+	std::pop_heap(heap.begin(), heap.end(), Better());
+	heap.back() = ScoredPassage{ id, score };
+	std::push_heap(heap.begin(), heap.end(), Better());
+	return true;
+}
+
+} // namespace
+
+
+void Tokenize(const std::string& text, std::vector<std::string>& terms) {
+	terms.clear();
+	size_t i = 0;
+	while (i < text.size()) {
+		while (i < text.size() && !IsWordByte(text[i])) ++i;
+		size_t start = i;
+		while (i < text.size() && IsWordByte(text[i])) ++i;
+		if (i == start) break;
+		terms.emplace_back(text, start, i - start);
+		for (char& c: terms.back()) {
+			if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+		}
+	}
+}
+
+
+/// Walks a posting list in doc id order. Blocks are decoded whole when
+/// entered, so stepping is an array walk and a seek within a block is a
+/// binary search.
+class TextIndex::Cursor {
+public:
+	Cursor(const PostingList& list, float idf, float upperBound):
+		doc(kEnd), tf(0), idf(idf), upperBound(upperBound), list_(&list), block_(0), pos_(0), count_(0) {
+		Load(0);
+	}
+
+	uint32_t doc;
+	uint32_t tf;
+	float idf;
+	/// The most the term adds to any passage's score.
+	float upperBound;
+
+	void Next() {
+		if (++pos_ < count_) {
+			doc = docs_[pos_];
+			tf = tfs_[pos_];
+		} else if (++block_ < list_->blocks.size()) {
+			Load(block_);
+		} else {
+			doc = kEnd;
+		}
+	}
+
+	/// The block that would hold target.
+	/// @return     nullptr if every doc id left is before target.
+	const Block* BlockAt(uint32_t target) const {
+		const std::vector<Block>& blocks = list_->blocks;
+		if (blocks[block_].lastDoc >= target) return &blocks[block_];
+		auto it = std::lower_bound(blocks.begin() + block_ + 1, blocks.end(), target,
+			[](const Block& b, uint32_t d) { return b.lastDoc < d; });
+		return (it == blocks.end())? nullptr: &*it;
+	}
+
+	/// Move to the first doc id at or after target, skipping whole blocks.
+	void Seek(uint32_t target) {
+		if (doc >= target) return;
+		const Block* block = BlockAt(target);
+		if (block == nullptr) {
+			doc = kEnd;
+			return;
+		}
+		if (block != &list_->blocks[block_]) {
+			block_ = block - list_->blocks.data();
+			Load(block_);
+		}
+		pos_ = std::lower_bound(docs_ + pos_, docs_ + count_, target) - docs_;
+		doc = docs_[pos_];
+		tf = tfs_[pos_];
+	}
+
+private:
+	const PostingList* list_;
+	size_t block_;
+	uint32_t pos_;
+	uint32_t count_;
+	uint32_t docs_[kBlockSize];
+	uint32_t tfs_[kBlockSize];
+
+	void Load(size_t b) {
+		const Block& block = list_->blocks[b];
+		const uint8_t* p = reinterpret_cast<const uint8_t*>(list_->bytes.data()) + block.offset;
+		uint32_t prev = (b == 0)? kNone: list_->blocks[b - 1].lastDoc;
+		for (uint32_t i = 0; i < block.count; ++i) {
+			prev += GetVarint(p);
+			docs_[i] = prev;
+			tfs_[i] = GetVarint(p);
+		}
+		count_ = block.count;
+		pos_ = 0;
+		doc = docs_[0];
+		tf = tfs_[0];
+	}
+};
+
+
+uint32_t TextIndex::Add(const std::string& passage) {
+	uint32_t id = passages_.size();
+	std::vector<std::string> terms;
+	Tokenize(passage, terms);
+	std::sort(terms.begin(), terms.end());
+	uint32_t length = terms.size();
+	for (size_t i = 0; i < terms.size(); ) {
+		size_t j = i + 1;
+		while (j < terms.size() && terms[j] == terms[i]) ++j;
+		uint32_t tf = j - i;
+		PostingList& list = postings_[terms[i]];
+		if (list.blocks.empty() || list.blocks.back().count == kBlockSize)
+			list.blocks.push_back(Block{ uint32_t(list.bytes.size()), 0, kNone });
+		Block& block = list.blocks.back();
+		uint32_t prev = (block.count != 0)? block.lastDoc:
+			(list.blocks.size() > 1)? list.blocks[list.blocks.size() - 2].lastDoc: kNone;
+		PutVarint(list.bytes, id - prev);
+		PutVarint(list.bytes, tf);
+		++block.count;
+		block.lastDoc = id;
+		++list.docs;
+		list.maxTf = std::max(list.maxTf, tf);
+		list.minLength = std::min(list.minLength, length);
+		i = j;
+	}
+	passages_.push_back(passage);
+	lengths_.push_back(length);
+	totalLength_ += length;
+	return id;
+}
+
+
+float TextIndex::Idf(const PostingList& list) const {
+	double n = passages_.size();
+	return std::log(1.0 + (n - list.docs + 0.5) / (list.docs + 0.5));
+}
+
+
+
+
+void TextIndex::Lookup(const std::string& query, std::vector<const PostingList*>& lists) const {
+	std::vector<std::string> terms;
+	Tokenize(query, terms);
+	std::sort(terms.begin(), terms.end());
+	terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+	lists.clear();
+	for (const std::string& term: terms) {
+		auto it = postings_.find(term);
+		if (it != postings_.end()) lists.push_back(&it->second);
+	}
+}
+
+
+void TextIndex::Search(const std::string& query, size_t k, std::vector<ScoredPassage>& results) const {
+	results.clear();
+	std::vector<const PostingList*> lists;
+	Lookup(query, lists);
+	if (lists.empty() || k == 0) return;
+	Bm25 score(params_, totalLength_, passages_.size());
+	std::vector<Cursor> cursors;
+	cursors.reserve(lists.size());
+	for (const PostingList* list: lists) {
+		float idf = Idf(*list);
+		cursors.push_back(Cursor(*list, idf, score(idf, list->maxTf, list->minLength)));
+	}
+	// By upper bound, with the running sums of the bounds.
+	std::sort(cursors.begin(), cursors.end(), [](const Cursor& a, const Cursor& b) { return a.upperBound < b.upperBound; });
+	std::vector<float> bounds(cursors.size());
+	float sum = 0;
+	for (size_t i = 0; i < cursors.size(); ++i)
+		bounds[i] = sum += cursors[i].upperBound;
+
+	// Terms before essential cannot lift a passage into the top k by
+	// themselves. Candidates come from the essential terms only, and the
+	// others are looked up in them while they can still make a difference.
+	size_t essential = 0;
+	for (;;) {
+		uint32_t doc = kEnd;
+		for (size_t i = essential; i < cursors.size(); ++i)
+			doc = std::min(doc, cursors[i].doc);
+		if (doc == kEnd) break;
+		float total = 0;
+		for (size_t i = essential; i < cursors.size(); ++i) {
+			Cursor& c = cursors[i];
+			if (c.doc != doc) continue;
+			total += score(c.idf, c.tf, lengths_[doc]);
+			c.Next();
+		}
+		float threshold = (results.size() < k)? 0: results.front().score;
+		for (size_t i = essential; i-- > 0; ) {
+			if (results.size() == k && total + bounds[i] <= threshold) break;
+			Cursor& c = cursors[i];
+			c.Seek(doc);
+			if (c.doc == doc) total += score(c.idf, c.tf, lengths_[doc]);
+		}
+		if (Offer(results, k, doc, total) && results.size() == k) {
+			while (essential < cursors.size() && bounds[essential] <= results.front().score)
+				++essential;
+			if (essential == cursors.size()) break;
+		}
+	}
+	std::sort_heap(results.begin(), results.end(), Better());
+}
+
+
+void TextIndex::SearchExact(const std::string& query, size_t k, std::vector<ScoredPassage>& results) const {
+	results.clear();
+	std::vector<const PostingList*> lists;
+	Lookup(query, lists);
+	if (lists.empty() || k == 0) return;
+	Bm25 score(params_, totalLength_, passages_.size());
+	std::vector<float> scores(passages_.size(), 0.0f);
+	for (const PostingList* list: lists) {
+		float idf = Idf(*list);
+		for (Cursor c(*list, idf, 0); c.doc != kEnd; c.Next())
+			scores[c.doc] += score(idf, c.tf, lengths_[c.doc]);
+	}
+	for (uint32_t id = 0; id < scores.size(); ++id) {
+		if (scores[id] > 0) Offer(results, k, id, scores[id]);
+	}
+	std::sort_heap(results.begin(), results.end(), Better());
+}
+
+
+size_t TextIndex::MemoryUsage() const {
+	size_t n = sizeof(*this) + passages_.capacity() * sizeof(std::string) + lengths_.capacity() * sizeof(uint32_t);
+	for (const std::string& passage: passages_) n += passage.capacity();
+	for (const auto& term: postings_) {
+		n += sizeof(term) + term.first.capacity() + term.second.bytes.capacity() +
+			term.second.blocks.capacity() * sizeof(Block);
+	}
+	return n;
+}
+
+} // namespace lucida
@@ -0,0 +1,378 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <lucida/trace.h>
+#include <lucida/call_scope.h>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <glog/logging.h>
+
+namespace lucida {
+
+std::atomic<bool> Tracer::enabled_(false);
+std::atomic<unsigned> Tracer::generation_(0);
+
+namespace {
+std::mutex configMu;
+std::string traceDir;
+std::string traceService;
+unsigned traceCapacity = 4096;
+
+// This thread's ring, replaced when the tracer is re-enabled.
+struct ThreadRing {
+	ThreadRing(): generation(0) {}
+	std::unique_ptr<TraceRing> ring;
+	unsigned generation;
+};
+
+std::string ToHex(uint64_t v) {
+	char buf[17];
+	snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)v);
+	return buf;
+}
+
+bool FindMetadata(const std::multimap<::grpc::string_ref, ::grpc::string_ref>& md, const char* key, std::string& value) {
+	auto it = md.find(key);
+	if (it == md.end()) return false;
+	value.assign(it->second.data(), it->second.size());
+	return true;
+}
+
+uint64_t SinceUs(int64_t startNs) {
+	int64_t d = Tracer::NowNs() - startNs;
+	return (d > 0)? d / 1000: 0;
+}
+}
+
+
+TraceRing::TraceRing(void* base, size_t size): base_(base), size_(size),
+	header_(static_cast<TraceRingHeader*>(base)),
+	records_(reinterpret_cast<SpanRecord*>(static_cast<char*>(base) + sizeof(TraceRingHeader))) {
+}
+
+
+TraceRing::~TraceRing() {
+	munmap(base_, size_);
+}
+
+
+TraceRing* TraceRing::Create(const std::string& path, const std::string& service, unsigned capacity) {
+	size_t size = sizeof(TraceRingHeader) + capacity * sizeof(SpanRecord);
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		LOG(ERROR) << "TraceRing: cannot create " << path;
+		return nullptr;
+	}
+	void* base = MAP_FAILED;
+	if (ftruncate(fd, size) == 0)
+		base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		LOG(ERROR) << "TraceRing: cannot map " << path;
+		return nullptr;
+	}
+	// The file is zero filled so every record starts with an even sequence.
+	TraceRingHeader* h = static_cast<TraceRingHeader*>(base);
+	h->version = TraceRingHeader::kVersion;
+	h->capacity = capacity;
+	h->recordSize = sizeof(SpanRecord);
+	h->pid = getpid();
+	h->tid = (int32_t)syscall(SYS_gettid);
+	h->head.store(0, std::memory_order_relaxed);
+	strncpy(h->service, service.c_str(), sizeof(h->service) - 1);
+	std::atomic_thread_fence(std::memory_order_release);
+	h->magic = TraceRingHeader::kMagic;
+	return new TraceRing(base, size);
+}
+
+
+TraceRing* TraceRing::Open(const std::string& path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return nullptr;
+	struct stat st;
+	void* base = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(TraceRingHeader))
+		base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) return nullptr;
+	const TraceRingHeader* h = static_cast<const TraceRingHeader*>(base);
+	if (h->magic != TraceRingHeader::kMagic || h->version != TraceRingHeader::kVersion ||
+			h->recordSize != sizeof(SpanRecord) ||
+			sizeof(TraceRingHeader) + (size_t)h->capacity * sizeof(SpanRecord) > (size_t)st.st_size) {
+		munmap(base, st.st_size);
+		return nullptr;
+	}
+	return new TraceRing(base, st.st_size);
+}
+
+
+void TraceRing::Append(const SpanRecord& record) {
+	uint64_t head = header_->head.load(std::memory_order_relaxed);
+	SpanRecord& slot = records_[head % header_->capacity];
+	uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+	slot.seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(reinterpret_cast<char*>(&slot) + sizeof(slot.seq), reinterpret_cast<const char*>(&record) + sizeof(record.seq),
+		sizeof(SpanRecord) - sizeof(record.seq));
+	slot.seq.store(seq + 2, std::memory_order_release);
+	header_->head.store(head + 1, std::memory_order_release);
+}
+
+
+bool TraceRing::Read(uint64_t index, SpanRecord& record) const {
+	const SpanRecord& slot = records_[index % header_->capacity];
+	uint32_t before = slot.seq.load(std::memory_order_acquire);
+	if (before == 0 || (before & 1) != 0) return false;
+	memcpy(reinterpret_cast<char*>(&record) + sizeof(record.seq), reinterpret_cast<const char*>(&slot) + sizeof(slot.seq),
+		sizeof(SpanRecord) - sizeof(record.seq));
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (slot.seq.load(std::memory_order_relaxed) != before) return false;
+	record.seq.store(before, std::memory_order_relaxed);
+	return true;
+}
+
+
+std::vector<SpanInfo> ReadTraceRings(const std::string& dir, uint64_t traceId) {
+	std::vector<SpanInfo> spans;
+	DIR* d = opendir(dir.c_str());
+	if (d == nullptr) return spans;
+	struct dirent* e;
+	while ((e = readdir(d)) != nullptr) {
+		std::string name(e->d_name);
+		if (name.size() < 5 || name.compare(name.size() - 5, 5, ".ring") != 0) continue;
+		std::unique_ptr<TraceRing> ring(TraceRing::Open(dir + "/" + name));
+		if (!ring) continue;
+		const TraceRingHeader& h = ring->GetHeader();
+		uint64_t head = h.head.load(std::memory_order_acquire);
+		uint64_t first = (head > h.capacity)? head - h.capacity: 0;
+		for (uint64_t i = first; i < head; ++i) {
+			SpanRecord r;
+			if (!ring->Read(i, r) || r.traceId == 0) continue;
+			if (traceId != 0 && r.traceId != traceId) continue;
+			SpanInfo info;
+			info.service.assign(h.service, strnlen(h.service, sizeof(h.service)));
+			info.pid = h.pid;
+			info.tid = h.tid;
+			info.kind = (SpanRecord::Kind)r.kind;
+			info.status = (::grpc::StatusCode)r.status;
+			info.traceId = r.traceId;
+			info.spanId = r.spanId;
+			info.parentId = r.parentId;
+			info.startNs = r.startNs;
+			info.queueUs = r.queueUs;
+			info.durationUs = r.durationUs;
+			info.downstreamUs = r.downstreamUs;
+			info.method.assign(r.method, strnlen(r.method, sizeof(r.method)));
+			spans.push_back(info);
+		}
+	}
+	closedir(d);
+	std::sort(spans.begin(), spans.end(), [](const SpanInfo& a, const SpanInfo& b) {
+		return a.startNs < b.startNs;
+	});
+	return spans;
+}
+
+
+void Tracer::Enable(const std::string& dir, const std::string& service, unsigned capacity) {
+	std::lock_guard<std::mutex> guard(configMu);
+	traceDir = dir;
+	traceService = service;
+	traceCapacity = capacity;
+	generation_.fetch_add(1);
+	enabled_.store(true);
+}
+
+
+void Tracer::Disable() {
+	std::lock_guard<std::mutex> guard(configMu);
+	generation_.fetch_add(1);
+	enabled_.store(false);
+}
+
+
+void Tracer::Record(const SpanRecord& record) {
+	static thread_local ThreadRing local;
+	if (!IsEnabled()) {
+		local.ring.reset();
+		return;
+	}
+	unsigned generation = generation_.load(std::memory_order_acquire);
+	if (local.generation != generation) {
+		std::lock_guard<std::mutex> guard(configMu);
+		std::ostringstream os;
+		os << traceDir << "/" << traceService << "." << getpid() << "." << syscall(SYS_gettid) << ".ring";
+		local.ring.reset(TraceRing::Create(os.str(), traceService, traceCapacity));
+		local.generation = generation;
+	}
+	if (local.ring) local.ring->Append(record);
+}
+
+
+uint64_t Tracer::NewId() {
+	static thread_local std::mt19937_64 rng(std::random_device{}() ^
+		((uint64_t)syscall(SYS_gettid) << 32) ^ (uint64_t)NowNs());
+	uint64_t id;
+	while ((id = rng()) == 0) {}
+	return id;
+}
+
+
+int64_t Tracer::NowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+void TraceSpan::Fill(SpanRecord& r, SpanRecord::Kind kind, const ::grpc::Status& status, uint64_t durationUs) const {
+	memset(reinterpret_cast<char*>(&r) + sizeof(r.seq), 0, sizeof(r) - sizeof(r.seq));
+	r.kind = kind;
+	r.status = (uint8_t)status.error_code();
+	r.traceId = traceId_;
+	r.spanId = spanId_;
+	r.parentId = parentId_;
+	r.startNs = startNs_;
+	r.queueUs = (uint32_t)std::min<uint64_t>(queueUs_, UINT32_MAX);
+	r.durationUs = (uint32_t)std::min<uint64_t>(durationUs, UINT32_MAX);
+	r.downstreamUs = (uint32_t)std::min<uint64_t>(downstreamUs_, UINT32_MAX);
+	strncpy(r.method, method_, sizeof(r.method) - 1);
+}
+
+
+bool TraceSpan::StartServer(const ::grpc::ServerContext& ctx, const char* method) {
+	std::string value;
+	if (!FindMetadata(ctx.client_metadata(), kTraceIdKey, value)) return false;
+	traceId_ = strtoull(value.c_str(), nullptr, 16);
+	if (traceId_ == 0) return false;
+	if (FindMetadata(ctx.client_metadata(), kSpanIdKey, value))
+		parentId_ = strtoull(value.c_str(), nullptr, 16);
+	spanId_ = Tracer::NewId();
+	method_ = method;
+	startNs_ = Tracer::NowNs();
+	if (FindMetadata(ctx.client_metadata(), kSentKey, value)) {
+		int64_t sent = strtoll(value.c_str(), nullptr, 10);
+		queueUs_ = (sent > 0 && sent < startNs_)? (startNs_ - sent) / 1000: 0;
+	}
+	return true;
+}
+
+
+void TraceSpan::FinishServer(::grpc::ServerContext& ctx, const ::grpc::Status& status) {
+	if (!IsTraced()) return;
+	uint64_t durationUs = SinceUs(startNs_);
+	std::ostringstream os;
+	os << "queue=" << queueUs_ << ",handler=" << durationUs << ",downstream=" << downstreamUs_;
+	ctx.AddTrailingMetadata(kServerTimingKey, os.str());
+	if (Tracer::IsEnabled()) {
+		SpanRecord r;
+		Fill(r, SpanRecord::SERVER, status, durationUs);
+		Tracer::Record(r);
+	}
+	traceId_ = 0;
+}
+
+
+bool TraceSpan::StartClient(const char* method) {
+	TraceSpan* parent = CallScope::CurrentSpan();
+	if (parent != nullptr && parent->IsTraced()) {
+		traceId_ = parent->traceId_;
+		parentId_ = parent->spanId_;
+	} else if (Tracer::IsEnabled()) {
+		traceId_ = Tracer::NewId();
+		parentId_ = 0;
+	} else {
+		return false;
+	}
+	spanId_ = Tracer::NewId();
+	method_ = method;
+	startNs_ = Tracer::NowNs();
+	return true;
+}
+
+
+void TraceSpan::Inject(::grpc::ClientContext& ctx) const {
+	if (!IsTraced()) return;
+	ctx.AddMetadata(kTraceIdKey, ToHex(traceId_));
+	ctx.AddMetadata(kSpanIdKey, ToHex(spanId_));
+	ctx.AddMetadata(kSentKey, std::to_string(Tracer::NowNs()));
+}
+
+
+void TraceSpan::FinishClient(const ::grpc::ClientContext* ctx, const ::grpc::Status& status) {
+	if (!IsTraced()) return;
+	uint64_t durationUs = SinceUs(startNs_);
+	// Record the server's handler time so the dump can split out the network.
+	uint64_t queueUs = 0, handlerUs = 0, downstreamUs = 0;
+	std::string value;
+	if (ctx != nullptr && FindMetadata(ctx->GetServerTrailingMetadata(), kServerTimingKey, value))
+		ParseServerTiming(value, queueUs, handlerUs, downstreamUs);
+	downstreamUs_ = handlerUs;
+	if (Tracer::IsEnabled()) {
+		SpanRecord r;
+		Fill(r, SpanRecord::CLIENT, status, durationUs);
+		Tracer::Record(r);
+	}
+	traceId_ = 0;
+}
+
+
+bool TraceSpan::ParseServerTiming(const std::string& value, uint64_t& queueUs, uint64_t& handlerUs, uint64_t& downstreamUs) {
+	bool found = false;
+	size_t pos = 0;
+	while (pos < value.size()) {
+		size_t end = value.find(',', pos);
+		if (end == std::string::npos) end = value.size();
+		size_t eq = value.find('=', pos);
+		if (eq != std::string::npos && eq < end) {
+			std::string key = value.substr(pos, eq - pos);
+			uint64_t v = strtoull(value.c_str() + eq + 1, nullptr, 10);
+			if (key == "queue") queueUs = v;
+			else if (key == "handler") { handlerUs = v; found = true; }
+			else if (key == "downstream") downstreamUs = v;
+		}
+		pos = end + 1;
+	}
+	return found;
+}
+
+} // namespace lucida
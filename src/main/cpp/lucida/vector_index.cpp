@@ -0,0 +1,534 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <lucida/vector_index.h>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <random>
+#include <utility>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace lucida {
+namespace {
+
+float DotPortable(const float* a, const float* b, size_t n) {
+	float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		s0 += a[i] * b[i];
+		s1 += a[i + 1] * b[i + 1];
+		s2 += a[i + 2] * b[i + 2];
+		s3 += a[i + 3] * b[i + 3];
+	}
+	for (; i < n; ++i)
+		s0 += a[i] * b[i];
+	return (s0 + s1) + (s2 + s3);
+}
+
+float SquaredL2Portable(const float* a, const float* b, size_t n) {
+	float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		float d0 = a[i] - b[i], d1 = a[i + 1] - b[i + 1], d2 = a[i + 2] - b[i + 2], d3 = a[i + 3] - b[i + 3];
+		s0 += d0 * d0;
+		s1 += d1 * d1;
+		s2 += d2 * d2;
+		s3 += d3 * d3;
+	}
+	for (; i < n; ++i)
+		s0 += (a[i] - b[i]) * (a[i] - b[i]);
+	return (s0 + s1) + (s2 + s3);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2,fma")))
+float HorizontalSum(__m256 v) {
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_movehdup_ps(s));
+	return _mm_cvtss_f32(s);
+}
+
+// Two accumulators hide the latency of the fused multiply-add.
+__attribute__((target("avx2,fma")))
+float DotAvx2(const float* a, const float* b, size_t n) {
+	__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+		acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+	}
+	if (i + 8 <= n) {
+		acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+		i += 8;
+	}
+	float s = HorizontalSum(_mm256_add_ps(acc0, acc1));
+	for (; i < n; ++i)
+		s += a[i] * b[i];
+	return s;
+}
+
+__attribute__((target("avx2,fma")))
+float SquaredL2Avx2(const float* a, const float* b, size_t n) {
+	__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+		__m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+		acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+		acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+	}
+	if (i + 8 <= n) {
+		__m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+		acc0 = _mm256_fmadd_ps(d, d, acc0);
+		i += 8;
+	}
+	float s = HorizontalSum(_mm256_add_ps(acc0, acc1));
+	for (; i < n; ++i)
+		s += (a[i] - b[i]) * (a[i] - b[i]);
+	return s;
+}
+
+// The tail is read with a masked load, so there is no scalar loop.
+__attribute__((target("avx512f")))
+float DotAvx512(const float* a, const float* b, size_t n) {
+	__m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+		acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+	}
+	for (; i < n; i += 16) {
+		__mmask16 m = (n - i >= 16)? __mmask16(0xffff): __mmask16((1u << (n - i)) - 1);
+		acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), acc0);
+	}
+	return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f")))
+float SquaredL2Avx512(const float* a, const float* b, size_t n) {
+	__m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+		__m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+		acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+		acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+	}
+	for (; i < n; i += 16) {
+		__mmask16 m = (n - i >= 16)? __mmask16(0xffff): __mmask16((1u << (n - i)) - 1);
+		__m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+		acc0 = _mm512_fmadd_ps(d, d, acc0);
+	}
+	return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+#endif
+
+struct Kernels {
+	float (*dot)(const float*, const float*, size_t);
+	float (*squaredL2)(const float*, const float*, size_t);
+	const char* level;
+};
+
+Kernels ChooseKernels() {
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx512f")) return Kernels{ DotAvx512, SquaredL2Avx512, "avx512f" };
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return Kernels{ DotAvx2, SquaredL2Avx2, "avx2" };
+#endif
+	return Kernels{ DotPortable, SquaredL2Portable, "portable" };
+}
+
+const Kernels& GetKernels() {
+	static const Kernels kernels = ChooseKernels();
+	return kernels;
+}
+
+/// Best first by score.
+struct Closer {
+	bool operator () (const Neighbor& a, const Neighbor& b) const { return a.score > b.score; }
+};
+
+} // namespace
+
+
+float DotProduct(const float* a, const float* b, size_t n) {
+	return GetKernels().dot(a, b, n);
+}
+
+
+float SquaredL2(const float* a, const float* b, size_t n) {
+	return GetKernels().squaredL2(a, b, n);
+}
+
+
+const char* SimdLevel() {
+	return GetKernels().level;
+}
+
+
+void Normalize(float* v, size_t n) {
+	float norm = std::sqrt(DotProduct(v, v, n));
+	if (norm == 0) return;
+	for (size_t i = 0; i < n; ++i)
+		v[i] /= norm;
+}
+
+
+/// Hierarchical navigable small world graph over the vectors of a
+/// VectorIndex (Malkov and Yashunin, 2016). Nodes are the index's ids. The
+/// bottom layer has every node, each layer above a random fraction of the
+/// one below. A search descends greedily through the sparse layers to a
+/// good entry point, then does a best first search of the bottom layer.
+///
+/// The vectors are passed to each call since adding to the index may move
+/// them. Distance is one minus the cosine similarity of unit vectors.
+class HnswGraph {
+public:
+	explicit HnswGraph(const VectorIndexOptions& options):
+		m_(std::max(2u, options.m)), m0_(2 * m_), efConstruction_(std::max(options.efConstruction, m_)),
+		levelMult_(1.0 / std::log(double(m_))), rng_(options.seed), entry_(0), maxLevel_(-1) {}
+
+	/// Link a node. Nodes must be inserted in id order.
+	void Insert(const float* base, size_t dim, uint32_t id);
+
+	/// @param[in]  query   A unit vector.
+	void Search(const float* base, size_t dim, const float* query, size_t k, size_t ef, std::vector<Neighbor>& results) const;
+
+	size_t MemoryUsage() const {
+		size_t n = sizeof(*this) + links0_.capacity() * sizeof(uint32_t) + levels_.capacity() +
+			upper_.capacity() * sizeof(std::vector<uint32_t>);
+		for (const auto& links: upper_) n += links.capacity() * sizeof(uint32_t);
+		return n;
+	}
+
+private:
+	/// Distance and id.
+	typedef std::pair<float, uint32_t> Candidate;
+
+	const unsigned m_;
+	const unsigned m0_;
+	const unsigned efConstruction_;
+	const double levelMult_;
+	std::mt19937 rng_;
+	/// Bottom layer links of each node, a count then up to m0_ ids.
+	std::vector<uint32_t> links0_;
+	/// Links of each node on layers 1 to its level, each a count then up
+	/// to m_ ids. Most nodes have none.
+	std::vector<std::vector<uint32_t>> upper_;
+	std::vector<uint8_t> levels_;
+	uint32_t entry_;
+	int maxLevel_;
+
+	static float Distance(const float* base, size_t dim, const float* q, uint32_t id) {
+		return 1.0f - GetKernels().dot(q, base + size_t(id) * dim, dim);
+	}
+
+	uint32_t* LinksOf(uint32_t id, int level) {
+		if (level == 0) return &links0_[size_t(id) * (m0_ + 1)];
+		return &upper_[id][size_t(level - 1) * (m_ + 1)];
+	}
+	const uint32_t* LinksOf(uint32_t id, int level) const {
+		return const_cast<HnswGraph*>(this)->LinksOf(id, level);
+	}
+
+	/// Move to the node of a layer closest to q, starting at ep.
+	void Descend(const float* base, size_t dim, const float* q, int level, uint32_t& ep, float& epDist) const;
+
+	/// Best first search of a layer.
+	/// @return The ef closest nodes found, closest first.
+	std::vector<Candidate> SearchLayer(const float* base, size_t dim, const float* q, uint32_t ep, size_t ef, int level) const;
+
+	/// Pick up to m of candidates, closest first, skipping any closer to
+	/// one already picked than to the target, so links spread in all
+	/// directions rather than into one cluster.
+	static void SelectNeighbors(const float* base, size_t dim, const std::vector<Candidate>& candidates,
+		unsigned m, std::vector<uint32_t>& selected);
+
+	/// Link from to to on a layer, pruning from's links if full.
+	void Connect(const float* base, size_t dim, uint32_t from, uint32_t to, int level);
+};
+
+
+namespace {
+
+/// Visited marks of a search, reused by the thread. A node is visited if
+/// its mark is the current epoch.
+struct VisitedSet {
+	std::vector<uint32_t> marks;
+	uint32_t epoch = 0;
+
+	void Reset(size_t n) {
+		if (marks.size() < n) marks.resize(n, 0);
+		if (++epoch == 0) {
+			std::fill(marks.begin(), marks.end(), 0);
+			epoch = 1;
+		}
+	}
+	/// @return True if id was not visited before.
+	bool Visit(uint32_t id) {
+		if (marks[id] == epoch) return false;
+		marks[id] = epoch;
+		return true;
+	}
+};
+
+thread_local VisitedSet visited;
+
+} // namespace
+
+
+void HnswGraph::Descend(const float* base, size_t dim, const float* q, int level, uint32_t& ep, float& epDist) const {
+	for (bool changed = true; changed; ) {
+		changed = false;
+		const uint32_t* links = LinksOf(ep, level);
+		for (uint32_t i = 1; i <= links[0]; ++i) {
+			float d = Distance(base, dim, q, links[i]);
+			if (d < epDist) {
+				epDist = d;
+				ep = links[i];
+				changed = true;
+			}
+		}
+	}
+}
+
+
+std::vector<HnswGraph::Candidate> HnswGraph::SearchLayer(const float* base, size_t dim, const float* q,
+	uint32_t ep, size_t ef, int level) const {
+	visited.Reset(levels_.size());
+	// Nodes to expand, closest on top, and the best found, furthest on top.
+	std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> frontier;
+	std::priority_queue<Candidate> best;
+	float d = Distance(base, dim, q, ep);
+	frontier.push(Candidate(d, ep));
+	best.push(Candidate(d, ep));
+	visited.Visit(ep);
+	while (!frontier.empty()) {
+		Candidate c = frontier.top();
+		if (c.first > best.top().first && best.size() >= ef) break;
+		frontier.pop();
+		const uint32_t* links = LinksOf(c.second, level);
+		for (uint32_t i = 1; i <= links[0]; ++i) {
+			uint32_t n = links[i];
+			if (i < links[0]) __builtin_prefetch(base + size_t(links[i + 1]) * dim);
+			if (!visited.Visit(n)) continue;
+			d = Distance(base, dim, q, n);
+			if (best.size() < ef || d < best.top().first) {
+				frontier.push(Candidate(d, n));
+				best.push(Candidate(d, n));
+				if (best.size() > ef) best.pop();
+			}
+		}
+	}
+	std::vector<Candidate> result(best.size());
+	for (size_t i = result.size(); i-- > 0; best.pop())
+		result[i] = best.top();
+	return result;
+}
+
+
+void HnswGraph::SelectNeighbors(const float* base, size_t dim, const std::vector<Candidate>& candidates,
+	unsigned m, std::vector<uint32_t>& selected) {
+	selected.clear();
+	for (const Candidate& c: candidates) {
+		if (selected.size() >= m) break;
+		const float* v = base + size_t(c.second) * dim;
+		bool diverse = true;
+		for (uint32_t s: selected) {
+			if (Distance(base, dim, v, s) < c.first) {
+				diverse = false;
+				break;
+			}
+		}
+		if (diverse) selected.push_back(c.second);
+	}
+}
+
+
+void HnswGraph::Connect(const float* base, size_t dim, uint32_t from, uint32_t to, int level) {
+	uint32_t* links = LinksOf(from, level);
+	unsigned max = (level == 0)? m0_: m_;
+	if (links[0] < max) {
+		links[++links[0]] = to;
+		return;
+	}
+	const float* v = base + size_t(from) * dim;
+	std::vector<Candidate> candidates;
+	candidates.reserve(max + 1);
+	candidates.push_back(Candidate(Distance(base, dim, v, to), to));
+	for (uint32_t i = 1; i <= links[0]; ++i)
+		candidates.push_back(Candidate(Distance(base, dim, v, links[i]), links[i]));
+	std::sort(candidates.begin(), candidates.end());
+	std::vector<uint32_t> selected;
+	SelectNeighbors(base, dim, candidates, max, selected);
+	links[0] = selected.size();
+	std::copy(selected.begin(), selected.end(), links + 1);
+}
+
+
+void HnswGraph::Insert(const float* base, size_t dim, uint32_t id) {
+	std::uniform_real_distribution<double> uniform(std::numeric_limits<double>::min(), 1.0);
+	int level = std::min(int(-std::log(uniform(rng_)) * levelMult_), 15);
+	levels_.push_back(level);
+	links0_.resize(levels_.size() * (m0_ + 1), 0);
+	upper_.emplace_back(size_t(level) * (m_ + 1), 0);
+	if (maxLevel_ < 0) {
+		entry_ = id;
+		maxLevel_ = level;
+		return;
+	}
+
+	const float* q = base + size_t(id) * dim;
+	uint32_t ep = entry_;
+	float epDist = Distance(base, dim, q, ep);
+	for (int l = maxLevel_; l > level; --l)
+		Descend(base, dim, q, l, ep, epDist);
+	std::vector<uint32_t> selected;
+	for (int l = std::min(level, maxLevel_); l >= 0; --l) {
+		std::vector<Candidate> candidates = SearchLayer(base, dim, q, ep, efConstruction_, l);
+		SelectNeighbors(base, dim, candidates, m_, selected);
+		uint32_t* links = LinksOf(id, l);
+		links[0] = selected.size();
+		std::copy(selected.begin(), selected.end(), links + 1);
+		for (uint32_t n: selected)
+			Connect(base, dim, n, id, l);
+		ep = candidates.front().second;
+	}
+	if (level > maxLevel_) {
+		entry_ = id;
+		maxLevel_ = level;
+	}
+}
+
+
+void HnswGraph::Search(const float* base, size_t dim, const float* query, size_t k, size_t ef,
+	std::vector<Neighbor>& results) const {
+	results.clear();
+	if (maxLevel_ < 0) return;
+	uint32_t ep = entry_;
+	float epDist = Distance(base, dim, query, ep);
+	for (int l = maxLevel_; l > 0; --l)
+		Descend(base, dim, query, l, ep, epDist);
+	std::vector<Candidate> candidates = SearchLayer(base, dim, query, ep, std::max(ef, k), 0);
+	if (candidates.size() > k) candidates.resize(k);
+	for (const Candidate& c: candidates)
+		results.push_back(Neighbor{ c.second, 1.0f - c.first });
+}
+
+
+VectorIndex::VectorIndex(const VectorIndexOptions& options): options_(options), dim_(0) {
+}
+
+
+VectorIndex::~VectorIndex() {
+}
+
+
+bool VectorIndex::Add(const std::string& label, const float* v, size_t dim) {
+	if (dim_ == 0) dim_ = dim;
+	if (dim == 0 || dim != dim_) return false;
+	size_t offset = vectors_.size();
+	vectors_.insert(vectors_.end(), v, v + dim);
+	Normalize(&vectors_[offset], dim);
+	labels_.push_back(label);
+	if (graph_) {
+		graph_->Insert(vectors_.data(), dim_, labels_.size() - 1);
+	} else if (labels_.size() >= options_.graphThreshold) {
+		BuildGraph();
+	}
+	return true;
+}
+
+
+void VectorIndex::BuildGraph() {
+	graph_.reset(new HnswGraph(options_));
+	for (uint32_t id = 0; id < labels_.size(); ++id)
+		graph_->Insert(vectors_.data(), dim_, id);
+}
+
+
+void VectorIndex::Search(const float* query, size_t dim, size_t k, std::vector<Neighbor>& results) const {
+	if (!graph_) {
+		SearchExact(query, dim, k, results);
+		return;
+	}
+	results.clear();
+	if (dim != dim_ || k == 0) return;
+	std::vector<float> q(query, query + dim);
+	Normalize(q.data(), dim);
+	graph_->Search(vectors_.data(), dim_, q.data(), k, options_.efSearch, results);
+}
+
+
+void VectorIndex::SearchExact(const float* query, size_t dim, size_t k, std::vector<Neighbor>& results) const {
+	results.clear();
+	if (dim != dim_ || k == 0) return;
+	std::vector<float> q(query, query + dim);
+	Normalize(q.data(), dim);
+	// Keep the best k in a heap with the worst on top.
+	float (*dot)(const float*, const float*, size_t) = GetKernels().dot;
+	results.reserve(std::min(k, labels_.size()));
+	for (uint32_t id = 0; id < labels_.size(); ++id) {
+		float score = dot(q.data(), GetVector(id), dim);
+		if (results.size() < k) {
+			results.push_back(Neighbor{ id, score });
+			std::push_heap(results.begin(), results.end(), Closer());
+		} else if (score > results.front().score) {
+			std::pop_heap(results.begin(), results.end(), Closer());
+			results.back() = Neighbor{ id, score };
+			std::push_heap(results.begin(), results.end(), Closer());
+		}
+	}
+	std::sort_heap(results.begin(), results.end(), Closer());
+}
+
+
+void VectorIndex::Clear() {
+	dim_ = 0;
+	std::vector<float>().swap(vectors_);
+	std::vector<std::string>().swap(labels_);
+	graph_.reset();
+}
+
+
+size_t VectorIndex::MemoryUsage() const {
+	size_t n = sizeof(*this) + vectors_.capacity() * sizeof(float) + labels_.capacity() * sizeof(std::string);
+	for (const std::string& label: labels_) n += label.capacity();
+	if (graph_) n += graph_->MemoryUsage();
+	return n;
+}
+
+} // namespace lucida
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Question answering service that retrieves passages from per-user
+// BM25 indexes.
+//
+// Usage: lucida_qa [--port=8083] [--threads=4] [--top_k=1] [--learn_log=dir] ...
+
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <grpc++/health_check_service_interface.h>
+#include <lucida/passage_search.h>
+#include <lucida/learn_log.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/signal_watcher.h>
+
+DEFINE_int32(port, 8083, "Port to listen on");
+DEFINE_int32(threads, 4, "Worker threads, each with its own completion queue");
+DEFINE_string(cpus, "", "Pin the worker threads to these CPUs, for example 0-3,8");
+DEFINE_int32(busy_poll_us, 0, "Poll the completion queues this long before blocking");
+DEFINE_string(capture, "", "Capture requests to this log for lucida_replay");
+DEFINE_double(capture_rate, 1.0, "The fraction of requests captured");
+DEFINE_bool(load_reports, false, "Send the server's load in the trailing metadata of every call");
+DEFINE_string(hot_restart, "", "Control socket to take over the port from a running instance, and to hand it on");
+DEFINE_int32(not_ready_ms, 0, "On shutdown, report not ready to health checks and keep serving this long");
+DEFINE_int32(grace_ms, 30000, "Then wait this long for calls in flight before cancelling them, 0 for no limit");
+DEFINE_string(learn_log, "", "Log learn requests in this directory and replay them on startup");
+DEFINE_int32(top_k, 1, "Passages returned by infer");
+DEFINE_double(k1, 1.2, "BM25 term frequency saturation");
+DEFINE_double(b, 0.75, "BM25 length normalization");
+
+using namespace lucida;
+
+
+int main(int argc, char* argv[]) {
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+	// Serve grpc.health.v1.Health, reporting not serving while draining.
+	::grpc::EnableDefaultHealthCheckService(true);
+
+	Bm25Params params;
+	params.k1 = FLAGS_k1;
+	params.b = FLAGS_b;
+	PassageSearchHandler* handler = new PassageSearchHandler(params, FLAGS_top_k);
+	std::unique_ptr<LearnLog> learned;
+	if (!FLAGS_learn_log.empty()) {
+		learned.reset(new LearnLog(FLAGS_learn_log));
+		if (!ReplayLearnLog(*learned, *handler)) return 1;
+		handler->SetLearnLog(learned.get());
+	}
+
+	std::unique_ptr<AsyncServiceAcceptorT<PassageSearchHandler>> server(
+		new AsyncServiceAcceptorT<PassageSearchHandler>(handler, "qa"));
+	if (!FLAGS_capture.empty() && !server->EnableCapture(FLAGS_capture, FLAGS_capture_rate)) return 1;
+	if (FLAGS_load_reports) server->EnableLoadReports();
+	if (!FLAGS_hot_restart.empty()) server->EnableHotRestart(FLAGS_hot_restart);
+	PollingPolicy polling;
+	if (!ParseCpuList(FLAGS_cpus, polling.cpus)) {
+		LOG(ERROR) << "bad --cpus " << FLAGS_cpus;
+		return 1;
+	}
+	polling.busyPollUs = FLAGS_busy_poll_us;
+	server->SetPollingPolicy(polling);
+	DrainPolicy drain;
+	drain.notReadyMs = std::max(FLAGS_not_ready_ms, 0);
+	drain.graceMs = std::max(FLAGS_grace_ms, 0);
+	server->SetDrainPolicy(drain);
+	SignalWatcher watcher(server.get());
+	std::ostringstream hostAndPort;
+	hostAndPort << "0.0.0.0:" << FLAGS_port;
+	return server->Start(hostAndPort.str(), FLAGS_threads)? 0: 1;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Front router sharding LucidaService users over replicas by LUCID. Calls
+// are forwarded as received, so routing costs the same for any payload.
+//
+//   lucida_router --port=8080 qa1:8083 qa2:8083 qa3:8083
+//
+// Usage: lucida_router [--port=8080] [--threads=4] [--grace_ms=30000] [--load_bound=1.25] <host:port>...
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <lucida/router.h>
+#include <lucida/signal_watcher.h>
+
+DEFINE_int32(port, 8080, "Port to listen on");
+DEFINE_int32(threads, 4, "Worker threads, each with its own completion queue");
+DEFINE_int32(grace_ms, 30000, "On shutdown, give calls in flight this long before cancelling them");
+DEFINE_double(load_bound, 1.25, "A backend over this multiple of the average calls in flight spills users to their next choice");
+
+using namespace lucida;
+
+
+int main(int argc, char* argv[]) {
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s [--port=8080] [--threads=4] [--grace_ms=30000] [--load_bound=1.25] <host:port>...\n", argv[0]);
+		return 2;
+	}
+	std::vector<std::string> backends(argv + 1, argv + argc);
+	Router router(backends, FLAGS_load_bound);
+	SignalWatcher watcher([&router]() { router.Shutdown(FLAGS_grace_ms); });
+	std::ostringstream hostAndPort;
+	hostAndPort << "0.0.0.0:" << FLAGS_port;
+	return router.Start(hostAndPort.str(), FLAGS_threads)? 0: 1;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Fake Lucida service for benchmarking service graphs on one machine.
+// Each method follows a profile, for example
+//
+//   lucida_sim --port=8090 --infer=latency=lognormal:2000:0.5,cpu=300,size=512
+//
+// Requests whose QueryInput tags describe a service graph are forwarded to
+// the next hops. See ParseMethodProfile and GraphChildren.
+//
+// --shards=N runs N shared-nothing servers on the port instead, one thread
+// each. See ShardedAcceptorT.
+//
+// Usage: lucida_sim [--port=8090] [--threads=4] [--shards=0] [--all=PROFILE] [--infer=PROFILE] ...
+
+#include <memory>
+#include <sstream>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/signal_watcher.h>
+#include <lucida/simulator.h>
+
+DEFINE_int32(port, 8090, "Port to listen on");
+DEFINE_int32(threads, 4, "Worker threads, each with its own completion queue");
+DEFINE_int32(shards, 0, "Serve with this many SO_REUSEPORT shards instead of --threads");
+DEFINE_string(cpus, "", "Pin the worker threads to these CPUs, for example 0-3,8");
+DEFINE_int32(busy_poll_us, 0, "Poll the completion queues this long before blocking");
+DEFINE_string(all, "", "Profile of every method, overridden by --create, --learn and --infer");
+DEFINE_string(create, "", "Profile of create");
+DEFINE_string(learn, "", "Profile of learn");
+DEFINE_string(infer, "", "Profile of infer");
+DEFINE_uint64(seed, 42, "Seeds latency and error draws");
+DEFINE_string(capture, "", "Capture requests to this log for lucida_replay, suffixed .N for each shard");
+DEFINE_double(capture_rate, 1.0, "The fraction of requests captured");
+DEFINE_bool(load_reports, false, "Send the server's load in the trailing metadata of every call");
+
+using namespace lucida;
+
+
+int main(int argc, char* argv[]) {
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+
+	MethodProfile all;
+	if (!ParseMethodProfile(FLAGS_all, all)) return 1;
+	MethodProfile create = all, learn = all, infer = all;
+	if (!ParseMethodProfile(FLAGS_create, create) || !ParseMethodProfile(FLAGS_learn, learn) ||
+			!ParseMethodProfile(FLAGS_infer, infer))
+		return 1;
+
+	PollingPolicy polling;
+	if (!ParseCpuList(FLAGS_cpus, polling.cpus)) {
+		LOG(ERROR) << "bad --cpus " << FLAGS_cpus;
+		return 1;
+	}
+	polling.busyPollUs = FLAGS_busy_poll_us;
+	std::ostringstream hostAndPort;
+	hostAndPort << "0.0.0.0:" << FLAGS_port;
+
+	if (FLAGS_shards > 0) {
+		ShardedAcceptorT<SimulatorHandler> server(FLAGS_shards, [&](unsigned shard) {
+			return new SimulatorHandler(create, learn, infer, FLAGS_seed + shard);
+		}, "sim");
+		for (unsigned i = 0; i < server.ShardCount() && !FLAGS_capture.empty(); ++i) {
+			std::ostringstream path;
+			path << FLAGS_capture << "." << i;
+			if (!server.GetShard(i).EnableCapture(path.str(), FLAGS_capture_rate)) return 1;
+		}
+		for (unsigned i = 0; i < server.ShardCount() && FLAGS_load_reports; ++i)
+			server.GetShard(i).EnableLoadReports();
+		server.SetPollingPolicy(polling);
+		SignalWatcher watcher([&server]() { server.Shutdown(); });
+		return server.Start(hostAndPort.str())? 0: 1;
+	}
+
+	std::unique_ptr<AsyncServiceAcceptorT<SimulatorHandler>> server(
+		new AsyncServiceAcceptorT<SimulatorHandler>(new SimulatorHandler(create, learn, infer, FLAGS_seed), "sim"));
+	if (!FLAGS_capture.empty() && !server->EnableCapture(FLAGS_capture, FLAGS_capture_rate)) return 1;
+	if (FLAGS_load_reports) server->EnableLoadReports();
+	server->SetPollingPolicy(polling);
+	SignalWatcher watcher(server.get());
+	return server->Start(hostAndPort.str(), FLAGS_threads)? 0: 1;
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Replay a capture log against a service, keeping the captured arrival
+// times, and report the latency of each method.
+//
+// Usage: lucida_replay [--speed=1] [--max_inflight=1000] [--deadline_ms=0] <host:port> <capture-log>
+//
+// --speed=2 replays twice as fast as captured, --speed=0 back to back.
+
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <lucida/capture_log.h>
+#include <lucida/latency_histogram.h>
+#include <lucida/service_connector.h>
+
+DEFINE_double(speed, 1.0, "Replay speed relative to the capture, 0 for back to back");
+DEFINE_int32(max_inflight, 1000, "Wait for the oldest call beyond this many in flight");
+DEFINE_int32(deadline_ms, 0, "Deadline of each call, 0 for none");
+
+using namespace lucida;
+
+namespace {
+
+struct MethodStats {
+	MethodStats(): sent(0), errors(0) {}
+	uint64_t sent;
+	std::atomic<uint64_t> errors;
+	LatencyHistogram latency;
+};
+
+struct Pending {
+	/// Each call has its own context since they overlap.
+	std::unique_ptr<::grpc::ClientContext> context;
+	std::shared_ptr<RpcCall> call;
+};
+
+} // namespace
+
+
+int main(int argc, char* argv[]) {
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s [--speed=1] [--max_inflight=1000] [--deadline_ms=0] <host:port> <capture-log>\n", argv[0]);
+		return 2;
+	}
+	CaptureReader reader;
+	if (!reader.Open(argv[2])) return 1;
+	AsyncServiceConnector client(argv[1]);
+	client.Start();
+
+	// Filled in advance, continuations only update the counters.
+	std::map<std::string, MethodStats> stats;
+	for (const char* method: { "create", "learn", "infer" })
+		stats[method];
+	std::deque<Pending> pending;
+	CaptureRecord record;
+	int64_t firstNs = 0;
+	int64_t lastNs = 0;
+	uint64_t late = 0;
+	auto start = std::chrono::steady_clock::now();
+	while (reader.Next(record)) {
+		if (firstNs == 0) firstNs = record.arrivalNs;
+		lastNs = record.arrivalNs;
+		if (FLAGS_speed > 0) {
+			auto due = start + std::chrono::nanoseconds(int64_t((record.arrivalNs - firstNs) / FLAGS_speed));
+			auto now = std::chrono::steady_clock::now();
+			if (due > now) {
+				std::this_thread::sleep_until(due);
+			} else if (now - due > std::chrono::milliseconds(1)) {
+				++late;
+			}
+		}
+		while (!pending.empty() && pending.front().call->IsDone())
+			pending.pop_front();
+		while (pending.size() >= unsigned(FLAGS_max_inflight)) {
+			pending.front().call->Wait();
+			pending.pop_front();
+		}
+
+		Pending p;
+		p.context.reset(new ::grpc::ClientContext);
+		if (FLAGS_deadline_ms > 0)
+			p.context->set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(FLAGS_deadline_ms));
+		if (record.method == "create") {
+			p.call = client.createAsync(record.request, p.context.get());
+		} else if (record.method == "learn") {
+			p.call = client.learnAsync(record.request, p.context.get());
+		} else {
+			p.call = client.inferAsync(record.request, p.context.get());
+		}
+		MethodStats* ms = &stats[record.method];
+		++ms->sent;
+		RpcCall* call = p.call.get();
+		auto issued = std::chrono::steady_clock::now();
+		call->Then([ms, call, issued]() {
+			ms->latency.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - issued).count());
+			if (!call->IsOK()) ms->errors.fetch_add(1, std::memory_order_relaxed);
+		});
+		pending.push_back(std::move(p));
+	}
+	for (Pending& p: pending)
+		p.call->Wait();
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	client.Shutdown();
+
+	if (reader.IsDamaged())
+		fprintf(stderr, "lucida_replay: stopped at a damaged record\n");
+	printf("replayed in %.3fs, captured over %.3fs, %llu sent more than 1ms late\n",
+		elapsed, (lastNs - firstNs) / 1e9, (unsigned long long)late);
+	printf("%-8s %10s %10s %10s %10s %10s\n", "method", "sent", "errors", "p50(us)", "p99(us)", "p99.9(us)");
+	for (auto& kv: stats) {
+		MethodStats& ms = kv.second;
+		if (ms.sent == 0) continue;
+		printf("%-8s %10llu %10llu %10llu %10llu %10llu\n", kv.first.c_str(), (unsigned long long)ms.sent,
+			(unsigned long long)ms.errors.load(), (unsigned long long)ms.latency.Percentile(0.5),
+			(unsigned long long)ms.latency.Percentile(0.99), (unsigned long long)ms.latency.Percentile(0.999));
+	}
+	return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2016 (c). All rights reserved.
+ * Author: Paul Glendenning
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *
+ *    * Neither the name of the author, nor the names of other
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Reconstruct request timelines from the trace rings of local services.
+//
+// Usage: lucida_trace_dump <trace-dir> [trace-id]
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <vector>
+#include <lucida/trace.h>
+
+using namespace lucida;
+
+namespace {
+
+void PrintSpan(const SpanInfo& s, int64_t rootNs, int depth) {
+	printf("%*s+%.3fms %-6s %-6s %-16s", depth * 2, "", (s.startNs - rootNs) / 1e6,
+		(s.kind == SpanRecord::SERVER)? "server": "client", s.method.c_str(), s.service.c_str());
+	if (s.kind == SpanRecord::SERVER) {
+		printf(" queue=%.3fms handler=%.3fms downstream=%.3fms", s.queueUs / 1e3, s.durationUs / 1e3, s.downstreamUs / 1e3);
+	} else {
+		printf(" total=%.3fms", s.durationUs / 1e3);
+		// The server's handler time came back in the trailing metadata.
+		if (s.downstreamUs != 0)
+			printf(" remote=%.3fms network+queue=%.3fms", s.downstreamUs / 1e3,
+				(s.durationUs > s.downstreamUs)? (s.durationUs - s.downstreamUs) / 1e3: 0.0);
+	}
+	if (s.status != ::grpc::StatusCode::OK) printf(" status=%d", (int)s.status);
+	printf(" [pid %d tid %d]\n", s.pid, s.tid);
+}
+
+void PrintTree(const std::vector<SpanInfo>& spans, const std::multimap<uint64_t, size_t>& children,
+		size_t index, int64_t rootNs, int depth) {
+	PrintSpan(spans[index], rootNs, depth);
+	auto range = children.equal_range(spans[index].spanId);
+	for (auto it = range.first; it != range.second; ++it)
+		PrintTree(spans, children, it->second, rootNs, depth + 1);
+}
+
+}
+
+
+int main(int argc, char* argv[]) {
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s <trace-dir> [trace-id]\n", argv[0]);
+		return 2;
+	}
+	uint64_t traceId = (argc == 3)? strtoull(argv[2], nullptr, 16): 0;
+	std::vector<SpanInfo> spans = ReadTraceRings(argv[1], traceId);
+
+	// Group by trace, in order of first appearance.
+	std::vector<uint64_t> traces;
+	std::map<uint64_t, std::vector<SpanInfo>> byTrace;
+	for (auto& s: spans) {
+		auto& v = byTrace[s.traceId];
+		if (v.empty()) traces.push_back(s.traceId);
+		v.push_back(s);
+	}
+	for (uint64_t id: traces) {
+		const std::vector<SpanInfo>& v = byTrace[id];
+		std::set<uint64_t> ids;
+		std::multimap<uint64_t, size_t> children;
+		for (auto& s: v) ids.insert(s.spanId);
+		for (size_t i = 0; i < v.size(); ++i)
+			children.insert(std::make_pair(v[i].parentId, i));
+		int64_t end = v[0].startNs;
+		for (auto& s: v) end = std::max<int64_t>(end, s.startNs + s.durationUs * 1000ll);
+		printf("trace %016llx spans=%zu elapsed=%.3fms\n", (unsigned long long)id, v.size(), (end - v[0].startNs) / 1e6);
+		// Roots are spans whose parent was not recorded locally.
+		for (size_t i = 0; i < v.size(); ++i) {
+			if (ids.count(v[i].parentId) == 0)
+				PrintTree(v, children, i, v[0].startNs, 1);
+		}
+	}
+	return 0;
+}
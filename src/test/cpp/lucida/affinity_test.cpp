@@ -0,0 +1,121 @@
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <gflags/gflags.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <lucida/simulator.h>
+#include <gtest/gtest.h>
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+TEST(AffinityTest, MinimalRemap) {
+	std::vector<std::string> four{ "a:1", "b:1", "c:1", "d:1" };
+	std::vector<std::string> three{ "a:1", "b:1", "c:1" };
+	AsyncServiceConnector before(four), after(three);
+	const unsigned users = 2000;
+	unsigned counts[4] = { 0, 0, 0, 0 };
+	for (unsigned i = 0; i < users; ++i) {
+		std::string lucid = "user" + std::to_string(i);
+		unsigned was = before.PreferredTarget(lucid);
+		++counts[was];
+		// Only the users of the removed target move.
+		if (was != 3) EXPECT_EQ(after.PreferredTarget(lucid), was);
+	}
+	for (unsigned count: counts) {
+		EXPECT_GT(count, users / 4 - 100);
+		EXPECT_LT(count, users / 4 + 100);
+	}
+	// The order follows the names, not their position.
+	AsyncServiceConnector reversed(std::vector<std::string>{ "c:1", "b:1", "a:1" });
+	EXPECT_EQ(2 - reversed.PreferredTarget("user1"), after.PreferredTarget("user1"));
+}
+
+
+TEST(AffinityTest, RouteAndSpill) {
+	MethodProfile profile;
+	ASSERT_TRUE(ParseMethodProfile("latency=20000", profile));
+	std::vector<std::string> targets{ HostAndPort(31), HostAndPort(32), HostAndPort(33) };
+	std::vector<std::shared_ptr<AsyncServiceAcceptorT<SimulatorHandler>>> servers;
+	std::vector<std::thread> threads;
+	for (auto& target: targets) {
+		servers.emplace_back(new AsyncServiceAcceptorT<SimulatorHandler>(
+			new SimulatorHandler(profile, profile, profile), "testserver"));
+		auto server = servers.back();
+		threads.emplace_back([server, target]() { server->Start(target, 1); });
+	}
+	for (auto& target: targets)
+		ASSERT_TRUE(WaitForServer(target));
+
+	AsyncServiceConnector client(targets);
+	AffinityPolicy policy;
+	policy.enabled = true;
+	client.SetAffinityPolicy(policy);
+	client.Start();
+
+	// One call at a time stays on the user's target.
+	Request request;
+	request.set_lucid("alice");
+	const unsigned home = client.PreferredTarget("alice");
+	::grpc::ClientContext createContext, learnContext;
+	ASSERT_TRUE(client.create(request, &createContext).ok());
+	ASSERT_TRUE(client.learn(request, &learnContext).ok());
+	for (unsigned i = 0; i < 3; ++i) {
+		::grpc::ClientContext context;
+		Response response;
+		ASSERT_TRUE(client.infer(request, response, &context).ok());
+	}
+	auto stats = client.GetTargetStats();
+	for (unsigned i = 0; i < targets.size(); ++i)
+		EXPECT_EQ(stats[i].attempts, (i == home)? 5u: 0u);
+
+	// A burst past the load bound spills to the user's other targets.
+	const unsigned burst = 12;
+	std::vector<std::unique_ptr<::grpc::ClientContext>> contexts;
+	std::vector<std::shared_ptr<RpcCall>> calls;
+	for (unsigned i = 0; i < burst; ++i) {
+		contexts.emplace_back(new ::grpc::ClientContext);
+		calls.push_back(client.inferAsync(request, contexts.back().get()));
+	}
+	for (auto& call: calls) {
+		ASSERT_TRUE(call->Wait(5));
+		EXPECT_TRUE(call->IsOK());
+	}
+	stats = client.GetTargetStats();
+	uint64_t spills = 0;
+	for (unsigned i = 0; i < targets.size(); ++i) {
+		spills += stats[i].spills;
+		if (i == home) continue;
+		EXPECT_GT(stats[i].attempts, 0u);
+		EXPECT_GE(stats[home].attempts - 5, stats[i].attempts);
+	}
+	EXPECT_EQ(stats[home].spills, 0u);
+	EXPECT_EQ(spills, burst - (stats[home].attempts - 5));
+	client.Shutdown();
+
+	for (auto& server: servers) {
+		server->Shutdown();
+		EXPECT_TRUE(server->BlockUntilShutdown(5));
+	}
+	for (auto& t: threads)
+		t.join();
+}
+
+} } // namespace lucida::test
@@ -0,0 +1,215 @@
+#include <sstream>
+#include <thread>
+#include <boost/filesystem.hpp>
+#include <gflags/gflags.h>
+#include <lucida/blob_store.h>
+#include <lucida/image_match.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <lucida/service_names.h>
+#include <gtest/gtest.h>
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+/// Records the images it learns.
+class TestBlobHandler : public AsyncServiceHandlerT<TestBlobHandler> {
+public:
+	void OnLearn(TypedCall<Request, ::google::protobuf::Empty>* call) {
+		for (const QueryInput& input: call->request_.spec().content()) {
+			for (const std::string& data: input.data()) learned.push_back(data);
+		}
+	}
+	void OnInfer(TypedCall<Request, Response>* call) {
+		call->response_.set_msg("got blob infer");
+	}
+	std::vector<std::string> learned;
+};
+
+
+static Request ImageRequest(const std::string& lucid, const std::string& image) {
+	Request request;
+	request.set_lucid(lucid);
+	QueryInput* input = request.mutable_spec()->add_content();
+	input->set_type(ServiceNames::imageTypeName);
+	input->add_data(image);
+	return request;
+}
+
+
+TEST(BlobStoreTest, PutGetAndCollect) {
+	boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	std::string kept, dropped;
+	{
+		BlobStore store(dir.string());
+		ASSERT_TRUE(store.Open());
+		EXPECT_EQ(BlobStore::ToHex(BlobStore::Digest("abc", 3)),
+			"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+		ASSERT_TRUE(store.Put("kept image", &kept));
+		ASSERT_TRUE(store.Put("kept image"));
+		ASSERT_TRUE(store.Put("dropped image", &dropped));
+		EXPECT_EQ(store.GetStats().blobs, 2u);
+		EXPECT_EQ(store.GetStats().duplicatePuts, 1u);
+		std::string data;
+		ASSERT_TRUE(store.Get(kept, data));
+		EXPECT_EQ(data, "kept image");
+		EXPECT_FALSE(store.AddRef(BlobStore::Digest("none", 4)));
+		EXPECT_TRUE(store.AddRef(kept));
+		EXPECT_TRUE(store.AddRef(kept));
+		EXPECT_TRUE(store.AddRef(dropped));
+		EXPECT_TRUE(store.Release(dropped));
+		EXPECT_EQ(store.GetRefs(kept), 2u);
+	}
+	BlobStore store(dir.string());
+	ASSERT_TRUE(store.Open());
+	EXPECT_EQ(store.GetRefs(kept), 2u);
+	EXPECT_EQ(store.GetRefs(dropped), 0u);
+	EXPECT_EQ(store.CollectGarbage(std::chrono::seconds(0)), 1u);
+	EXPECT_FALSE(store.Contains(dropped));
+	EXPECT_TRUE(store.Contains(kept));
+	boost::filesystem::remove_all(dir);
+}
+
+
+TEST(BlobStoreTest, ResolveByDigest) {
+	boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	BlobStore store(dir.string());
+	ASSERT_TRUE(store.Open());
+	Request request = ImageRequest("user", "an image");
+	ASSERT_TRUE(store.Resolve(request, true).ok());
+	const QueryInput& input = request.spec().content(0);
+	ASSERT_EQ(input.digests_size(), 1);
+	EXPECT_TRUE(store.Contains(input.digests(0)));
+	EXPECT_EQ(store.GetRefs(input.digests(0)), 0u);
+	store.AddRefs(request);
+	EXPECT_EQ(store.GetRefs(input.digests(0)), 1u);
+
+	Request byDigest(request);
+	byDigest.mutable_spec()->mutable_content(0)->mutable_data(0)->clear();
+	ASSERT_TRUE(store.Resolve(byDigest, false).ok());
+	EXPECT_EQ(byDigest.spec().content(0).data(0), "an image");
+
+	Request missing(byDigest);
+	missing.mutable_spec()->mutable_content(0)->set_digests(0, BlobStore::Digest("other", 5));
+	missing.mutable_spec()->mutable_content(0)->mutable_data(0)->clear();
+	EXPECT_EQ(store.Resolve(missing, false).error_code(), ::grpc::StatusCode::FAILED_PRECONDITION);
+	boost::filesystem::remove_all(dir);
+}
+
+
+TEST(BlobStoreTest, LearnDedup) {
+	boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	BlobStore store(dir.string());
+	ASSERT_TRUE(store.Open());
+	std::string hostAndPort = HostAndPort(14);
+	TestBlobHandler* handler = new TestBlobHandler();
+	handler->SetBlobStore(&store);
+	std::shared_ptr<AsyncServiceAcceptorT<TestBlobHandler>> server(
+		new AsyncServiceAcceptorT<TestBlobHandler>(handler, "blobserver"));
+	std::thread svr_thread([hostAndPort, server]() { server->Start(hostAndPort, 1); });
+	ASSERT_TRUE(WaitForServer(hostAndPort));
+
+	std::string image(100000, 'x');
+	AsyncServiceConnector client(hostAndPort.c_str());
+	client.Start();
+	ASSERT_TRUE(client.learnDedup(ImageRequest("user1", image)).ok());
+	ASSERT_TRUE(client.learnDedup(ImageRequest("user2", image)).ok());
+	BlobDedupStats stats = client.GetBlobDedupStats();
+	EXPECT_EQ(stats.offered, 1u);
+	EXPECT_EQ(stats.uploaded, 1u);
+	EXPECT_EQ(stats.bytesSaved, image.size());
+	EXPECT_EQ(store.GetRefs(BlobStore::Digest(image.data(), image.size())), 2u);
+
+	// A second client offers again and finds the blob stored.
+	AsyncServiceConnector other(hostAndPort.c_str());
+	other.Start();
+	ASSERT_TRUE(other.learnDedup(ImageRequest("user3", image)).ok());
+	EXPECT_EQ(other.GetBlobDedupStats().uploaded, 0u);
+	EXPECT_EQ(store.GetStats().blobs, 1u);
+
+	// The service lost the blob; the learn is resent inline.
+	EXPECT_TRUE(store.Release(BlobStore::Digest(image.data(), image.size())));
+	EXPECT_TRUE(store.Release(BlobStore::Digest(image.data(), image.size())));
+	EXPECT_TRUE(store.Release(BlobStore::Digest(image.data(), image.size())));
+	EXPECT_EQ(store.CollectGarbage(std::chrono::seconds(0)), 1u);
+	ASSERT_TRUE(client.learnDedup(ImageRequest("user4", image)).ok());
+	EXPECT_EQ(client.GetBlobDedupStats().fallbacks, 1u);
+
+	ASSERT_EQ(handler->learned.size(), 4u);
+	for (const std::string& data: handler->learned) EXPECT_EQ(data, image);
+	client.Shutdown();
+	other.Shutdown();
+
+	server->Shutdown();
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+	boost::filesystem::remove_all(dir);
+}
+
+TEST(BlobStoreTest, RefsFollowLearns) {
+	boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	BlobStore store(dir.string());
+	ASSERT_TRUE(store.Open());
+	std::string hostAndPort = HostAndPort(41);
+	ImageMatchHandler* handler = new ImageMatchHandler(new HashFeatureExtractor());
+	handler->SetBlobStore(&store);
+	std::shared_ptr<AsyncServiceAcceptorT<ImageMatchHandler>> server(
+		new AsyncServiceAcceptorT<ImageMatchHandler>(handler, "blobserver"));
+	std::thread svr_thread([hostAndPort, server]() { server->Start(hostAndPort, 1); });
+	ASSERT_TRUE(WaitForServer(hostAndPort));
+
+	AsyncServiceConnector client(hostAndPort.c_str());
+	client.Start();
+	const std::string first(1000, 'a'), failed(1000, 'b'), second(1000, 'c');
+	const std::string firstDigest = BlobStore::Digest(first.data(), first.size());
+	const std::string failedDigest = BlobStore::Digest(failed.data(), failed.size());
+	const std::string secondDigest = BlobStore::Digest(second.data(), second.size());
+	::grpc::ClientContext context1;
+	ASSERT_TRUE(client.learn(ImageRequest("user", first), &context1).ok());
+	EXPECT_EQ(store.GetRefs(firstDigest), 1u);
+
+	// A learn that fails part way references none of its blobs.
+	Request bad = ImageRequest("user", failed);
+	QueryInput* missing = bad.mutable_spec()->add_content();
+	missing->set_type(ServiceNames::imageTypeName);
+	missing->add_data("");
+	missing->add_digests(BlobStore::Digest("none", 4));
+	::grpc::ClientContext context2;
+	EXPECT_EQ(client.learn(bad, &context2).error_code(), ::grpc::StatusCode::FAILED_PRECONDITION);
+	EXPECT_TRUE(store.Contains(failedDigest));
+	EXPECT_EQ(store.GetRefs(failedDigest), 0u);
+
+	// Replacing the user's images releases the old ones.
+	Request replace = ImageRequest("user", second);
+	replace.mutable_spec()->add_content()->set_type(ServiceNames::unlearnTypeName);
+	::grpc::ClientContext context3;
+	ASSERT_TRUE(client.learn(replace, &context3).ok());
+	EXPECT_EQ(store.GetRefs(firstDigest), 0u);
+	EXPECT_EQ(store.GetRefs(secondDigest), 1u);
+	EXPECT_EQ(store.CollectGarbage(std::chrono::seconds(0)), 2u);
+	EXPECT_TRUE(store.Contains(secondDigest));
+	client.Shutdown();
+
+	server->Shutdown();
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+	boost::filesystem::remove_all(dir);
+}
+
+} } // namespace lucida::test
@@ -0,0 +1,147 @@
+#include <sstream>
+#include <thread>
+#include <boost/filesystem.hpp>
+#include <gflags/gflags.h>
+#include <lucida/capture_log.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <gtest/gtest.h>
+#include "handler.h"
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+static Request NamedRequest(const std::string& lucid) {
+	Request request;
+	request.set_lucid(lucid);
+	request.mutable_spec()->set_name("query");
+	return request;
+}
+
+
+TEST(CaptureTest, RoundTrip) {
+	boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	{
+		CaptureWriter writer;
+		ASSERT_TRUE(writer.Open(path.string()));
+		EXPECT_TRUE(writer.Capture("learn", NamedRequest("user1"), 1000));
+		EXPECT_TRUE(writer.Capture("infer", NamedRequest("user2"), 2000));
+		EXPECT_FALSE(writer.Capture("offerBlobs", NamedRequest("user3"), 3000));
+		EXPECT_TRUE(writer.Flush());
+		EXPECT_EQ(writer.GetStats().captured, 2u);
+	}
+	CaptureReader reader;
+	ASSERT_TRUE(reader.Open(path.string()));
+	CaptureRecord record;
+	ASSERT_TRUE(reader.Next(record));
+	EXPECT_EQ(record.method, "learn");
+	EXPECT_EQ(record.arrivalNs, 1000);
+	EXPECT_EQ(record.request.lucid(), "user1");
+	ASSERT_TRUE(reader.Next(record));
+	EXPECT_EQ(record.method, "infer");
+	EXPECT_EQ(record.request.spec().name(), "query");
+	EXPECT_FALSE(reader.Next(record));
+	EXPECT_FALSE(reader.IsDamaged());
+
+	// A record cut short by a crash ends the log.
+	boost::filesystem::resize_file(path, boost::filesystem::file_size(path) - 3);
+	ASSERT_TRUE(reader.Open(path.string()));
+	EXPECT_TRUE(reader.Next(record));
+	EXPECT_FALSE(reader.Next(record));
+	EXPECT_TRUE(reader.IsDamaged());
+	boost::filesystem::remove(path);
+}
+
+
+TEST(CaptureTest, SamplingAndLimit) {
+	boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	CaptureWriter writer;
+	ASSERT_TRUE(writer.Open(path.string(), 0.25));
+	for (unsigned i = 0; i < 4000; ++i)
+		writer.Capture("infer", NamedRequest("user"));
+	writer.Flush();
+	CaptureStats stats = writer.GetStats();
+	EXPECT_EQ(stats.seen, 4000u);
+	EXPECT_GT(stats.captured, 800u);
+	EXPECT_LT(stats.captured, 1200u);
+
+	ASSERT_TRUE(writer.Open(path.string(), 1.0, 200));
+	for (unsigned i = 0; i < 100; ++i)
+		writer.Capture("infer", NamedRequest("user"));
+	writer.Flush();
+	stats = writer.GetStats();
+	EXPECT_LE(stats.bytes, 200u);
+	EXPECT_EQ(stats.captured + stats.overLimit, 100u);
+	EXPECT_GT(stats.overLimit, 0u);
+
+	// A record larger than the thread's ring is dropped rather than waited for.
+	CaptureWriter small;
+	ASSERT_TRUE(small.Open(path.string(), 1.0, 0, 16));
+	EXPECT_FALSE(small.Capture("infer", NamedRequest("user")));
+	small.Flush();
+	stats = small.GetStats();
+	EXPECT_EQ(stats.dropped, 1u);
+	EXPECT_EQ(stats.captured, 0u);
+	boost::filesystem::remove(path);
+}
+
+
+TEST(CaptureTest, CaptureServedRequests) {
+	boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	std::string hostAndPort = HostAndPort(17);
+	std::shared_ptr<AsyncServiceAcceptorT<TestStaticHandler>> server(
+		new AsyncServiceAcceptorT<TestStaticHandler>(new TestStaticHandler(), "captureserver"));
+	ASSERT_TRUE(server->EnableCapture(path.string()));
+	std::thread svr_thread([hostAndPort, server]() { server->Start(hostAndPort, 1); });
+	ASSERT_TRUE(WaitForServer(hostAndPort));
+
+	AsyncServiceConnector client(hostAndPort.c_str());
+	client.Start();
+	for (unsigned i = 0; i < 5; ++i) {
+		::grpc::ClientContext ctx;
+		Response response;
+		EXPECT_TRUE(client.infer(NamedRequest("user" + std::to_string(i)), response, &ctx).ok());
+	}
+	// Unimplemented by the handler, but still captured.
+	::grpc::ClientContext ctx;
+	client.learn(NamedRequest("learner"), &ctx);
+	client.Shutdown();
+	server->Shutdown();
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+	EXPECT_EQ(server->GetCaptureStats().captured, 6u);
+
+	CaptureReader reader;
+	ASSERT_TRUE(reader.Open(path.string()));
+	CaptureRecord record;
+	int64_t last = 0;
+	for (unsigned i = 0; i < 5; ++i) {
+		ASSERT_TRUE(reader.Next(record));
+		EXPECT_EQ(record.method, "infer");
+		EXPECT_EQ(record.request.lucid(), "user" + std::to_string(i));
+		EXPECT_GE(record.arrivalNs, last);
+		last = record.arrivalNs;
+	}
+	ASSERT_TRUE(reader.Next(record));
+	EXPECT_EQ(record.method, "learn");
+	EXPECT_FALSE(reader.Next(record));
+	boost::filesystem::remove(path);
+}
+
+} } // namespace lucida::test
@@ -0,0 +1,152 @@
+#include <sstream>
+#include <thread>
+#include <gflags/gflags.h>
+#include <lucida/circuit_breaker.h>
+#include <lucida/service_connector.h>
+#include <gtest/gtest.h>
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+TEST(CircuitBreakerTest, OpensAndRecovers) {
+	CircuitBreaker breaker;
+	CircuitBreakerPolicy policy;
+	policy.enabled = true;
+	policy.windowSize = 10;
+	policy.minCalls = 4;
+	policy.failureRate = 0.5;
+	policy.openMs = 20;
+	policy.probes = 2;
+	breaker.SetPolicy(policy);
+
+	// Client errors do not count
+	for (unsigned i = 0; i < 10; ++i) {
+		ASSERT_TRUE(breaker.Allow());
+		breaker.Record(::grpc::StatusCode::INVALID_ARGUMENT, 10);
+	}
+	EXPECT_EQ(breaker.GetState(), CircuitBreaker::CLOSED);
+
+	// 5 failures in a window of 10 opens
+	for (unsigned i = 0; i < 5; ++i) {
+		ASSERT_TRUE(breaker.Allow());
+		breaker.Record(::grpc::StatusCode::UNAVAILABLE, 10);
+	}
+	EXPECT_EQ(breaker.GetState(), CircuitBreaker::OPEN);
+	EXPECT_FALSE(breaker.Allow());
+	EXPECT_EQ(breaker.GetRejected(), 1u);
+
+	// Half open lets the probes through, a failed probe reopens
+	std::this_thread::sleep_for(std::chrono::milliseconds(30));
+	EXPECT_TRUE(breaker.Allow());
+	EXPECT_TRUE(breaker.Allow());
+	EXPECT_FALSE(breaker.Allow());
+	EXPECT_EQ(breaker.GetState(), CircuitBreaker::HALF_OPEN);
+	breaker.Record(::grpc::StatusCode::OK, 10);
+	breaker.Record(::grpc::StatusCode::DEADLINE_EXCEEDED, 10);
+	EXPECT_EQ(breaker.GetState(), CircuitBreaker::OPEN);
+	EXPECT_EQ(breaker.GetOpened(), 2u);
+
+	// Passing probes close
+	std::this_thread::sleep_for(std::chrono::milliseconds(30));
+	EXPECT_TRUE(breaker.Allow());
+	EXPECT_TRUE(breaker.Allow());
+	breaker.Record(::grpc::StatusCode::OK, 10);
+	breaker.Record(::grpc::StatusCode::OK, 10);
+	EXPECT_EQ(breaker.GetState(), CircuitBreaker::CLOSED);
+}
+
+
+TEST(CircuitBreakerTest, SlowCalls) {
+	CircuitBreaker breaker;
+	CircuitBreakerPolicy policy;
+	policy.enabled = true;
+	policy.minCalls = 4;
+	policy.slowCallMs = 100;
+	policy.slowRate = 0.75;
+	breaker.SetPolicy(policy);
+	for (unsigned i = 0; i < 3; ++i)
+		breaker.Record(::grpc::StatusCode::OK, 200000);
+	EXPECT_EQ(breaker.GetState(), CircuitBreaker::CLOSED);
+	breaker.Record(::grpc::StatusCode::OK, 200000);
+	EXPECT_EQ(breaker.GetState(), CircuitBreaker::OPEN);
+}
+
+
+TEST(CircuitBreakerTest, ProbesAreNotLost) {
+	CircuitBreaker breaker;
+	CircuitBreakerPolicy policy;
+	policy.enabled = true;
+	policy.minCalls = 2;
+	policy.openMs = 20;
+	policy.probes = 1;
+	policy.probeTimeoutMs = 50;
+	breaker.SetPolicy(policy);
+	CircuitBreaker::Ticket straggler, ticket;
+	ASSERT_TRUE(breaker.Allow(&straggler));
+	for (unsigned i = 0; i < 2; ++i) {
+		ASSERT_TRUE(breaker.Allow(&ticket));
+		breaker.Record(::grpc::StatusCode::UNAVAILABLE, 10, ticket);
+	}
+	ASSERT_EQ(breaker.GetState(), CircuitBreaker::OPEN);
+
+	// A cancelled probe gives its slot back.
+	std::this_thread::sleep_for(std::chrono::milliseconds(30));
+	ASSERT_TRUE(breaker.Allow(&ticket));
+	EXPECT_FALSE(breaker.Allow());
+	breaker.Release(ticket);
+	ASSERT_TRUE(breaker.Allow(&ticket));
+
+	// A call sent while closed is not taken for the probe.
+	breaker.Record(::grpc::StatusCode::OK, 10, straggler);
+	EXPECT_EQ(breaker.GetState(), CircuitBreaker::HALF_OPEN);
+
+	// The probe never answers, so the breaker opens again and re-probes.
+	std::this_thread::sleep_for(std::chrono::milliseconds(60));
+	EXPECT_FALSE(breaker.Allow());
+	EXPECT_EQ(breaker.GetState(), CircuitBreaker::OPEN);
+	EXPECT_EQ(breaker.GetOpened(), 2u);
+	breaker.Record(::grpc::StatusCode::OK, 10, ticket);
+	EXPECT_EQ(breaker.GetState(), CircuitBreaker::OPEN);
+	std::this_thread::sleep_for(std::chrono::milliseconds(30));
+	ASSERT_TRUE(breaker.Allow(&ticket));
+	breaker.Record(::grpc::StatusCode::OK, 10, ticket);
+	EXPECT_EQ(breaker.GetState(), CircuitBreaker::CLOSED);
+}
+
+TEST(CircuitBreakerTest, ConnectorFailsFast) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + 5);
+	// Nothing is listening
+	AsyncServiceConnector client(os.str().c_str());
+	CircuitBreakerPolicy policy;
+	policy.enabled = true;
+	policy.minCalls = 3;
+	policy.openMs = 60000;
+	client.SetCircuitBreakerPolicy(policy);
+	client.Start();
+
+	Request req;
+	for (unsigned i = 0; i < 3; ++i) {
+		::grpc::ClientContext ctx;
+		auto rpc = client.inferAsync(req, &ctx);
+		ASSERT_TRUE(rpc->Wait(5));
+		EXPECT_EQ(rpc->GetStatus().error_code(), ::grpc::StatusCode::UNAVAILABLE);
+	}
+	auto rpc = client.inferAsync(req);
+	ASSERT_TRUE(rpc->Wait(1));
+	EXPECT_EQ(rpc->GetStatus().error_message(), AsyncServiceConnector::CircuitOpenStatus().error_message());
+	Response resp;
+	EXPECT_EQ(client.infer(req, resp).error_message(), AsyncServiceConnector::CircuitOpenStatus().error_message());
+
+	auto stats = client.GetTargetStats();
+	ASSERT_EQ(stats.size(), 1u);
+	EXPECT_EQ(stats[0].breaker, CircuitBreaker::OPEN);
+	EXPECT_EQ(stats[0].rejected, 2u);
+	EXPECT_EQ(stats[0].ejections, 1u);
+	client.Shutdown();
+}
+
+} } // namespace lucida::test
@@ -143,6 +143,85 @@ TEST(LucidaTest, SimpleAsyncClientAsyncServer) {
 	//EXPECT_FALSE(server->BlockUntilShutdown(5));
 }
 
+TEST(LucidaTest, SyncClientStaticAsyncServer) {
+	// Prep
+	std::ostringstream os;
+	os << "localhost:"<< FLAGS_port;
+	std::shared_ptr<AsyncServiceAcceptorT<TestStaticHandler>> server(
+		new AsyncServiceAcceptorT<TestStaticHandler>(new TestStaticHandler(), "testserver"));
+	std::string hostandport = os.str();
+	// Start receiving RPC's
+	std::thread svr_thread( [hostandport, server]() {
+		server->Start(hostandport, 1);
+	});
+
+	AsyncServiceConnector client(hostandport.c_str());
+
+	Request  req;
+	Response resp;
+	auto status = client.infer(req, resp);
+	EXPECT_TRUE(status.ok());
+	EXPECT_EQ(resp.msg(), "got static infer");
+	::grpc::ClientContext ctx;
+	status = client.learn(req, &ctx);
+	EXPECT_EQ(status.error_code(), ::grpc::StatusCode::UNIMPLEMENTED);
+
+	// Wait until shutdown
+	server->Shutdown();
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+}
+
+TEST(LucidaTest, ListenerDepthAsyncServer) {
+	// Prep
+	std::ostringstream os;
+	os << "localhost:"<< FLAGS_port;
+	std::shared_ptr<AsyncServiceAcceptor> server(new AsyncServiceAcceptor(new TestAsyncHandler(), "testserver"));
+	server->SetListenerDepth(4);
+	std::string hostandport = os.str();
+	// Start receiving RPC's on two completion queues
+	std::thread svr_thread( [hostandport, server]() {
+		server->Start(hostandport, 2);
+	});
+
+	AsyncServiceConnector client(hostandport.c_str());
+	client.Start();
+
+	const int count = 32;
+	Request  req;
+	// Concurrent calls need their own context.
+	std::vector<std::unique_ptr<::grpc::ClientContext>> contexts;
+	std::vector<std::shared_ptr<RpcCall>> rpcs;
+	for (int i = 0; i < count; ++i) {
+		contexts.emplace_back(new ::grpc::ClientContext());
+		rpcs.push_back(client.inferAsync(req, contexts.back().get()));
+	}
+	for (auto& rpc: rpcs) {
+		ASSERT_NE(rpc.get(), nullptr);
+		Response* resp = nullptr;
+		EXPECT_TRUE(rpc->Wait(3));
+		EXPECT_TRUE(rpc->Get(resp));
+		ASSERT_NE(resp, nullptr);
+		EXPECT_EQ(resp->msg(), "got infer");
+	}
+
+	// Wait until shutdown
+	server->Shutdown();
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+
+	auto report = server->GetListenerReport();
+	ASSERT_EQ(report.size(), 6u);
+	for (auto& r: report) {
+		EXPECT_EQ(r.depth, 4u);
+		EXPECT_LE(r.dry, r.matched);
+		if (r.method == "infer")
+			EXPECT_EQ(r.matched, (uint64_t)count);
+		else
+			EXPECT_EQ(r.matched, 0u);
+	}
+}
+
 } } // namespace lucida::test
 
 
@@ -0,0 +1,137 @@
+#include <lucida/coroutine.h>
+#ifdef LUCIDA_HAS_COROUTINES
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <gtest/gtest.h>
+#include "handler.h"
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+/// Forwards infer without blocking its completion queue thread.
+class TestCoForwardHandler : public CoroutineServiceHandlerT<TestCoForwardHandler> {
+public:
+	TestCoForwardHandler(AsyncServiceConnector* downstream): inflight(0), maxInflight(0), downstream_(downstream) {}
+	CallTask CoInfer(TypedCall<Request, Response>* call) {
+		maxInflight = std::max(maxInflight, ++inflight);
+		auto rpc = co_await downstream_->inferAsync(call->request_);
+		--inflight;
+		Response* resp = nullptr;
+		if (!rpc->IsOK() || !rpc->Get(resp)) {
+			call->FinishWithError(rpc->GetStatus());
+			co_return;
+		}
+		call->response_.set_msg("forwarded " + resp->msg());
+	}
+	CallTask CoLearn(TypedCall<Request, ::google::protobuf::Empty>* call) {
+		auto rpc = co_await downstream_->inferAsync(call->request_);
+		throw std::runtime_error("learn failed");
+	}
+	// Only touched by the single completion queue thread.
+	unsigned inflight;
+	unsigned maxInflight;
+private:
+	AsyncServiceConnector* downstream_;
+};
+
+
+TEST(CoroutineTest, ForwardsConcurrently) {
+	std::string back = HostAndPort(11);
+	std::string front = HostAndPort(12);
+	std::shared_ptr<AsyncServiceAcceptorT<TestSlowHandler>> backServer(
+		new AsyncServiceAcceptorT<TestSlowHandler>(new TestSlowHandler(100), "backserver"));
+	std::thread back_thread([back, backServer]() { backServer->Start(back, 4); });
+	ASSERT_TRUE(WaitForServer(back));
+
+	AsyncServiceConnector downstream(back.c_str());
+	downstream.Start();
+	TestCoForwardHandler* handler = new TestCoForwardHandler(&downstream);
+	std::shared_ptr<AsyncServiceAcceptorT<TestCoForwardHandler>> frontServer(
+		new AsyncServiceAcceptorT<TestCoForwardHandler>(handler, "frontserver"));
+	frontServer->SetListenerDepth(4);
+	std::thread front_thread([front, frontServer]() { frontServer->Start(front, 1); });
+	ASSERT_TRUE(WaitForServer(front));
+
+	AsyncServiceConnector client(front.c_str());
+	client.Start();
+	const unsigned count = 4;
+	Request req;
+	std::vector<std::unique_ptr<::grpc::ClientContext>> contexts;
+	std::vector<std::shared_ptr<RpcCall>> rpcs;
+	for (unsigned i = 0; i < count; ++i) {
+		contexts.emplace_back(new ::grpc::ClientContext());
+		rpcs.push_back(client.inferAsync(req, contexts.back().get()));
+	}
+	for (auto& rpc: rpcs) {
+		ASSERT_TRUE(rpc->Wait(5));
+		Response* resp = nullptr;
+		EXPECT_TRUE(rpc->IsOK());
+		EXPECT_TRUE(rpc->Get(resp));
+		EXPECT_EQ(resp->msg(), "forwarded got slow infer");
+	}
+	// One thread had every call suspended at once.
+	EXPECT_GT(handler->maxInflight, 1u);
+	EXPECT_EQ(handler->inflight, 0u);
+	client.Shutdown();
+
+	frontServer->Shutdown();
+	EXPECT_TRUE(frontServer->BlockUntilShutdown(5));
+	front_thread.join();
+	downstream.Shutdown();
+	backServer->Shutdown();
+	EXPECT_TRUE(backServer->BlockUntilShutdown(5));
+	back_thread.join();
+}
+
+
+TEST(CoroutineTest, ThrowFinishesWithInternal) {
+	std::string back = HostAndPort(11);
+	std::string front = HostAndPort(12);
+	std::shared_ptr<AsyncServiceAcceptorT<TestStaticHandler>> backServer(
+		new AsyncServiceAcceptorT<TestStaticHandler>(new TestStaticHandler(), "backserver"));
+	std::thread back_thread([back, backServer]() { backServer->Start(back, 1); });
+	ASSERT_TRUE(WaitForServer(back));
+
+	AsyncServiceConnector downstream(back.c_str());
+	downstream.Start();
+	std::shared_ptr<AsyncServiceAcceptorT<TestCoForwardHandler>> frontServer(
+		new AsyncServiceAcceptorT<TestCoForwardHandler>(new TestCoForwardHandler(&downstream), "frontserver"));
+	std::thread front_thread([front, frontServer]() { frontServer->Start(front, 1); });
+	ASSERT_TRUE(WaitForServer(front));
+
+	AsyncServiceConnector client(front.c_str());
+	Request req;
+	EXPECT_EQ(client.learn(req).error_code(), ::grpc::StatusCode::INTERNAL);
+
+	frontServer->Shutdown();
+	EXPECT_TRUE(frontServer->BlockUntilShutdown(5));
+	front_thread.join();
+	downstream.Shutdown();
+	backServer->Shutdown();
+	EXPECT_TRUE(backServer->BlockUntilShutdown(5));
+	back_thread.join();
+}
+
+} } // namespace lucida::test
+#endif  // LUCIDA_HAS_COROUTINES
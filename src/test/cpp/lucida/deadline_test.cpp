@@ -0,0 +1,101 @@
+#include <sstream>
+#include <thread>
+#include <gflags/gflags.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <gtest/gtest.h>
+#include "handler.h"
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+TEST(DeadlineTest, PropagatesDownstream) {
+	std::string slow = HostAndPort(6);
+	std::string front = HostAndPort(7);
+	std::shared_ptr<AsyncServiceAcceptorT<TestSlowHandler>> slowServer(
+		new AsyncServiceAcceptorT<TestSlowHandler>(new TestSlowHandler(300), "slowserver"));
+	std::thread slow_thread([slow, slowServer]() { slowServer->Start(slow, 1); });
+	ASSERT_TRUE(WaitForServer(slow));
+
+	AsyncServiceConnector downstream(slow.c_str());
+	TestForwardHandler* handler = new TestForwardHandler(&downstream);
+	std::shared_ptr<AsyncServiceAcceptorT<TestForwardHandler>> frontServer(
+		new AsyncServiceAcceptorT<TestForwardHandler>(handler, "frontserver"));
+	std::thread front_thread([front, frontServer]() { frontServer->Start(front, 1); });
+	ASSERT_TRUE(WaitForServer(front));
+
+	AsyncServiceConnector client(front.c_str());
+	::grpc::ClientContext ctx;
+	ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(100));
+	Request req;
+	Response resp;
+	EXPECT_EQ(client.infer(req, resp, &ctx).error_code(), ::grpc::StatusCode::DEADLINE_EXCEEDED);
+
+	frontServer->Shutdown();
+	EXPECT_TRUE(frontServer->BlockUntilShutdown(5));
+	front_thread.join();
+	// The handler saw the client's deadline and the downstream call gave up
+	// with it instead of waiting for the slow server. Depending on which
+	// fires first it sees its own deadline or the parent's cancellation.
+	EXPECT_GT(handler->remaining.count(), 0);
+	EXPECT_LE(handler->remaining.count(), 100);
+	EXPECT_TRUE(handler->downstreamStatus.error_code() == ::grpc::StatusCode::DEADLINE_EXCEEDED ||
+		handler->downstreamStatus.error_code() == ::grpc::StatusCode::CANCELLED);
+	EXPECT_LT(handler->downstreamTime.count(), 250);
+
+	slowServer->Shutdown();
+	EXPECT_TRUE(slowServer->BlockUntilShutdown(5));
+	slow_thread.join();
+}
+
+
+TEST(DeadlineTest, DropsExpiredBeforeDispatch) {
+	std::string slow = HostAndPort(8);
+	std::shared_ptr<AsyncServiceAcceptorT<TestSlowHandler>> server(
+		new AsyncServiceAcceptorT<TestSlowHandler>(new TestSlowHandler(200), "slowserver"));
+	std::thread svr_thread([slow, server]() { server->Start(slow, 1); });
+	ASSERT_TRUE(WaitForServer(slow));
+
+	AsyncServiceConnector client(slow.c_str());
+	client.Start();
+	Request req;
+	// The first call keeps the only thread busy while the second expires.
+	::grpc::ClientContext ctx1, ctx2;
+	auto busy = client.inferAsync(req, &ctx1);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	ctx2.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(50));
+	auto late = client.inferAsync(req, &ctx2);
+	ASSERT_TRUE(busy->Wait(5));
+	ASSERT_TRUE(late->Wait(5));
+	EXPECT_TRUE(busy->IsOK());
+	EXPECT_EQ(late->GetStatus().error_code(), ::grpc::StatusCode::DEADLINE_EXCEEDED);
+	client.Shutdown();
+
+	server->Shutdown();
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+	for (auto& r: server->GetListenerReport()) {
+		if (r.method == "infer") {
+			EXPECT_EQ(r.matched, 2u);
+			EXPECT_EQ(r.expired, 1u);
+		}
+	}
+}
+
+} } // namespace lucida::test
@@ -0,0 +1,129 @@
+
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <deque>
+#include <gflags/gflags.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <gtest/gtest.h>
+
+DEFINE_int32(port,
+			 9000,
+			 "Port for benchmark (default: 9000)");
+
+DEFINE_int32(bench_dispatches,
+			 10000000,
+			 "Number of handler dispatches per dispatch benchmark (default: 10000000)");
+
+DEFINE_int32(bench_rpcs,
+			 2000,
+			 "Number of RPC's per RPC benchmark (default: 2000)");
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+// Benchmarks report timings and only check the calls complete. They build
+// into lucida_bench, not lucida_test, so test runs do not pay for them.
+
+class BenchVirtualHandler : public AsyncServiceHandler {
+public:
+	unsigned count_ = 0;
+private:
+	void OnCreate(TypedCall<Request, ::google::protobuf::Empty>* call) override {}
+	void OnLearn(TypedCall<Request, ::google::protobuf::Empty>* call) override {}
+	void OnInfer(TypedCall<Request, Response>* call) override { ++count_; }
+};
+
+class BenchStaticHandler : public AsyncServiceHandlerT<BenchStaticHandler> {
+public:
+	unsigned count_ = 0;
+	void OnInfer(TypedCall<Request, Response>* call) { ++count_; }
+};
+
+
+template<class Handler, class Base>
+static double TimeDispatch(Handler& handler, Base* base) {
+	StaticCall<Base, InferMethod> call(base, nullptr);
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < FLAGS_bench_dispatches; ++i)
+		InferMethod::Dispatch(base, &call);
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+	EXPECT_EQ(handler.count_, unsigned(FLAGS_bench_dispatches));
+	return elapsed.count() / FLAGS_bench_dispatches;
+}
+
+
+TEST(DispatchBench, Dispatch) {
+	BenchVirtualHandler vh;
+	BenchStaticHandler sh;
+	// Hide the dynamic type behind a volatile pointer so the virtual call is not devirtualized.
+	AsyncServiceHandler* volatile vp = &vh;
+	double vns = TimeDispatch(vh, static_cast<AsyncServiceHandler*>(vp));
+	double sns = TimeDispatch(sh, &sh);
+	std::cout << "[ BENCH    ] dispatch virtual=" << vns << "ns static=" << sns << "ns" << std::endl;
+}
+
+
+template<class Acceptor>
+static double TimeRpcs(Acceptor* server) {
+	std::ostringstream os;
+	os << "localhost:"<< FLAGS_port;
+	std::string hostandport = os.str();
+	std::shared_ptr<Acceptor> guard(server);
+	std::thread svr_thread( [hostandport, guard]() {
+		guard->Start(hostandport, 1);
+	});
+
+	auto channel = ::grpc::CreateChannel(hostandport, ::grpc::InsecureChannelCredentials());
+	EXPECT_TRUE(channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5)));
+
+	AsyncServiceConnector client(hostandport.c_str());
+	client.Start();
+	Request req;
+	Response resp;
+	::grpc::ClientContext warmup;
+	EXPECT_TRUE(client.infer(req, resp, &warmup).ok());	// warm up the channel
+
+	// Keep a window of calls in flight
+	std::deque<std::shared_ptr<RpcCall>> window;
+	std::deque<std::unique_ptr<::grpc::ClientContext>> contexts;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < FLAGS_bench_rpcs; ++i) {
+		if (window.size() == 32) {
+			EXPECT_TRUE(window.front()->Wait(5));
+			window.pop_front();
+			contexts.pop_front();
+		}
+		contexts.emplace_back(new ::grpc::ClientContext());
+		window.push_back(client.inferAsync(req, contexts.back().get()));
+	}
+	while (!window.empty()) {
+		EXPECT_TRUE(window.front()->Wait(5));
+		window.pop_front();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	client.Shutdown();
+	guard->Shutdown();
+	EXPECT_TRUE(guard->BlockUntilShutdown(5));
+	svr_thread.join();
+	return FLAGS_bench_rpcs / elapsed.count();
+}
+
+
+TEST(DispatchBench, Rpcs) {
+	double vrate = TimeRpcs(new AsyncServiceAcceptor(new BenchVirtualHandler(), "bench"));
+	double srate = TimeRpcs(new AsyncServiceAcceptorT<BenchStaticHandler>(new BenchStaticHandler(), "bench"));
+	std::cout << "[ BENCH    ] infer virtual=" << vrate << "rpc/s static=" << srate << "rpc/s" << std::endl;
+}
+
+} } // namespace lucida::test
+
+
+int main(int argc, char** argv) {
+	::testing::InitGoogleTest(&argc, argv);
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	return RUN_ALL_TESTS();
+}
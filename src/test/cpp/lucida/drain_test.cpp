@@ -0,0 +1,103 @@
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <gflags/gflags.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <lucida/simulator.h>
+#include <gtest/gtest.h>
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+// Infer takes latencyUs without holding a completion queue thread.
+static AsyncServiceAcceptorT<SimulatorHandler>* CreateServer(const std::string& latencyUs) {
+	MethodProfile profile;
+	EXPECT_TRUE(ParseMethodProfile("latency=" + latencyUs, profile));
+	return new AsyncServiceAcceptorT<SimulatorHandler>(new SimulatorHandler(profile, profile, profile), "testserver");
+}
+
+
+TEST(DrainTest, FinishInFlight) {
+	std::string target = HostAndPort(26);
+	std::shared_ptr<AsyncServiceAcceptorT<SimulatorHandler>> server(CreateServer("400000"));
+	DrainPolicy policy;
+	policy.notReadyMs = 100;
+	policy.graceMs = 5000;
+	server->SetDrainPolicy(policy);
+	EXPECT_FALSE(server->IsReady());
+	std::thread svr_thread([target, server]() { server->Start(target, 1); });
+	ASSERT_TRUE(WaitForServer(target));
+	EXPECT_TRUE(server->IsReady());
+
+	AsyncServiceConnector client(target.c_str());
+	client.Start();
+	::grpc::ClientContext first;
+	auto inFlight = client.inferAsync(Request(), &first);
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	EXPECT_EQ(server->GetListenerReport()[2].inFlight, 1u);
+
+	server->Shutdown();
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	EXPECT_FALSE(server->IsReady());
+	// Calls are still served while not ready.
+	::grpc::ClientContext second;
+	auto late = client.inferAsync(Request(), &second);
+
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+	ASSERT_TRUE(inFlight->Wait(5));
+	EXPECT_TRUE(inFlight->IsOK()) << inFlight->GetStatus().error_message();
+	ASSERT_TRUE(late->Wait(5));
+	EXPECT_TRUE(late->IsOK()) << late->GetStatus().error_message();
+	auto report = server->GetListenerReport();
+	EXPECT_EQ(report[2].matched, 2u);
+	EXPECT_EQ(report[2].inFlight, 0u);
+	EXPECT_EQ(report[2].cancelled, 0u);
+	client.Shutdown();
+}
+
+
+TEST(DrainTest, CancelStragglers) {
+	std::string target = HostAndPort(27);
+	std::shared_ptr<AsyncServiceAcceptorT<SimulatorHandler>> server(CreateServer("2500000"));
+	DrainPolicy policy;
+	policy.graceMs = 200;
+	server->SetDrainPolicy(policy);
+	std::thread svr_thread([target, server]() { server->Start(target, 1); });
+	ASSERT_TRUE(WaitForServer(target));
+
+	AsyncServiceConnector client(target.c_str());
+	client.Start();
+	::grpc::ClientContext context;
+	auto rpc = client.inferAsync(Request(), &context);
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+	server->Shutdown();
+	ASSERT_TRUE(rpc->Wait(2));
+	EXPECT_FALSE(rpc->IsOK());
+	EXPECT_EQ(server->GetListenerReport()[2].cancelled, 1u);
+	// Shutdown completes once the handler lets the cancelled call go.
+	EXPECT_FALSE(server->BlockUntilShutdown(1));
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+	client.Shutdown();
+}
+
+} } // namespace lucida::test
@@ -0,0 +1,212 @@
+#include <sstream>
+#include <thread>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <lucida/fair_scheduler.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <gtest/gtest.h>
+#include "handler.h"
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+/// A matched call that only records what happened to it.
+class FakeCall: public UntypedCall {
+public:
+	FakeCall(const std::string& tenant, std::vector<std::string>* log): tenant_(tenant), log_(log) {
+		status_ = PROCESS;
+	}
+	void Proceed(bool) override { log_->push_back(tenant_); }
+	void Reject(const ::grpc::Status&) override { log_->push_back("rejected " + tenant_); delete this; }
+	UntypedCall* CreateListener() override { return nullptr; }
+	const char* GetMethodName() const override { return "fake"; }
+	const std::string* GetTenant() const override { return &tenant_; }
+private:
+	std::string tenant_;
+	std::vector<std::string>* log_;
+};
+
+
+static std::string Drain(FairScheduler& scheduler) {
+	std::string order;
+	while (UntypedCall* call = scheduler.Pop()) {
+		order += *call->GetTenant();
+		delete call;
+	}
+	return order;
+}
+
+
+TEST(FairSchedulerTest, WeightedRoundRobin) {
+	FairSchedulerPolicy policy;
+	policy.weights["a"] = 2;
+	FairScheduler scheduler(policy);
+	std::vector<std::string> log;
+	for (unsigned i = 0; i < 4; ++i)
+		scheduler.Push("a", new FakeCall("a", &log));
+	for (unsigned i = 0; i < 4; ++i)
+		scheduler.Push("b", new FakeCall("b", &log));
+	EXPECT_EQ(scheduler.Queued(), 8u);
+	EXPECT_EQ(Drain(scheduler), "aabaabbb");
+	EXPECT_FALSE(scheduler.Runnable());
+
+	std::vector<TenantReport> report;
+	scheduler.Report(report);
+	ASSERT_EQ(report.size(), 2u);
+	for (auto& r: report)
+		EXPECT_EQ(r.dispatched, 4u);
+}
+
+
+TEST(FairSchedulerTest, Limits) {
+	FairSchedulerPolicy policy;
+	policy.maxInflight = 1;
+	policy.maxQueued = 2;
+	FairScheduler scheduler(policy);
+	std::vector<std::string> log;
+	for (unsigned i = 0; i < 3; ++i)
+		scheduler.Push("a", new FakeCall("a", &log));
+	scheduler.Push("b", new FakeCall("b", &log));
+	ASSERT_EQ(log.size(), 1u);
+	EXPECT_EQ(log[0], "rejected a");
+
+	UntypedCall* a = scheduler.Pop();
+	EXPECT_EQ(*a->GetTenant(), "a");
+	// a is at its limit so b goes next, then nothing can run.
+	UntypedCall* b = scheduler.Pop();
+	EXPECT_EQ(*b->GetTenant(), "b");
+	EXPECT_FALSE(scheduler.Runnable());
+	EXPECT_EQ(scheduler.Pop(), nullptr);
+	delete a;
+	EXPECT_TRUE(scheduler.Runnable());
+	EXPECT_EQ(Drain(scheduler), "a");
+	delete b;
+}
+
+
+TEST(FairSchedulerTest, QuietTenantOvertakesNoisyOne) {
+	std::string hostAndPort = HostAndPort(13);
+	std::shared_ptr<AsyncServiceAcceptorT<TestSlowHandler>> server(
+		new AsyncServiceAcceptorT<TestSlowHandler>(new TestSlowHandler(20), "testserver"));
+	FairSchedulerPolicy policy;
+	policy.enabled = true;
+	server->SetFairScheduling(policy);
+	std::thread svr_thread([hostAndPort, server]() { server->Start(hostAndPort, 1); });
+	ASSERT_TRUE(WaitForServer(hostAndPort));
+
+	AsyncServiceConnector client(hostAndPort.c_str());
+	client.Start();
+	const unsigned count = 10;
+	Request noisy;
+	noisy.set_lucid("noisy");
+	std::vector<std::unique_ptr<::grpc::ClientContext>> contexts;
+	std::vector<std::shared_ptr<RpcCall>> rpcs;
+	for (unsigned i = 0; i < count; ++i) {
+		contexts.emplace_back(new ::grpc::ClientContext());
+		rpcs.push_back(client.inferAsync(noisy, contexts.back().get()));
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	// Served FIFO the quiet call would wait for the whole noisy backlog.
+	Request quiet;
+	quiet.set_lucid("quiet");
+	::grpc::ClientContext context;
+	auto start = std::chrono::steady_clock::now();
+	auto rpc = client.inferAsync(quiet, &context);
+	ASSERT_TRUE(rpc->Wait(5));
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	EXPECT_TRUE(rpc->IsOK());
+	EXPECT_LT(elapsed, std::chrono::milliseconds(20 * count / 2));
+	for (auto& r: rpcs) {
+		ASSERT_TRUE(r->Wait(5));
+		EXPECT_TRUE(r->IsOK());
+	}
+
+	auto report = server->GetTenantReport();
+	ASSERT_EQ(report.size(), 2u);
+	EXPECT_EQ(report[0].tenant, "noisy");
+	EXPECT_EQ(report[0].dispatched, count);
+	EXPECT_EQ(report[1].tenant, "quiet");
+	EXPECT_EQ(report[1].dispatched, 1u);
+	client.Shutdown();
+
+	server->Shutdown();
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+}
+
+
+TEST(FairSchedulerTest, CancelQueuedCall) {
+	std::string hostAndPort = HostAndPort(37);
+	std::shared_ptr<AsyncServiceAcceptorT<TestSlowHandler>> server(
+		new AsyncServiceAcceptorT<TestSlowHandler>(new TestSlowHandler(20), "testserver"));
+	FairSchedulerPolicy policy;
+	policy.enabled = true;
+	server->SetFairScheduling(policy);
+	std::thread svr_thread([hostAndPort, server]() { server->Start(hostAndPort, 1); });
+	ASSERT_TRUE(WaitForServer(hostAndPort));
+
+	AsyncServiceConnector client(hostAndPort.c_str());
+	client.Start();
+	Request request;
+	request.set_lucid("user");
+	// Connected, so the calls arrive in the order sent.
+	::grpc::ClientContext warmup;
+	auto warm = client.inferAsync(request, &warmup);
+	ASSERT_TRUE(warm->Wait(5));
+	std::vector<std::unique_ptr<::grpc::ClientContext>> contexts;
+	std::vector<std::shared_ptr<RpcCall>> rpcs;
+	for (unsigned i = 0; i < 5; ++i) {
+		contexts.emplace_back(new ::grpc::ClientContext());
+		rpcs.push_back(client.inferAsync(request, contexts.back().get()));
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	// Both wait behind the backlog, one is cancelled and one expires.
+	::grpc::ClientContext cancelled, expired;
+	expired.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(30));
+	auto cancelledRpc = client.inferAsync(request, &cancelled);
+	auto expiredRpc = client.inferAsync(request, &expired);
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	cancelled.TryCancel();
+
+	ASSERT_TRUE(cancelledRpc->Wait(5));
+	EXPECT_EQ(cancelledRpc->GetStatus().error_code(), ::grpc::StatusCode::CANCELLED);
+	ASSERT_TRUE(expiredRpc->Wait(5));
+	EXPECT_EQ(expiredRpc->GetStatus().error_code(), ::grpc::StatusCode::DEADLINE_EXCEEDED);
+	for (auto& r: rpcs) {
+		ASSERT_TRUE(r->Wait(5));
+		EXPECT_TRUE(r->IsOK());
+	}
+	// Queued behind them, so the abandoned calls were dropped by the time it
+	// is served.
+	::grpc::ClientContext context;
+	auto rpc = client.inferAsync(request, &context);
+	ASSERT_TRUE(rpc->Wait(5));
+	EXPECT_TRUE(rpc->IsOK());
+	EXPECT_EQ(server->GetListenerReport()[2].expired, 2u);
+	EXPECT_EQ(server->GetTenantReport()[0].dispatched, 9u);
+	client.Shutdown();
+
+	server->Shutdown();
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+}
+
+} } // namespace lucida::test
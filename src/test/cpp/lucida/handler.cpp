@@ -2,6 +2,30 @@
 
 namespace lucida { namespace test {
 
+///////////////////////////////////////////////////////////////////////////////
+// Recognizer
+
+std::atomic<unsigned> TestRecognizer::aborts(0);
+
+TestRecognizer::TestRecognizer(size_t frameSize): frameSize_(frameSize), frames_(0), bytes_(0) {
+}
+
+void TestRecognizer::Begin(const std::string& lucid, unsigned sampleRate) {
+	lucid_ = lucid;
+}
+
+bool TestRecognizer::Process(const char* frame, std::string& interim) {
+	++frames_;
+	bytes_ += frameSize_;
+	interim = lucid_ + " frames=" + std::to_string(frames_);
+	return true;
+}
+
+std::string TestRecognizer::End(const char* tail, size_t size) {
+	bytes_ += size;
+	return lucid_ + " frames=" + std::to_string(frames_) + " bytes=" + std::to_string(bytes_);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Async
 
@@ -20,6 +44,10 @@ void TestAsyncHandler::OnInfer(TypedCall<Request, Response>* call) {
 	call->response_.set_msg("got infer");
 }
 
+Recognizer* TestAsyncHandler::CreateRecognizer() {
+	return new TestRecognizer();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Sync
 
@@ -1,9 +1,31 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
 
 namespace lucida { namespace test {
 
+/// Counts frames and bytes.
+class TestRecognizer : public Recognizer {
+public:
+	TestRecognizer(size_t frameSize=320);
+	size_t FrameSize() const override { return frameSize_; }
+	void Begin(const std::string& lucid, unsigned sampleRate) override;
+	bool Process(const char* frame, std::string& interim) override;
+	std::string End(const char* tail, size_t size) override;
+	void Abort() override { ++aborts; }
+	/// Streams aborted by any instance.
+	static std::atomic<unsigned> aborts;
+private:
+	size_t frameSize_;
+	size_t frames_;
+	size_t bytes_;
+	std::string lucid_;
+};
+
 class TestAsyncHandler : public AsyncServiceHandler {
 public:
 	TestAsyncHandler();
@@ -11,6 +33,68 @@ private:
 	void OnCreate(TypedCall<Request, ::google::protobuf::Empty>* call) override;
 	void OnLearn(TypedCall<Request, ::google::protobuf::Empty>* call) override;
 	void OnInfer(TypedCall<Request, Response>* call) override;
+	Recognizer* CreateRecognizer() override;
+};
+
+/// Statically dispatched; create and learn use the UNIMPLEMENTED defaults.
+class TestStaticHandler : public AsyncServiceHandlerT<TestStaticHandler> {
+public:
+	void OnInfer(TypedCall<Request, Response>* call) {
+		call->response_.set_msg("got static infer");
+	}
+	Recognizer* CreateRecognizer() {
+		return new TestRecognizer();
+	}
+};
+
+/// Blocks its completion queue for a while on infer.
+class TestSlowHandler : public AsyncServiceHandlerT<TestSlowHandler> {
+public:
+	TestSlowHandler(unsigned delayMs): delayMs_(delayMs) {}
+	void OnInfer(TypedCall<Request, Response>* call) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(delayMs_));
+		call->response_.set_msg("got slow infer");
+	}
+private:
+	unsigned delayMs_;
+};
+
+/// Answers infer with its name and a warm state handed over on hot restart,
+/// taking delayMs first.
+class TestWarmHandler : public AsyncServiceHandlerT<TestWarmHandler> {
+public:
+	TestWarmHandler(const std::string& name, const std::string& state, unsigned delayMs=0):
+		name_(name), state_(state), delayMs_(delayMs) {}
+	void OnInfer(TypedCall<Request, Response>* call) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(delayMs_));
+		call->response_.set_msg(name_ + ":" + state_);
+	}
+	bool ExportWarmState(std::string& state) {
+		state = state_;
+		return true;
+	}
+	void ImportWarmState(const std::string& state) { state_ = state; }
+private:
+	std::string name_;
+	std::string state_;
+	unsigned delayMs_;
+};
+
+/// Forwards infer downstream and records what it saw.
+class TestForwardHandler : public AsyncServiceHandlerT<TestForwardHandler> {
+public:
+	TestForwardHandler(AsyncServiceConnector* downstream): downstream_(downstream) {}
+	void OnInfer(TypedCall<Request, Response>* call) {
+		remaining = call->GetRemaining();
+		auto start = std::chrono::steady_clock::now();
+		downstreamStatus = downstream_->infer(call->request_, call->response_);
+		downstreamTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+	}
+	std::chrono::milliseconds remaining;
+	std::chrono::milliseconds downstreamTime;
+	::grpc::Status downstreamStatus;
+private:
+	AsyncServiceConnector* downstream_;
 };
 
 class TestSyncHandler : public LucidaService::Service {
@@ -0,0 +1,144 @@
+#include <sstream>
+#include <thread>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <lucida/latency_histogram.h>
+#include <lucida/retry_policy.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <gtest/gtest.h>
+#include "handler.h"
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+TEST(HedgingTest, LatencyHistogram) {
+	LatencyHistogram h;
+	EXPECT_EQ(h.Percentile(0.5), 0u);
+	for (uint64_t v = 0; v < 64; ++v) {
+		unsigned b = LatencyHistogram::BucketOf(v);
+		EXPECT_GT(LatencyHistogram::BucketLimit(b), v);
+		if (b > 0) EXPECT_LE(LatencyHistogram::BucketLimit(b - 1), v);
+	}
+	for (unsigned i = 0; i < 90; ++i) h.Record(100);
+	for (unsigned i = 0; i < 10; ++i) h.Record(10000);
+	EXPECT_EQ(h.Count(), 100u);
+	EXPECT_GE(h.Percentile(0.5), 100u);
+	EXPECT_LT(h.Percentile(0.5), 125u);
+	EXPECT_GE(h.Percentile(0.95), 10000u);
+	h.Decay();
+	EXPECT_EQ(h.Count(), 50u);
+}
+
+
+TEST(HedgingTest, RetryBudget) {
+	RetryBudget budget(0.5, 2);
+	EXPECT_TRUE(budget.TryWithdraw());
+	EXPECT_TRUE(budget.TryWithdraw());
+	EXPECT_FALSE(budget.TryWithdraw());
+	budget.Deposit();
+	EXPECT_FALSE(budget.TryWithdraw());
+	budget.Deposit();
+	EXPECT_TRUE(budget.TryWithdraw());
+}
+
+
+TEST(HedgingTest, HedgeSlowTarget) {
+	std::string slow = HostAndPort(1);
+	std::string fast = HostAndPort(2);
+	std::shared_ptr<AsyncServiceAcceptorT<TestSlowHandler>> slowServer(
+		new AsyncServiceAcceptorT<TestSlowHandler>(new TestSlowHandler(200), "slowserver"));
+	std::shared_ptr<AsyncServiceAcceptorT<TestStaticHandler>> fastServer(
+		new AsyncServiceAcceptorT<TestStaticHandler>(new TestStaticHandler(), "fastserver"));
+	std::thread slow_thread([slow, slowServer]() { slowServer->Start(slow, 1); });
+	std::thread fast_thread([fast, fastServer]() { fastServer->Start(fast, 1); });
+	ASSERT_TRUE(WaitForServer(slow));
+	ASSERT_TRUE(WaitForServer(fast));
+
+	AsyncServiceConnector client(std::vector<std::string>{ slow, fast });
+	HedgePolicy policy;
+	policy.enabled = true;
+	policy.defaultDelayMs = 20;
+	policy.minSamples = 1000;
+	client.SetHedgePolicy(policy);
+	client.Start();
+
+	const unsigned count = 6;
+	Request req;
+	for (unsigned i = 0; i < count; ++i) {
+		Response resp;
+		auto status = client.infer(req, resp);
+		EXPECT_TRUE(status.ok());
+		EXPECT_EQ(resp.msg(), "got static infer");
+	}
+	auto stats = client.GetTargetStats();
+	ASSERT_EQ(stats.size(), 2u);
+	EXPECT_EQ(stats[0].target, slow);
+	EXPECT_EQ(stats[0].wins, 0u);
+	EXPECT_EQ(stats[1].wins, count);
+	// Half the calls start on the slow target and are hedged to the fast one.
+	EXPECT_EQ(stats[1].hedges, count / 2);
+	EXPECT_EQ(stats[0].attempts, count / 2);
+	client.Shutdown();
+
+	slowServer->Shutdown();
+	EXPECT_TRUE(slowServer->BlockUntilShutdown(5));
+	fastServer->Shutdown();
+	EXPECT_TRUE(fastServer->BlockUntilShutdown(5));
+	slow_thread.join();
+	fast_thread.join();
+}
+
+
+TEST(HedgingTest, RetryUnavailableTarget) {
+	std::string dead = HostAndPort(3);
+	std::string live = HostAndPort(4);
+	std::shared_ptr<AsyncServiceAcceptorT<TestStaticHandler>> server(
+		new AsyncServiceAcceptorT<TestStaticHandler>(new TestStaticHandler(), "testserver"));
+	std::thread svr_thread([live, server]() { server->Start(live, 1); });
+	ASSERT_TRUE(WaitForServer(live));
+
+	AsyncServiceConnector client(std::vector<std::string>{ dead, live });
+	RetryPolicy policy;
+	policy.maxAttempts = 2;
+	client.SetRetryPolicy(policy);
+	client.Start();
+
+	const unsigned count = 6;
+	Request req;
+	for (unsigned i = 0; i < count; ++i) {
+		auto rpc = client.inferAsync(req);
+		ASSERT_TRUE(rpc->Wait(5));
+		Response* resp = nullptr;
+		EXPECT_TRUE(rpc->IsOK());
+		EXPECT_TRUE(rpc->Get(resp));
+		EXPECT_EQ(resp->msg(), "got static infer");
+	}
+	auto stats = client.GetTargetStats();
+	EXPECT_EQ(stats[0].errors, count / 2);
+	EXPECT_EQ(stats[1].retries, count / 2);
+	EXPECT_EQ(stats[1].wins, count);
+	client.Shutdown();
+
+	server->Shutdown();
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+}
+
+} } // namespace lucida::test
@@ -0,0 +1,134 @@
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <sstream>
+#include <thread>
+#include <gflags/gflags.h>
+#include <lucida/hot_restart.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <gtest/gtest.h>
+#include "handler.h"
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+static std::string ControlPath() {
+	std::ostringstream os;
+	os << "/tmp/lucida_hot_restart_test." << getpid();
+	return os.str();
+}
+
+
+static int LocalPort(int fd) {
+	sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) return -1;
+	if (addr.ss_family == AF_INET6)
+		return ntohs(reinterpret_cast<sockaddr_in6*>(&addr)->sin6_port);
+	return ntohs(reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+}
+
+
+TEST(HotRestartTest, PassListener) {
+	std::string path = ControlPath();
+	std::string state;
+	// Nobody to take over from.
+	unlink(path.c_str());
+	EXPECT_EQ(ReceiveListener(path, state), -1);
+
+	std::ostringstream target;
+	target << "0.0.0.0:" << (FLAGS_port + 24);
+	int listenFd = ListenTcp(target.str());
+	ASSERT_GE(listenFd, 0);
+	int control = ListenControl(path);
+	ASSERT_GE(control, 0);
+	std::string warm(100000, 'w');
+	std::thread sender([control, listenFd, &warm]() {
+		int conn = accept(control, nullptr, nullptr);
+		ASSERT_GE(conn, 0);
+		EXPECT_TRUE(SendListener(conn, listenFd, warm));
+		close(conn);
+	});
+	int fd = ReceiveListener(path, state);
+	sender.join();
+	ASSERT_GE(fd, 0);
+	EXPECT_NE(fd, listenFd);
+	EXPECT_EQ(LocalPort(fd), FLAGS_port + 24);
+	EXPECT_EQ(state, warm);
+	close(fd);
+	close(listenFd);
+	close(control);
+	unlink(path.c_str());
+}
+
+
+TEST(HotRestartTest, Handover) {
+	std::string path = ControlPath();
+	std::string target = HostAndPort(25);
+	std::ostringstream listen;
+	listen << "0.0.0.0:" << (FLAGS_port + 25);
+
+	auto first = std::make_shared<AsyncServiceAcceptorT<TestWarmHandler>>(
+		new TestWarmHandler("first", "cache", 300), "first");
+	first->EnableHotRestart(path);
+	std::thread firstThread([first, &listen]() { EXPECT_TRUE(first->Start(listen.str(), 2)); });
+	ASSERT_TRUE(WaitForServer(target));
+
+	// A call in flight when the successor takes over.
+	AsyncServiceConnector client(target.c_str());
+	client.Start();
+	::grpc::ClientContext inFlightContext;
+	auto inFlight = client.inferAsync(Request(), &inFlightContext);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	auto second = std::make_shared<AsyncServiceAcceptorT<TestWarmHandler>>(
+		new TestWarmHandler("second", ""), "second");
+	second->EnableHotRestart(path);
+	std::thread secondThread([second, &listen]() { EXPECT_TRUE(second->Start(listen.str(), 1)); });
+
+	// The first drains the call it had and stops.
+	EXPECT_TRUE(first->BlockUntilShutdown(5));
+	firstThread.join();
+	ASSERT_TRUE(inFlight->Wait(5));
+	Response* response = nullptr;
+	ASSERT_TRUE(inFlight->IsOK()) << inFlight->GetStatus().error_message();
+	ASSERT_TRUE(inFlight->Get(response));
+	EXPECT_EQ(response->msg(), "first:cache");
+	client.Shutdown();
+
+	// New connections reach the second, warmed with the first's state.
+	AsyncServiceConnector next(target.c_str());
+	next.Start();
+	::grpc::ClientContext context;
+	auto rpc = next.inferAsync(Request(), &context);
+	ASSERT_TRUE(rpc->Wait(5));
+	ASSERT_TRUE(rpc->IsOK()) << rpc->GetStatus().error_message();
+	ASSERT_TRUE(rpc->Get(response));
+	EXPECT_EQ(response->msg(), "second:cache");
+	next.Shutdown();
+
+	second->Shutdown();
+	EXPECT_TRUE(second->BlockUntilShutdown(5));
+	secondThread.join();
+	unlink(path.c_str());
+}
+
+} } // namespace lucida::test
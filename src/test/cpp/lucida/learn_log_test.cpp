@@ -0,0 +1,156 @@
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <thread>
+#include <boost/filesystem.hpp>
+#include <lucida/crc32c.h>
+#include <lucida/learn_log.h>
+#include <gtest/gtest.h>
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+typedef std::map<std::string, std::vector<std::string>> Learned;
+
+
+static std::function<void(const LearnEntry&)> Collect(Learned& learned) {
+	return [&learned](const LearnEntry& e) { learned[e.GetLucid()].push_back(e.GetData()); };
+}
+
+
+static void Learn(LearnLog& log, Learned& expected, unsigned first, unsigned count) {
+	for (unsigned i = first; i < first + count; ++i) {
+		std::string lucid = "user" + std::to_string(i % 3);
+		std::string data = "fact " + std::to_string(i);
+		ASSERT_TRUE(log.Append(lucid, data.data(), data.size()));
+		expected[lucid].push_back(data);
+	}
+}
+
+
+TEST(LearnLogTest, Crc32c) {
+	EXPECT_EQ(Crc32c("123456789", 9), 0xe3069283u);
+	EXPECT_EQ(Crc32c("56789", 5, Crc32c("1234", 4)), 0xe3069283u);
+	EXPECT_EQ(Crc32c("", 0), 0u);
+}
+
+
+TEST(LearnLogTest, ReplaysSegments) {
+	boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	LearnLogOptions options;
+	options.segmentBytes = 512;
+	Learned expected;
+	{
+		LearnLog log(dir.string(), options);
+		Learned none;
+		ASSERT_TRUE(log.Open(Collect(none)));
+		EXPECT_TRUE(none.empty());
+		Learn(log, expected, 0, 100);
+		EXPECT_GT(log.GetStats().segments, 2u);
+	}
+	LearnLog log(dir.string(), options);
+	Learned learned;
+	ASSERT_TRUE(log.Open(Collect(learned)));
+	EXPECT_EQ(learned, expected);
+	EXPECT_EQ(log.GetStats().tailRecords, 100u);
+
+	Request request;
+	request.set_lucid("user9");
+	ASSERT_TRUE(log.Append(request));
+	boost::filesystem::remove_all(dir);
+}
+
+
+TEST(LearnLogTest, CompactsToSnapshot) {
+	boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	LearnLogOptions options;
+	options.segmentBytes = 512;
+	Learned expected;
+	{
+		LearnLog log(dir.string(), options);
+		Learned none;
+		ASSERT_TRUE(log.Open(Collect(none)));
+		Learn(log, expected, 0, 60);
+		ASSERT_TRUE(log.Compact());
+		Learn(log, expected, 60, 30);
+		ASSERT_TRUE(log.Compact());
+		Learn(log, expected, 90, 9);
+		LearnLogStats stats = log.GetStats();
+		EXPECT_EQ(stats.snapshotRecords, 90u);
+		EXPECT_EQ(stats.snapshotUsers, 3u);
+		EXPECT_EQ(stats.tailRecords, 9u);
+		EXPECT_EQ(stats.compactions, 2u);
+	}
+	// Serve from the mapped snapshot and replay only the tail.
+	LearnLog log(dir.string(), options);
+	Learned tail;
+	ASSERT_TRUE(log.Open(Collect(tail), false));
+	EXPECT_EQ(tail["user0"].size(), 3u);
+	auto snapshot = log.GetSnapshot();
+	ASSERT_TRUE(snapshot != nullptr);
+	Learned learned;
+	for (auto& kv: expected)
+		EXPECT_EQ(snapshot->Find(kv.first, Collect(learned)), 30u);
+	EXPECT_EQ(snapshot->Find("nobody", Collect(learned)), 0u);
+	for (auto& kv: tail)
+		learned[kv.first].insert(learned[kv.first].end(), kv.second.begin(), kv.second.end());
+	EXPECT_EQ(learned, expected);
+
+	// Nothing left over from before the compactions.
+	unsigned files = 0;
+	for (boost::filesystem::directory_iterator it(dir), end; it != end; ++it)
+		++files;
+	EXPECT_EQ(files, 3u);
+	boost::filesystem::remove_all(dir);
+}
+
+
+TEST(LearnLogTest, CompactsInBackground) {
+	boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	LearnLogOptions options;
+	options.compactBytes = 1024;
+	LearnLog log(dir.string(), options);
+	Learned none, expected;
+	ASSERT_TRUE(log.Open(Collect(none)));
+	Learn(log, expected, 0, 100);
+	for (unsigned i = 0; i < 100 && log.GetStats().compactions == 0; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	EXPECT_GT(log.GetStats().compactions, 0u);
+	boost::filesystem::remove_all(dir);
+}
+
+
+TEST(LearnLogTest, CutsTornRecord) {
+	boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	Learned expected;
+	{
+		LearnLog log(dir.string());
+		Learned none;
+		ASSERT_TRUE(log.Open(Collect(none)));
+		Learn(log, expected, 0, 10);
+	}
+	// A crash in the middle of a write.
+	boost::filesystem::path segment;
+	for (boost::filesystem::directory_iterator it(dir), end; it != end; ++it)
+		segment = it->path();
+	uintmax_t size = boost::filesystem::file_size(segment);
+	{
+		std::ofstream out(segment.string(), std::ios::binary | std::ios::app);
+		out << "torn record";
+	}
+	{
+		LearnLog log(dir.string());
+		Learned learned;
+		ASSERT_TRUE(log.Open(Collect(learned)));
+		EXPECT_EQ(learned, expected);
+		EXPECT_EQ(boost::filesystem::file_size(segment), size);
+		Learn(log, expected, 10, 5);
+	}
+	LearnLog log(dir.string());
+	Learned learned;
+	ASSERT_TRUE(log.Open(Collect(learned)));
+	EXPECT_EQ(learned, expected);
+	boost::filesystem::remove_all(dir);
+}
+
+} } // namespace lucida::test
@@ -0,0 +1,157 @@
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <gflags/gflags.h>
+#include <lucida/load_report.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <lucida/simulator.h>
+#include <gtest/gtest.h>
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+// Infer takes latencyUs without holding a completion queue thread.
+static std::shared_ptr<AsyncServiceAcceptorT<SimulatorHandler>> CreateServer(const std::string& latencyUs) {
+	MethodProfile profile;
+	EXPECT_TRUE(ParseMethodProfile("latency=" + latencyUs, profile));
+	std::shared_ptr<AsyncServiceAcceptorT<SimulatorHandler>> server(
+		new AsyncServiceAcceptorT<SimulatorHandler>(new SimulatorHandler(profile, profile, profile), "testserver"));
+	server->EnableLoadReports();
+	return server;
+}
+
+
+TEST(LoadReportTest, Encoding) {
+	LoadReport report;
+	report.inFlight = 12;
+	report.queued = 3;
+	report.utilization = 0.4256f;
+	report.latencyUs = 1850;
+	report.qps = 970;
+	EXPECT_EQ(report.Encode(), "12,3,426,1850,970");
+	LoadReport parsed;
+	ASSERT_TRUE(LoadReport::Parse(report.Encode(), parsed));
+	EXPECT_EQ(parsed.inFlight, 12u);
+	EXPECT_EQ(parsed.queued, 3u);
+	EXPECT_FLOAT_EQ(parsed.utilization, 0.426f);
+	EXPECT_EQ(parsed.latencyUs, 1850u);
+	EXPECT_EQ(parsed.qps, 970u);
+	EXPECT_FALSE(LoadReport::Parse("1,2,3,4", parsed));
+	EXPECT_FALSE(LoadReport::Parse("1,2,3,4,5,6", parsed));
+	EXPECT_FALSE(LoadReport::Parse("1,2,-3,4,5", parsed));
+	EXPECT_FALSE(LoadReport::Parse("1,2,3,4,x", parsed));
+	EXPECT_FALSE(LoadReport::Parse("", parsed));
+	// A failed parse leaves the report alone.
+	EXPECT_EQ(parsed.inFlight, 12u);
+}
+
+
+TEST(LoadReportTest, Reporter) {
+	LoadReporter reporter(10);
+	reporter.AddInFlight(2);
+	reporter.AddQueued(1);
+	reporter.RecordCall(800);
+	reporter.RecordCall(1600);
+	LoadReport report = reporter.Get();
+	EXPECT_EQ(report.inFlight, 2u);
+	EXPECT_EQ(report.queued, 1u);
+	EXPECT_EQ(report.latencyUs, 900u);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	report = reporter.Get();
+	EXPECT_GT(report.qps, 0u);
+	EXPECT_GE(report.utilization, 0.0f);
+	EXPECT_LE(report.utilization, 1.0f);
+}
+
+
+TEST(LoadReportTest, TrailingMetadata) {
+	std::string target = HostAndPort(28);
+	auto server = CreateServer("2000");
+	std::thread svr_thread([target, server]() { server->Start(target, 1); });
+	ASSERT_TRUE(WaitForServer(target));
+
+	AsyncServiceConnector client(target.c_str());
+	::grpc::ClientContext context;
+	Response response;
+	ASSERT_TRUE(client.infer(Request(), response, &context).ok());
+	auto& metadata = context.GetServerTrailingMetadata();
+	auto it = metadata.find(LoadReport::Key());
+	ASSERT_NE(it, metadata.end());
+	LoadReport report;
+	ASSERT_TRUE(LoadReport::Parse(std::string(it->second.data(), it->second.size()), report));
+	EXPECT_EQ(report.inFlight, 1u);
+	EXPECT_GE(report.latencyUs, 2000u);
+	EXPECT_EQ(client.GetTargetStats()[0].load.latencyUs, report.latencyUs);
+	EXPECT_GE(server->GetLoadReport().latencyUs, 2000u);
+
+	server->Shutdown();
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+}
+
+
+TEST(LoadReportTest, LeastLoadRouting) {
+	// Replicas serving at different speeds.
+	std::string fast = HostAndPort(29);
+	std::string slow = HostAndPort(30);
+	std::shared_ptr<AsyncServiceAcceptorT<SimulatorHandler>> servers[2] = { CreateServer("1000"), CreateServer("8000") };
+	std::string targets[2] = { fast, slow };
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < 2; ++i) {
+		auto server = servers[i];
+		std::string target = targets[i];
+		threads.emplace_back([server, target]() { server->Start(target, 1); });
+	}
+	for (auto& target: targets)
+		ASSERT_TRUE(WaitForServer(target));
+
+	AsyncServiceConnector client(std::vector<std::string>{ slow, fast });
+	client.SetLeastLoadRouting(true);
+	client.Start();
+	// Keep a few calls in flight.
+	const unsigned total = 300, window = 6;
+	std::vector<std::unique_ptr<::grpc::ClientContext>> contexts;
+	std::vector<std::shared_ptr<RpcCall>> calls;
+	for (unsigned i = 0; i < total; ++i) {
+		if (calls.size() >= window) {
+			ASSERT_TRUE(calls[i - window]->Wait(5));
+			EXPECT_TRUE(calls[i - window]->IsOK());
+		}
+		contexts.emplace_back(new ::grpc::ClientContext);
+		calls.push_back(client.inferAsync(Request(), contexts.back().get()));
+	}
+	for (auto& call: calls)
+		ASSERT_TRUE(call->Wait(5));
+	auto stats = client.GetTargetStats();
+	EXPECT_EQ(stats[0].attempts + stats[1].attempts, total);
+	EXPECT_GT(stats[0].attempts, 0u);
+	EXPECT_GT(stats[1].attempts, 3 * stats[0].attempts);
+	EXPECT_GT(stats[0].load.latencyUs, stats[1].load.latencyUs);
+	client.Shutdown();
+
+	for (auto& server: servers) {
+		server->Shutdown();
+		EXPECT_TRUE(server->BlockUntilShutdown(5));
+	}
+	for (auto& t: threads)
+		t.join();
+}
+
+} } // namespace lucida::test
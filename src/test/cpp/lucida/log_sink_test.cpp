@@ -0,0 +1,112 @@
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <lucida/log_sink.h>
+#include <gtest/gtest.h>
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+/// Keeps what a sink writes.
+class Collector {
+public:
+	LogSink::Writer GetWriter() {
+		return [this](const CallLogRecord& r) {
+			std::lock_guard<std::mutex> guard(mu_);
+			records_.push_back(r);
+		};
+	}
+	std::vector<CallLogRecord> Take() {
+		std::lock_guard<std::mutex> guard(mu_);
+		std::vector<CallLogRecord> records;
+		records.swap(records_);
+		return records;
+	}
+private:
+	std::mutex mu_;
+	std::vector<CallLogRecord> records_;
+};
+
+
+TEST(LogSinkTest, Record) {
+	Collector collector;
+	LogSink sink(LogPolicy(), collector.GetWriter());
+	std::string tenant(100, 'u');
+	sink.LogCall("infer", ::grpc::Status(::grpc::StatusCode::NOT_FOUND, "no such user"), &tenant, 1234);
+	sink.LogCall("infer", ::grpc::Status::OK, &tenant);
+	sink.Flush();
+	auto records = collector.Take();
+	ASSERT_EQ(records.size(), 1u);
+	EXPECT_STREQ(records[0].method, "infer");
+	EXPECT_EQ(records[0].code, int(::grpc::StatusCode::NOT_FOUND));
+	EXPECT_EQ(records[0].latencyUs, 1234u);
+	EXPECT_STREQ(records[0].message, "no such user");
+	EXPECT_EQ(std::string(records[0].tenant), tenant.substr(0, sizeof(records[0].tenant) - 1));
+	EXPECT_GT(records[0].timeNs, 0);
+
+	LogPolicy policy;
+	policy.okSampleRate = 1;
+	sink.SetPolicy(policy);
+	sink.LogCall("learn", ::grpc::Status::OK);
+	sink.Flush();
+	records = collector.Take();
+	ASSERT_EQ(records.size(), 1u);
+	EXPECT_EQ(records[0].code, 0);
+	EXPECT_STREQ(records[0].tenant, "");
+}
+
+
+TEST(LogSinkTest, RateLimitByCode) {
+	Collector collector;
+	LogPolicy policy;
+	policy.errorsPerSecond = 1;
+	policy.burst = 5;
+	LogSink sink(policy, collector.GetWriter());
+	::grpc::Status unavailable(::grpc::StatusCode::UNAVAILABLE, "down");
+	::grpc::Status internal(::grpc::StatusCode::INTERNAL, "bug");
+	for (unsigned i = 0; i < 1000; ++i)
+		sink.LogCall("infer", unavailable);
+	sink.LogCall("infer", internal);
+	sink.Flush();
+	auto stats = sink.GetStats();
+	EXPECT_EQ(stats.logged, 6u);
+	EXPECT_EQ(stats.suppressed, 995u);
+	auto records = collector.Take();
+	// The admitted records, then a summary of the suppressed ones.
+	ASSERT_EQ(records.size(), 7u);
+	EXPECT_EQ(records[5].code, int(::grpc::StatusCode::INTERNAL));
+	EXPECT_STREQ(records[6].method, "LogSink");
+	EXPECT_EQ(records[6].code, int(::grpc::StatusCode::UNAVAILABLE));
+	EXPECT_STREQ(records[6].message, "suppressed 995 records");
+}
+
+
+TEST(LogSinkTest, ThreadsAndOverflow) {
+	Collector collector;
+	LogPolicy policy;
+	policy.errorsPerSecond = 0;
+	policy.flushIntervalMs = 1000;
+	policy.threadBufferBytes = 64 * sizeof(CallLogRecord);
+	LogSink sink(policy, collector.GetWriter());
+	const unsigned threads = 4, count = 1000;
+	std::vector<std::thread> loggers;
+	for (unsigned t = 0; t < threads; ++t) {
+		loggers.emplace_back([&sink]() {
+			for (unsigned i = 0; i < count; ++i)
+				sink.LogCall("infer", ::grpc::Status(::grpc::StatusCode::ABORTED, "conflict"));
+		});
+	}
+	for (auto& t: loggers)
+		t.join();
+	// The threads have exited, their buffers are still drained.
+	sink.Flush();
+	auto stats = sink.GetStats();
+	EXPECT_EQ(stats.logged + stats.dropped, threads * count);
+	EXPECT_GE(stats.logged, threads * 64u);
+	EXPECT_EQ(stats.written, stats.logged);
+	EXPECT_EQ(collector.Take().size(), stats.logged);
+}
+
+} } // namespace lucida::test
@@ -0,0 +1,102 @@
+#include <string>
+#include <thread>
+#include <vector>
+#include <lucida/lucid_store.h>
+#include <gtest/gtest.h>
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+struct KnowledgeBase {
+	KnowledgeBase(): learned(0) {}
+	std::vector<std::string> facts;
+	unsigned learned;
+};
+
+struct KnowledgeBaseSizer {
+	size_t operator () (const KnowledgeBase& kb) const {
+		return sizeof(kb) + MemoryUsageOf(kb.facts) - sizeof(kb.facts);
+	}
+};
+
+
+TEST(LucidStoreTest, CreateReadWrite) {
+	LucidStore<KnowledgeBase, KnowledgeBaseSizer> store(4);
+	EXPECT_FALSE(store.Read("alice", [](const KnowledgeBase&) {}));
+	EXPECT_FALSE(store.Write("alice", [](KnowledgeBase&) {}));
+	EXPECT_TRUE(store.Create("alice"));
+	EXPECT_FALSE(store.Create("alice"));
+	EXPECT_TRUE(store.Write("bob", [](KnowledgeBase& kb) { kb.learned = 7; }, true));
+	EXPECT_EQ(store.Size(), 2u);
+
+	size_t empty = store.MemoryUsage("alice");
+	EXPECT_GT(empty, sizeof(KnowledgeBase));
+	std::string fact(1000, 'x');
+	EXPECT_TRUE(store.Write("alice", [&fact](KnowledgeBase& kb) { kb.facts.push_back(fact); }));
+	EXPECT_GE(store.MemoryUsage("alice"), empty + fact.size());
+	EXPECT_EQ(store.MemoryUsage(), store.MemoryUsage("alice") + store.MemoryUsage("bob"));
+
+	unsigned learned = 0;
+	EXPECT_TRUE(store.Read("bob", [&learned](const KnowledgeBase& kb) { learned = kb.learned; }));
+	EXPECT_EQ(learned, 7u);
+
+	unsigned users = 0;
+	store.ForEach([&users](const std::string&, const KnowledgeBase&) { ++users; });
+	EXPECT_EQ(users, 2u);
+
+	EXPECT_TRUE(store.Erase("alice"));
+	EXPECT_FALSE(store.Erase("alice"));
+	EXPECT_EQ(store.Size(), 1u);
+	EXPECT_EQ(store.MemoryUsage(), store.MemoryUsage("bob"));
+}
+
+
+TEST(LucidStoreTest, ConcurrentLearnAndInfer) {
+	LucidStore<KnowledgeBase> store;
+	const unsigned threads = 4;
+	const unsigned users = 16;
+	const unsigned rounds = 1000;
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < threads; ++t) {
+		workers.push_back(std::thread([&store, t, rounds]() {
+			for (unsigned i = 0; i < rounds; ++i) {
+				std::string lucid = "user" + std::to_string((t + i) % users);
+				if (i % 4 == 0) {
+					store.Write(lucid, [](KnowledgeBase& kb) { ++kb.learned; }, true);
+				} else {
+					store.Read(lucid, [rounds](const KnowledgeBase& kb) { EXPECT_LE(kb.learned, rounds); });
+				}
+			}
+		}));
+	}
+	for (auto& w: workers)
+		w.join();
+	unsigned learned = 0;
+	store.ForEach([&learned](const std::string&, const KnowledgeBase& kb) { learned += kb.learned; });
+	EXPECT_EQ(learned, threads * rounds / 4);
+	EXPECT_EQ(store.Size(), users);
+}
+
+
+TEST(LucidStoreTest, CreateInitializesBeforePublishing) {
+	LucidStore<KnowledgeBase> store;
+	const unsigned users = 20000;
+	std::thread creator([&store, users]() {
+		for (unsigned i = 0; i < users; ++i)
+			store.Create("user" + std::to_string(i), [](KnowledgeBase& kb) { kb.learned = 42; });
+	});
+	// A reader racing the creator never sees a user before init ran.
+	for (unsigned i = 0; i < users; ++i) {
+		std::string lucid = "user" + std::to_string(i);
+		unsigned learned = 0;
+		while (!store.Read(lucid, [&learned](const KnowledgeBase& kb) { learned = kb.learned; }))
+			std::this_thread::yield();
+		EXPECT_EQ(learned, 42u) << lucid;
+	}
+	creator.join();
+	EXPECT_FALSE(store.Create("user0", [](KnowledgeBase& kb) { kb.learned = 0; }));
+	EXPECT_GT(store.MemoryUsage("user0"), sizeof(KnowledgeBase));
+}
+
+} } // namespace lucida::test
@@ -0,0 +1,102 @@
+#include <sched.h>
+#include <sstream>
+#include <thread>
+#include <gflags/gflags.h>
+#include <lucida/polling.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <gtest/gtest.h>
+#include "handler.h"
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+TEST(PollingTest, ParseCpuList) {
+	std::vector<int> cpus;
+	ASSERT_TRUE(ParseCpuList("0-3,8,10-11", cpus));
+	EXPECT_EQ(cpus, (std::vector<int>{ 0, 1, 2, 3, 8, 10, 11 }));
+	ASSERT_TRUE(ParseCpuList("", cpus));
+	EXPECT_TRUE(cpus.empty());
+	cpus.push_back(5);
+	EXPECT_FALSE(ParseCpuList("3-1", cpus));
+	EXPECT_FALSE(ParseCpuList("1,,2", cpus));
+	EXPECT_FALSE(ParseCpuList("a", cpus));
+	EXPECT_FALSE(ParseCpuList("-1", cpus));
+	EXPECT_FALSE(ParseCpuList("0-100000", cpus));
+	// A failed parse leaves the list alone.
+	EXPECT_EQ(cpus, std::vector<int>{ 5 });
+}
+
+
+TEST(PollingTest, PlaceThread) {
+	PollingPolicy policy;
+	EXPECT_TRUE(PlaceThread(policy, 3));
+	policy.cpus.push_back(0);
+	std::thread t([&policy]() {
+		ASSERT_TRUE(PlaceThread(policy, 3));
+		cpu_set_t set;
+		ASSERT_EQ(pthread_getaffinity_np(pthread_self(), sizeof(set), &set), 0);
+		EXPECT_EQ(CPU_COUNT(&set), 1);
+		EXPECT_TRUE(CPU_ISSET(0, &set));
+		EXPECT_EQ(sched_getcpu(), 0);
+	});
+	t.join();
+}
+
+
+TEST(PollingTest, BusyPoll) {
+	std::string target = HostAndPort(21);
+	PollingPolicy policy;
+	policy.cpus.push_back(0);
+	policy.busyPollUs = 200;
+	std::shared_ptr<AsyncServiceAcceptorT<TestStaticHandler>> server(
+		new AsyncServiceAcceptorT<TestStaticHandler>(new TestStaticHandler(), "testserver"));
+	server->SetPollingPolicy(policy);
+	// Only the server's own threads are pinned.
+	bool callerKept = false;
+	std::thread svr_thread([target, server, &callerKept]() {
+		cpu_set_t before, after;
+		ASSERT_EQ(pthread_getaffinity_np(pthread_self(), sizeof(before), &before), 0);
+		server->Start(target, 2);
+		ASSERT_EQ(pthread_getaffinity_np(pthread_self(), sizeof(after), &after), 0);
+		callerKept = CPU_EQUAL(&before, &after);
+	});
+	ASSERT_TRUE(WaitForServer(target));
+
+	AsyncServiceConnector client(target.c_str());
+	client.SetPollingPolicy(policy);
+	client.Start();
+	for (unsigned i = 0; i < 20; ++i) {
+		::grpc::ClientContext context;
+		auto rpc = client.inferAsync(Request(), &context);
+		ASSERT_TRUE(rpc->Wait(5));
+		Response* response = nullptr;
+		ASSERT_TRUE(rpc->IsOK());
+		ASSERT_TRUE(rpc->Get(response));
+		EXPECT_EQ(response->msg(), "got static infer");
+	}
+	client.Shutdown();
+
+	server->Shutdown();
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+	EXPECT_TRUE(callerKept);
+}
+
+} } // namespace lucida::test
@@ -0,0 +1,202 @@
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <gflags/gflags.h>
+#include <lucida/router.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <lucida/simulator.h>
+#include <gtest/gtest.h>
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+// The bytes cut into slices at every offset in cuts.
+static ::grpc::ByteBuffer Sliced(const std::string& bytes, std::vector<size_t> cuts) {
+	std::vector<::grpc::Slice> slices;
+	size_t start = 0;
+	cuts.push_back(bytes.size());
+	for (size_t cut: cuts) {
+		slices.emplace_back(bytes.data() + start, cut - start);
+		start = cut;
+	}
+	return ::grpc::ByteBuffer(slices.data(), slices.size());
+}
+
+
+TEST(RouterTest, PeekLucid) {
+	Request request;
+	request.set_lucid("alice");
+	QueryInput* input = request.mutable_spec()->add_content();
+	input->set_type("image");
+	input->add_data(std::string(1 << 20, 'x'));
+	std::string bytes = request.SerializeAsString();
+	std::string lucid;
+	// The LUCID split across slices.
+	ASSERT_TRUE(PeekLucid(Sliced(bytes, { 1, 4, 100 }), lucid));
+	EXPECT_EQ(lucid, "alice");
+
+	// The spec first.
+	Request spec;
+	*spec.mutable_spec() = request.spec();
+	Request user;
+	user.set_lucid("bob");
+	ASSERT_TRUE(PeekLucid(Sliced(spec.SerializeAsString() + user.SerializeAsString(), {}), lucid));
+	EXPECT_EQ(lucid, "bob");
+	ASSERT_TRUE(PeekLucid(Sliced(spec.SerializeAsString(), {}), lucid));
+	EXPECT_EQ(lucid, "");
+
+	EXPECT_FALSE(PeekLucid(Sliced(bytes.substr(0, 4), {}), lucid));
+	EXPECT_FALSE(PeekLucid(Sliced(bytes.substr(0, bytes.size() - 1), { 10 }), lucid));
+	EXPECT_FALSE(PeekLucid(Sliced("\x08\x01", {}), lucid));
+}
+
+
+TEST(RouterTest, Forward) {
+	MethodProfile profile, failing;
+	ASSERT_TRUE(ParseMethodProfile("size=4", profile));
+	ASSERT_TRUE(ParseMethodProfile("errors=1,code=10", failing));
+	std::string front = HostAndPort(34);
+	std::vector<std::string> backends{ HostAndPort(35), HostAndPort(36) };
+	std::vector<std::shared_ptr<AsyncServiceAcceptorT<SimulatorHandler>>> servers;
+	std::vector<std::thread> threads;
+	for (auto& backend: backends) {
+		servers.emplace_back(new AsyncServiceAcceptorT<SimulatorHandler>(
+			new SimulatorHandler(profile, failing, profile), "testserver"));
+		servers.back()->EnableLoadReports();
+		auto server = servers.back();
+		threads.emplace_back([server, backend]() { server->Start(backend, 1); });
+	}
+	Router router(backends);
+	threads.emplace_back([&router, front]() { EXPECT_TRUE(router.Start(front, 2)); });
+	for (auto& backend: backends)
+		ASSERT_TRUE(WaitForServer(backend));
+	ASSERT_TRUE(WaitForServer(front));
+
+	// The router and a connector agree on each user's backend.
+	AsyncServiceConnector replicas(backends);
+	const char* users[] = { "alice", "bob", "carol", "dave" };
+	for (const char* user: users)
+		EXPECT_EQ(router.PickBackend(user), replicas.PreferredTarget(user));
+
+	AsyncServiceConnector client(front.c_str());
+	client.Start();
+	std::vector<uint64_t> expected(backends.size());
+	for (const char* user: users) {
+		Request request;
+		request.set_lucid(user);
+		for (unsigned i = 0; i < 3; ++i) {
+			::grpc::ClientContext context;
+			auto rpc = client.inferAsync(request, &context);
+			ASSERT_TRUE(rpc->Wait(5));
+			Response* response = nullptr;
+			ASSERT_TRUE(rpc->IsOK()) << rpc->GetStatus().error_message();
+			ASSERT_TRUE(rpc->Get(response));
+			EXPECT_EQ(response->msg().size(), 4u);
+			// The backend's load report passes through.
+			EXPECT_EQ(context.GetServerTrailingMetadata().count(LoadReport::Key()), 1u);
+		}
+		expected[router.PickBackend(user)] += 3;
+	}
+	EXPECT_EQ(router.GetStats().forwarded, expected);
+
+	// Backend errors come back as they are.
+	Request request;
+	request.set_lucid("alice");
+	::grpc::ClientContext learnContext;
+	EXPECT_EQ(client.learn(request, &learnContext).error_code(), ::grpc::StatusCode::ABORTED);
+	::grpc::ClientContext streamContext;
+	auto stream = client.recognize(&streamContext);
+	stream->WritesDone();
+	EXPECT_EQ(stream->Finish().error_code(), ::grpc::StatusCode::UNIMPLEMENTED);
+	auto stats = router.GetStats();
+	EXPECT_EQ(stats.calls, 14u);
+	EXPECT_EQ(stats.errors, 1u);
+	EXPECT_EQ(stats.rejected, 1u);
+	client.Shutdown();
+
+	router.Shutdown(1000);
+	for (auto& server: servers) {
+		server->Shutdown();
+		EXPECT_TRUE(server->BlockUntilShutdown(5));
+	}
+	for (auto& t: threads)
+		t.join();
+}
+
+TEST(RouterTest, SpillOverLoadBound) {
+	MethodProfile profile;
+	ASSERT_TRUE(ParseMethodProfile("latency=20000", profile));
+	std::string front = HostAndPort(38);
+	std::vector<std::string> backends{ HostAndPort(39), HostAndPort(40) };
+	std::vector<std::shared_ptr<AsyncServiceAcceptorT<SimulatorHandler>>> servers;
+	std::vector<std::thread> threads;
+	for (auto& backend: backends) {
+		servers.emplace_back(new AsyncServiceAcceptorT<SimulatorHandler>(
+			new SimulatorHandler(profile, profile, profile), "testserver"));
+		auto server = servers.back();
+		threads.emplace_back([server, backend]() { server->Start(backend, 1); });
+	}
+	Router router(backends);
+	threads.emplace_back([&router, front]() { EXPECT_TRUE(router.Start(front, 1)); });
+	for (auto& backend: backends)
+		ASSERT_TRUE(WaitForServer(backend));
+	ASSERT_TRUE(WaitForServer(front));
+
+	AsyncServiceConnector client(front.c_str());
+	client.Start();
+	Request request;
+	request.set_lucid("alice");
+	const unsigned home = router.PickBackend("alice");
+	{
+		::grpc::ClientContext context;
+		Response response;
+		ASSERT_TRUE(client.infer(request, response, &context).ok());
+	}
+	EXPECT_EQ(router.GetStats().spills, 0u);
+
+	// A burst past the load bound spills to the user's other backend.
+	const unsigned burst = 12;
+	std::vector<std::unique_ptr<::grpc::ClientContext>> contexts;
+	std::vector<std::shared_ptr<RpcCall>> calls;
+	for (unsigned i = 0; i < burst; ++i) {
+		contexts.emplace_back(new ::grpc::ClientContext);
+		calls.push_back(client.inferAsync(request, contexts.back().get()));
+	}
+	for (auto& call: calls) {
+		ASSERT_TRUE(call->Wait(5));
+		EXPECT_TRUE(call->IsOK());
+	}
+	auto stats = router.GetStats();
+	EXPECT_GT(stats.spills, 0u);
+	EXPECT_EQ(stats.forwarded[1 - home], stats.spills);
+	EXPECT_EQ(stats.forwarded[home] + stats.forwarded[1 - home], burst + 1);
+	EXPECT_GE(stats.forwarded[home] - 1, stats.forwarded[1 - home]);
+	client.Shutdown();
+
+	router.Shutdown(1000);
+	for (auto& server: servers) {
+		server->Shutdown();
+		EXPECT_TRUE(server->BlockUntilShutdown(5));
+	}
+	for (auto& t: threads)
+		t.join();
+}
+
+} } // namespace lucida::test
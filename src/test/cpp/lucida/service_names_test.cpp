@@ -0,0 +1,55 @@
+
+#include <lucida/service_names.h>
+#include <lucida/query_spec_view.h>
+#include <gtest/gtest.h>
+
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+TEST(ServiceNamesTest, PerfectHash) {
+	EXPECT_EQ(ServiceNames::toCommandId(ServiceNames::learnCommandName), ServiceNames::LEARN_COMMAND);
+	EXPECT_EQ(ServiceNames::toCommandId(ServiceNames::createCommandName), ServiceNames::CREATE_COMMAND);
+	EXPECT_EQ(ServiceNames::toCommandId(ServiceNames::inferCommandName), ServiceNames::INFER_COMMAND);
+	EXPECT_EQ(ServiceNames::toTypeId(ServiceNames::textTypeName), ServiceNames::TEXT_TYPE);
+	EXPECT_EQ(ServiceNames::toTypeId(ServiceNames::urlTypeName), ServiceNames::URL_TYPE);
+	EXPECT_EQ(ServiceNames::toTypeId(ServiceNames::imageTypeName), ServiceNames::IMAGE_TYPE);
+	EXPECT_EQ(ServiceNames::toTypeId(ServiceNames::unlearnTypeName), ServiceNames::UNLEARN_TYPE);
+
+	EXPECT_EQ(ServiceNames::toCommandId(""), ServiceNames::UNKNOWN_COMMAND);
+	EXPECT_EQ(ServiceNames::toCommandId("querys"), ServiceNames::UNKNOWN_COMMAND);
+	EXPECT_EQ(ServiceNames::toTypeId("Text"), ServiceNames::UNKNOWN_TYPE);
+	EXPECT_TRUE(ServiceNames::isCommandName("knowledge"));
+	EXPECT_FALSE(ServiceNames::isCommandName("text"));
+	EXPECT_TRUE(ServiceNames::isTypeName("image"));
+	EXPECT_FALSE(ServiceNames::isTypeName("query"));
+}
+
+
+TEST(ServiceNamesTest, QuerySpecView) {
+	QuerySpec spec;
+	spec.set_name(ServiceNames::learnCommandName);
+	spec.add_content()->set_type(ServiceNames::imageTypeName);
+	spec.add_content()->set_type("audio");
+	spec.add_content()->set_type(ServiceNames::textTypeName);
+
+	QuerySpecView view(spec);
+	EXPECT_EQ(view.command(), ServiceNames::LEARN_COMMAND);
+	ASSERT_EQ(view.size(), 3);
+	EXPECT_EQ(view.type(0), ServiceNames::IMAGE_TYPE);
+	EXPECT_EQ(view.type(1), ServiceNames::UNKNOWN_TYPE);
+	EXPECT_EQ(view.type(2), ServiceNames::TEXT_TYPE);
+
+	typedef int (*InputFn)(const QueryInput&);
+	TypeDispatchTable<InputFn> table([](const QueryInput&) { return 0; });
+	table.On(ServiceNames::TEXT_TYPE, [](const QueryInput&) { return 1; })
+		.On(ServiceNames::IMAGE_TYPE, [](const QueryInput&) { return 2; });
+	int sum = 0;
+	for (int i = 0; i < view.size(); ++i)
+		sum = sum * 10 + table[view.type(i)](view.input(i));
+	EXPECT_EQ(sum, 201);
+}
+
+} } // namespace lucida::test
+
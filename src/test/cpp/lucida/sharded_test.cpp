@@ -0,0 +1,93 @@
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <sstream>
+#include <thread>
+#include <gflags/gflags.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <gtest/gtest.h>
+#include "handler.h"
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+TEST(ShardedTest, SpreadConnections) {
+	std::string target = HostAndPort(22);
+	const unsigned shards = 4;
+	unsigned created = 0;
+	ShardedAcceptorT<TestStaticHandler> server(shards, [&created](unsigned) {
+		++created;
+		return new TestStaticHandler();
+	}, "testserver");
+	EXPECT_EQ(created, shards);
+	ASSERT_EQ(server.ShardCount(), shards);
+	std::thread svr_thread([target, &server]() { EXPECT_TRUE(server.Start(target)); });
+	ASSERT_TRUE(WaitForServer(target));
+
+	// Each client has its own connection.
+	const unsigned clients = 32;
+	std::vector<std::unique_ptr<AsyncServiceConnector>> connectors;
+	for (unsigned i = 0; i < clients; ++i) {
+		::grpc::ChannelArguments args;
+		args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+		connectors.emplace_back(new AsyncServiceConnector(
+			::grpc::CreateCustomChannel(target, ::grpc::InsecureChannelCredentials(), args)));
+		connectors.back()->Start();
+		::grpc::ClientContext context;
+		auto rpc = connectors.back()->inferAsync(Request(), &context);
+		ASSERT_TRUE(rpc->Wait(5));
+		EXPECT_TRUE(rpc->IsOK());
+	}
+	uint64_t total = 0;
+	unsigned used = 0;
+	for (unsigned i = 0; i < shards; ++i) {
+		uint64_t matched = server.GetShard(i).GetListenerReport()[2].matched;
+		total += matched;
+		used += (matched != 0);
+	}
+	EXPECT_EQ(total, clients);
+	EXPECT_GT(used, 1u);
+	for (auto& c: connectors)
+		c->Shutdown();
+
+	server.Shutdown();
+	svr_thread.join();
+}
+
+
+TEST(ShardedTest, PortTaken) {
+	// A socket bound without SO_REUSEPORT keeps every shard off the port.
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	ASSERT_GE(fd, 0);
+	sockaddr_in addr = sockaddr_in();
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(FLAGS_port + 23);
+	ASSERT_EQ(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+	ASSERT_EQ(listen(fd, 1), 0);
+
+	std::ostringstream target;
+	target << "0.0.0.0:" << (FLAGS_port + 23);
+	ShardedAcceptorT<TestStaticHandler> server(3, [](unsigned) { return new TestStaticHandler(); }, "testserver");
+	EXPECT_FALSE(server.Start(target.str()));
+	close(fd);
+}
+
+} } // namespace lucida::test
@@ -0,0 +1,179 @@
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <gflags/gflags.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <lucida/simulator.h>
+#include <gtest/gtest.h>
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+static void AddNode(Request& request, const std::string& hostAndPort, std::vector<std::string> children) {
+	QueryInput* node = request.mutable_spec()->add_content();
+	node->set_type("text");
+	node->add_tags(hostAndPort);
+	for (auto& child: children)
+		node->add_tags(child);
+}
+
+
+TEST(SimulatorTest, ParseProfile) {
+	MethodProfile profile;
+	ASSERT_TRUE(ParseMethodProfile("latency=uniform:100:300,cpu=50,size=64,errors=0.25,code=10", profile));
+	EXPECT_EQ(profile.latency.kind, LatencyModel::UNIFORM);
+	EXPECT_EQ(profile.latency.a, 100);
+	EXPECT_EQ(profile.latency.b, 300);
+	EXPECT_EQ(profile.cpuUs, 50u);
+	EXPECT_EQ(profile.responseBytes, 64u);
+	EXPECT_EQ(profile.errorRate, 0.25);
+	EXPECT_EQ(profile.errorCode, ::grpc::StatusCode::ABORTED);
+	ASSERT_TRUE(ParseMethodProfile("latency=700", profile));
+	EXPECT_EQ(profile.latency.kind, LatencyModel::FIXED);
+	EXPECT_EQ(profile.cpuUs, 50u);
+	EXPECT_TRUE(ParseMethodProfile("", profile));
+	EXPECT_FALSE(ParseMethodProfile("latency=uniform:300:100", profile));
+	EXPECT_FALSE(ParseMethodProfile("latency=gamma:1", profile));
+	EXPECT_FALSE(ParseMethodProfile("errors=2", profile));
+	EXPECT_FALSE(ParseMethodProfile("size=-1", profile));
+	EXPECT_FALSE(ParseMethodProfile("speed=1", profile));
+	// A failed parse leaves the profile alone.
+	EXPECT_EQ(profile.latency.a, 700);
+}
+
+
+TEST(SimulatorTest, LatencySamples) {
+	std::mt19937_64 rng(1);
+	LatencyModel model;
+	model.kind = LatencyModel::FIXED;
+	model.a = 250;
+	EXPECT_EQ(model.Sample(rng), 250u);
+
+	const unsigned n = 20000;
+	model.kind = LatencyModel::EXPONENTIAL;
+	model.a = 1000;
+	double sum = 0;
+	for (unsigned i = 0; i < n; ++i) sum += model.Sample(rng);
+	EXPECT_NEAR(sum / n, 1000, 50);
+
+	model.kind = LatencyModel::LOGNORMAL;
+	model.b = 1.0;
+	unsigned below = 0;
+	for (unsigned i = 0; i < n; ++i) below += model.Sample(rng) < 1000;
+	EXPECT_NEAR(double(below) / n, 0.5, 0.02);
+}
+
+
+TEST(SimulatorTest, GraphRewrite) {
+	// 0 -> {1, 2}, 1 -> {2}, 2 -> {0}. Tag "7" and node 3 without a host are
+	// not children.
+	Request request;
+	AddNode(request, "a:1", { "1", "2", "7", "3" });
+	AddNode(request, "b:1", { "2" });
+	AddNode(request, "c:1", { "0" });
+	request.mutable_spec()->add_content();
+	EXPECT_EQ(GraphChildren(request), (std::vector<int>{ 1, 2 }));
+
+	Request toC = ForwardedRequest(request, 2);
+	EXPECT_EQ(toC.spec().content(0).tags(0), "c:1");
+	EXPECT_EQ(toC.spec().content(2).tags(0), "a:1");
+	EXPECT_EQ(toC.spec().content(2).tags_size(), 1);
+	EXPECT_EQ(toC.spec().content(1).tags(1), "0");
+	// The cycle back to a reaches a leaf.
+	EXPECT_EQ(GraphChildren(toC), (std::vector<int>{ 2 }));
+	Request toA = ForwardedRequest(toC, 2);
+	EXPECT_EQ(toA.spec().content(0).tags(0), "a:1");
+	EXPECT_TRUE(GraphChildren(toA).empty());
+
+	Request toB = ForwardedRequest(request, 1);
+	EXPECT_EQ(toB.spec().content(0).tags(0), "b:1");
+	EXPECT_EQ(GraphChildren(toB), (std::vector<int>{ 2 }));
+}
+
+
+TEST(SimulatorTest, FanOut) {
+	std::string root = HostAndPort(18);
+	std::string left = HostAndPort(19);
+	std::string right = HostAndPort(20);
+	MethodProfile rootProfile, leftProfile, rightProfile, failing;
+	ASSERT_TRUE(ParseMethodProfile("latency=2000,cpu=100,size=4", rootProfile));
+	ASSERT_TRUE(ParseMethodProfile("latency=exp:500,size=3", leftProfile));
+	ASSERT_TRUE(ParseMethodProfile("size=5", rightProfile));
+	ASSERT_TRUE(ParseMethodProfile("errors=1,code=10", failing));
+	SimulatorHandler* rootHandler = new SimulatorHandler(rootProfile, rootProfile, rootProfile);
+	SimulatorHandler* leftHandler = new SimulatorHandler(leftProfile, leftProfile, leftProfile);
+	std::shared_ptr<AsyncServiceAcceptorT<SimulatorHandler>> servers[3] = {
+		std::make_shared<AsyncServiceAcceptorT<SimulatorHandler>>(rootHandler, "root"),
+		std::make_shared<AsyncServiceAcceptorT<SimulatorHandler>>(leftHandler, "left"),
+		std::make_shared<AsyncServiceAcceptorT<SimulatorHandler>>(
+			new SimulatorHandler(rightProfile, failing, rightProfile), "right")
+	};
+	std::string targets[3] = { root, left, right };
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < 3; ++i) {
+		auto server = servers[i];
+		std::string target = targets[i];
+		threads.emplace_back([server, target]() { server->Start(target, 2); });
+	}
+	for (auto& target: targets)
+		ASSERT_TRUE(WaitForServer(target));
+
+	// root -> {left, right}, left -> {right}
+	Request request;
+	request.set_lucid("user");
+	AddNode(request, root, { "1", "2" });
+	AddNode(request, left, { "2" });
+	AddNode(request, right, {});
+
+	AsyncServiceConnector client(root.c_str());
+	client.Start();
+	const unsigned count = 4;
+	for (unsigned i = 0; i < count; ++i) {
+		::grpc::ClientContext context;
+		auto rpc = client.inferAsync(request, &context);
+		ASSERT_TRUE(rpc->Wait(5));
+		Response* response = nullptr;
+		ASSERT_TRUE(rpc->IsOK()) << rpc->GetStatus().error_message();
+		ASSERT_TRUE(rpc->Get(response));
+		// 4 from root, 3 + 5 through left and 5 straight from right.
+		EXPECT_EQ(response->msg().size(), 17u);
+	}
+	auto stats = rootHandler->GetStats();
+	EXPECT_EQ(stats.calls, count);
+	EXPECT_EQ(stats.forwarded, 2 * count);
+	EXPECT_EQ(leftHandler->GetStats().forwarded, count);
+
+	// Right fails every learn, failing left and root with it.
+	::grpc::ClientContext context;
+	auto rpc = client.learnAsync(request, &context);
+	ASSERT_TRUE(rpc->Wait(5));
+	EXPECT_EQ(rpc->GetStatus().error_code(), ::grpc::StatusCode::ABORTED);
+	EXPECT_EQ(rootHandler->GetStats().downstreamErrors, 1u);
+	client.Shutdown();
+
+	for (auto& server: servers) {
+		server->Shutdown();
+		EXPECT_TRUE(server->BlockUntilShutdown(5));
+	}
+	for (auto& t: threads)
+		t.join();
+}
+
+} } // namespace lucida::test
@@ -0,0 +1,127 @@
+
+#include <sstream>
+#include <thread>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <lucida/ring_buffer.h>
+#include <lucida/audio_gateway.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <gtest/gtest.h>
+#include "handler.h"
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+TEST(StreamingTest, RingBufferWraps) {
+	RingBuffer ring(10);
+	EXPECT_EQ(ring.Capacity(), 16u);
+	char out[16];
+	EXPECT_EQ(ring.Write("0123456789", 10), 10u);
+	EXPECT_EQ(ring.Read(out, 8), 8u);
+	// Wraps around the end
+	EXPECT_EQ(ring.Write("abcdefghijklmnop", 16), 14u);
+	EXPECT_EQ(ring.Space(), 0u);
+	EXPECT_EQ(ring.Read(out, 16), 16u);
+	EXPECT_EQ(std::string(out, 16), "89abcdefghijklmn");
+	EXPECT_EQ(ring.Size(), 0u);
+}
+
+
+TEST(StreamingTest, RingBufferSpsc) {
+	RingBuffer ring(64);
+	const unsigned count = 10000;
+	std::thread producer([&ring]() {
+		for (unsigned i = 0; i < count; ) {
+			if (ring.Write(&i, sizeof(i)) == sizeof(i)) ++i;
+			else std::this_thread::yield();
+		}
+	});
+	unsigned expected = 0;
+	while (expected < count) {
+		unsigned v;
+		if (ring.Size() >= sizeof(v)) {
+			ring.Read(&v, sizeof(v));
+			ASSERT_EQ(v, expected);
+			++expected;
+		} else {
+			std::this_thread::yield();
+		}
+	}
+	producer.join();
+}
+
+
+TEST(StreamingTest, GatewayFrames) {
+	AudioGateway gateway(new TestRecognizer(4));
+	std::string interim;
+	gateway.GetRecognizer()->Begin("id", 16000);
+	EXPECT_FALSE(gateway.Feed("abc", 3, interim));
+	EXPECT_TRUE(gateway.Feed("defghijklmnopq", 14, interim));
+	EXPECT_EQ(interim, "id frames=4");
+	EXPECT_EQ(gateway.GetFrameCount(), 4u);
+	EXPECT_EQ(gateway.Drain(), "id frames=4 bytes=17");
+}
+
+
+TEST(StreamingTest, AsyncServerRecognize) {
+	std::ostringstream os;
+	os << "localhost:"<< FLAGS_port;
+	std::shared_ptr<AsyncServiceAcceptor> server(new AsyncServiceAcceptor(new TestAsyncHandler(), "testserver"));
+	std::string hostandport = os.str();
+	std::thread svr_thread( [hostandport, server]() {
+		server->Start(hostandport, 1);
+	});
+
+	AsyncServiceConnector client(hostandport.c_str());
+	::grpc::ClientContext ctx;
+	auto stream = client.recognize(&ctx);
+	AudioChunk chunk;
+	Transcript transcript;
+	chunk.set_lucid("student");
+	chunk.set_sample_rate(16000);
+	chunk.set_data(std::string(500, 'x'));
+	ASSERT_TRUE(stream->Write(chunk));
+	ASSERT_TRUE(stream->Read(&transcript));
+	EXPECT_FALSE(transcript.is_final());
+	EXPECT_EQ(transcript.msg(), "student frames=1");
+	chunk.Clear();
+	chunk.set_data(std::string(500, 'x'));
+	ASSERT_TRUE(stream->Write(chunk));
+	ASSERT_TRUE(stream->Read(&transcript));
+	EXPECT_EQ(transcript.msg(), "student frames=3");
+	stream->WritesDone();
+	ASSERT_TRUE(stream->Read(&transcript));
+	EXPECT_TRUE(transcript.is_final());
+	EXPECT_EQ(transcript.msg(), "student frames=3 bytes=1000");
+	EXPECT_FALSE(stream->Read(&transcript));
+	EXPECT_TRUE(stream->Finish().ok());
+	std::vector<TargetStats> stats = client.GetTargetStats();
+	EXPECT_EQ(stats[0].attempts, 1u);
+	EXPECT_EQ(stats[0].wins, 1u);
+
+	// A cancel is not taken for a half-close.
+	unsigned aborts = TestRecognizer::aborts.load();
+	::grpc::ClientContext cancelled;
+	stream = client.recognize(&cancelled);
+	chunk.set_data(std::string(500, 'x'));
+	ASSERT_TRUE(stream->Write(chunk));
+	ASSERT_TRUE(stream->Read(&transcript));
+	cancelled.TryCancel();
+	EXPECT_FALSE(stream->Read(&transcript));
+	EXPECT_EQ(stream->Finish().error_code(), ::grpc::StatusCode::CANCELLED);
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (TestRecognizer::aborts.load() == aborts && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	EXPECT_EQ(TestRecognizer::aborts.load(), aborts + 1);
+
+	server->Shutdown();
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+}
+
+} } // namespace lucida::test
+
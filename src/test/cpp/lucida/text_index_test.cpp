@@ -0,0 +1,167 @@
+#include <random>
+#include <sstream>
+#include <thread>
+#include <boost/filesystem.hpp>
+#include <gflags/gflags.h>
+#include <lucida/learn_log.h>
+#include <lucida/passage_search.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <lucida/service_names.h>
+#include <lucida/text_index.h>
+#include <gtest/gtest.h>
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+/// Words drawn from a skewed vocabulary, so some postings are long.
+static std::string RandomText(std::mt19937& rng, unsigned words) {
+	std::geometric_distribution<unsigned> word(0.01);
+	std::string text;
+	for (unsigned i = 0; i < words; ++i) {
+		if (i != 0) text += ' ';
+		text += "w" + std::to_string(word(rng));
+	}
+	return text;
+}
+
+
+static Request TextRequest(const std::string& lucid, const std::vector<std::string>& texts) {
+	Request request;
+	request.set_lucid(lucid);
+	QueryInput* input = request.mutable_spec()->add_content();
+	input->set_type(ServiceNames::textTypeName);
+	for (const std::string& text: texts) input->add_data(text);
+	return request;
+}
+
+
+TEST(TextIndexTest, Tokenize) {
+	std::vector<std::string> terms;
+	Tokenize("  Who wrote \"Hamlet\", in 1600? ", terms);
+	EXPECT_EQ(terms, (std::vector<std::string>{ "who", "wrote", "hamlet", "in", "1600" }));
+	Tokenize("", terms);
+	EXPECT_TRUE(terms.empty());
+}
+
+
+TEST(TextIndexTest, RanksPassages) {
+	TextIndex index;
+	index.Add("The mitochondria is the powerhouse of the cell.");
+	index.Add("Hamlet is a tragedy written by William Shakespeare.");
+	index.Add("Shakespeare was born in Stratford-upon-Avon.");
+	std::vector<ScoredPassage> results;
+	index.Search("Who wrote Hamlet?", 2, results);
+	ASSERT_EQ(results.size(), 1u);
+	EXPECT_EQ(results[0].id, 1u);
+	index.Search("where was shakespeare born", 3, results);
+	ASSERT_EQ(results.size(), 2u);
+	EXPECT_EQ(results[0].id, 2u);
+	EXPECT_GT(results[0].score, results[1].score);
+	index.Search("photosynthesis", 3, results);
+	EXPECT_TRUE(results.empty());
+
+	// Learning more appends to the postings.
+	EXPECT_EQ(index.Add("Macbeth is another Shakespeare tragedy."), 3u);
+	index.Search("macbeth", 1, results);
+	ASSERT_EQ(results.size(), 1u);
+	EXPECT_EQ(results[0].id, 3u);
+}
+
+
+TEST(TextIndexTest, MaxScoreMatchesExact) {
+	std::mt19937 rng(7);
+	TextIndex index;
+	for (unsigned i = 0; i < 5000; ++i)
+		index.Add(RandomText(rng, 20 + rng() % 40));
+	std::vector<ScoredPassage> pruned, exact;
+	for (unsigned q = 0; q < 200; ++q) {
+		std::string query = RandomText(rng, 1 + q % 5);
+		index.Search(query, 10, pruned);
+		index.SearchExact(query, 10, exact);
+		ASSERT_EQ(pruned.size(), exact.size()) << query;
+		for (size_t i = 0; i < pruned.size(); ++i)
+			EXPECT_NEAR(pruned[i].score, exact[i].score, 1e-4) << query;
+	}
+}
+
+
+TEST(TextIndexTest, AnswerQuestions) {
+	std::string hostAndPort = HostAndPort(16);
+	std::shared_ptr<AsyncServiceAcceptorT<PassageSearchHandler>> server(
+		new AsyncServiceAcceptorT<PassageSearchHandler>(new PassageSearchHandler(), "qaserver"));
+	std::thread svr_thread([hostAndPort, server]() { server->Start(hostAndPort, 2); });
+	ASSERT_TRUE(WaitForServer(hostAndPort));
+
+	AsyncServiceConnector client(hostAndPort.c_str());
+	client.Start();
+	::grpc::ClientContext ctx1, ctx2, ctx3, ctx4, ctx5;
+	ASSERT_TRUE(client.learn(TextRequest("user", {
+		"The speed of light is about 300000 km per second.",
+		"Water boils at 100 degrees Celsius at sea level." }), &ctx1).ok());
+	ASSERT_TRUE(client.learn(TextRequest("user", { "Mount Everest is the highest mountain on Earth." }), &ctx2).ok());
+	Response response;
+	ASSERT_TRUE(client.infer(TextRequest("user", { "What is the highest mountain?" }), response, &ctx3).ok());
+	EXPECT_EQ(response.msg(), "Mount Everest is the highest mountain on Earth.");
+	EXPECT_EQ(client.infer(TextRequest("nobody", { "boils" }), response, &ctx4).error_code(), ::grpc::StatusCode::NOT_FOUND);
+	EXPECT_EQ(client.learn(TextRequest("user", {}), &ctx5).error_code(), ::grpc::StatusCode::INVALID_ARGUMENT);
+	client.Shutdown();
+
+	server->Shutdown();
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+}
+
+
+TEST(TextIndexTest, ReplayLearnLog) {
+	boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	std::string hostAndPort = HostAndPort(42);
+	{
+		LearnLog log(dir.string());
+		PassageSearchHandler* handler = new PassageSearchHandler();
+		ASSERT_TRUE(ReplayLearnLog(log, *handler));
+		handler->SetLearnLog(&log);
+		std::shared_ptr<AsyncServiceAcceptorT<PassageSearchHandler>> server(
+			new AsyncServiceAcceptorT<PassageSearchHandler>(handler, "qaserver"));
+		std::thread svr_thread([hostAndPort, server]() { server->Start(hostAndPort, 1); });
+		ASSERT_TRUE(WaitForServer(hostAndPort));
+
+		AsyncServiceConnector client(hostAndPort.c_str());
+		client.Start();
+		::grpc::ClientContext ctx1, ctx2;
+		ASSERT_TRUE(client.learn(TextRequest("user", { "Mount Everest is the highest mountain on Earth." }), &ctx1).ok());
+		EXPECT_EQ(client.learn(TextRequest("user", {}), &ctx2).error_code(), ::grpc::StatusCode::INVALID_ARGUMENT);
+		client.Shutdown();
+		server->Shutdown();
+		EXPECT_TRUE(server->BlockUntilShutdown(5));
+		svr_thread.join();
+	}
+	// A restarted handler gets the learn back, and the rejected one again
+	// changes nothing.
+	LearnLog log(dir.string());
+	PassageSearchHandler handler;
+	ASSERT_TRUE(ReplayLearnLog(log, handler));
+	EXPECT_EQ(log.GetStats().tailRecords, 2u);
+	size_t passages = 0;
+	EXPECT_TRUE(handler.GetStore().Read("user", [&](const TextIndex& index) { passages = index.Size(); }));
+	EXPECT_EQ(passages, 1u);
+	boost::filesystem::remove_all(dir);
+}
+
+} } // namespace lucida::test
@@ -0,0 +1,121 @@
+#include <sstream>
+#include <thread>
+#include <cstdlib>
+#include <gflags/gflags.h>
+#include <boost/filesystem.hpp>
+#include <lucida/trace.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <gtest/gtest.h>
+#include "handler.h"
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+TEST(TraceTest, RingWraps) {
+	boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	boost::filesystem::create_directories(dir);
+	std::string path = (dir / "test.ring").string();
+	std::unique_ptr<TraceRing> ring(TraceRing::Create(path, "test", 4));
+	ASSERT_TRUE(ring != nullptr);
+	SpanRecord r;
+	memset(&r, 0, sizeof(r));
+	for (unsigned i = 1; i <= 6; ++i) {
+		r.traceId = i;
+		ring->Append(r);
+	}
+	std::unique_ptr<TraceRing> reader(TraceRing::Open(path));
+	ASSERT_TRUE(reader != nullptr);
+	EXPECT_EQ(reader->GetHeader().head.load(), 6u);
+	EXPECT_EQ(std::string(reader->GetHeader().service), "test");
+	SpanRecord out;
+	ASSERT_TRUE(reader->Read(2, out));
+	EXPECT_EQ(out.traceId, 3u);
+	ASSERT_TRUE(reader->Read(5, out));
+	EXPECT_EQ(out.traceId, 6u);
+	EXPECT_EQ(ReadTraceRings(dir.string()).size(), 4u);
+	boost::filesystem::remove_all(dir);
+
+	uint64_t queue = 0, handler = 0, downstream = 0;
+	EXPECT_TRUE(TraceSpan::ParseServerTiming("queue=12,handler=345,downstream=6", queue, handler, downstream));
+	EXPECT_EQ(queue, 12u);
+	EXPECT_EQ(handler, 345u);
+	EXPECT_EQ(downstream, 6u);
+	EXPECT_FALSE(TraceSpan::ParseServerTiming("queue=12", queue, handler, downstream));
+}
+
+
+TEST(TraceTest, Timeline) {
+	boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	boost::filesystem::create_directories(dir);
+	Tracer::Enable(dir.string(), "test", 64);
+
+	std::string back = HostAndPort(9);
+	std::string front = HostAndPort(10);
+	std::shared_ptr<AsyncServiceAcceptorT<TestSlowHandler>> backServer(
+		new AsyncServiceAcceptorT<TestSlowHandler>(new TestSlowHandler(5), "backserver"));
+	std::thread back_thread([back, backServer]() { backServer->Start(back, 1); });
+	ASSERT_TRUE(WaitForServer(back));
+	AsyncServiceConnector downstream(back.c_str());
+	std::shared_ptr<AsyncServiceAcceptorT<TestForwardHandler>> frontServer(
+		new AsyncServiceAcceptorT<TestForwardHandler>(new TestForwardHandler(&downstream), "frontserver"));
+	std::thread front_thread([front, frontServer]() { frontServer->Start(front, 1); });
+	ASSERT_TRUE(WaitForServer(front));
+
+	AsyncServiceConnector client(front.c_str());
+	::grpc::ClientContext ctx;
+	Request req;
+	Response resp;
+	ASSERT_TRUE(client.infer(req, resp, &ctx).ok());
+	EXPECT_EQ(resp.msg(), "got slow infer");
+	auto timing = ctx.GetServerTrailingMetadata().find(kServerTimingKey);
+	ASSERT_NE(timing, ctx.GetServerTrailingMetadata().end());
+	uint64_t queue = 0, handler = 0, downstreamUs = 0;
+	EXPECT_TRUE(TraceSpan::ParseServerTiming(std::string(timing->second.data(), timing->second.size()), queue, handler, downstreamUs));
+	EXPECT_GE(handler, downstreamUs);
+	EXPECT_GE(downstreamUs, 5000u);
+
+	frontServer->Shutdown();
+	EXPECT_TRUE(frontServer->BlockUntilShutdown(5));
+	front_thread.join();
+	backServer->Shutdown();
+	EXPECT_TRUE(backServer->BlockUntilShutdown(5));
+	back_thread.join();
+	Tracer::Disable();
+
+	// client -> front server -> front client -> back server
+	std::vector<SpanInfo> spans = ReadTraceRings(dir.string());
+	ASSERT_EQ(spans.size(), 4u);
+	for (auto& s: spans) EXPECT_EQ(s.traceId, spans[0].traceId);
+	EXPECT_EQ(spans[0].kind, SpanRecord::CLIENT);
+	EXPECT_EQ(spans[0].parentId, 0u);
+	EXPECT_EQ(spans[1].kind, SpanRecord::SERVER);
+	EXPECT_EQ(spans[1].parentId, spans[0].spanId);
+	EXPECT_EQ(spans[2].kind, SpanRecord::CLIENT);
+	EXPECT_EQ(spans[2].parentId, spans[1].spanId);
+	EXPECT_EQ(spans[3].kind, SpanRecord::SERVER);
+	EXPECT_EQ(spans[3].parentId, spans[2].spanId);
+	EXPECT_EQ(spans[3].method, "infer");
+	EXPECT_GE(spans[3].durationUs, 5000u);
+	// The client saw the back server's handler time.
+	EXPECT_EQ(spans[2].downstreamUs, spans[3].durationUs);
+	boost::filesystem::remove_all(dir);
+}
+
+} } // namespace lucida::test
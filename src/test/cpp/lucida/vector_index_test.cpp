@@ -0,0 +1,158 @@
+#include <random>
+#include <sstream>
+#include <thread>
+#include <gflags/gflags.h>
+#include <lucida/image_match.h>
+#include <lucida/service_acceptor.h>
+#include <lucida/service_connector.h>
+#include <lucida/service_names.h>
+#include <lucida/vector_index.h>
+#include <gtest/gtest.h>
+
+DECLARE_int32(port);
+
+using namespace lucida;
+namespace lucida { namespace test {
+
+
+static std::string HostAndPort(int offset) {
+	std::ostringstream os;
+	os << "localhost:"<< (FLAGS_port + offset);
+	return os.str();
+}
+
+
+static bool WaitForServer(const std::string& hostAndPort) {
+	auto channel = ::grpc::CreateChannel(hostAndPort, ::grpc::InsecureChannelCredentials());
+	return channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+}
+
+
+static std::vector<float> RandomVectors(size_t count, size_t dim, uint32_t seed) {
+	std::mt19937 rng(seed);
+	std::normal_distribution<float> normal;
+	std::vector<float> v(count * dim);
+	for (float& x: v) x = normal(rng);
+	return v;
+}
+
+
+static Request ImageRequest(const std::string& lucid, const std::string& image, const std::string& label="") {
+	Request request;
+	request.set_lucid(lucid);
+	QueryInput* input = request.mutable_spec()->add_content();
+	input->set_type(ServiceNames::imageTypeName);
+	input->add_data(image);
+	if (!label.empty()) input->add_tags(label);
+	return request;
+}
+
+
+TEST(VectorIndexTest, Kernels) {
+	std::vector<float> v = RandomVectors(2, 133, 1);
+	const float* a = v.data();
+	const float* b = a + 133;
+	for (size_t n: { 0, 1, 7, 8, 15, 16, 17, 31, 32, 33, 128, 133 }) {
+		double dot = 0, l2 = 0;
+		for (size_t i = 0; i < n; ++i) {
+			dot += a[i] * b[i];
+			l2 += (a[i] - b[i]) * (a[i] - b[i]);
+		}
+		EXPECT_NEAR(DotProduct(a, b, n), dot, 1e-3) << SimdLevel() << " n=" << n;
+		EXPECT_NEAR(SquaredL2(a, b, n), l2, 1e-3) << SimdLevel() << " n=" << n;
+	}
+}
+
+
+TEST(VectorIndexTest, ExactSearch) {
+	const size_t dim = 24, count = 500;
+	std::vector<float> v = RandomVectors(count, dim, 2);
+	VectorIndex index;
+	for (size_t i = 0; i < count; ++i)
+		ASSERT_TRUE(index.Add(std::to_string(i), &v[i * dim], dim));
+	EXPECT_FALSE(index.Add("short", v.data(), dim - 1));
+	EXPECT_FALSE(index.HasGraph());
+
+	std::vector<Neighbor> results;
+	index.Search(&v[7 * dim], dim, 5, results);
+	ASSERT_EQ(results.size(), 5u);
+	EXPECT_EQ(results[0].id, 7u);
+	EXPECT_NEAR(results[0].score, 1.0f, 1e-5);
+	for (size_t i = 1; i < results.size(); ++i)
+		EXPECT_GE(results[i - 1].score, results[i].score);
+	index.Search(v.data(), dim, count + 10, results);
+	EXPECT_EQ(results.size(), count);
+}
+
+
+TEST(VectorIndexTest, GraphRecall) {
+	const size_t dim = 32, count = 5000, queries = 50, k = 10;
+	std::vector<float> v = RandomVectors(count, dim, 3);
+	VectorIndexOptions options;
+	options.graphThreshold = 1000;
+	options.efConstruction = 100;
+	VectorIndex index(options);
+	for (size_t i = 0; i < count; ++i)
+		ASSERT_TRUE(index.Add(std::to_string(i), &v[i * dim], dim));
+	EXPECT_TRUE(index.HasGraph());
+
+	std::vector<float> q = RandomVectors(queries, dim, 4);
+	size_t hits = 0;
+	std::vector<Neighbor> approx, exact;
+	for (size_t i = 0; i < queries; ++i) {
+		index.Search(&q[i * dim], dim, k, approx);
+		index.SearchExact(&q[i * dim], dim, k, exact);
+		ASSERT_EQ(approx.size(), k);
+		for (const Neighbor& e: exact) {
+			for (const Neighbor& a: approx) {
+				if (a.id == e.id) ++hits;
+			}
+		}
+	}
+	EXPECT_GE(double(hits) / (queries * k), 0.9);
+	// Every stored vector is found.
+	index.Search(&v[4321 * dim], dim, 1, approx);
+	EXPECT_EQ(approx[0].id, 4321u);
+}
+
+
+TEST(VectorIndexTest, MatchImages) {
+	std::string hostAndPort = HostAndPort(15);
+	std::shared_ptr<AsyncServiceAcceptorT<ImageMatchHandler>> server(
+		new AsyncServiceAcceptorT<ImageMatchHandler>(new ImageMatchHandler(new HashFeatureExtractor()), "immserver"));
+	std::thread svr_thread([hostAndPort, server]() { server->Start(hostAndPort, 2); });
+	ASSERT_TRUE(WaitForServer(hostAndPort));
+
+	AsyncServiceConnector client(hostAndPort.c_str());
+	client.Start();
+	std::vector<std::string> images;
+	std::mt19937 rng(5);
+	for (int i = 0; i < 3; ++i) {
+		std::string image(4096, '\0');
+		for (char& c: image) c = char(rng());
+		images.push_back(image);
+		::grpc::ClientContext ctx;
+		ASSERT_TRUE(client.learn(ImageRequest("user", image, "photo" + std::to_string(i)), &ctx).ok());
+	}
+	// A slightly changed copy still matches.
+	std::string query = images[1];
+	for (size_t i = 0; i < 100; ++i) query[i * 40] ^= 0x55;
+	Response response;
+	::grpc::ClientContext ctx1, ctx2, ctx3;
+	ASSERT_TRUE(client.infer(ImageRequest("user", query), response, &ctx1).ok());
+	EXPECT_EQ(response.msg(), "photo1");
+	EXPECT_EQ(client.infer(ImageRequest("nobody", query), response, &ctx2).error_code(), ::grpc::StatusCode::NOT_FOUND);
+	EXPECT_EQ(client.infer(Request(), response, &ctx3).error_code(), ::grpc::StatusCode::INVALID_ARGUMENT);
+	// A spec naming another command is refused.
+	Request misnamed = ImageRequest("user", query);
+	misnamed.mutable_spec()->set_name(ServiceNames::learnCommandName);
+	::grpc::ClientContext ctx4;
+	EXPECT_EQ(client.infer(misnamed, response, &ctx4).error_code(), ::grpc::StatusCode::INVALID_ARGUMENT);
+	client.Shutdown();
+
+	server->Shutdown();
+	EXPECT_TRUE(server->BlockUntilShutdown(5));
+	svr_thread.join();
+}
+
+} } // namespace lucida::test